@@ -1,8 +1,71 @@
+/* The host may specialise the program for a grid and a device.
+   Built with -DDATA_WIDTH=N+2 the width of the grids is a constant, so
+   the compiler can fold it into the indexing; the kernels still take
+   their data_width argument, and ignore it. With -DTILE_SIZE=T the tiled
+   kernels require T x T work groups and their tile width is a constant. */
+#ifdef DATA_WIDTH
+  #define data_width DATA_WIDTH
+  #define WIDTH_ARG int data_width_arg
+#else
+  #define WIDTH_ARG int data_width
+#endif
+
+#ifdef TILE_SIZE
+  #define TILE TILE_SIZE
+  #define TILED_KERNEL __kernel __attribute__((reqd_work_group_size(TILE_SIZE, TILE_SIZE, 1)))
+#else
+  #define TILE get_local_size(0)
+  #define TILED_KERNEL __kernel
+#endif
+
+/* With -DSLAB_FIRST=f -DSLAB_LAST=l -DHALO=h the program works on a slab
+   of the grid, rows f to l of the interior, for one of several devices
+   sharing a grid too large for one. The buffers hold only the slab and h
+   halo rows each side, copies of the neighbouring slabs' rows which the
+   host refreshes after every launch, and the whole grid's ghost rows if
+   the slab reaches them. Indices stay those of the whole grid: AT() takes
+   them into the stored rows, clamping any that stray out of them. The
+   host launches the kernels on the slab's rows with a global offset. */
+#ifdef SLAB_FIRST
+  #define FIRST_ROW SLAB_FIRST
+  #define LAST_ROW SLAB_LAST
+  #define STORED_FIRST max(SLAB_FIRST-HALO, 0)
+  #define STORED_LAST min(SLAB_LAST+HALO, data_width-1)
+  #define AT(i) (clamp((int)(i), STORED_FIRST*data_width, (STORED_LAST+1)*data_width-1) - STORED_FIRST*data_width)
+#else
+  #define FIRST_ROW 1
+  #define LAST_ROW (data_width-2)
+  #define STORED_FIRST 0
+  #define STORED_LAST (data_width-1)
+  #define AT(i) (i)
+#endif
+
+/* With -DHALF_STORAGE the fields of the fused kernels, the CFL reduction
+   and the splats are half floats, read with vload_half and written with
+   vstore_half, which halves the memory they move; the arithmetic is still
+   float. The other kernels always take floats, so only the fused chain
+   with semi-Lagrangian advection runs on half fields. */
+#ifdef HALF_STORAGE
+  #define FIELD half
+  #define FIELD2 half
+  #define LOAD(p, i) vload_half(AT(i), (p))
+  #define LOAD2(p, i) vload_half2(AT(i), (p))
+  #define STORE(p, i, v) vstore_half((v), AT(i), (p))
+  #define STORE2(p, i, v) vstore_half2((v), AT(i), (p))
+#else
+  #define FIELD float
+  #define FIELD2 float2
+  #define LOAD(p, i) (p)[AT(i)]
+  #define LOAD2(p, i) (p)[AT(i)]
+  #define STORE(p, i, v) ((p)[AT(i)] = (v))
+  #define STORE2(p, i, v) ((p)[AT(i)] = (v))
+#endif
+
 /*** FUNCTIONS FOR FLOAT 2 ***/
 
 __kernel void add_source_float2(__global float2* prev,
                                 __global float2* curr,
-                                int data_width,
+                                WIDTH_ARG,
                                 float dt) {
   uint global_addr_x, global_addr_y, idx;
   global_addr_x = get_global_id(0);
@@ -13,7 +76,7 @@ __kernel void add_source_float2(__global float2* prev,
 
 __kernel void add_source_float(__global float* prev,
                                __global float* curr,
-                               int data_width,
+                               WIDTH_ARG,
                                float dt) {
   uint global_addr_x, global_addr_y, idx;
   global_addr_x = get_global_id(0);
@@ -22,9 +85,12 @@ __kernel void add_source_float(__global float* prev,
   curr[idx] += dt*prev[idx];
 }
 
+/* lin_solve sweeps in place: a work item may read a neighbour before
+   or after its work item writes it, so the results depend on the order
+   they run in. The fused red-black and Jacobi kernels don't. */
 __kernel void lin_solve_float2(__global float2* prev,
                                __global float2* curr,
-                               int data_width,
+                               WIDTH_ARG,
                                float a,
                                float c) {
 
@@ -42,7 +108,7 @@ __kernel void lin_solve_float2(__global float2* prev,
 
 __kernel void lin_solve_float2_ip(__global float2* arr,
                                   __global float2* unused,
-                                  int data_width,
+                                  WIDTH_ARG,
                                   float a,
                                   float c) {
 
@@ -55,12 +121,12 @@ __kernel void lin_solve_float2_ip(__global float2* arr,
   idx10 = (global_addr_y-1)*(data_width)+(global_addr_x);
   idx12 = (global_addr_y+1)*(data_width)+(global_addr_x);
 
-  arr[idx11].y = (arr[idx11].x + a*(arr[idx01].x+arr[idx21].x+arr[idx10].x+arr[idx12].x))/c;
+  arr[idx11].y = (arr[idx11].x + a*(arr[idx01].y+arr[idx21].y+arr[idx10].y+arr[idx12].y))/c;
 }
 
 /* Call with one dimension work item, equals to fluid width */
 __kernel void set_bnd_float2(__global float2 *arr,
-                             int data_width) {
+                             WIDTH_ARG) {
   uint global_addr_x, global_addr_y, 
        idx0I, idxN1I, idxI0, idxIN1,
        idx1I, idxNI,  idxI1, idxIN;
@@ -78,11 +144,34 @@ __kernel void set_bnd_float2(__global float2 *arr,
   arr[idx0I] = arr[idx1I]*(float2)(-1,1);
   arr[idxN1I] = arr[idxNI]*(float2)(-1,1);
   arr[idxI0] = arr[idxI1]*(float2)(1,-1);
-  arr[idxI0] = arr[idxIN]*(float2)(1,-1);
+  arr[idxIN1] = arr[idxIN]*(float2)(1,-1);
+}
+
+/* set_bnd_float2 for the divergence and pressure of project, which
+   are mirrored at the walls rather than reflected like velocity */
+__kernel void set_bnd_mirror_float2(__global float2 *arr,
+                                    WIDTH_ARG) {
+  uint global_addr_x, idx0I, idxN1I, idxI0, idxIN1,
+       idx1I, idxNI, idxI1, idxIN;
+  global_addr_x = get_global_id(0)+1;
+  idx0I = (global_addr_x)*(data_width)+0;
+  idxN1I = (global_addr_x)*(data_width)+data_width-1;
+  idxI0 = 0*(data_width)+(global_addr_x);
+  idxIN1 = (data_width-1)*(data_width)+(global_addr_x);
+
+  idx1I = (global_addr_x)*(data_width)+1;
+  idxNI = (global_addr_x)*(data_width)+(data_width-2);
+  idxI1 = 1*(data_width)+(global_addr_x);
+  idxIN = (data_width-2)*(data_width)+(global_addr_x);
+
+  arr[idx0I] = arr[idx1I];
+  arr[idxN1I] = arr[idxNI];
+  arr[idxI0] = arr[idxI1];
+  arr[idxIN1] = arr[idxIN];
 }
 
 __kernel void set_bnd_float2_end(__global float2 *arr,
-                                 int data_width) {
+                                 WIDTH_ARG) {
   uint idx00, idx10, idx01, idx0N1, idx1N1, idx0N,
        idxN10, idxN0, idxN11, idxN1N1, idxNN1, idxN1N;
 
@@ -109,7 +198,7 @@ __kernel void set_bnd_float2_end(__global float2 *arr,
 
 __kernel void lin_solve_float(__global float* prev,
                               __global float* curr,
-                              int data_width,
+                              WIDTH_ARG,
                               float a,
                               float c) {
 
@@ -126,7 +215,7 @@ __kernel void lin_solve_float(__global float* prev,
 
 /* Call with one dimension work item, equals to fluid width */
 __kernel void set_bnd_float(__global float *arr,
-                            int data_width) {
+                            WIDTH_ARG) {
   uint global_addr_x, global_addr_y, 
        idx0I, idxN1I, idxI0, idxIN1,
        idx1I, idxNI,  idxI1, idxIN;
@@ -144,11 +233,11 @@ __kernel void set_bnd_float(__global float *arr,
   arr[idx0I] = arr[idx1I];
   arr[idxN1I] = arr[idxNI];
   arr[idxI0] = arr[idxI1];
-  arr[idxI0] = arr[idxIN];
+  arr[idxIN1] = arr[idxIN];
 }
 
 __kernel void set_bnd_float_end(__global float *arr,
-                                int data_width) {
+                                WIDTH_ARG) {
   uint idx00, idx10, idx01, idx0N1, idx1N1, idx0N,
        idxN10, idxN0, idxN11, idxN1N1, idxNN1, idxN1N;
 
@@ -174,7 +263,7 @@ __kernel void set_bnd_float_end(__global float *arr,
 /** PROJECT **/
 __kernel void project_start(__global float2 *uv1,
                             __global float2 *uv0,
-                            int data_width) {
+                            WIDTH_ARG) {
   uint global_addr_x, global_addr_y, idx11, idx01, idx21, idx10, idx12;
   global_addr_x = get_global_id(0)+1;
   global_addr_y = get_global_id(1)+1;
@@ -190,7 +279,7 @@ __kernel void project_start(__global float2 *uv1,
 
 __kernel void project_end(__global float2 *uv1,
                           __global float2 *uv0,
-                          int data_width) {
+                          WIDTH_ARG) {
   uint global_addr_x, global_addr_y, idx11, idx01, idx21, idx10, idx12;
   global_addr_x = get_global_id(0)+1;
   global_addr_y = get_global_id(1)+1;
@@ -208,7 +297,7 @@ __kernel void project_end(__global float2 *uv1,
 __kernel void advect_float2(__global float2 *uv0,
                             __global float2 *uv1,
                             __global float2 *uv,
-                            int data_width,
+                            WIDTH_ARG,
                             float dt0) {
   uint global_addr_x, global_addr_y, idx, idx00, idx01, idx10, idx11;
   float x, y, s0, t0, s1, t1;
@@ -235,7 +324,7 @@ __kernel void advect_float2(__global float2 *uv0,
 __kernel void advect_float(__global float *arr0,
                            __global float *arr1,
                            __global float2 *uv,
-                           int data_width,
+                           WIDTH_ARG,
                            float dt0) {
   uint global_addr_x, global_addr_y, idx, idx00, idx01, idx10, idx11;
   float x, y, s0, t0, s1, t1;
@@ -257,4 +346,677 @@ __kernel void advect_float(__global float *arr0,
 
   arr1[idx] = s0 * (t0 * arr0[idx00] + t1 * arr0[idx01]) +
               s1 * (t0 * arr0[idx10] + t1 * arr0[idx11]);
-}
\ No newline at end of file
+}
+/** HIGHER ORDER ADVECTION **/
+/* MacCormack and BFECC run advect forwards (fwd) and then backwards (bwd)
+   with -dt0 to measure the error of the first order advection. Results are
+   clamped to the four cells of the original field the first order value
+   was interpolated from. */
+
+int departure(uint i, uint j, float2 vel, WIDTH_ARG, float dt0, float2 *st) {
+  float x, y;
+  int i0, j0;
+  x = clamp(i - dt0*vel.x, 0.5f, (data_width-2)+0.5f);
+  y = clamp(j - dt0*vel.y, STORED_FIRST+0.5f, STORED_LAST-0.5f);
+  i0 = (int)x;
+  j0 = (int)y;
+  *st = (float2)(x - i0, y - j0);
+  return j0*data_width+i0;
+}
+
+float limit_float(__global float *arr0, int idx00, WIDTH_ARG, float val) {
+  float a = arr0[idx00], b = arr0[idx00+1], c = arr0[idx00+data_width], d = arr0[idx00+data_width+1];
+  return clamp(val, fmin(fmin(a, b), fmin(c, d)), fmax(fmax(a, b), fmax(c, d)));
+}
+
+float2 limit_float2(__global float2 *arr0, int idx00, WIDTH_ARG, float2 val) {
+  float2 a = arr0[idx00], b = arr0[idx00+1], c = arr0[idx00+data_width], d = arr0[idx00+data_width+1];
+  return clamp(val, fmin(fmin(a, b), fmin(c, d)), fmax(fmax(a, b), fmax(c, d)));
+}
+
+__kernel void maccormack_float2(__global float2 *uv0,
+                                __global float2 *fwd,
+                                __global float2 *bwd,
+                                __global float2 *uv1,
+                                __global float2 *uv,
+                                WIDTH_ARG,
+                                float dt0) {
+  uint global_addr_x, global_addr_y, idx;
+  int idx00;
+  float2 st;
+  global_addr_x = get_global_id(0)+1;
+  global_addr_y = get_global_id(1)+1;
+  idx = (global_addr_y)*(data_width)+(global_addr_x);
+  idx00 = departure(global_addr_x, global_addr_y, uv[idx], data_width, dt0, &st);
+
+  uv1[idx] = limit_float2(uv0, idx00, data_width, fwd[idx] + 0.5f*(uv0[idx] - bwd[idx]));
+}
+
+__kernel void maccormack_float(__global float *arr0,
+                               __global float *fwd,
+                               __global float *bwd,
+                               __global float *arr1,
+                               __global float2 *uv,
+                               WIDTH_ARG,
+                               float dt0) {
+  uint global_addr_x, global_addr_y, idx;
+  int idx00;
+  float2 st;
+  global_addr_x = get_global_id(0)+1;
+  global_addr_y = get_global_id(1)+1;
+  idx = (global_addr_y)*(data_width)+(global_addr_x);
+  idx00 = departure(global_addr_x, global_addr_y, uv[idx], data_width, dt0, &st);
+
+  arr1[idx] = limit_float(arr0, idx00, data_width, fwd[idx] + 0.5f*(arr0[idx] - bwd[idx]));
+}
+
+/* bwd = arr0 + (arr0 - bwd)/2: the original with the round trip error removed */
+__kernel void bfecc_correct_float2(__global float2 *uv0,
+                                   __global float2 *bwd,
+                                   WIDTH_ARG) {
+  uint global_addr_x, global_addr_y, idx;
+  global_addr_x = get_global_id(0)+1;
+  global_addr_y = get_global_id(1)+1;
+  idx = (global_addr_y)*(data_width)+(global_addr_x);
+  bwd[idx] = uv0[idx] + 0.5f*(uv0[idx] - bwd[idx]);
+}
+
+__kernel void bfecc_correct_float(__global float *arr0,
+                                  __global float *bwd,
+                                  WIDTH_ARG) {
+  uint global_addr_x, global_addr_y, idx;
+  global_addr_x = get_global_id(0)+1;
+  global_addr_y = get_global_id(1)+1;
+  idx = (global_addr_y)*(data_width)+(global_addr_x);
+  bwd[idx] = arr0[idx] + 0.5f*(arr0[idx] - bwd[idx]);
+}
+
+/* uv1 = advect(bwd), clamped to the cells of uv0 it came from */
+__kernel void advect_limited_float2(__global float2 *uv0,
+                                    __global float2 *bwd,
+                                    __global float2 *uv1,
+                                    __global float2 *uv,
+                                    WIDTH_ARG,
+                                    float dt0) {
+  uint global_addr_x, global_addr_y, idx;
+  int idx00;
+  float2 st, val;
+  global_addr_x = get_global_id(0)+1;
+  global_addr_y = get_global_id(1)+1;
+  idx = (global_addr_y)*(data_width)+(global_addr_x);
+  idx00 = departure(global_addr_x, global_addr_y, uv[idx], data_width, dt0, &st);
+
+  val = (1 - st.x) * ((1 - st.y) * bwd[idx00] + st.y * bwd[idx00+data_width]) +
+        st.x * ((1 - st.y) * bwd[idx00+1] + st.y * bwd[idx00+data_width+1]);
+  uv1[idx] = limit_float2(uv0, idx00, data_width, val);
+}
+
+__kernel void advect_limited_float(__global float *arr0,
+                                   __global float *bwd,
+                                   __global float *arr1,
+                                   __global float2 *uv,
+                                   WIDTH_ARG,
+                                   float dt0) {
+  uint global_addr_x, global_addr_y, idx;
+  int idx00;
+  float2 st;
+  float val;
+  global_addr_x = get_global_id(0)+1;
+  global_addr_y = get_global_id(1)+1;
+  idx = (global_addr_y)*(data_width)+(global_addr_x);
+  idx00 = departure(global_addr_x, global_addr_y, uv[idx], data_width, dt0, &st);
+
+  val = (1 - st.x) * ((1 - st.y) * bwd[idx00] + st.y * bwd[idx00+data_width]) +
+        st.x * ((1 - st.y) * bwd[idx00+1] + st.y * bwd[idx00+data_width+1]);
+  arr1[idx] = limit_float(arr0, idx00, data_width, val);
+}
+
+/** FUSED KERNELS **/
+/* These read the ghost cells as set_bnd would set them from the interior,
+   so no set_bnd is needed between them, and the work items next to the
+   walls write the ghost cells of their results so the buffers stay valid
+   for the other kernels and for drawing.
+   A ghost cell is its interior neighbour times wx across the left and
+   right walls and wy across the top and bottom walls; the corners get the
+   average of the two. */
+
+#define VEL_WX (float2)(-1.0f, 1.0f)
+#define VEL_WY (float2)(1.0f, -1.0f)
+#define MIRROR (float2)(1.0f, 1.0f)
+
+float2 fetch_float2(__global const FIELD2 *arr, int i, int j, WIDTH_ARG, float2 wx, float2 wy) {
+  int n = data_width-2;
+  int ex = i < 1 || i > n, ey = j < 1 || j > n;
+  float2 w = ex ? (ey ? 0.5f*(wx + wy) : wx) : (ey ? wy : MIRROR);
+  return LOAD2(arr, clamp(j, 1, n)*data_width + clamp(i, 1, n)) * w;
+}
+
+float fetch_float(__global const FIELD *arr, int i, int j, WIDTH_ARG) {
+  int n = data_width-2;
+  return LOAD(arr, clamp(j, 1, n)*data_width + clamp(i, 1, n));
+}
+
+void put_ghosts_float2(__global FIELD2 *arr, int i, int j, WIDTH_ARG, float2 val, float2 wx, float2 wy) {
+  int n = data_width-2;
+  if (i == 1) STORE2(arr, j*data_width, val * wx);
+  if (i == n) STORE2(arr, j*data_width + n+1, val * wx);
+  if (j == 1) STORE2(arr, i, val * wy);
+  if (j == n) STORE2(arr, (n+1)*data_width + i, val * wy);
+  if ((i == 1 || i == n) && (j == 1 || j == n)) {
+    STORE2(arr, (j == 1 ? 0 : n+1)*data_width + (i == 1 ? 0 : n+1), val * 0.5f*(wx + wy));
+  }
+}
+
+void put_ghosts_float(__global FIELD *arr, int i, int j, WIDTH_ARG, float val) {
+  int n = data_width-2;
+  if (i == 1) STORE(arr, j*data_width, val);
+  if (i == n) STORE(arr, j*data_width + n+1, val);
+  if (j == 1) STORE(arr, i, val);
+  if (j == n) STORE(arr, (n+1)*data_width + i, val);
+  if ((i == 1 || i == n) && (j == 1 || j == n)) {
+    STORE(arr, (j == 1 ? 0 : n+1)*data_width + (i == 1 ? 0 : n+1), val);
+  }
+}
+
+/* Half a red-black sweep of lin_solve and set_bnd: only the cells with
+   (i+j)&1 == color change, and they read only cells of the other colour,
+   so the result doesn't depend on the order the work items run in.
+   On the first launch of a diffuse dt is the time step of the sources in
+   src, which are added to prev as add_source would, and 0 after that.
+   src may be curr, whose values are the first guess. */
+__kernel void lin_solve_fused_float2(__global FIELD2 *prev,
+                                     __global FIELD2 *curr,
+                                     __global FIELD2 *src,
+                                     WIDTH_ARG,
+                                     float a,
+                                     float c,
+                                     float dt,
+                                     int color) {
+  int i = get_global_id(0)+1, j = get_global_id(1)+1;
+  int idx = j*data_width + i;
+  float2 x0 = LOAD2(prev, idx);
+  if (dt != 0) {
+    x0 += dt*LOAD2(src, idx);
+    STORE2(prev, idx, x0);
+  }
+  if (((i + j) & 1) != color) return;
+  float2 val = (x0 + a*(fetch_float2(curr, i-1, j, data_width, VEL_WX, VEL_WY) +
+                        fetch_float2(curr, i+1, j, data_width, VEL_WX, VEL_WY) +
+                        fetch_float2(curr, i, j-1, data_width, VEL_WX, VEL_WY) +
+                        fetch_float2(curr, i, j+1, data_width, VEL_WX, VEL_WY)))/c;
+  STORE2(curr, idx, val);
+  put_ghosts_float2(curr, i, j, data_width, val, VEL_WX, VEL_WY);
+}
+
+__kernel void lin_solve_fused_float(__global FIELD *prev,
+                                    __global FIELD *curr,
+                                    __global FIELD *src,
+                                    WIDTH_ARG,
+                                    float a,
+                                    float c,
+                                    float dt,
+                                    int color) {
+  int i = get_global_id(0)+1, j = get_global_id(1)+1;
+  int idx = j*data_width + i;
+  float x0 = LOAD(prev, idx);
+  if (dt != 0) {
+    x0 += dt*LOAD(src, idx);
+    STORE(prev, idx, x0);
+  }
+  if (((i + j) & 1) != color) return;
+  float val = (x0 + a*(fetch_float(curr, i-1, j, data_width) + fetch_float(curr, i+1, j, data_width) +
+                       fetch_float(curr, i, j-1, data_width) + fetch_float(curr, i, j+1, data_width)))/c;
+  STORE(curr, idx, val);
+  put_ghosts_float(curr, i, j, data_width, val);
+}
+
+/* A Jacobi sweep of lin_solve and set_bnd from curr into next, which
+   must be different buffers. Sources as lin_solve_fused_float2. */
+__kernel void lin_solve_jacobi_float2(__global FIELD2 *prev,
+                                      __global const FIELD2 *curr,
+                                      __global FIELD2 *next,
+                                      __global const FIELD2 *src,
+                                      WIDTH_ARG,
+                                      float a,
+                                      float c,
+                                      float dt) {
+  int i = get_global_id(0)+1, j = get_global_id(1)+1;
+  int idx = j*data_width + i;
+  float2 x0 = LOAD2(prev, idx);
+  if (dt != 0) {
+    x0 += dt*LOAD2(src, idx);
+    STORE2(prev, idx, x0);
+  }
+  float2 val = (x0 + a*(fetch_float2(curr, i-1, j, data_width, VEL_WX, VEL_WY) +
+                        fetch_float2(curr, i+1, j, data_width, VEL_WX, VEL_WY) +
+                        fetch_float2(curr, i, j-1, data_width, VEL_WX, VEL_WY) +
+                        fetch_float2(curr, i, j+1, data_width, VEL_WX, VEL_WY)))/c;
+  STORE2(next, idx, val);
+  put_ghosts_float2(next, i, j, data_width, val, VEL_WX, VEL_WY);
+}
+
+__kernel void lin_solve_jacobi_float(__global FIELD *prev,
+                                     __global const FIELD *curr,
+                                     __global FIELD *next,
+                                     __global const FIELD *src,
+                                     WIDTH_ARG,
+                                     float a,
+                                     float c,
+                                     float dt) {
+  int i = get_global_id(0)+1, j = get_global_id(1)+1;
+  int idx = j*data_width + i;
+  float x0 = LOAD(prev, idx);
+  if (dt != 0) {
+    x0 += dt*LOAD(src, idx);
+    STORE(prev, idx, x0);
+  }
+  float val = (x0 + a*(fetch_float(curr, i-1, j, data_width) + fetch_float(curr, i+1, j, data_width) +
+                       fetch_float(curr, i, j-1, data_width) + fetch_float(curr, i, j+1, data_width)))/c;
+  STORE(next, idx, val);
+  put_ghosts_float(next, i, j, data_width, val);
+}
+
+/* The pressure is in .y of uv0 and the divergence in .x. Both are mirrored
+   at the walls. */
+
+/* project_start and, if sweep isn't 0, the first pressure sweep, which
+   starts from zero */
+__kernel void project_start_fused(__global FIELD2 *uv1,
+                                  __global FIELD2 *uv0,
+                                  WIDTH_ARG,
+                                  int sweep) {
+  int i = get_global_id(0)+1, j = get_global_id(1)+1;
+  float div = -0.5f*(fetch_float2(uv1, i+1, j, data_width, VEL_WX, VEL_WY).x -
+                     fetch_float2(uv1, i-1, j, data_width, VEL_WX, VEL_WY).x +
+                     fetch_float2(uv1, i, j+1, data_width, VEL_WX, VEL_WY).y -
+                     fetch_float2(uv1, i, j-1, data_width, VEL_WX, VEL_WY).y)/(data_width-2);
+  float2 val = (float2)(div, sweep ? div/4 : 0);
+  STORE2(uv0, j*data_width + i, val);
+  put_ghosts_float2(uv0, i, j, data_width, val, MIRROR, MIRROR);
+}
+
+/* a pressure sweep, a = 1 and c = 4 */
+float pressure_sweep(__global const FIELD2 *arr, int i, int j, WIDTH_ARG) {
+  int n = data_width-2;
+  i = clamp(i, 1, n);
+  j = clamp(j, 1, n);
+  return (LOAD2(arr, j*data_width + i).x +
+          fetch_float2(arr, i-1, j, data_width, MIRROR, MIRROR).y +
+          fetch_float2(arr, i+1, j, data_width, MIRROR, MIRROR).y +
+          fetch_float2(arr, i, j-1, data_width, MIRROR, MIRROR).y +
+          fetch_float2(arr, i, j+1, data_width, MIRROR, MIRROR).y)/4;
+}
+
+/* half a red-black pressure sweep, as lin_solve_fused_float2 */
+__kernel void lin_solve_fused_float2_ip(__global FIELD2 *arr,
+                                        WIDTH_ARG,
+                                        int color) {
+  int i = get_global_id(0)+1, j = get_global_id(1)+1;
+  int idx = j*data_width + i;
+  if (((i + j) & 1) != color) return;
+  float2 val = (float2)(LOAD2(arr, idx).x, pressure_sweep(arr, i, j, data_width));
+  STORE2(arr, idx, val);
+  put_ghosts_float2(arr, i, j, data_width, val, MIRROR, MIRROR);
+}
+
+/* a Jacobi pressure sweep from curr into next */
+__kernel void lin_solve_jacobi_float2_ip(__global const FIELD2 *curr,
+                                         __global FIELD2 *next,
+                                         WIDTH_ARG) {
+  int i = get_global_id(0)+1, j = get_global_id(1)+1;
+  int idx = j*data_width + i;
+  float2 val = (float2)(LOAD2(curr, idx).x, pressure_sweep(curr, i, j, data_width));
+  STORE2(next, idx, val);
+  put_ghosts_float2(next, i, j, data_width, val, MIRROR, MIRROR);
+}
+
+/* project_end and, if sweep isn't 0, the last pressure sweep. The
+   pressure of the four neighbours is swept here from the last but one,
+   so uv0 isn't written. */
+float end_pressure(__global const FIELD2 *arr, int i, int j, WIDTH_ARG, int sweep) {
+  return sweep ? pressure_sweep(arr, i, j, data_width) : fetch_float2(arr, i, j, data_width, MIRROR, MIRROR).y;
+}
+
+__kernel void project_end_fused(__global FIELD2 *uv1,
+                                __global FIELD2 *uv0,
+                                WIDTH_ARG,
+                                int sweep) {
+  int i = get_global_id(0)+1, j = get_global_id(1)+1;
+  int idx = j*data_width + i;
+  float n = data_width-2;
+  float2 val = LOAD2(uv1, idx) - (float2)(0.5f*n*(end_pressure(uv0, i+1, j, data_width, sweep) - end_pressure(uv0, i-1, j, data_width, sweep)),
+                                   0.5f*n*(end_pressure(uv0, i, j+1, data_width, sweep) - end_pressure(uv0, i, j-1, data_width, sweep)));
+  STORE2(uv1, idx, val);
+  put_ghosts_float2(uv1, i, j, data_width, val, VEL_WX, VEL_WY);
+}
+
+/* advect and set_bnd */
+__kernel void advect_fused_float2(__global FIELD2 *uv0,
+                                  __global FIELD2 *uv1,
+                                  __global FIELD2 *uv,
+                                  WIDTH_ARG,
+                                  float dt0) {
+  int i = get_global_id(0)+1, j = get_global_id(1)+1;
+  int idx = j*data_width + i;
+  float2 st;
+  int idx00 = departure(i, j, LOAD2(uv, idx), data_width, dt0, &st);
+  int i0 = idx00 % data_width, j0 = idx00 / data_width;
+  float2 val = (1 - st.x) * ((1 - st.y) * fetch_float2(uv0, i0, j0, data_width, VEL_WX, VEL_WY) +
+                             st.y * fetch_float2(uv0, i0, j0+1, data_width, VEL_WX, VEL_WY)) +
+               st.x * ((1 - st.y) * fetch_float2(uv0, i0+1, j0, data_width, VEL_WX, VEL_WY) +
+                       st.y * fetch_float2(uv0, i0+1, j0+1, data_width, VEL_WX, VEL_WY));
+  STORE2(uv1, idx, val);
+  put_ghosts_float2(uv1, i, j, data_width, val, VEL_WX, VEL_WY);
+}
+
+__kernel void advect_fused_float(__global FIELD *arr0,
+                                 __global FIELD *arr1,
+                                 __global FIELD2 *uv,
+                                 WIDTH_ARG,
+                                 float dt0) {
+  int i = get_global_id(0)+1, j = get_global_id(1)+1;
+  int idx = j*data_width + i;
+  float2 st;
+  int idx00 = departure(i, j, LOAD2(uv, idx), data_width, dt0, &st);
+  int i0 = idx00 % data_width, j0 = idx00 / data_width;
+  float val = (1 - st.x) * ((1 - st.y) * fetch_float(arr0, i0, j0, data_width) +
+                            st.y * fetch_float(arr0, i0, j0+1, data_width)) +
+              st.x * ((1 - st.y) * fetch_float(arr0, i0+1, j0, data_width) +
+                      st.y * fetch_float(arr0, i0+1, j0+1, data_width));
+  STORE(arr1, idx, val);
+  put_ghosts_float(arr1, i, j, data_width, val);
+}
+
+/** TILED LIN_SOLVE **/
+/* lin_solve_fused with each work group keeping a (T+2) x (T+2) tile of
+   curr in local memory, its T x T cells and a ring of neighbours, and
+   making several red-black sweeps on the tile before writing to next:
+   the cells with i+j even and then those with i+j odd. The ring and the
+   ghost cells are read once a launch, so the cells at the edges of a tile
+   lag their neighbours in other tiles by up to sweeps-1 sweeps. curr and
+   next are different buffers. The work groups are T x T and the global size is
+   rounded up to a multiple of T; work items past the grid only load. */
+TILED_KERNEL void lin_solve_tiled_float2(__global FIELD2 *prev,
+                                     __global const FIELD2 *curr,
+                                     __global FIELD2 *next,
+                                     __global const FIELD2 *src,
+                                     WIDTH_ARG,
+                                     float a,
+                                     float c,
+                                     float dt,
+                                     int sweeps,
+                                     __local float2 *tile) {
+  int n = data_width-2;
+  int i = get_global_id(0)+1, j = get_global_id(1)+1;
+  int li = get_local_id(0)+1, lj = get_local_id(1)+1;
+  int T = TILE, tw = T+2;
+  int inside = i <= n && j <= LAST_ROW;
+  int idx = clamp(j, 1, n)*data_width + clamp(i, 1, n);
+  int k, s;
+
+  float2 x0 = LOAD2(prev, idx);
+  if (dt != 0) {
+    x0 += dt*LOAD2(src, idx);
+    if (inside) STORE2(prev, idx, x0);
+  }
+
+  k = lj*tw + li;
+  tile[k] = fetch_float2(curr, i, j, data_width, VEL_WX, VEL_WY);
+  if (li == 1) tile[k-1] = fetch_float2(curr, i-1, j, data_width, VEL_WX, VEL_WY);
+  if (li == T) tile[k+1] = fetch_float2(curr, i+1, j, data_width, VEL_WX, VEL_WY);
+  if (lj == 1) tile[k-tw] = fetch_float2(curr, i, j-1, data_width, VEL_WX, VEL_WY);
+  if (lj == T) tile[k+tw] = fetch_float2(curr, i, j+1, data_width, VEL_WX, VEL_WY);
+  barrier(CLK_LOCAL_MEM_FENCE);
+
+  for (s = 0; s != sweeps*2; ++s) {
+    if (inside && ((i + j + s) & 1)) {
+      tile[k] = (x0 + a*(tile[k-1] + tile[k+1] + tile[k-tw] + tile[k+tw]))/c;
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+  }
+
+  float2 val = tile[k];
+  if (inside) {
+    STORE2(next, j*data_width + i, val);
+    put_ghosts_float2(next, i, j, data_width, val, VEL_WX, VEL_WY);
+  }
+}
+
+TILED_KERNEL void lin_solve_tiled_float(__global FIELD *prev,
+                                    __global const FIELD *curr,
+                                    __global FIELD *next,
+                                    __global const FIELD *src,
+                                    WIDTH_ARG,
+                                    float a,
+                                    float c,
+                                    float dt,
+                                    int sweeps,
+                                    __local float *tile) {
+  int n = data_width-2;
+  int i = get_global_id(0)+1, j = get_global_id(1)+1;
+  int li = get_local_id(0)+1, lj = get_local_id(1)+1;
+  int T = TILE, tw = T+2;
+  int inside = i <= n && j <= LAST_ROW;
+  int idx = clamp(j, 1, n)*data_width + clamp(i, 1, n);
+  int k, s;
+
+  float x0 = LOAD(prev, idx);
+  if (dt != 0) {
+    x0 += dt*LOAD(src, idx);
+    if (inside) STORE(prev, idx, x0);
+  }
+
+  k = lj*tw + li;
+  tile[k] = fetch_float(curr, i, j, data_width);
+  if (li == 1) tile[k-1] = fetch_float(curr, i-1, j, data_width);
+  if (li == T) tile[k+1] = fetch_float(curr, i+1, j, data_width);
+  if (lj == 1) tile[k-tw] = fetch_float(curr, i, j-1, data_width);
+  if (lj == T) tile[k+tw] = fetch_float(curr, i, j+1, data_width);
+  barrier(CLK_LOCAL_MEM_FENCE);
+
+  for (s = 0; s != sweeps*2; ++s) {
+    if (inside && ((i + j + s) & 1)) {
+      tile[k] = (x0 + a*(tile[k-1] + tile[k+1] + tile[k-tw] + tile[k+tw]))/c;
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+  }
+
+  float val = tile[k];
+  if (inside) {
+    STORE(next, j*data_width + i, val);
+    put_ghosts_float(next, i, j, data_width, val);
+  }
+}
+
+/* pressure sweeps of project, as lin_solve_fused_float2_ip. Only the
+   pressure goes in the tile. */
+TILED_KERNEL void lin_solve_tiled_float2_ip(__global const FIELD2 *curr,
+                                        __global FIELD2 *next,
+                                        WIDTH_ARG,
+                                        int sweeps,
+                                        __local float *tile) {
+  int n = data_width-2;
+  int i = get_global_id(0)+1, j = get_global_id(1)+1;
+  int li = get_local_id(0)+1, lj = get_local_id(1)+1;
+  int T = TILE, tw = T+2;
+  int inside = i <= n && j <= LAST_ROW;
+  int k, s;
+
+  float div = LOAD2(curr, clamp(j, 1, n)*data_width + clamp(i, 1, n)).x;
+
+  k = lj*tw + li;
+  tile[k] = fetch_float2(curr, i, j, data_width, MIRROR, MIRROR).y;
+  if (li == 1) tile[k-1] = fetch_float2(curr, i-1, j, data_width, MIRROR, MIRROR).y;
+  if (li == T) tile[k+1] = fetch_float2(curr, i+1, j, data_width, MIRROR, MIRROR).y;
+  if (lj == 1) tile[k-tw] = fetch_float2(curr, i, j-1, data_width, MIRROR, MIRROR).y;
+  if (lj == T) tile[k+tw] = fetch_float2(curr, i, j+1, data_width, MIRROR, MIRROR).y;
+  barrier(CLK_LOCAL_MEM_FENCE);
+
+  for (s = 0; s != sweeps*2; ++s) {
+    if (inside && ((i + j + s) & 1)) {
+      tile[k] = (div + tile[k-1] + tile[k+1] + tile[k-tw] + tile[k+tw])/4;
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+  }
+
+  if (inside) {
+    float2 val = (float2)(div, tile[k]);
+    STORE2(next, j*data_width + i, val);
+    put_ghosts_float2(next, i, j, data_width, val, MIRROR, MIRROR);
+  }
+}
+
+/** CFL **/
+/* Largest |u| or |v| of the interior of uv + dt*src, or of a slab's
+   rows, so the fused kernels can leave the sources to the first diffuse. Each work item takes every
+   get_global_size(0)'th cell, then each work group reduces its items in
+   local memory and writes one result to partial for the host to combine.
+   The local size must be a power of two. */
+__kernel void max_speed_float2(__global FIELD2 *uv,
+                               __global FIELD2 *src,
+                               __global float *partial,
+                               __local float *scratch,
+                               WIDTH_ARG,
+                               float dt) {
+  uint lid, n, rows, k, s, idx;
+  float speed = 0;
+  float2 a;
+  lid = get_local_id(0);
+  n = data_width-2;
+  rows = LAST_ROW-FIRST_ROW+1;
+  for (k = get_global_id(0); k < n*rows; k += get_global_size(0)) {
+    idx = (k/n+FIRST_ROW)*data_width + k%n+1;
+    a = fabs(LOAD2(uv, idx) + dt*LOAD2(src, idx));
+    speed = fmax(speed, fmax(a.x, a.y));
+  }
+  scratch[lid] = speed;
+  barrier(CLK_LOCAL_MEM_FENCE);
+
+  for (s = get_local_size(0)/2; s > 0; s >>= 1) {
+    if (lid < s) {
+      scratch[lid] = fmax(scratch[lid], scratch[lid+s]);
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+  }
+  if (lid == 0) {
+    partial[get_group_id(0)] = scratch[0];
+  }
+}
+
+/** SPLATS **/
+/* The sources of a step are zero but for the few cells the user touched,
+   so rather than upload whole grids the host clears uv and dens on the
+   device and uploads a list of splats, each (cell, u, v, density) with
+   the cell index y*data_width+x in .x. One work item a splat, so the
+   list should hold a cell at most once. */
+__kernel void clear_sources(__global FIELD2 *uv,
+                            __global FIELD *dens,
+                            WIDTH_ARG) {
+  uint idx = get_global_id(1)*data_width + get_global_id(0);
+  STORE2(uv, idx, (float2)(0, 0));
+  STORE(dens, idx, 0.0f);
+}
+
+__kernel void splat_sources(__global FIELD2 *uv,
+                            __global FIELD *dens,
+                            __global const float4 *splats,
+                            WIDTH_ARG) {
+  float4 s = splats[get_global_id(0)];
+  uint idx = (uint)s.x;
+  STORE2(uv, idx, (float2)(s.y, s.z));
+  STORE(dens, idx, s.w);
+}
+
+/** DRAWING **/
+/* The velocity of each cell as a line for GL_LINES, drawn straight from a
+   buffer shared with GL so the host never reads the velocity back. Each
+   cell writes two vertices of three floats: its centre, at origin plus
+   step times (i, j), and its centre plus its velocity times scale. */
+__kernel void velocity_lines(__global const FIELD2 *uv,
+                             __global float *lines,
+                             WIDTH_ARG,
+                             float origin,
+                             float step,
+                             float scale) {
+  uint i = get_global_id(0), j = get_global_id(1);
+  uint idx = j*data_width + i;
+  float2 vel = LOAD2(uv, idx) * scale;
+  float x = origin + i*step, y = origin + j*step;
+  __global float *line = lines + idx*6;
+  line[0] = x;
+  line[1] = y;
+  line[2] = 0;
+  line[3] = x + vel.x;
+  line[4] = y + vel.y;
+  line[5] = 0;
+}
+
+/** PARTICLES **/
+/* Passive tracers carried by the velocity, one work item a particle.
+   Positions are in the world units of the drawing, cell (i, j) being at
+   origin plus step times (i, j), so pos1 can be a GL buffer drawn as
+   GL_POINTS straight after. Each step reads pos0 and writes pos1, with a
+   second (rk3 == 0) or third order Runge-Kutta step of the bilinear
+   velocity. A particle older than lifetime or outside the interior is
+   recycled in its own slot, at a position hashed from its index and seed,
+   so the pool stays full and nothing is allocated or compacted. */
+float2 sample_velocity(__global const FIELD2 *uv, float x, float y, WIDTH_ARG) {
+  float hi = (data_width-2)+0.5f;
+  x = clamp(x, 0.5f, hi);
+  y = clamp(y, 0.5f, hi);
+  int i0 = (int)x, j0 = (int)y;
+  float s1 = x - i0, t1 = y - j0;
+  float s0 = 1 - s1, t0 = 1 - t1;
+  int idx = j0*data_width + i0;
+  return s0 * (t0 * LOAD2(uv, idx) + t1 * LOAD2(uv, idx+data_width)) +
+         s1 * (t0 * LOAD2(uv, idx+1) + t1 * LOAD2(uv, idx+data_width+1));
+}
+
+uint hash_uint(uint x) {
+  x ^= x >> 16;
+  x *= 0x7feb352dU;
+  x ^= x >> 15;
+  x *= 0x846ca68bU;
+  x ^= x >> 16;
+  return x;
+}
+
+__kernel void advect_particles(__global const float2 *pos0,
+                               __global float2 *pos1,
+                               __global float *age,
+                               __global const FIELD2 *uv,
+                               WIDTH_ARG,
+                               float dt,
+                               float dt0,
+                               float lifetime,
+                               float origin,
+                               float step,
+                               uint seed,
+                               int rk3) {
+  uint k = get_global_id(0);
+  float2 p = pos0[k];
+  float x = (p.x - origin) / step, y = (p.y - origin) / step;
+  float2 k1 = sample_velocity(uv, x, y, data_width);
+  float2 k2 = sample_velocity(uv, x + 0.5f*dt0*k1.x, y + 0.5f*dt0*k1.y, data_width);
+  float2 d;
+  if (rk3) {
+    float2 k3 = sample_velocity(uv, x + dt0*(2*k2.x - k1.x), y + dt0*(2*k2.y - k1.y), data_width);
+    d = (k1 + 4*k2 + k3) * (dt0/6);
+  } else {
+    d = k2 * dt0;
+  }
+  x += d.x;
+  y += d.y;
+
+  float a = age[k] + dt;
+  float hi = (data_width-2)+0.5f;
+  if (a >= lifetime || !(x >= 0.5f && x <= hi && y >= 0.5f && y <= hi)) {
+    uint h = hash_uint(k ^ hash_uint(seed));
+    x = 0.5f + (h >> 8) * (1.0f/16777216.0f) * (data_width-2);
+    h = hash_uint(h);
+    y = 0.5f + (h >> 8) * (1.0f/16777216.0f) * (data_width-2);
+    a = 0;
+  }
+  pos1[k] = (float2)(origin + x*step, origin + y*step);
+  age[k] = a;
+}
@@ -96,6 +96,24 @@ namespace octet { namespace containers {
       return res;
     }
 
+    // memory aligned to "alignment" bytes, a power of two.
+    // the offset to the start of the block is stored just before the result.
+    static void *malloc_aligned(size_t size, size_t alignment) {
+      size_t extra = alignment + sizeof(size_t);
+      char *raw = (char*)malloc(size + extra);
+      if (!raw) return 0;
+      char *res = (char*)(((size_t)raw + extra) & ~(alignment - 1));
+      ((size_t*)res)[-1] = (size_t)(res - raw);
+      return res;
+    }
+
+    // free memory from malloc_aligned. size and alignment must match.
+    static void free_aligned(void *ptr, size_t size, size_t alignment) {
+      if (!ptr) return;
+      char *raw = (char*)ptr - ((size_t*)ptr)[-1];
+      free(raw, size + alignment + sizeof(size_t));
+    }
+
     // crude check of stack integrity
     static void test(const char *label) {
       printf("test %s\n", label);
@@ -0,0 +1,334 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2012-2014
+//
+// Modular Framework for OpenGLES2 rendering on multiple platforms.
+//
+// Headless fluid simulation driven by a script.
+//
+// The script sets up the run and schedules sources and forces in place of
+// the mouse input of the fluidshader example. One command per line, # starts
+// a comment. Positions and radii are fractions of the grid's width, steps
+// count from 0 and an event applies on steps first to last inclusive.
+//
+//   grid N
+//   dt seconds
+//   diffusion value
+//   viscosity value
+//   steps count
+//   every count                  write a frame every count steps
+//   cfl cells max_substeps       see fluid_solver::set_cfl
+//   sparse 0|1                   see fluid_solver::set_sparse
+//   fields dens u v              which fields go in the frames
+//   format float|half|bfloat16   how the frames store the cells
+//   source first last x y radius amount
+//   force first last x y radius fx fy
+//
+// Sources and forces are rates, added to dens_prev, u_prev and v_prev for
+// every cell within radius of (x, y), as get_from_UI does for the mouse.
+//
+// A long run can write a fluid_checkpoint every few steps and be resumed
+// from the last one after a crash. The events are a function of the step,
+// so the resumed run writes the frames the whole run would have: it keeps
+// the frames file's frames up to the checkpoint and writes the rest after
+// them. The frames are flushed to the file with every checkpoint.
+//
+
+namespace octet {
+  class fluid_batch {
+  public:
+    enum event_kind {
+      event_source,
+      event_force,
+    };
+
+    struct event {
+      event_kind kind;
+      int first;
+      int last;
+      float x, y, radius;
+      float amount;
+      float fx, fy;
+    };
+
+  private:
+    int N;
+    float dt;
+    float diff;
+    float visc;
+    int steps;
+    int every;
+    float cfl;
+    int max_substeps;
+    int sparse;
+    int fields;
+    int format;
+
+    dynarray<event> events;
+
+    fluid_grid grid;
+    int u_field, v_field, dens_field;
+
+    fluid_workers workers;
+    fluid_solver solver;
+
+    // where and how often run() saves checkpoints, and the one it resumes from
+    const char *checkpoint_file;
+    int checkpoint_every;
+    const char *resume_file;
+
+    // write the checkpoint to a temporary file first, so a crash while
+    // saving leaves the last one intact
+    bool save_checkpoint(fluid_checkpoint &checkpoint, int step) {
+      string tmp = checkpoint_file;
+      tmp += ".tmp";
+      checkpoint.set_state(step, dt, 0);
+      if (!checkpoint.save(tmp.c_str())) return false;
+      if (rename(tmp.c_str(), checkpoint_file)) {
+        // windows won't rename over an existing file
+        remove(checkpoint_file);
+        if (rename(tmp.c_str(), checkpoint_file)) {
+          perror(checkpoint_file);
+          return false;
+        }
+      }
+      return true;
+    }
+
+    // zero the sources, then add those of the events running on this step
+    void apply_events(int step, float *d, float *u, float *v) {
+      for (int j = 0; j != N+2; ++j) {
+        for (int i = grid.index(0, j); i != grid.index(N+2, j); ++i) {
+          u[i] = v[i] = d[i] = 0.0f;
+        }
+      }
+
+      for (int e = 0; e != (int)events.size(); ++e) {
+        const event &ev = events[e];
+        if (step < ev.first || step > ev.last) continue;
+
+        // cell (i, j) is centred on ((i - 0.5) / N, (j - 0.5) / N)
+        float cx = ev.x * N + 0.5f, cy = ev.y * N + 0.5f;
+        float r = ev.radius * N;
+        if (r < 0.5f) r = 0.5f;
+        int i0 = (int)floorf(cx - r), i1 = (int)ceilf(cx + r);
+        int j0 = (int)floorf(cy - r), j1 = (int)ceilf(cy + r);
+        if (i0 < 1) i0 = 1;
+        if (i1 > N) i1 = N;
+        if (j0 < 1) j0 = 1;
+        if (j1 > N) j1 = N;
+
+        for (int j = j0; j <= j1; ++j) {
+          for (int i = i0; i <= i1; ++i) {
+            float dx = i - cx, dy = j - cy;
+            if (dx*dx + dy*dy > r*r) continue;
+            int idx = grid.index(i, j);
+            if (ev.kind == event_source) {
+              d[idx] += ev.amount;
+            } else {
+              u[idx] += ev.fx;
+              v[idx] += ev.fy;
+            }
+          }
+        }
+      }
+    }
+
+    bool parse_line(const char *line, int line_number, const char *filename) {
+      char cmd[32];
+      int n = 0;
+      if (sscanf(line, " %31s%n", cmd, &n) != 1 || cmd[0] == '#') return true;
+      const char *args = line + n;
+
+      event ev;
+      memset(&ev, 0, sizeof(ev));
+      bool ok = true;
+      if (!strcmp(cmd, "grid")) {
+        ok = sscanf(args, "%d", &N) == 1 && N > 0;
+      } else if (!strcmp(cmd, "dt")) {
+        ok = sscanf(args, "%f", &dt) == 1;
+      } else if (!strcmp(cmd, "diffusion")) {
+        ok = sscanf(args, "%f", &diff) == 1;
+      } else if (!strcmp(cmd, "viscosity")) {
+        ok = sscanf(args, "%f", &visc) == 1;
+      } else if (!strcmp(cmd, "steps")) {
+        ok = sscanf(args, "%d", &steps) == 1 && steps >= 0;
+      } else if (!strcmp(cmd, "every")) {
+        ok = sscanf(args, "%d", &every) == 1 && every > 0;
+      } else if (!strcmp(cmd, "cfl")) {
+        ok = sscanf(args, "%f %d", &cfl, &max_substeps) == 2;
+      } else if (!strcmp(cmd, "sparse")) {
+        ok = sscanf(args, "%d", &sparse) == 1;
+      } else if (!strcmp(cmd, "fields")) {
+        fields = 0;
+        char name[32];
+        int used = 0;
+        while (ok && sscanf(args, " %31s%n", name, &used) == 1) {
+          args += used;
+          if (!strcmp(name, "dens")) fields |= fluid_frame_writer::field_dens;
+          else if (!strcmp(name, "u")) fields |= fluid_frame_writer::field_u;
+          else if (!strcmp(name, "v")) fields |= fluid_frame_writer::field_v;
+          else ok = false;
+        }
+      } else if (!strcmp(cmd, "format")) {
+        char name[32];
+        ok = sscanf(args, " %31s", name) == 1 && (format = fluid_half::find_format(name)) >= 0;
+      } else if (!strcmp(cmd, "source")) {
+        ev.kind = event_source;
+        ok = sscanf(args, "%d %d %f %f %f %f", &ev.first, &ev.last, &ev.x, &ev.y, &ev.radius, &ev.amount) == 6;
+        if (ok) events.push_back(ev);
+      } else if (!strcmp(cmd, "force")) {
+        ev.kind = event_force;
+        ok = sscanf(args, "%d %d %f %f %f %f %f", &ev.first, &ev.last, &ev.x, &ev.y, &ev.radius, &ev.fx, &ev.fy) == 7;
+        if (ok) events.push_back(ev);
+      } else {
+        printf("%s:%d: unknown command %s\n", filename, line_number, cmd);
+        return false;
+      }
+
+      if (!ok) printf("%s:%d: bad arguments to %s\n", filename, line_number, cmd);
+      return ok;
+    }
+
+  public:
+    fluid_batch() {
+      N = 64;
+      dt = 0.1f;
+      diff = 0.0f;
+      visc = 0.0f;
+      steps = 100;
+      every = 1;
+      cfl = 0;
+      max_substeps = 1;
+      sparse = 0;
+      fields = fluid_frame_writer::field_dens | fluid_frame_writer::field_u | fluid_frame_writer::field_v;
+      format = fluid_half::format_float;
+      u_field = v_field = dens_field = -1;
+      checkpoint_file = 0;
+      checkpoint_every = 0;
+      resume_file = 0;
+    }
+
+    /// read the settings and events of a script. returns false on errors.
+    bool load_script(const char *filename) {
+      FILE *file = fopen(filename, "r");
+      if (!file) {
+        perror(filename);
+        return false;
+      }
+
+      events.resize(0);
+      char line[256];
+      bool ok = true;
+      for (int line_number = 1; fgets(line, sizeof(line), file); ++line_number) {
+        ok &= parse_line(line, line_number, filename);
+      }
+      fclose(file);
+      return ok;
+    }
+
+    /// add an event, as the source and force script commands do
+    void add_event(const event &ev) {
+      events.push_back(ev);
+    }
+
+    /// the solver, to change settings the script doesn't have.
+    /// set_advection() etc. hold through run(), which only calls init().
+    fluid_solver &access_solver() {
+      return solver;
+    }
+
+    /// save a checkpoint to filename every count steps of run()
+    void set_checkpoint(const char *filename, int count) {
+      checkpoint_file = filename;
+      checkpoint_every = count;
+    }
+
+    /// start run() from a checkpoint instead of step 0, carrying on the
+    /// frames file of the run that saved it. The script must be the one
+    /// that run used.
+    void set_resume(const char *filename) {
+      resume_file = filename;
+    }
+
+    /// run the simulation on num_threads threads (0 for one per core) and
+    /// write a frame to filename every few steps. returns false if the
+    /// file can't be written.
+    bool run(const char *filename, int num_threads = 0, bool use_mmap = false) {
+      grid.init(N);
+      u_field = grid.add_field("u", true);
+      v_field = grid.add_field("v", true);
+      dens_field = grid.add_field("dens", true);
+      if (u_field < 0 || v_field < 0 || dens_field < 0) {
+        fprintf(stderr, "cannot allocate data\n");
+        return false;
+      }
+
+      workers.init(num_threads);
+      solver.init(grid, &workers);
+      solver.set_cfl(cfl, max_substeps);
+      solver.set_sparse(sparse != 0);
+
+      fluid_checkpoint checkpoint;
+      checkpoint.init(grid, &solver);
+      int first_step = 0;
+      if (resume_file) {
+        if (!checkpoint.load(resume_file)) return false;
+        first_step = checkpoint.get_step();
+        dt = checkpoint.get_dt();
+        printf("resuming from %s at step %d\n", resume_file, first_step);
+      }
+
+      // a resumed run writes the frames after its first step
+      fluid_frame_writer writer;
+      int num_frames = steps / every, first_frame = first_step < steps ? first_step / every : num_frames;
+      bool opened = resume_file ?
+        writer.resume(filename, N, fields, num_frames, dt, every, first_frame, use_mmap, format) :
+        writer.open(filename, N, fields, num_frames, dt, every, use_mmap, format);
+      if (!opened) return false;
+
+      float *u = grid.get(u_field), *u_prev = grid.get_prev(u_field);
+      float *v = grid.get(v_field), *v_prev = grid.get_prev(v_field);
+      float *dens = grid.get(dens_field), *dens_prev = grid.get_prev(dens_field);
+
+      // frame fields in the order of the file
+      const float *out[fluid_frame_writer::num_field_kinds];
+      int num_out = 0;
+      if (fields & fluid_frame_writer::field_dens) out[num_out++] = dens;
+      if (fields & fluid_frame_writer::field_u) out[num_out++] = u;
+      if (fields & fluid_frame_writer::field_v) out[num_out++] = v;
+
+      double start = fluid_timer::now();
+      int total_substeps = 0;
+      for (int step = first_step; step < steps; ++step) {
+        apply_events(step, dens_prev, u_prev, v_prev);
+        float *active[] = { dens, dens_prev, u_prev, v_prev };
+        solver.update_active(u, v, active, 4, dt);
+        total_substeps += solver.step(u, v, u_prev, v_prev, dens, dens_prev, visc, diff, dt);
+
+        if ((step + 1) % every == 0) {
+          writer.write_frame(step + 1, (step + 1) * dt, out, grid.get_stride());
+        }
+
+        if (checkpoint_file && checkpoint_every > 0 && (step + 1) % checkpoint_every == 0) {
+          writer.flush();
+          if (!save_checkpoint(checkpoint, step + 1)) return false;
+        }
+      }
+      double seconds = fluid_timer::now() - start;
+
+      printf("%d steps (%d substeps) of %dx%d in %.3fs, %d frames to %s\n",
+        steps - first_step, total_substeps, N, N, seconds, writer.get_frames_written(), filename);
+      writer.close();
+      return true;
+    }
+
+    int get_N() const {
+      return N;
+    }
+
+    int get_steps() const {
+      return steps;
+    }
+  };
+}
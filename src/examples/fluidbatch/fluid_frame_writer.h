@@ -0,0 +1,292 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2012-2014
+//
+// Modular Framework for OpenGLES2 rendering on multiple platforms.
+//
+// Binary file of fluid simulation frames.
+//
+// The file is a header followed by num_frames frames of the same size.
+// A frame is the step number and time followed by the N x N interior cells
+// of each field in the header's fields mask (dens, u, v in that order),
+// row by row, as native 32 bit floats or, packed, as 16 bit half floats or
+// bfloat16s (see fluid_half), which halves the file. Frame k starts at
+// sizeof(header) + k * frame_bytes, so readers can seek or map the file.
+//
+// Frames are written with stdio, or copied into a memory mapped file when
+// mmap is asked for and the platform has it.
+//
+// resume() carries on a file a run wrote before it stopped: it keeps the
+// frames before first_frame, which must all be there, and writes from
+// there on. flush() makes sure the frames written so far are in the file,
+// for a run that may be resumed.
+//
+
+#if !defined(_WIN32)
+  #include <sys/mman.h>
+  #include <sys/types.h>
+  #include <fcntl.h>
+  #include <unistd.h>
+#endif
+
+namespace octet {
+  class fluid_frame_writer {
+  public:
+    enum {
+      field_dens = 1,
+      field_u = 2,
+      field_v = 4,
+      num_field_kinds = 3,
+      version = 2,
+    };
+
+    struct header {
+      char magic[4];        // "FLDF"
+      uint32_t version;
+      uint32_t N;
+      uint32_t fields;      // field_dens | field_u | field_v
+      uint32_t num_frames;
+      float dt;             // time of one step
+      uint32_t every;       // steps between frames
+      uint32_t frame_bytes;
+      uint32_t format;      // fluid_half::format_float, _half or _bfloat16
+    };
+
+  private:
+    header hdr;
+    int num_fields;
+
+    // a row of a packed field
+    dynarray<uint16_t> packed;
+
+    FILE *file;
+
+    // the mapped file, or NULL when using stdio
+    uint8_t *map;
+    size_t map_size;
+    size_t map_offset;
+    int fd;
+
+    // frames in the file, the ones a resumed file started with included
+    int frames_written;
+
+    void write_bytes(const void *src, size_t bytes) {
+      if (map) {
+        memcpy(map + map_offset, src, bytes);
+        map_offset += bytes;
+      } else {
+        fwrite(src, 1, bytes, file);
+      }
+    }
+
+    void init_header(int N, int fields, int num_frames, float dt, int every, int format) {
+      num_fields = 0;
+      for (int k = 0; k != num_field_kinds; ++k) {
+        if (fields & (1 << k)) num_fields++;
+      }
+
+      memcpy(hdr.magic, "FLDF", 4);
+      hdr.version = version;
+      hdr.N = N;
+      hdr.fields = fields;
+      hdr.num_frames = num_frames;
+      hdr.dt = dt;
+      hdr.every = every;
+      hdr.frame_bytes = get_frame_bytes(N, num_fields, format);
+      hdr.format = format;
+      packed.resize(format == fluid_half::format_float ? 0 : N);
+    }
+
+    // true if filename has hdr but for the frame count, and at least
+    // first_frame frames
+    bool check_existing(const char *filename, int first_frame) {
+      FILE *old_file = fopen(filename, "rb");
+      if (!old_file) {
+        perror(filename);
+        return false;
+      }
+      header old;
+      bool ok = fread(&old, 1, sizeof(old), old_file) == sizeof(old) && fseek(old_file, 0, SEEK_END) == 0;
+      long size = ok ? ftell(old_file) : -1;
+      fclose(old_file);
+      if (!ok || memcmp(old.magic, hdr.magic, 4) || old.version != hdr.version || old.N != hdr.N ||
+        old.fields != hdr.fields || old.dt != hdr.dt || old.every != hdr.every ||
+        old.frame_bytes != hdr.frame_bytes || old.format != hdr.format) {
+        printf("fluid_frame_writer: %s wasn't written by this script\n", filename);
+        return false;
+      }
+      if (size < 0 || (size_t)size < sizeof(header) + (size_t)first_frame * hdr.frame_bytes) {
+        printf("fluid_frame_writer: %s has fewer than %d frames\n", filename, first_frame);
+        return false;
+      }
+      return true;
+    }
+
+    // map the file, made afresh or, when resuming, as it is with the
+    // frames from first_frame on to be written
+    bool open_mapped(const char *filename, bool resuming, int first_frame) {
+      #if !defined(_WIN32)
+        fd = ::open(filename, resuming ? O_RDWR : O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+          perror(filename);
+          return false;
+        }
+        map_size = sizeof(header) + (size_t)hdr.num_frames * hdr.frame_bytes;
+        if (ftruncate(fd, (off_t)map_size) != 0) {
+          perror("fluid_frame_writer: ftruncate");
+          ::close(fd);
+          fd = -1;
+          return false;
+        }
+        void *p = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (p == MAP_FAILED) {
+          perror("fluid_frame_writer: mmap");
+          ::close(fd);
+          fd = -1;
+          return false;
+        }
+        map = (uint8_t*)p;
+        map_offset = 0;
+        write_bytes(&hdr, sizeof(hdr));
+        map_offset = sizeof(header) + (size_t)first_frame * hdr.frame_bytes;
+        return true;
+      #else
+        return false;
+      #endif
+    }
+
+    // the same with stdio
+    bool open_file(const char *filename, bool resuming, int first_frame) {
+      file = fopen(filename, resuming ? "r+b" : "wb");
+      if (!file) {
+        perror(filename);
+        return false;
+      }
+      write_bytes(&hdr, sizeof(hdr));
+      fseek(file, (long)(sizeof(header) + (size_t)first_frame * hdr.frame_bytes), SEEK_SET);
+      return true;
+    }
+
+  public:
+    fluid_frame_writer() {
+      memset(&hdr, 0, sizeof(hdr));
+      num_fields = 0;
+      file = 0;
+      map = 0;
+      map_size = map_offset = 0;
+      fd = -1;
+      frames_written = 0;
+    }
+
+    ~fluid_frame_writer() {
+      close();
+    }
+
+    /// bytes in one frame of an N x N grid with num_fields fields
+    static uint32_t get_frame_bytes(int N, int num_fields, int format = fluid_half::format_float) {
+      return (uint32_t)(2 * sizeof(uint32_t) + (size_t)num_fields * N * N * fluid_half::get_value_size(format));
+    }
+
+    /// create the file and write the header. fields is a mask of field_dens etc.
+    /// With use_mmap the whole file is mapped up front; if that isn't
+    /// possible stdio is used instead. format is a fluid_half format for the
+    /// cells. returns false if the file can't be made.
+    bool open(const char *filename, int N, int fields, int num_frames, float dt, int every, bool use_mmap, int format = fluid_half::format_float) {
+      close();
+      init_header(N, fields, num_frames, dt, every, format);
+      frames_written = 0;
+
+      if (!use_mmap || !open_mapped(filename, false, 0)) {
+        if (use_mmap) printf("fluid_frame_writer: can't map %s, using stdio\n", filename);
+        return open_file(filename, false, 0);
+      }
+      return true;
+    }
+
+    /// open a file written by the same run, of num_frames frames in all,
+    /// to carry on from frame first_frame. The frames before it are kept;
+    /// returns false if the file is missing, was written with other
+    /// settings or has fewer than first_frame frames.
+    bool resume(const char *filename, int N, int fields, int num_frames, float dt, int every, int first_frame, bool use_mmap, int format = fluid_half::format_float) {
+      close();
+      init_header(N, fields, num_frames, dt, every, format);
+      frames_written = first_frame;
+      if (!check_existing(filename, first_frame)) return false;
+
+      if (!use_mmap || !open_mapped(filename, true, first_frame)) {
+        if (use_mmap) printf("fluid_frame_writer: can't map %s, using stdio\n", filename);
+        return open_file(filename, true, first_frame);
+      }
+      return true;
+    }
+
+    /// get the frames written so far into the file
+    void flush() {
+      #if !defined(_WIN32)
+        if (map) msync(map, map_offset, MS_SYNC);
+      #endif
+      if (file) fflush(file);
+    }
+
+    /// write the interior of the fields in the header's mask. fields[k] is
+    /// cell (0,0) of the k'th of them, with rows stride floats apart. Packed
+    /// formats convert a row at a time.
+    void write_frame(uint32_t step, float time, const float *const *fields, int stride) {
+      if (map && map_offset + hdr.frame_bytes > map_size) {
+        printf("fluid_frame_writer: more than %d frames\n", hdr.num_frames);
+        return;
+      }
+      write_bytes(&step, sizeof(step));
+      write_bytes(&time, sizeof(time));
+      int N = (int)hdr.N;
+      for (int k = 0; k != num_fields; ++k) {
+        for (int j = 1; j <= N; ++j) {
+          const float *row = fields[k] + 1 + j * stride;
+          if (hdr.format == fluid_half::format_float) {
+            write_bytes(row, N * sizeof(float));
+          } else {
+            fluid_half::pack(packed.data(), row, N, hdr.format);
+            write_bytes(packed.data(), N * sizeof(uint16_t));
+          }
+        }
+      }
+      frames_written++;
+    }
+
+    /// finish the file. The header's frame count is fixed up if fewer
+    /// frames than promised were written.
+    void close() {
+      if (map) {
+        if (frames_written != (int)hdr.num_frames) {
+          ((header*)map)->num_frames = frames_written;
+        }
+        #if !defined(_WIN32)
+          munmap(map, map_size);
+          if (frames_written != (int)hdr.num_frames) {
+            ftruncate(fd, (off_t)(sizeof(header) + (size_t)frames_written * hdr.frame_bytes));
+          }
+          ::close(fd);
+        #endif
+        map = 0;
+        fd = -1;
+      }
+      if (file) {
+        if (frames_written != (int)hdr.num_frames) {
+          hdr.num_frames = frames_written;
+          fseek(file, 0, SEEK_SET);
+          fwrite(&hdr, 1, sizeof(hdr), file);
+        }
+        fclose(file);
+        file = 0;
+      }
+    }
+
+    int get_frames_written() const {
+      return frames_written;
+    }
+
+    const header &get_header() const {
+      return hdr;
+    }
+  };
+}
@@ -0,0 +1,74 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2012-2014
+//
+// Modular Framework for OpenGLES2 rendering on multiple platforms.
+//
+// Headless batch runner for the CPU fluid solver.
+//
+// Runs a fluid_batch script without a window and writes the frames to a
+// binary file. Build it for the generic platform, for example
+//
+//   g++ -std=gnu++98 -fpermissive -O2 -D__GENERIC__ -I../.. main.cpp -o fluidbatch -lpthread
+//
+// usage: fluidbatch script.txt frames.bin [-threads n] [-mmap]
+//                   [-checkpoint file steps] [-resume file]
+//
+// -checkpoint saves the state to file every few steps; after a crash, run
+// the same script and frames file with -resume file to carry on from the
+// last one. The frames written before it are kept.
+//
+
+// the solver doesn't need the physics engines
+#define OCTET_BULLET 0
+#define OCTET_BOX2D 0
+
+#include "../../octet.h"
+
+#include "../fluidshader/fluid_timer.h"
+#include "../fluidshader/fluid_workers.h"
+#include "../fluidshader/fluid_grid.h"
+#include "../fluidshader/fluid_simd.h"
+#include "../fluidshader/fluid_multigrid.h"
+#include "../fluidshader/fluid_pcg.h"
+#include "../fluidshader/fluid_bricks.h"
+#include "../fluidshader/fluid_solids.h"
+#include "../fluidshader/fluid_solver.h"
+#include "../fluidshader/fluid_half.h"
+#include "../fluidshader/fluid_checkpoint.h"
+#include "fluid_frame_writer.h"
+#include "fluid_batch.h"
+
+int main(int argc, char **argv) {
+  if (argc < 3) {
+    printf("usage: %s script.txt frames.bin [-threads n] [-mmap] [-checkpoint file steps] [-resume file]\n", argv[0]);
+    return 1;
+  }
+
+  int threads = 0;
+  bool use_mmap = false;
+  const char *checkpoint = 0;
+  int checkpoint_every = 0;
+  const char *resume = 0;
+  for (int i = 3; i < argc; ++i) {
+    if (!strcmp(argv[i], "-threads") && i + 1 < argc) {
+      threads = atoi(argv[++i]);
+    } else if (!strcmp(argv[i], "-mmap")) {
+      use_mmap = true;
+    } else if (!strcmp(argv[i], "-checkpoint") && i + 2 < argc && atoi(argv[i+2]) > 0) {
+      checkpoint = argv[++i];
+      checkpoint_every = atoi(argv[++i]);
+    } else if (!strcmp(argv[i], "-resume") && i + 1 < argc) {
+      resume = argv[++i];
+    } else {
+      printf("unknown option %s\n", argv[i]);
+      return 1;
+    }
+  }
+
+  octet::fluid_batch batch;
+  if (!batch.load_script(argv[1])) return 1;
+  if (checkpoint) batch.set_checkpoint(checkpoint, checkpoint_every);
+  if (resume) batch.set_resume(resume);
+  return batch.run(argv[2], threads, use_mmap) ? 0 : 1;
+}
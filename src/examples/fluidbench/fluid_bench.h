@@ -0,0 +1,842 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2012-2014
+//
+// Modular Framework for OpenGLES2 rendering on multiple platforms.
+//
+// Benchmarks of the fluid solvers.
+//
+// Each run steps a plume (a source and an upward force in the middle of
+// the grid) for a number of steps on an N x N grid and reports, for every
+// stage of the solver:
+//
+//   ns_per_cell   time in the stage per step per interior cell
+//   gb_per_s      estimated memory traffic of the stage over its time
+//   speedup       against the same stage on one thread at the same size
+//
+// plus a "step" row with the wall clock time of whole steps. The CPU
+// fluid_solver is run at each thread count, the OpenCL fluid_cl_solver
+// once per size on the first device found, with the stage times taken
+// from the profiling events of its kernels.
+//
+// validate_cl() runs the fused and the original OpenCL kernels side by side
+// on the same plume and compares the results, which is worth doing on a CPU
+// OpenCL runtime as well as on the GPU. It also checks that two runs of the
+// fused kernels give identical results, that the program specialised for
+// the grid and tile sizes and the sources uploaded as splats to a pipelined
+// solver give them too, that half storage stays close to them, that a grid
+// split into slabs gives the results of one grid and that the red-black
+// kernels give the results of the CPU solver.
+//
+// With -slabs the OpenCL grid is split across the devices of the platform,
+// each slab in a context of its own, as fluid_cl_slabs does, and the stage
+// times are the sums of the slabs' times.
+//
+// run_cpu3d() steps the plume in a fluid_solver3d on an N x N x N grid,
+// with rows for its velocity and density steps, and validate_3d() checks
+// that it keeps mass and removes most of the force's divergence.
+//
+
+namespace octet {
+  class fluid_bench {
+  public:
+    struct result {
+      const char *target;  // "cpu", "cl" or "3d"
+      int N;
+      int threads;         // 0 for cl, or its number of slabs
+      const char *stage;   // a stage name or "step"
+      int calls;
+      double ns_per_cell;
+      double gb_per_s;
+      double speedup;
+    };
+
+  private:
+    dynarray<int> sizes;
+    dynarray<int> thread_counts;
+    int steps;
+    float dt;
+    bool cl_fused;
+    bool cl_half;
+    int cl_slabs;
+    int cl_sweeps[2];
+    int cl_relaxation;
+    dynarray<result> results;
+
+    // steps to take at size N when none were asked for: enough to fill
+    // about half a second on one thread, and at least two.
+    int get_steps(int N) const {
+      if (steps > 0) return steps;
+      int n = (1 << 22) / (N * N);
+      return n < 2 ? 2 : n > 100 ? 100 : n;
+    }
+
+    // the same for the 3D solver at size N^3
+    int get_steps3d(int N) const {
+      if (steps > 0) return steps;
+      int n = (1 << 22) / N / (N * N);
+      return n < 2 ? 2 : n > 100 ? 100 : n;
+    }
+
+    // the plume's sources, rates as in get_from_UI. stride is the
+    // distance between rows and comps the floats per cell of uv.
+    void make_sources(int N, int stride, float *d, float *u, float *v, int comps) {
+      int r = N / 16 < 1 ? 1 : N / 16;
+      for (int j = N/2 - r; j <= N/2 + r; ++j) {
+        for (int i = N/2 - r; i <= N/2 + r; ++i) {
+          d[i + j*stride] = 100.0f;
+          u[(i + j*stride)*comps] = 0.0f;
+          v[(i + j*stride)*comps] = 20.0f;
+        }
+      }
+    }
+
+    void add_result(const char *target, int N, int threads, const char *stage, int calls, double seconds, double bytes, int num_steps) {
+      result r;
+      r.target = target;
+      r.N = N;
+      r.threads = threads;
+      r.stage = stage;
+      r.calls = calls;
+      r.ns_per_cell = seconds * 1e9 / ((double)N * N * num_steps);
+      r.gb_per_s = seconds > 0 ? bytes / seconds * 1e-9 : 0;
+      r.speedup = 1;
+
+      // the one thread result of this stage is already there if there is one
+      for (int i = 0; i != (int)results.size(); ++i) {
+        const result &base = results[i];
+        if (base.threads == 1 && base.N == N && !strcmp(base.target, target) && !strcmp(base.stage, stage)) {
+          r.speedup = r.ns_per_cell > 0 ? base.ns_per_cell / r.ns_per_cell : 0;
+        }
+      }
+      results.push_back(r);
+      printf("%-4s %5d %3d %-10s %8d %10.3f ns/cell %8.2f GB/s %6.2fx\n",
+        target, N, threads, stage, calls, r.ns_per_cell, r.gb_per_s, r.speedup);
+    }
+
+    void run_cpu(int N, int threads) {
+      fluid_grid grid;
+      grid.init(N);
+      int u_field = grid.add_field("u", true);
+      int v_field = grid.add_field("v", true);
+      int dens_field = grid.add_field("dens", true);
+      if (u_field < 0 || v_field < 0 || dens_field < 0) {
+        fprintf(stderr, "cannot allocate data for N=%d\n", N);
+        return;
+      }
+      float *u = grid.get(u_field), *u_prev = grid.get_prev(u_field);
+      float *v = grid.get(v_field), *v_prev = grid.get_prev(v_field);
+      float *dens = grid.get(dens_field), *dens_prev = grid.get_prev(dens_field);
+      int stride = grid.get_stride();
+
+      fluid_workers workers;
+      workers.init(threads);
+      fluid_solver solver;
+      solver.init(grid, &workers);
+
+      // warm the caches and the thread pool before timing
+      int num_steps = get_steps(N);
+      double start = 0;
+      for (int step = -1; step != num_steps; ++step) {
+        if (step == 0) {
+          solver.set_profiling(true);
+          solver.reset_profile();
+          start = fluid_timer::now();
+        }
+        for (int j = 0; j != N+2; ++j) {
+          for (int i = grid.index(0, j); i != grid.index(N+2, j); ++i) {
+            u_prev[i] = v_prev[i] = dens_prev[i] = 0.0f;
+          }
+        }
+        make_sources(N, stride, dens_prev, u_prev, v_prev, 1);
+        solver.step(u, v, u_prev, v_prev, dens, dens_prev, 0.0f, 0.0001f, dt);
+      }
+      double seconds = fluid_timer::now() - start;
+
+      const fluid_solver::stage_stats &profile = solver.get_profile();
+      double total_bytes = 0;
+      for (int s = 0; s != fluid_solver::num_stages; ++s) {
+        total_bytes += profile.bytes[s];
+        add_result("cpu", N, threads, fluid_solver::get_stage_name((fluid_solver::stage_t)s),
+          profile.calls[s], profile.seconds[s], profile.bytes[s], num_steps);
+      }
+      add_result("cpu", N, threads, "step", num_steps, seconds, total_bytes, num_steps);
+    }
+
+    // the fields of a fluid_solver3d, zeroed
+    struct fields3d {
+      enum { u, v, w, u0, v0, w0, dens, dens0, num_fields };
+      dynarray<float> f[num_fields];
+
+      void init(const fluid_solver3d &solver) {
+        for (int i = 0; i != num_fields; ++i) {
+          f[i].resize(solver.get_field_size());
+          memset(f[i].data(), 0, f[i].size() * sizeof(float));
+        }
+      }
+
+      float *get(int i) {
+        return f[i].data();
+      }
+    };
+
+    // the 3D plume: a cube of source rising along v, as make_sources
+    void make_sources3d(const fluid_solver3d &solver, float *d, float *v) {
+      int N = solver.get_N();
+      int r = N / 16 < 1 ? 1 : N / 16;
+      for (int k = N/2 - r; k <= N/2 + r; ++k) {
+        for (int j = N/2 - r; j <= N/2 + r; ++j) {
+          for (int i = N/2 - r; i <= N/2 + r; ++i) {
+            int c = solver.index(i, j, k);
+            d[c] = 100.0f;
+            v[c] = 20.0f;
+          }
+        }
+      }
+    }
+
+    // root mean square of the divergence of u, v, w over the interior
+    static double rms_divergence3d(const fluid_solver3d &solver, const float *u, const float *v, const float *w) {
+      int N = solver.get_N();
+      double sum = 0;
+      for (int k = 1; k <= N; ++k) {
+        for (int j = 1; j <= N; ++j) {
+          for (int i = 1; i <= N; ++i) {
+            double div = -0.5 / N * (
+              u[solver.index(i+1,j,k)] - u[solver.index(i-1,j,k)] +
+              v[solver.index(i,j+1,k)] - v[solver.index(i,j-1,k)] +
+              w[solver.index(i,j,k+1)] - w[solver.index(i,j,k-1)]);
+            sum += div * div;
+          }
+        }
+      }
+      return sqrt(sum / ((double)N * N * N));
+    }
+
+    static double interior_sum3d(const fluid_solver3d &solver, const float *x) {
+      int N = solver.get_N();
+      double sum = 0;
+      for (int k = 1; k <= N; ++k) {
+        for (int j = 1; j <= N; ++j) {
+          for (int i = 1; i <= N; ++i) {
+            sum += x[solver.index(i, j, k)];
+          }
+        }
+      }
+      return sum;
+    }
+
+    // the 3D solver has no stage profile, so it has a row for each of its
+    // two steps and one for the whole step. ns_per_cell is per cell of the
+    // N^3 grid and there is no estimate of the traffic.
+    void run_cpu3d(int N, int threads) {
+      fluid_workers workers;
+      workers.init(threads);
+      fluid_solver3d solver;
+      solver.init(N, &workers);
+      fields3d fields;
+      fields.init(solver);
+      float *u = fields.get(fields3d::u), *v = fields.get(fields3d::v), *w = fields.get(fields3d::w);
+      float *u0 = fields.get(fields3d::u0), *v0 = fields.get(fields3d::v0), *w0 = fields.get(fields3d::w0);
+      float *dens = fields.get(fields3d::dens), *dens0 = fields.get(fields3d::dens0);
+      int field_size = solver.get_field_size();
+
+      int num_steps = get_steps3d(N);
+      double vel_seconds = 0, dens_seconds = 0;
+      for (int step = -1; step != num_steps; ++step) {
+        for (int c = 0; c != field_size; ++c) {
+          u0[c] = v0[c] = w0[c] = dens0[c] = 0.0f;
+        }
+        make_sources3d(solver, dens0, v0);
+        double start = fluid_timer::now();
+        solver.vel_step(u, v, w, u0, v0, w0, 0.0f, dt);
+        double mid = fluid_timer::now();
+        solver.dens_step(dens, dens0, u, v, w, 0.0001f, dt);
+        double end = fluid_timer::now();
+        if (step >= 0) {
+          vel_seconds += mid - start;
+          dens_seconds += end - mid;
+        }
+      }
+
+      // add_result takes the time per N^2 cells
+      add_result("3d", N, threads, "vel_step", num_steps, vel_seconds, 0, num_steps * N);
+      add_result("3d", N, threads, "dens_step", num_steps, dens_seconds, 0, num_steps * N);
+      add_result("3d", N, threads, "step", num_steps, vel_seconds + dens_seconds, 0, num_steps * N);
+    }
+
+    // a density step without velocity or diffusion has to keep the mass
+    // of the source to within rounding, and a velocity step from rest has
+    // to remove most of the divergence of the plume's force. The pressure
+    // solve's 20 sweeps leave a fifth of it at N=16 and a third at N=128.
+    bool validate_3d(int N) {
+      fluid_workers workers;
+      workers.init(fluid_workers::get_num_cores());
+      fluid_solver3d solver;
+      solver.init(N, &workers);
+      fields3d fields;
+      fields.init(solver);
+      float *u = fields.get(fields3d::u), *v = fields.get(fields3d::v), *w = fields.get(fields3d::w);
+      float *u0 = fields.get(fields3d::u0), *v0 = fields.get(fields3d::v0), *w0 = fields.get(fields3d::w0);
+      float *dens = fields.get(fields3d::dens), *dens0 = fields.get(fields3d::dens0);
+
+      make_sources3d(solver, dens0, v0);
+      double mass0 = dt * interior_sum3d(solver, dens0);
+      solver.dens_step(dens, dens0, u, v, w, 0.0f, dt);
+      double mass1 = interior_sum3d(solver, dens);
+      double mass_diff = fabs(mass1 - mass0) / mass0;
+      bool mass_ok = mass_diff <= 1e-5;
+      printf("3d %5d %-28s dens %-12g %s\n", N, "mass at rest", mass_diff, mass_ok ? "PASS" : "FAIL");
+
+      // the divergence of the force as vel_step adds it
+      double div0 = dt * rms_divergence3d(solver, u0, v0, w0);
+      solver.vel_step(u, v, w, u0, v0, w0, 0.0f, dt);
+      double div_ratio = rms_divergence3d(solver, u, v, w) / div0;
+      bool div_ok = div_ratio <= 0.5;
+      printf("3d %5d %-28s div  %-12g %s\n", N, "divergence left", div_ratio, div_ok ? "PASS" : "FAIL");
+      return mass_ok && div_ok;
+    }
+
+  #if OCTET_OPENCL
+    cl_context clContext;
+    cl_device_id clDeviceID;
+
+    // a context on the first GPU, or the first device of any kind
+    bool init_cl() {
+      cl_platform_id platform;
+      cl_int err = clGetPlatformIDs(1, &platform, NULL);
+      if (err < 0) {
+        printf("cl: no OpenCL platform, skipping\n");
+        return false;
+      }
+      err = clGetDeviceIDs(platform, CL_DEVICE_TYPE_GPU, 1, &clDeviceID, NULL);
+      if (err < 0) {
+        err = clGetDeviceIDs(platform, CL_DEVICE_TYPE_ALL, 1, &clDeviceID, NULL);
+      }
+      if (err < 0) {
+        printf("cl: no OpenCL device, skipping\n");
+        return false;
+      }
+      clContext = clCreateContext(NULL, 1, &clDeviceID, NULL, NULL, &err);
+      if (err < 0) {
+        printf("cl: could not create a context, skipping\n");
+        return false;
+      }
+      char name[256] = "";
+      clGetDeviceInfo(clDeviceID, CL_DEVICE_NAME, sizeof(name), name, NULL);
+      printf("cl: %s\n", name);
+      return true;
+    }
+
+    void run_cl(int N) {
+      if (cl_slabs > 0) {
+        run_cl_slabs(N);
+        return;
+      }
+      fluid_cl_solver solver;
+      solver.set_half_storage(cl_half);
+      if (!solver.init(clContext, clDeviceID, N, NULL, NULL, true)) return;
+      configure_cl(solver, cl_fused);
+
+      int Nborder = N + 2;
+      dynarray<float> dens(Nborder * Nborder), uv(Nborder * Nborder * 2);
+
+      int num_steps = get_steps(N);
+      double start = 0;
+      for (int step = -1; step != num_steps; ++step) {
+        if (step == 0) {
+          solver.finish();
+          solver.reset_profile();
+          start = fluid_timer::now();
+        }
+        memset(dens.data(), 0, dens.size() * sizeof(float));
+        memset(uv.data(), 0, uv.size() * sizeof(float));
+        make_sources(N, Nborder, dens.data(), uv.data(), uv.data() + 1, 2);
+        solver.writeArray(solver.get_dens0(), dens.data(), dens.size());
+        solver.writeArray(solver.get_uv0(), uv.data(), uv.size());
+        solver.step(0.0f, 0.0001f, dt);
+      }
+      solver.finish();
+      double seconds = fluid_timer::now() - start;
+
+      const fluid_cl_solver::stage_stats &profile = solver.get_profile();
+      double total_bytes = 0;
+      for (int s = 0; s != fluid_cl_solver::num_stages; ++s) {
+        total_bytes += profile.bytes[s];
+        add_result("cl", N, 0, fluid_cl_solver::get_stage_name(s),
+          profile.kernels[s], profile.seconds[s], profile.bytes[s], num_steps);
+      }
+      add_result("cl", N, 0, "step", num_steps, seconds, total_bytes, num_steps);
+    }
+
+    // the plume's sources in the layout of the OpenCL buffers
+    void make_plume(int N, dynarray<float> &dens, dynarray<float> &uv) {
+      int Nborder = N + 2;
+      dens.resize(Nborder * Nborder);
+      uv.resize(Nborder * Nborder * 2);
+      memset(dens.data(), 0, dens.size() * sizeof(float));
+      memset(uv.data(), 0, uv.size() * sizeof(float));
+      make_sources(N, Nborder, dens.data(), uv.data(), uv.data() + 1, 2);
+    }
+
+    // a splat for each cell of the sources that is set, then splat_sources()
+    template <class solver_t> void splat_plume(solver_t &solver, int N, const dynarray<float> &dens, const dynarray<float> &uv) {
+      int Nborder = N + 2;
+      for (int k = 0; k != Nborder * Nborder; ++k) {
+        if (dens[k] != 0 || uv[k*2] != 0 || uv[k*2+1] != 0) {
+          solver.add_splat(k % Nborder, k / Nborder, uv[k*2], uv[k*2+1], dens[k]);
+        }
+      }
+      solver.splat_sources();
+    }
+
+    void run_cl_slabs(int N) {
+      fluid_cl_slabs slabs;
+      slabs.set_half_storage(cl_half);
+      if (cl_relaxation >= 0) slabs.set_relaxation(cl_relaxation);
+      if (slabs.add_devices(CL_DEVICE_TYPE_ALL, cl_slabs) == 0 || !slabs.init(N, true)) return;
+      int count = slabs.get_num_slabs();
+      for (int k = 0; k != count; ++k) {
+        configure_cl(*slabs.get_solver(k), true);
+      }
+
+      dynarray<float> dens, uv;
+      make_plume(N, dens, uv);
+      int num_steps = get_steps(N);
+      double start = 0;
+      for (int step = -1; step != num_steps; ++step) {
+        if (step == 0) {
+          slabs.finish();
+          for (int k = 0; k != count; ++k) {
+            slabs.get_solver(k)->reset_profile();
+          }
+          start = fluid_timer::now();
+        }
+        splat_plume(slabs, N, dens, uv);
+        slabs.step(0.0f, 0.0001f, dt);
+      }
+      slabs.finish();
+      double seconds = fluid_timer::now() - start;
+
+      fluid_cl_solver::stage_stats profile;
+      memset(&profile, 0, sizeof(profile));
+      for (int k = 0; k != count; ++k) {
+        const fluid_cl_solver::stage_stats &slab_profile = slabs.get_solver(k)->get_profile();
+        for (int s = 0; s != fluid_cl_solver::num_stages; ++s) {
+          profile.seconds[s] += slab_profile.seconds[s];
+          profile.bytes[s] += slab_profile.bytes[s];
+          profile.kernels[s] += slab_profile.kernels[s];
+        }
+      }
+      double total_bytes = 0;
+      for (int s = 0; s != fluid_cl_solver::num_stages; ++s) {
+        total_bytes += profile.bytes[s];
+        add_result("cl", N, count, fluid_cl_solver::get_stage_name(s),
+          profile.kernels[s], profile.seconds[s], profile.bytes[s], num_steps);
+      }
+      add_result("cl", N, count, "step", num_steps, seconds, total_bytes, num_steps);
+    }
+
+    // root mean square difference of a and b over that of a
+    static float rms_rel_diff(const dynarray<float> &a, const dynarray<float> &b) {
+      double diff = 0, norm = 0;
+      for (int i = 0; i != (int)a.size(); ++i) {
+        diff += (double)(a[i] - b[i]) * (a[i] - b[i]);
+        norm += (double)a[i] * a[i];
+      }
+      return (float)(norm > 0 ? sqrt(diff / norm) : sqrt(diff));
+    }
+
+    void configure_cl(fluid_cl_solver &solver, bool fused) {
+      solver.set_fused(fused);
+      if (cl_sweeps[0] > 0) solver.set_sweeps_per_launch(cl_sweeps[0], cl_sweeps[1]);
+      if (cl_relaxation >= 0) solver.set_relaxation(cl_relaxation);
+    }
+
+    // step the solvers with the plume and read their density and velocity
+    // in the layout of the OpenCL buffers. A tenth of the time step keeps
+    // the plume's front from moving many cells a step, which would magnify
+    // small differences in the pressure.
+    // with splats, the sources are given to the solver as splats of the
+    // cells make_sources sets rather than as whole grids
+    void run_plume_cl(fluid_cl_solver &solver, int num_steps, dynarray<float> &dens, dynarray<float> &uv, bool splats = false) {
+      int N = solver.get_N();
+      for (int step = 0; step != num_steps; ++step) {
+        make_plume(N, dens, uv);
+        if (splats) {
+          splat_plume(solver, N, dens, uv);
+        } else {
+          solver.writeArray(solver.get_dens0(), dens.data(), dens.size());
+          solver.writeArray(solver.get_uv0(), uv.data(), uv.size());
+        }
+        solver.step(0.0f, 0.0001f, dt * 0.1f);
+      }
+      solver.readArray(solver.get_dens1(), dens.data(), dens.size());
+      solver.readArray(solver.get_uv1(), uv.data(), uv.size());
+    }
+
+    void run_plume_cpu(int N, int num_steps, dynarray<float> &dens, dynarray<float> &uv) {
+      fluid_grid grid;
+      grid.init(N);
+      int u_field = grid.add_field("u", true);
+      int v_field = grid.add_field("v", true);
+      int dens_field = grid.add_field("dens", true);
+      float *u = grid.get(u_field), *u_prev = grid.get_prev(u_field);
+      float *v = grid.get(v_field), *v_prev = grid.get_prev(v_field);
+      float *d = grid.get(dens_field), *d_prev = grid.get_prev(dens_field);
+
+      fluid_workers workers;
+      workers.init(1);
+      fluid_solver solver;
+      solver.init(grid, &workers);
+      for (int step = 0; step != num_steps; ++step) {
+        for (int j = 0; j != N+2; ++j) {
+          for (int i = grid.index(0, j); i != grid.index(N+2, j); ++i) {
+            u_prev[i] = v_prev[i] = d_prev[i] = 0.0f;
+          }
+        }
+        make_sources(N, grid.get_stride(), d_prev, u_prev, v_prev, 1);
+        solver.step(u, v, u_prev, v_prev, d, d_prev, 0.0f, 0.0001f, dt * 0.1f);
+      }
+
+      int Nborder = N + 2;
+      dens.resize(Nborder * Nborder);
+      uv.resize(Nborder * Nborder * 2);
+      for (int j = 0; j != Nborder; ++j) {
+        for (int i = 0; i != Nborder; ++i) {
+          int k = j * Nborder + i;
+          dens[k] = d[grid.index(i, j)];
+          uv[k*2] = u[grid.index(i, j)];
+          uv[k*2+1] = v[grid.index(i, j)];
+        }
+      }
+    }
+
+    bool check(const char *what, int N, const dynarray<float> &dens0, const dynarray<float> &uv0,
+               const dynarray<float> &dens1, const dynarray<float> &uv1, float tolerance) {
+      float dens_diff = rms_rel_diff(dens0, dens1);
+      float uv_diff = rms_rel_diff(uv0, uv1);
+      bool ok = dens_diff <= tolerance && uv_diff <= tolerance;
+      printf("cl %5d %-28s dens %-12g uv %-12g %s\n", N, what, dens_diff, uv_diff, ok ? "PASS" : "FAIL");
+      return ok;
+    }
+
+    bool validate_cl(int N, int num_steps, float tolerance) {
+      dynarray<float> dens[2], uv[2];
+      bool ok = true;
+      for (int s = 0; s != 2; ++s) {
+        fluid_cl_solver solver;
+        if (!solver.init(clContext, clDeviceID, N)) return false;
+        configure_cl(solver, s == 0);
+        run_plume_cl(solver, num_steps, dens[s], uv[s]);
+      }
+      ok &= check("fused against unfused", N, dens[1], uv[1], dens[0], uv[0], tolerance);
+
+      {
+        fluid_cl_solver solver;
+        if (!solver.init(clContext, clDeviceID, N)) return false;
+        configure_cl(solver, true);
+        run_plume_cl(solver, num_steps, dens[1], uv[1]);
+      }
+      ok &= check("fused run twice", N, dens[0], uv[0], dens[1], uv[1], 0);
+
+      {
+        fluid_cl_solver solver;
+        solver.set_specialised(false);
+        if (!solver.init(clContext, clDeviceID, N)) return false;
+        configure_cl(solver, true);
+        run_plume_cl(solver, num_steps, dens[1], uv[1]);
+      }
+      ok &= check("specialised against generic", N, dens[0], uv[0], dens[1], uv[1], 0);
+
+      {
+        fluid_cl_solver solver;
+        solver.set_pipelined(true);
+        if (!solver.init(clContext, clDeviceID, N)) return false;
+        configure_cl(solver, true);
+        run_plume_cl(solver, num_steps, dens[1], uv[1], true);
+      }
+      ok &= check("pipelined splats", N, dens[0], uv[0], dens[1], uv[1], 0);
+
+      // half floats keep about three digits, and the rounding builds up
+      // over the sweeps
+      {
+        fluid_cl_solver solver;
+        solver.set_half_storage(true);
+        if (!solver.init(clContext, clDeviceID, N)) return false;
+        configure_cl(solver, true);
+        run_plume_cl(solver, num_steps, dens[1], uv[1]);
+      }
+      ok &= check("half against float storage", N, dens[0], uv[0], dens[1], uv[1], 1e-2f);
+
+      // pipelined slabs without substeps, whose agreements don't wait for
+      // the queues, against the fused run
+      {
+        fluid_cl_slabs slabs;
+        for (int k = 0; k < (cl_slabs > 1 ? cl_slabs : 2); ++k) {
+          slabs.add_device(clContext, clDeviceID);
+        }
+        if (cl_relaxation >= 0) slabs.set_relaxation(cl_relaxation);
+        slabs.set_pipelined(true);
+        if (!slabs.init(N)) return false;
+        for (int k = 0; k != slabs.get_num_slabs(); ++k) {
+          configure_cl(*slabs.get_solver(k), true);
+        }
+        for (int step = 0; step != num_steps; ++step) {
+          make_plume(N, dens[1], uv[1]);
+          splat_plume(slabs, N, dens[1], uv[1]);
+          slabs.step(0.0f, 0.0001f, dt * 0.1f);
+        }
+        slabs.read_density(dens[1].data());
+        slabs.read_velocity(uv[1].data());
+      }
+      ok &= check("pipelined slabs without substeps", N, dens[0], uv[0], dens[1], uv[1], 0);
+
+      // slabs sharing the bench's device, with substeps for them to agree on
+      {
+        fluid_cl_solver solver;
+        if (!solver.init(clContext, clDeviceID, N)) return false;
+        configure_cl(solver, true);
+        solver.set_cfl(1.0f, 4);
+        run_plume_cl(solver, num_steps, dens[0], uv[0]);
+      }
+      {
+        fluid_cl_slabs slabs;
+        for (int k = 0; k < (cl_slabs > 1 ? cl_slabs : 2); ++k) {
+          slabs.add_device(clContext, clDeviceID);
+        }
+        if (cl_relaxation >= 0) slabs.set_relaxation(cl_relaxation);
+        if (!slabs.init(N)) return false;
+        for (int k = 0; k != slabs.get_num_slabs(); ++k) {
+          configure_cl(*slabs.get_solver(k), true);
+          slabs.get_solver(k)->set_cfl(1.0f, 4);
+        }
+        make_plume(N, dens[1], uv[1]);
+        for (int step = 0; step != num_steps; ++step) {
+          splat_plume(slabs, N, dens[1], uv[1]);
+          slabs.step(0.0f, 0.0001f, dt * 0.1f);
+        }
+        slabs.read_density(dens[1].data());
+        slabs.read_velocity(uv[1].data());
+      }
+      ok &= check("slabs against one grid", N, dens[0], uv[0], dens[1], uv[1], 0);
+
+      // the CPU solver makes 20 red-black sweeps
+      {
+        fluid_cl_solver solver;
+        if (!solver.init(clContext, clDeviceID, N)) return false;
+        solver.set_relaxation(fluid_cl_solver::relaxation_red_black);
+        solver.set_solver_sweeps(20);
+        run_plume_cl(solver, num_steps, dens[0], uv[0]);
+      }
+      run_plume_cpu(N, num_steps, dens[1], uv[1]);
+      ok &= check("red-black against the CPU", N, dens[1], uv[1], dens[0], uv[0], 1e-4f);
+      return ok;
+    }
+  #endif
+
+  public:
+    fluid_bench() {
+      steps = 0;
+      dt = 0.1f;
+      cl_fused = true;
+      cl_half = false;
+      cl_slabs = 0;
+      cl_sweeps[0] = cl_sweeps[1] = -1;
+      cl_relaxation = -1;
+    #if OCTET_OPENCL
+      clContext = NULL;
+      clDeviceID = NULL;
+    #endif
+    }
+
+    ~fluid_bench() {
+    #if OCTET_OPENCL
+      if (clContext) {
+        cl_program_cache::release(clContext);
+        clReleaseContext(clContext);
+      }
+    #endif
+    }
+
+    /// grid sizes to run, in order. 64 to 2048 if none are added.
+    void add_size(int N) {
+      sizes.push_back(N);
+    }
+
+    /// thread counts to run the CPU solver on. Powers of two up to the
+    /// number of cores if none are added.
+    void add_threads(int threads) {
+      thread_counts.push_back(threads);
+    }
+
+    /// steps to time at every size, 0 (default) to pick by size
+    void set_steps(int value) {
+      steps = value;
+    }
+
+    /// time the fused (default) or the original OpenCL kernels
+    void set_cl_fused(bool value) {
+      cl_fused = value;
+    }
+
+    /// time the OpenCL solver with its fields in half floats, see
+    /// fluid_cl_solver::set_half_storage
+    void set_cl_half(bool value) {
+      cl_half = value;
+    }
+
+    /// split the OpenCL grid into this many slabs, see fluid_cl_slabs, or
+    /// 0 (default) for one solver. Validation uses two slabs if unset.
+    void set_cl_slabs(int value) {
+      cl_slabs = value;
+    }
+
+    /// sweeps a launch of the tiled OpenCL solves, see
+    /// fluid_cl_solver::set_sweeps_per_launch. The solver's defaults if unset.
+    void set_cl_sweeps(int diffuse, int pressure) {
+      cl_sweeps[0] = diffuse;
+      cl_sweeps[1] = pressure;
+    }
+
+    /// the kernels of the fused OpenCL solves, see
+    /// fluid_cl_solver::set_relaxation. The solver's default if unset.
+    void set_cl_relaxation(int value) {
+      cl_relaxation = value;
+    }
+
+    /// run the CPU solver at every size and thread count
+    void run_cpu() {
+      if (sizes.size() == 0) {
+        for (int N = 64; N <= 2048; N *= 2) sizes.push_back(N);
+      }
+      if (thread_counts.size() == 0) {
+        int cores = fluid_workers::get_num_cores();
+        for (int t = 1; t < cores; t *= 2) thread_counts.push_back(t);
+        thread_counts.push_back(cores);
+      }
+      for (int i = 0; i != (int)sizes.size(); ++i) {
+        for (int t = 0; t != (int)thread_counts.size(); ++t) {
+          run_cpu(sizes[i], thread_counts[t]);
+        }
+      }
+    }
+
+    /// run the OpenCL solver at every size. returns false if there is no
+    /// OpenCL device, or OpenCL isn't built in.
+    bool run_cl() {
+    #if OCTET_OPENCL
+      if (!clContext && !init_cl()) return false;
+      if (sizes.size() == 0) {
+        for (int N = 64; N <= 2048; N *= 2) sizes.push_back(N);
+      }
+      for (int i = 0; i != (int)sizes.size(); ++i) {
+        run_cl(sizes[i]);
+      }
+      return true;
+    #else
+      printf("cl: not built with OCTET_OPENCL, skipping\n");
+      return false;
+    #endif
+    }
+
+    /// compare the fused OpenCL kernels with the original ones at every
+    /// size after a few steps. The root mean square difference in density
+    /// and velocity, relative to the values, has to be within tolerance.
+    /// A second run of the fused kernels has to give the same results, and
+    /// the red-black kernels those of the CPU solver to within rounding.
+    /// They differ as the pressure solve stops well short of converging
+    /// and its sweeps differ: red-black is within 1% of the original and
+    /// tiled within 5%, while Jacobi converges about half as fast and is
+    /// further off.
+    /// returns false on a failure or without an OpenCL device.
+    bool validate_cl(float tolerance = 5e-2f) {
+    #if OCTET_OPENCL
+      if (!clContext && !init_cl()) return false;
+      if (sizes.size() == 0) {
+        for (int N = 64; N <= 256; N *= 2) sizes.push_back(N);
+      }
+      bool ok = true;
+      for (int i = 0; i != (int)sizes.size(); ++i) {
+        ok &= validate_cl(sizes[i], steps > 0 ? steps : 5, tolerance);
+      }
+      return ok;
+    #else
+      (void)tolerance;
+      printf("cl: not built with OCTET_OPENCL, skipping\n");
+      return false;
+    #endif
+    }
+
+    /// run the 3D CPU solver at every size and thread count
+    void run_cpu3d() {
+      if (sizes.size() == 0) {
+        for (int N = 16; N <= 128; N *= 2) sizes.push_back(N);
+      }
+      if (thread_counts.size() == 0) {
+        int cores = fluid_workers::get_num_cores();
+        for (int t = 1; t < cores; t *= 2) thread_counts.push_back(t);
+        thread_counts.push_back(cores);
+      }
+      for (int i = 0; i != (int)sizes.size(); ++i) {
+        for (int t = 0; t != (int)thread_counts.size(); ++t) {
+          run_cpu3d(sizes[i], thread_counts[t]);
+        }
+      }
+    }
+
+    /// check the 3D solver's mass and divergence at every size.
+    /// returns false on a failure.
+    bool validate_3d() {
+      if (sizes.size() == 0) {
+        for (int N = 16; N <= 64; N *= 2) sizes.push_back(N);
+      }
+      bool ok = true;
+      for (int i = 0; i != (int)sizes.size(); ++i) {
+        ok &= validate_3d(sizes[i]);
+      }
+      return ok;
+    }
+
+    const dynarray<result> &get_results() const {
+      return results;
+    }
+
+    /// write the results as comma separated values with a header line
+    bool write_csv(const char *filename) const {
+      FILE *file = fopen(filename, "w");
+      if (!file) {
+        perror(filename);
+        return false;
+      }
+      fprintf(file, "target,N,threads,stage,calls,ns_per_cell,gb_per_s,speedup\n");
+      for (int i = 0; i != (int)results.size(); ++i) {
+        const result &r = results[i];
+        fprintf(file, "%s,%d,%d,%s,%d,%.4f,%.4f,%.4f\n",
+          r.target, r.N, r.threads, r.stage, r.calls, r.ns_per_cell, r.gb_per_s, r.speedup);
+      }
+      fclose(file);
+      return true;
+    }
+
+    /// write the results as a json array of objects
+    bool write_json(const char *filename) const {
+      FILE *file = fopen(filename, "w");
+      if (!file) {
+        perror(filename);
+        return false;
+      }
+      fprintf(file, "[\n");
+      for (int i = 0; i != (int)results.size(); ++i) {
+        const result &r = results[i];
+        fprintf(file, "  {\"target\": \"%s\", \"N\": %d, \"threads\": %d, \"stage\": \"%s\", \"calls\": %d, "
+          "\"ns_per_cell\": %.4f, \"gb_per_s\": %.4f, \"speedup\": %.4f}%s\n",
+          r.target, r.N, r.threads, r.stage, r.calls, r.ns_per_cell, r.gb_per_s, r.speedup,
+          i + 1 == (int)results.size() ? "" : ",");
+      }
+      fprintf(file, "]\n");
+      fclose(file);
+      return true;
+    }
+  };
+}
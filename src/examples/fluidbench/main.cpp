@@ -0,0 +1,156 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2012-2014
+//
+// Modular Framework for OpenGLES2 rendering on multiple platforms.
+//
+// Headless benchmarks of the CPU and OpenCL fluid solvers.
+//
+// Build it for the generic platform, for example
+//
+//   g++ -std=gnu++98 -fpermissive -O2 -D__GENERIC__ -I../.. main.cpp -o fluidbench -lpthread -lOpenCL
+//
+// or with -DOCTET_OPENCL=0 and without -lOpenCL for the CPU solver only.
+//
+// usage: fluidbench [-sizes n,n,...] [-threads n,n,...] [-steps n] [-cpu] [-cl]
+//                   [-csv file] [-json file] [-root path] [-unfused] [-validate]
+//                   [-sweeps diffuse,pressure] [-relax tiled|red-black|jacobi] [-half]
+//                   [-slabs n] [-3d]
+//
+// -cpu and -cl run only that solver; both run by default. -root is the
+// directory holding assets/opencl/fluids.cl, ending in a /. -unfused times
+// the original OpenCL kernels in place of the fused ones and -validate
+// only compares the two, failing if they disagree. -sweeps sets the sweeps a
+// launch of the tiled solves and -relax the kernels of the solves. -half
+// keeps the OpenCL solver's fields in half floats. -slabs splits the
+// OpenCL grid into n slabs on the devices found, and validates n slabs.
+// -3d times the 3D CPU solver in their place, or with -validate checks it.
+//
+
+// the solvers don't need the physics engines
+#define OCTET_BULLET 0
+#define OCTET_BOX2D 0
+
+#include "../../octet.h"
+
+#if OCTET_OPENCL
+  #include "../../platform/CL/cl.h"
+#endif
+
+#include "../fluidshader/fluid_timer.h"
+#include "../fluidshader/fluid_workers.h"
+#include "../fluidshader/fluid_grid.h"
+#include "../fluidshader/fluid_simd.h"
+#include "../fluidshader/fluid_multigrid.h"
+#include "../fluidshader/fluid_pcg.h"
+#include "../fluidshader/fluid_bricks.h"
+#include "../fluidshader/fluid_solids.h"
+#include "../fluidshader/fluid_solver.h"
+#include "../fluidshader/fluid_solver3d.h"
+#include "../fluidshader/fluid_half.h"
+#if OCTET_OPENCL
+  #include "../layer2/cl_program_cache.h"
+  #include "../layer2/fluid_cl_solver.h"
+  #include "../layer2/fluid_cl_slabs.h"
+#endif
+#include "fluid_bench.h"
+
+// add each number of a comma separated list
+static bool parse_list(const char *list, octet::dynarray<int> &values) {
+  while (*list) {
+    char *end;
+    long value = strtol(list, &end, 10);
+    if (end == list || value <= 0) return false;
+    values.push_back((int)value);
+    list = *end == ',' ? end + 1 : end;
+  }
+  return values.size() != 0;
+}
+
+int main(int argc, char **argv) {
+  octet::fluid_bench bench;
+  octet::dynarray<int> sizes, threads;
+  const char *csv = 0, *json = 0;
+  bool cpu = true, cl = true, validate = false, solver3d = false;
+
+  octet::app_utils::prefix("../../../");
+  for (int i = 1; i < argc; ++i) {
+    bool more = i + 1 < argc;
+    if (!strcmp(argv[i], "-sizes") && more) {
+      if (!parse_list(argv[++i], sizes)) {
+        printf("bad list of sizes %s\n", argv[i]);
+        return 1;
+      }
+    } else if (!strcmp(argv[i], "-threads") && more) {
+      if (!parse_list(argv[++i], threads)) {
+        printf("bad list of thread counts %s\n", argv[i]);
+        return 1;
+      }
+    } else if (!strcmp(argv[i], "-steps") && more) {
+      bench.set_steps(atoi(argv[++i]));
+    } else if (!strcmp(argv[i], "-cpu")) {
+      cl = false;
+    } else if (!strcmp(argv[i], "-cl")) {
+      cpu = false;
+    } else if (!strcmp(argv[i], "-csv") && more) {
+      csv = argv[++i];
+    } else if (!strcmp(argv[i], "-json") && more) {
+      json = argv[++i];
+    } else if (!strcmp(argv[i], "-unfused")) {
+      bench.set_cl_fused(false);
+    } else if (!strcmp(argv[i], "-half")) {
+      bench.set_cl_half(true);
+    } else if (!strcmp(argv[i], "-slabs") && more) {
+      int slabs = atoi(argv[++i]);
+      if (slabs < 1) {
+        printf("bad number of slabs %s\n", argv[i]);
+        return 1;
+      }
+      bench.set_cl_slabs(slabs);
+    } else if (!strcmp(argv[i], "-sweeps") && more) {
+      int diffuse, pressure;
+      if (sscanf(argv[++i], "%d,%d", &diffuse, &pressure) != 2 || diffuse < 1 || pressure < 1) {
+        printf("bad sweeps %s\n", argv[i]);
+        return 1;
+      }
+      bench.set_cl_sweeps(diffuse, pressure);
+    } else if (!strcmp(argv[i], "-relax") && more) {
+      static const char *names[] = { "tiled", "red-black", "jacobi" };
+      int relaxation = 0;
+      while (relaxation != 3 && strcmp(argv[i+1], names[relaxation])) ++relaxation;
+      if (relaxation == 3) {
+        printf("bad relaxation %s\n", argv[i+1]);
+        return 1;
+      }
+      bench.set_cl_relaxation(relaxation);
+      ++i;
+    } else if (!strcmp(argv[i], "-3d")) {
+      solver3d = true;
+    } else if (!strcmp(argv[i], "-validate")) {
+      validate = true;
+    } else if (!strcmp(argv[i], "-root") && more) {
+      octet::app_utils::prefix(argv[++i]);
+    } else {
+      printf("unknown option %s\n", argv[i]);
+      return 1;
+    }
+  }
+
+  for (int i = 0; i != (int)sizes.size(); ++i) bench.add_size(sizes[i]);
+  for (int i = 0; i != (int)threads.size(); ++i) bench.add_threads(threads[i]);
+
+  if (validate) {
+    return (solver3d ? bench.validate_3d() : bench.validate_cl()) ? 0 : 1;
+  }
+
+  if (solver3d) {
+    bench.run_cpu3d();
+  } else {
+    if (cpu) bench.run_cpu();
+    if (cl) bench.run_cl();
+  }
+
+  if (csv && !bench.write_csv(csv)) return 1;
+  if (json && !bench.write_json(json)) return 1;
+  return 0;
+}
@@ -0,0 +1,318 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2012-2014
+//
+// Modular Framework for OpenGLES2 rendering on multiple platforms.
+//
+// Occupancy mask for running the fluid solver on part of the grid.
+//
+// The N x N interior is divided into 16 x 16 cell bricks (one aligned
+// fluid_grid row segment wide). A brick is occupied if any cell of any field
+// is larger than a threshold. Occupied bricks are dilated by the distance
+// the fastest cell can move in one step (plus one brick for the diffusion and
+// pressure stencils) to give the active bricks the solver runs on.
+//
+// As in mesh_voxel_subcube, there is one bit per brick and coarser any/all
+// bits, here one per row of bricks, so empty rows and the fully active case
+// can be found quickly.
+//
+// Bricks that stop being active are cleared, so the cells outside the active
+// region are always zero and act as a zero boundary for the active ones.
+//
+
+namespace octet {
+  class fluid_bricks {
+  public:
+    enum {
+      brick_size = 16,
+    };
+
+  private:
+    int N;
+    int stride;
+
+    // bricks along each side
+    int num_bricks;
+
+    // 32 bit words per row of bricks
+    int row_words;
+
+    // one bit per brick: occupied by the last scan, dilated, and the previous mask
+    dynarray<uint32_t> occupied;
+    dynarray<uint32_t> active;
+    dynarray<uint32_t> prev_active;
+
+    // one bit per row of bricks
+    dynarray<uint32_t> any_active;
+    dynarray<uint32_t> all_active;
+    bool all_bricks_active;
+
+    // active bricks, bi + bj * num_bricks
+    dynarray<int> active_list;
+
+    // largest |u| or |v| of each row of bricks in the last scan
+    dynarray<float> row_speed;
+
+    float threshold;
+    float max_speed;
+    int radius;
+
+    fluid_workers *workers;
+
+    // the fields being scanned
+    float *scan_u;
+    float *scan_v;
+    float **scan_fields;
+    int scan_num_fields;
+
+    static void run_scan(void *context, int index) {
+      fluid_bricks *bricks = (fluid_bricks*)context;
+      bricks->scan_row(index);
+    }
+
+    static bool get_bit(const uint32_t *bits, int i) {
+      return ((bits[i >> 5] >> (i & 31)) & 1) != 0;
+    }
+
+    // find the occupied bricks of row bj and the fastest velocity
+    void scan_row(int bj) {
+      uint32_t *bits = occupied.data() + bj * row_words;
+      memset(bits, 0, row_words * sizeof(uint32_t));
+      float speed = 0;
+      for (int bi = 0; bi != num_bricks; ++bi) {
+        int i0, i1, j0, j1;
+        get_cells(bi, bj, i0, i1, j0, j1);
+        bool found = false;
+        for (int j = j0; j != j1; ++j) {
+          for (int i = i0 + j*stride, end = i1 + j*stride; i != end; ++i) {
+            float au = fabsf(scan_u[i]), av = fabsf(scan_v[i]);
+            if (au > speed) speed = au;
+            if (av > speed) speed = av;
+            found |= au > threshold || av > threshold;
+          }
+        }
+        for (int f = 0; f != scan_num_fields && !found; ++f) {
+          const float *x = scan_fields[f];
+          for (int j = j0; j != j1 && !found; ++j) {
+            for (int i = i0 + j*stride, end = i1 + j*stride; i != end; ++i) {
+              if (fabsf(x[i]) > threshold) { found = true; break; }
+            }
+          }
+        }
+        if (found) bits[bi >> 5] |= 1u << (bi & 31);
+      }
+      row_speed[bj] = speed;
+    }
+
+    // grow the bits of one row by one brick each side
+    void dilate_row(uint32_t *row) const {
+      uint32_t carry_left = 0;
+      for (int w = 0; w != row_words; ++w) {
+        uint32_t x = row[w];
+        uint32_t next = w + 1 != row_words ? row[w+1] : 0;
+        row[w] = x | x << 1 | carry_left | x >> 1 | next << 31;
+        carry_left = x >> 31;
+      }
+      int extra = row_words * 32 - num_bricks;
+      if (extra) row[row_words-1] &= ~0u >> extra;
+    }
+
+    void clear_brick(int bi, int bj, float *x) {
+      int i0, i1, j0, j1;
+      get_cells(bi, bj, i0, i1, j0, j1);
+      for (int j = j0; j != j1; ++j) {
+        memset(x + i0 + j*stride, 0, (i1 - i0) * sizeof(float));
+      }
+    }
+
+    void update_summary() {
+      int summary_words = (num_bricks + 31) >> 5;
+      memset(any_active.data(), 0, summary_words * sizeof(uint32_t));
+      memset(all_active.data(), 0, summary_words * sizeof(uint32_t));
+      active_list.resize(0);
+      all_bricks_active = true;
+      for (int bj = 0; bj != num_bricks; ++bj) {
+        const uint32_t *row = active.data() + bj * row_words;
+        bool any = false, all = true;
+        for (int bi = 0; bi != num_bricks; ++bi) {
+          if (get_bit(row, bi)) {
+            active_list.push_back(bi + bj * num_bricks);
+            any = true;
+          } else {
+            all = false;
+          }
+        }
+        if (any) any_active[bj >> 5] |= 1u << (bj & 31);
+        if (all) all_active[bj >> 5] |= 1u << (bj & 31);
+        all_bricks_active &= all;
+      }
+    }
+
+  public:
+    fluid_bricks() {
+      N = stride = num_bricks = row_words = 0;
+      all_bricks_active = true;
+      threshold = 1e-4f;
+      max_speed = 0;
+      radius = 0;
+      workers = 0;
+      scan_u = scan_v = 0;
+      scan_fields = 0;
+      scan_num_fields = 0;
+    }
+
+    /// set the grid size and the distance between rows. workers may be NULL.
+    /// Every brick starts active.
+    void init(int N, int stride, fluid_workers *workers = 0) {
+      this->N = N;
+      this->stride = stride;
+      this->workers = workers;
+      num_bricks = (N + brick_size - 1) / brick_size;
+      row_words = (num_bricks + 31) >> 5;
+      occupied.resize(num_bricks * row_words);
+      active.resize(num_bricks * row_words);
+      prev_active.resize(num_bricks * row_words);
+      any_active.resize(row_words);
+      all_active.resize(row_words);
+      row_speed.resize(num_bricks);
+      set_all_active();
+    }
+
+    /// make every brick active, for example when fields have been changed
+    /// outside the active region.
+    void set_all_active() {
+      for (int bj = 0; bj != num_bricks; ++bj) {
+        uint32_t *row = active.data() + bj * row_words;
+        memset(row, 0, row_words * sizeof(uint32_t));
+        for (int bi = 0; bi != num_bricks; ++bi) {
+          row[bi >> 5] |= 1u << (bi & 31);
+        }
+      }
+      update_summary();
+    }
+
+    /// cells with |x| at or below this count as empty
+    void set_threshold(float value) {
+      threshold = value;
+    }
+
+    float get_threshold() const {
+      return threshold;
+    }
+
+    /// find the active bricks from the velocity u, v and the other fields
+    /// (density, sources, ...), then clear every field in bricks that are
+    /// no longer active. dt is the time step about to be taken.
+    void update(float *u, float *v, float **fields, int num_fields, float dt) {
+      scan_u = u;
+      scan_v = v;
+      scan_fields = fields;
+      scan_num_fields = num_fields;
+      if (workers) {
+        workers->run(run_scan, (void*)this, num_bricks);
+      } else {
+        for (int bj = 0; bj != num_bricks; ++bj) {
+          scan_row(bj);
+        }
+      }
+
+      max_speed = 0;
+      for (int bj = 0; bj != num_bricks; ++bj) {
+        if (row_speed[bj] > max_speed) max_speed = row_speed[bj];
+      }
+
+      // cells move at most max_speed * dt * N cells per step
+      float cells = max_speed * dt * N;
+      radius = cells < num_bricks * brick_size ? (int)ceilf(cells / brick_size) + 1 : num_bricks;
+      if (radius > num_bricks) radius = num_bricks;
+
+      // dilate along rows, then OR together the rows within the radius
+      for (int bj = 0; bj != num_bricks; ++bj) {
+        uint32_t *row = occupied.data() + bj * row_words;
+        for (int r = 0; r != radius; ++r) {
+          dilate_row(row);
+        }
+      }
+      memcpy(prev_active.data(), active.data(), active.size() * sizeof(uint32_t));
+      memset(active.data(), 0, active.size() * sizeof(uint32_t));
+      for (int bj = 0; bj != num_bricks; ++bj) {
+        uint32_t *dest = active.data() + bj * row_words;
+        int k0 = bj - radius < 0 ? 0 : bj - radius;
+        int k1 = bj + radius >= num_bricks ? num_bricks - 1 : bj + radius;
+        for (int k = k0; k <= k1; ++k) {
+          const uint32_t *src = occupied.data() + k * row_words;
+          for (int w = 0; w != row_words; ++w) {
+            dest[w] |= src[w];
+          }
+        }
+      }
+
+      // bricks that have just become inactive are below the threshold: make them zero
+      for (int bj = 0; bj != num_bricks; ++bj) {
+        const uint32_t *was = prev_active.data() + bj * row_words;
+        const uint32_t *now = active.data() + bj * row_words;
+        for (int bi = 0; bi != num_bricks; ++bi) {
+          if (get_bit(was, bi) && !get_bit(now, bi)) {
+            clear_brick(bi, bj, u);
+            clear_brick(bi, bj, v);
+            for (int f = 0; f != num_fields; ++f) {
+              clear_brick(bi, bj, fields[f]);
+            }
+          }
+        }
+      }
+
+      update_summary();
+    }
+
+    /// interior cells [i0, i1) x [j0, j1) of brick (bi, bj)
+    void get_cells(int bi, int bj, int &i0, int &i1, int &j0, int &j1) const {
+      i0 = 1 + bi * brick_size;
+      j0 = 1 + bj * brick_size;
+      i1 = i0 + brick_size > N+1 ? N+1 : i0 + brick_size;
+      j1 = j0 + brick_size > N+1 ? N+1 : j0 + brick_size;
+    }
+
+    int get_num_bricks() const {
+      return num_bricks;
+    }
+
+    bool is_active(int bi, int bj) const {
+      return get_bit(active.data() + bj * row_words, bi);
+    }
+
+    /// true if any brick of row bj is active
+    bool is_row_active(int bj) const {
+      return get_bit(any_active.data(), bj);
+    }
+
+    /// true if every brick of row bj is active
+    bool is_row_full(int bj) const {
+      return get_bit(all_active.data(), bj);
+    }
+
+    /// true if every brick is active, when the solver may as well run densely
+    bool is_all_active() const {
+      return all_bricks_active;
+    }
+
+    int get_num_active() const {
+      return (int)active_list.size();
+    }
+
+    /// brick number bi + bj * get_num_bricks() of the k'th active brick
+    int get_active(int k) const {
+      return active_list[k];
+    }
+
+    /// fastest velocity component found by the last update
+    float get_max_speed() const {
+      return max_speed;
+    }
+
+    /// bricks added around the occupied ones by the last update
+    int get_radius() const {
+      return radius;
+    }
+  };
+}
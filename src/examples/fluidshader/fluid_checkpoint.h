@@ -0,0 +1,370 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2012-2014
+//
+// Modular Framework for OpenGLES2 rendering on multiple platforms.
+//
+// Checkpoints of a fluid run, and the input that drove it, for replays.
+//
+// A checkpoint is an octet binary file written through a visitor (see
+// binary_writer): the step counter, dt and the seed of the caller's random
+// numbers, then both buffers of every field of the grid and the pressure
+// the solver's warm start begins from, so a run resumed from it takes the
+// same steps as one that never stopped.
+//
+// Fields go out in chunks of rows, each packed on its own: every float is
+// xor'ed with the one before it, the bytes of the results are split into
+// four planes and runs of zero bytes in the planes are squeezed out. Still
+// and empty regions pack to almost nothing and the packing is lossless.
+// Loading reads one chunk at a time into a small buffer and unpacks it
+// straight into the grid.
+//
+// After the fields comes the input of get_from_UI recorded since the state
+// was saved, empty for a plain checkpoint. A recording is a checkpoint
+// written when recording starts, with the input appended when it stops.
+// Loading one and feeding the input back with next_input() replays the run.
+//
+
+namespace octet {
+  class fluid_checkpoint {
+  public:
+    enum {
+      version = 1,
+
+      // floats a chunk aims for
+      chunk_floats = 16384,
+
+      // zero runs and literal runs of the packing, at most 128 bytes each
+      max_run = 128,
+    };
+
+    /// the mouse state get_from_UI reads on one step
+    struct input {
+      int32_t step;
+      int32_t win_x, win_y;
+      int32_t mx, my;
+      int32_t omx, omy;
+      int32_t buttons;      // bit k for mouse_down[k]
+    };
+
+  private:
+    fluid_grid *grid;
+    fluid_solver *solver;
+
+    int32_t step;
+    float dt;
+    uint32_t seed;
+
+    // rows of a field in each chunk
+    int32_t rows_per_chunk;
+
+    // recorded input, or the input being replayed from replay_pos
+    dynarray<input> inputs;
+    int replay_pos;
+    bool replaying;
+
+    // the open recording
+    FILE *record_file;
+    binary_writer *record_writer;
+
+    // the planes of a chunk, and the chunk as it is in the file
+    dynarray<uint8_t> planes;
+    dynarray<uint8_t> packed;
+
+    // pack rows x width floats, rows being stride floats apart, into packed
+    void pack(const float *src, int stride, int width, int rows) {
+      int n = width * rows;
+      planes.resize(n * 4);
+      uint8_t *p = planes.data();
+      uint32_t prev = 0;
+      for (int j = 0, k = 0; j != rows; ++j) {
+        const float *row = src + j * stride;
+        for (int i = 0; i != width; ++i, ++k) {
+          uint32_t bits;
+          memcpy(&bits, row + i, sizeof(bits));
+          uint32_t d = bits ^ prev;
+          prev = bits;
+          p[k] = (uint8_t)d;
+          p[n + k] = (uint8_t)(d >> 8);
+          p[n*2 + k] = (uint8_t)(d >> 16);
+          p[n*3 + k] = (uint8_t)(d >> 24);
+        }
+      }
+
+      // a code byte c < max_run is followed by c+1 literal bytes, a code
+      // byte c > max_run stands for c+1-max_run zeros
+      int total = n * 4;
+      packed.resize(total + total / max_run + 1);
+      uint8_t *dst = packed.data();
+      int out = 0;
+      for (int k = 0; k != total; ) {
+        if (p[k] == 0 && k + 1 != total && p[k+1] == 0) {
+          int run = 2;
+          while (run != max_run && k + run != total && p[k + run] == 0) ++run;
+          dst[out++] = (uint8_t)(run - 1 + max_run);
+          k += run;
+        } else {
+          int start = k;
+          while (k - start != max_run && k != total && !(p[k] == 0 && k + 1 != total && p[k+1] == 0)) ++k;
+          dst[out++] = (uint8_t)(k - start - 1);
+          memcpy(dst + out, p + start, k - start);
+          out += k - start;
+        }
+      }
+      packed.resize(out);
+    }
+
+    // the inverse of pack. returns false if packed is not a chunk of this size.
+    bool unpack(float *dest, int stride, int width, int rows) {
+      int n = width * rows;
+      int total = n * 4;
+      planes.resize(total);
+      uint8_t *p = planes.data();
+      const uint8_t *src = packed.data(), *end = src + packed.size();
+      int k = 0;
+      while (src != end) {
+        int c = *src++;
+        if (c < max_run) {
+          int run = c + 1;
+          if (run > total - k || run > end - src) return false;
+          memcpy(p + k, src, run);
+          src += run;
+          k += run;
+        } else {
+          int run = c + 1 - max_run;
+          if (run > total - k) return false;
+          memset(p + k, 0, run);
+          k += run;
+        }
+      }
+      if (k != total) return false;
+
+      uint32_t prev = 0;
+      for (int j = 0, k = 0; j != rows; ++j) {
+        float *row = dest + j * stride;
+        for (int i = 0; i != width; ++i, ++k) {
+          uint32_t d = p[k] | (p[n + k] << 8) | (p[n*2 + k] << 16) | ((uint32_t)p[n*3 + k] << 24);
+          prev ^= d;
+          memcpy(row + i, &prev, sizeof(prev));
+        }
+      }
+      return true;
+    }
+
+    // cells (0, 0) .. (N+1, N+1) of one buffer, chunk by chunk
+    void visit_cells(visitor &v, float *cells) {
+      int N = grid->get_N(), stride = grid->get_stride();
+      for (int j = 0; j < N+2 && !v.get_error(); j += rows_per_chunk) {
+        int rows = N+2 - j < rows_per_chunk ? N+2 - j : rows_per_chunk;
+        if (!v.is_reader()) pack(cells + j * stride, stride, N+2, rows);
+        v.visit(packed, atom_chunk);
+        if (v.is_reader() && !v.get_error() && !unpack(cells + j * stride, stride, N+2, rows)) {
+          printf("fluid_checkpoint: bad chunk\n");
+          v.set_error(true);
+        }
+      }
+    }
+
+    // everything but the input
+    void visit_state(visitor &v) {
+      atom_t kind = atom_fluid_checkpoint;
+      int32_t file_version = version;
+      int32_t N = grid->get_N();
+      int32_t num_fields = grid->get_num_fields();
+      v.visit(kind, atom_kind);
+      v.visit(file_version, atom_version);
+      v.visit(N, atom_size);
+      if (v.get_error() || kind != atom_fluid_checkpoint || file_version != version || N != grid->get_N()) {
+        printf("fluid_checkpoint: not a checkpoint of a %dx%d grid\n", grid->get_N(), grid->get_N());
+        v.set_error(true);
+        return;
+      }
+
+      v.visit(step, atom_step);
+      v.visit(dt, atom_dt);
+      v.visit(seed, atom_seed);
+      v.visit(rows_per_chunk, atom_rows);
+      v.visit(num_fields, atom_fields);
+      if (v.get_error() || rows_per_chunk < 1 || num_fields != grid->get_num_fields()) {
+        printf("fluid_checkpoint: the grid has %d fields\n", grid->get_num_fields());
+        v.set_error(true);
+        return;
+      }
+
+      // fields by name, in the order they were saved
+      for (int f = 0; f != num_fields && !v.get_error(); ++f) {
+        string name = grid->get_name(f);
+        v.visit(name, atom_field);
+        int id = grid->find_field(name.c_str());
+        int32_t buffers = id < 0 ? 0 : grid->get_prev(id) ? 2 : 1;
+        v.visit(buffers, atom_buffers);
+        if (v.get_error() || id < 0 || buffers != (grid->get_prev(id) ? 2 : 1)) {
+          printf("fluid_checkpoint: field %s doesn't match the grid\n", name.c_str());
+          v.set_error(true);
+          return;
+        }
+        visit_cells(v, grid->get(id));
+        if (buffers == 2) visit_cells(v, grid->get_prev(id));
+      }
+
+      int32_t pressure = solver ? 2 : 0;
+      v.visit(pressure, atom_pressure);
+      for (int which = 0; which != pressure && solver; ++which) {
+        visit_cells(v, solver->access_last_pressure(which));
+      }
+    }
+
+    bool finish(visitor &v, FILE *file, const char *filename) {
+      bool ok = !v.get_error() && !ferror(file);
+      fclose(file);
+      if (!ok) printf("fluid_checkpoint: error in %s\n", filename);
+      return ok;
+    }
+
+  public:
+    fluid_checkpoint() {
+      grid = 0;
+      solver = 0;
+      step = 0;
+      dt = 0;
+      seed = 0;
+      rows_per_chunk = 1;
+      replay_pos = 0;
+      replaying = false;
+      record_file = 0;
+      record_writer = 0;
+    }
+
+    ~fluid_checkpoint() {
+      end_record();
+    }
+
+    /// checkpoint the fields of grid and, if solver is not NULL, the solver's
+    /// warm start. Loading needs a grid with the same size and fields.
+    void init(fluid_grid &grid, fluid_solver *solver = 0) {
+      this->grid = &grid;
+      this->solver = solver;
+      rows_per_chunk = chunk_floats / (grid.get_N() + 2);
+      if (rows_per_chunk < 1) rows_per_chunk = 1;
+    }
+
+    /// the step counter, dt and random seed saved with the fields
+    void set_state(int step, float dt, unsigned seed) {
+      this->step = step;
+      this->dt = dt;
+      this->seed = seed;
+    }
+
+    int get_step() const {
+      return step;
+    }
+
+    float get_dt() const {
+      return dt;
+    }
+
+    unsigned get_seed() const {
+      return seed;
+    }
+
+    /// write the state and the fields, without any input. returns false if
+    /// the file can't be written.
+    bool save(const char *filename) {
+      FILE *file = fopen(filename, "wb");
+      if (!file) {
+        perror(filename);
+        return false;
+      }
+      setvbuf(file, NULL, _IOFBF, 1 << 20);
+
+      dynarray<input> none;
+      binary_writer writer(file);
+      visitor &v = writer;
+      visit_state(v);
+      v.visit(none, atom_inputs);
+      return finish(v, file, filename);
+    }
+
+    /// read the fields and the state and any recorded input, ready to
+    /// replay. returns false if the file is not a checkpoint of this grid;
+    /// the fields may be partly overwritten then.
+    bool load(const char *filename) {
+      FILE *file = fopen(filename, "rb");
+      if (!file) {
+        perror(filename);
+        return false;
+      }
+      setvbuf(file, NULL, _IOFBF, 1 << 20);
+
+      binary_reader reader(file);
+      visitor &v = reader;
+      visit_state(v);
+      v.visit(inputs, atom_inputs);
+      replay_pos = 0;
+      replaying = inputs.size() != 0;
+      return finish(v, file, filename);
+    }
+
+    /// write a checkpoint of the state set with set_state and record the
+    /// input from now until end_record().
+    bool begin_record(const char *filename) {
+      end_record();
+      record_file = fopen(filename, "wb");
+      if (!record_file) {
+        perror(filename);
+        return false;
+      }
+      setvbuf(record_file, NULL, _IOFBF, 1 << 20);
+
+      inputs.resize(0);
+      replaying = false;
+      record_writer = new binary_writer(record_file);
+      visit_state(*record_writer);
+      return !record_writer->get_error();
+    }
+
+    /// add the input of a step to the recording
+    void record(const input &in) {
+      if (record_writer) inputs.push_back(in);
+    }
+
+    /// write the recorded input and close the recording
+    bool end_record() {
+      if (!record_writer) return false;
+      visitor &v = *record_writer;
+      v.visit(inputs, atom_inputs);
+      bool ok = finish(v, record_file, "recording");
+      delete record_writer;
+      record_writer = 0;
+      record_file = 0;
+      return ok;
+    }
+
+    bool is_recording() const {
+      return record_writer != 0;
+    }
+
+    /// the next recorded input, in place of the mouse. returns false, and
+    /// ends the replay, when the recording runs out.
+    bool next_input(input &in) {
+      if (!replaying || replay_pos == (int)inputs.size()) {
+        replaying = false;
+        return false;
+      }
+      in = inputs[replay_pos++];
+      return true;
+    }
+
+    bool is_replaying() const {
+      return replaying;
+    }
+
+    void stop_replay() {
+      replaying = false;
+    }
+
+    int get_num_inputs() const {
+      return (int)inputs.size();
+    }
+  };
+}
@@ -0,0 +1,184 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2012-2014
+//
+// Modular Framework for OpenGLES2 rendering on multiple platforms.
+//
+// Structure of arrays storage for the fields of a fluid simulation.
+//
+// Every field of the grid has the same layout: N x N interior cells with
+// ghost layers around them. Cell (i, j) of a field is p[i + j * stride]
+// where p = get(field) and 1 <= i, j <= N is the interior.
+//
+// Rows are padded to a multiple of 64 bytes and cell (1, j) of every row is
+// 64 byte aligned, so SIMD loads of the interior are aligned and threads
+// working on different rows never share a cache line.
+//
+// Fields are added by name and may be double buffered (get/get_prev/swap).
+//
+
+namespace octet {
+  class fluid_grid {
+  public:
+    enum {
+      alignment = 64,
+      align_floats = alignment / sizeof(float),
+      max_name = 32,
+    };
+
+  private:
+    struct field {
+      char name[max_name];
+      float *buffer[2];
+    };
+
+    int N;
+    int ghost;
+    int stride;
+
+    // offset of cell (0, 0) from the start of a buffer
+    int origin;
+
+    // floats in each buffer, including padding
+    int buffer_size;
+
+    dynarray<field> fields;
+
+    float *allocate() {
+      float *p = (float*)allocator::malloc_aligned(buffer_size * sizeof(float), alignment);
+      if (p) memset(p, 0, buffer_size * sizeof(float));
+      return p;
+    }
+
+    void release(float *p) {
+      allocator::free_aligned(p, buffer_size * sizeof(float), alignment);
+    }
+
+  public:
+    fluid_grid() {
+      N = ghost = stride = origin = buffer_size = 0;
+    }
+
+    ~fluid_grid() {
+      reset();
+    }
+
+    /// free all the fields
+    void reset() {
+      for (unsigned i = 0; i != fields.size(); ++i) {
+        release(fields[i].buffer[0]);
+        release(fields[i].buffer[1]);
+      }
+      fields.resize(0);
+    }
+
+    /// set the size of the interior and the number of ghost layers.
+    /// removes any fields.
+    void init(int N, int ghost = 1) {
+      reset();
+      this->N = N;
+      this->ghost = ghost;
+
+      // each row holds cells 1-ghost .. N+ghost
+      stride = (N + 2*ghost + align_floats - 1) & ~(align_floats - 1);
+
+      // cell (1, 1-ghost) must be aligned and cell (1-ghost, 1-ghost) in the buffer
+      int lead = ((ghost + align_floats - 1) / align_floats) * align_floats;
+      origin = lead - 1 + (ghost - 1) * stride;
+
+      // leave a vector's worth at the end for SIMD kernels that read past row N+ghost
+      buffer_size = origin + (N + ghost) * stride + N + ghost + 1 + align_floats;
+    }
+
+    /// add a field, cleared to zero. returns its id or -1 if out of memory.
+    int add_field(const char *name, bool double_buffered = false) {
+      field f;
+      memset(&f, 0, sizeof(f));
+      strncpy(f.name, name, max_name - 1);
+      f.buffer[0] = allocate();
+      f.buffer[1] = double_buffered ? allocate() : 0;
+      if (!f.buffer[0] || (double_buffered && !f.buffer[1])) {
+        release(f.buffer[0]);
+        release(f.buffer[1]);
+        return -1;
+      }
+      fields.push_back(f);
+      return (int)fields.size() - 1;
+    }
+
+    /// returns the id of a field or -1 if there isn't one of that name
+    int find_field(const char *name) const {
+      for (unsigned i = 0; i != fields.size(); ++i) {
+        if (!strcmp(fields[i].name, name)) return (int)i;
+      }
+      return -1;
+    }
+
+    /// cell (0, 0) of the current buffer of a field
+    float *get(int id) {
+      return fields[id].buffer[0] + origin;
+    }
+
+    const float *get(int id) const {
+      return fields[id].buffer[0] + origin;
+    }
+
+    /// cell (0, 0) of the other buffer, NULL if the field is single buffered
+    float *get_prev(int id) {
+      return fields[id].buffer[1] ? fields[id].buffer[1] + origin : 0;
+    }
+
+    /// exchange the buffers of a double buffered field
+    void swap(int id) {
+      float *tmp = fields[id].buffer[0];
+      fields[id].buffer[0] = fields[id].buffer[1];
+      fields[id].buffer[1] = tmp;
+    }
+
+    /// zero both buffers of a field
+    void clear(int id) {
+      for (int b = 0; b != 2; ++b) {
+        if (fields[id].buffer[b]) memset(fields[id].buffer[b], 0, buffer_size * sizeof(float));
+      }
+    }
+
+    void clear_all() {
+      for (unsigned i = 0; i != fields.size(); ++i) {
+        clear((int)i);
+      }
+    }
+
+    /// copy cells (0, 0) .. (N+1, N+1) of a field to an unpadded (N+2) x (N+2) array
+    void copy_out(int id, float *dest) const {
+      const float *src = get(id);
+      for (int j = 0; j != N+2; ++j) {
+        memcpy(dest + j*(N+2), src + j*stride, (N+2) * sizeof(float));
+      }
+    }
+
+    int index(int i, int j) const {
+      return i + j * stride;
+    }
+
+    int get_N() const {
+      return N;
+    }
+
+    int get_ghost() const {
+      return ghost;
+    }
+
+    /// distance in floats between rows
+    int get_stride() const {
+      return stride;
+    }
+
+    int get_num_fields() const {
+      return (int)fields.size();
+    }
+
+    const char *get_name(int id) const {
+      return fields[id].name;
+    }
+  };
+}
@@ -0,0 +1,135 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2012-2014
+//
+// Modular Framework for OpenGLES2 rendering on multiple platforms.
+//
+// 16 bit storage for fluid fields: IEEE half floats, as vload_half and
+// vstore_half and GL_HALF_FLOAT use, and bfloat16, the top half of a
+// float. Half floats keep 11 bits of mantissa up to 65504; bfloat16 keeps
+// 8 bits and the whole range of a float. Both round to nearest even.
+// Arithmetic stays in float; only the storage is packed.
+//
+
+namespace octet {
+  class fluid_half {
+    static uint32_t float_bits(float value) {
+      uint32_t bits;
+      memcpy(&bits, &value, 4);
+      return bits;
+    }
+
+    static float bits_float(uint32_t bits) {
+      float value;
+      memcpy(&value, &bits, 4);
+      return value;
+    }
+
+  public:
+    /// how a field is stored: 4, 2 or 2 bytes a value
+    enum format_t {
+      format_float,
+      format_half,
+      format_bfloat16,
+      num_formats,
+    };
+
+    static int get_value_size(int format) {
+      return format == format_float ? 4 : 2;
+    }
+
+    static const char *get_format_name(int format) {
+      static const char *names[] = { "float", "half", "bfloat16" };
+      return names[format];
+    }
+
+    /// the format called name, or -1
+    static int find_format(const char *name) {
+      for (int i = 0; i != num_formats; ++i) {
+        if (!strcmp(name, get_format_name(i))) return i;
+      }
+      return -1;
+    }
+
+    /// value as a half float. Too large values become infinity and too
+    /// small ones denormals or zero.
+    static uint16_t to_half(float value) {
+      uint32_t bits = float_bits(value);
+      uint32_t sign = (bits >> 16) & 0x8000;
+      uint32_t abs = bits & 0x7fffffff;
+
+      if (abs >= 0x7f800000) {
+        // infinity, or a quiet NaN
+        return (uint16_t)(sign | 0x7c00 | (abs > 0x7f800000 ? 0x200 : 0));
+      }
+      if (abs >= 0x477ff000) {
+        // rounds to more than 65504
+        return (uint16_t)(sign | 0x7c00);
+      }
+      if (abs < 0x38800000) {
+        // a denormal half: shift the mantissa, with its hidden bit, into place
+        if (abs < 0x33000000) return (uint16_t)sign;
+        uint32_t shift = 126 - (abs >> 23);
+        uint32_t mantissa = (abs & 0x7fffff) | 0x800000;
+        uint32_t result = mantissa >> shift;
+        uint32_t rest = mantissa & ((1u << shift) - 1);
+        uint32_t halfway = 1u << (shift - 1);
+        if (rest > halfway || (rest == halfway && (result & 1))) ++result;
+        return (uint16_t)(sign | result);
+      }
+      // rebias the exponent and round away the bottom 13 bits
+      uint32_t result = (abs - 0x38000000) >> 13;
+      uint32_t rest = abs & 0x1fff;
+      if (rest > 0x1000 || (rest == 0x1000 && (result & 1))) ++result;
+      return (uint16_t)(sign | result);
+    }
+
+    static float from_half(uint16_t value) {
+      uint32_t sign = (uint32_t)(value & 0x8000) << 16;
+      uint32_t exponent = (value >> 10) & 0x1f;
+      uint32_t mantissa = value & 0x3ff;
+
+      if (exponent == 0x1f) {
+        return bits_float(sign | 0x7f800000 | (mantissa << 13));
+      }
+      if (exponent == 0) {
+        // zero or a denormal, mantissa * 2^-24
+        float result = mantissa * (1.0f / 16777216.0f);
+        return sign ? -result : result;
+      }
+      return bits_float(sign | ((exponent + 112) << 23) | (mantissa << 13));
+    }
+
+    static uint16_t to_bfloat16(float value) {
+      uint32_t bits = float_bits(value);
+      if ((bits & 0x7fffffff) > 0x7f800000) {
+        // keep NaNs NaNs when the mantissa's top bits are zero
+        return (uint16_t)((bits >> 16) | 0x40);
+      }
+      bits += 0x7fff + ((bits >> 16) & 1);
+      return (uint16_t)(bits >> 16);
+    }
+
+    static float from_bfloat16(uint16_t value) {
+      return bits_float((uint32_t)value << 16);
+    }
+
+    /// pack count floats from src into dst in format
+    static void pack(uint16_t *dst, const float *src, int count, int format) {
+      if (format == format_half) {
+        for (int i = 0; i != count; ++i) dst[i] = to_half(src[i]);
+      } else {
+        for (int i = 0; i != count; ++i) dst[i] = to_bfloat16(src[i]);
+      }
+    }
+
+    /// unpack count values in format from src into dst
+    static void unpack(float *dst, const uint16_t *src, int count, int format) {
+      if (format == format_half) {
+        for (int i = 0; i != count; ++i) dst[i] = from_half(src[i]);
+      } else {
+        for (int i = 0; i != count; ++i) dst[i] = from_bfloat16(src[i]);
+      }
+    }
+  };
+}
@@ -0,0 +1,353 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2012-2014
+//
+// Modular Framework for OpenGLES2 rendering on multiple platforms.
+//
+// Geometric multigrid solver for the pressure equation.
+//
+// Solves 4 x[i,j] - x[i-1,j] - x[i+1,j] - x[i,j-1] - x[i,j+1] = b[i,j]
+// with the ghost cells copied from their neighbours (set_bnd(0, x)), the
+// same system that lin_solve(0, p, div, 1, 4) relaxes.
+//
+// The grid is cell centred: coarse cell (I,J) covers fine cells 2I-1..2I,
+// 2J-1..2J. Restriction sums the four fine residuals (the coarse stencil
+// is 4x the size), prolongation is bilinear and the smoother is red-black
+// Gauss-Seidel. Grids halve until they are small or odd; the coarsest
+// grid is just relaxed many times, so power of two sizes work best.
+//
+
+namespace octet {
+  class fluid_multigrid {
+  public:
+    enum cycle_t {
+      v_cycle = 1,
+      w_cycle = 2,
+    };
+
+  private:
+    enum { max_levels = 16 };
+
+    // stop coarsening at this size
+    enum { min_level_size = 4 };
+
+    // rows are processed in bands of at least this many cells
+    enum { min_band_cells = 4096 };
+
+    // the number of bands only depends on the grid size, so that the
+    // residual sums are added in the same order on any number of threads.
+    enum { max_bands = 256 };
+
+    struct level {
+      int n;
+      int stride;
+      int num_bands;
+      int band_rows;
+      float *x;
+      float *b;
+      float *r;
+      dynarray<float> storage;
+    };
+
+    enum op_kind {
+      op_smooth,
+      op_residual,
+      op_restrict,
+      op_prolong,
+    };
+
+    int num_levels;
+    level levels[max_levels];
+
+    cycle_t cycle;
+    int pre_smooth;
+    int post_smooth;
+    fluid_simd::level_t simd;
+    fluid_workers *workers;
+
+    // the op currently being run
+    op_kind kind;
+    int cur_level;
+    int parity;
+    double partial[max_bands];
+
+    static void run_band(void *context, int index) {
+      fluid_multigrid *mg = (fluid_multigrid*)context;
+      level &l = mg->levels[mg->cur_level];
+      int j0 = 1 + index * l.band_rows;
+      int j1 = j0 + l.band_rows > l.n+1 ? l.n+1 : j0 + l.band_rows;
+      mg->do_band(index, j0, j1);
+    }
+
+    void do_band(int index, int j0, int j1) {
+      switch (kind) {
+        case op_smooth: smooth_rows(levels[cur_level], j0, j1); break;
+        case op_residual: partial[index] = residual_rows(levels[cur_level], j0, j1); break;
+        case op_restrict: restrict_rows(levels[cur_level-1], levels[cur_level], j0, j1); break;
+        case op_prolong: prolong_rows(levels[cur_level], levels[cur_level+1], j0, j1); break;
+      }
+    }
+
+    // run an op over the interior rows of level l, split into bands.
+    // restrict runs on the coarse level, prolong on the fine one.
+    void run_op(op_kind kind, int l) {
+      this->kind = kind;
+      cur_level = l;
+      int count = levels[l].num_bands;
+      if (workers && count > 1) {
+        workers->run(run_band, (void*)this, count);
+      } else {
+        for (int i = 0; i != count; ++i) {
+          run_band((void*)this, i);
+        }
+      }
+    }
+
+    void smooth_rows(level &l, int j0, int j1) {
+      int n = l.n, stride = l.stride;
+      float *x = l.x, *b = l.b;
+      for (int j = j0; j != j1; ++j) {
+        int first = 1 + ((1 + j + parity) & 1);
+        if (simd != fluid_simd::reference) {
+          fluid_simd::red_black_row(simd, x + j*stride, b + j*stride, stride, n, first, 1, 4);
+        } else {
+          for (int i = j*stride + first, end = j*stride + n; i <= end; i += 2) {
+            x[i] = (b[i] + x[i-1] + x[i+1] + x[i-stride] + x[i+stride]) * 0.25f;
+          }
+        }
+      }
+    }
+
+    // r = b - A x. returns the sum of r squared over the rows.
+    double residual_rows(level &l, int j0, int j1) {
+      int n = l.n, stride = l.stride;
+      const float *x = l.x, *b = l.b;
+      float *r = l.r;
+      double sum = 0;
+      for (int j = j0; j != j1; ++j) {
+        float row_sum = 0;
+        for (int i = j*stride + 1, end = j*stride + n; i <= end; ++i) {
+          float ri = b[i] - (4*x[i] - x[i-1] - x[i+1] - x[i-stride] - x[i+stride]);
+          r[i] = ri;
+          row_sum += ri * ri;
+        }
+        sum += row_sum;
+      }
+      return sum;
+    }
+
+    // coarse rows j0..j1 of c from the fine residual of f. Clears c.x.
+    void restrict_rows(level &f, level &c, int j0, int j1) {
+      int fs = f.stride, cs = c.stride;
+      const float *r = f.r;
+      for (int J = j0; J != j1; ++J) {
+        const float *r0 = r + (2*J-1)*fs, *r1 = r0 + fs;
+        float *b = c.b + J*cs, *x = c.x + J*cs;
+        for (int I = 1; I <= c.n; ++I) {
+          b[I] = r0[2*I-1] + r0[2*I] + r1[2*I-1] + r1[2*I];
+          x[I] = 0;
+        }
+      }
+    }
+
+    // fine rows j0..j1 of f += bilinear interpolation of c.x
+    void prolong_rows(level &f, level &c, int j0, int j1) {
+      int fs = f.stride, cs = c.stride;
+      for (int j = j0; j != j1; ++j) {
+        // fine row 2J-1 is nearer to coarse row J-1, fine row 2J to J+1
+        int J = (j+1) >> 1;
+        const float *c0 = c.x + J*cs;
+        const float *c1 = c0 + (j & 1 ? -cs : cs);
+        float *x = f.x + j*fs;
+        for (int i = 1; i <= f.n; ++i) {
+          int I = (i+1) >> 1;
+          int I1 = i & 1 ? I-1 : I+1;
+          x[i] += 0.5625f*c0[I] + 0.1875f*(c0[I1] + c1[I]) + 0.0625f*c1[I1];
+        }
+      }
+    }
+
+    // ghost cells are copies of their neighbours. prolongation reads the
+    // corners too, so they copy the diagonal neighbour.
+    static void neumann(level &l) {
+      int n = l.n, stride = l.stride;
+      float *x = l.x;
+      for (int i = 1; i <= n; ++i) {
+        x[i*stride] = x[i*stride + 1];
+        x[i*stride + n+1] = x[i*stride + n];
+        x[i] = x[stride + i];
+        x[(n+1)*stride + i] = x[n*stride + i];
+      }
+      x[0] = x[stride + 1];
+      x[n+1] = x[stride + n];
+      x[(n+1)*stride] = x[n*stride + 1];
+      x[(n+1)*stride + n+1] = x[n*stride + n];
+    }
+
+    void smooth(int l) {
+      parity = 0;
+      run_op(op_smooth, l);
+      neumann(levels[l]);
+      parity = 1;
+      run_op(op_smooth, l);
+      neumann(levels[l]);
+    }
+
+    // returns the sum of the squared residual of level l
+    double residual(int l) {
+      neumann(levels[l]);
+      run_op(op_residual, l);
+      double sum = 0;
+      for (int i = 0; i != levels[l].num_bands; ++i) {
+        sum += partial[i];
+      }
+      return sum;
+    }
+
+    void do_cycle(int l) {
+      if (l == num_levels-1) {
+        // a few sweeps per cell across is enough to make the coarse grid
+        // error small compared to the smoothing error of the finer grids.
+        for (int k = 0, sweeps = levels[l].n * 2; k != sweeps; ++k) {
+          smooth(l);
+        }
+        return;
+      }
+
+      for (int k = 0; k != pre_smooth; ++k) {
+        smooth(l);
+      }
+
+      residual(l);
+      run_op(op_restrict, l+1);
+      neumann(levels[l+1]);
+
+      for (int k = 0; k != (int)cycle; ++k) {
+        do_cycle(l+1);
+      }
+
+      neumann(levels[l+1]);
+      run_op(op_prolong, l);
+      neumann(levels[l]);
+
+      for (int k = 0; k != post_smooth; ++k) {
+        smooth(l);
+      }
+    }
+
+    void init_level(level &l, int n, int stride) {
+      l.n = n;
+      l.stride = stride;
+      l.band_rows = (min_band_cells + n - 1) / n;
+      if (l.band_rows * max_bands < n) l.band_rows = (n + max_bands - 1) / max_bands;
+      l.num_bands = (n + l.band_rows - 1) / l.band_rows;
+    }
+
+    // the finest level uses the caller's x and b, so only the residual is stored.
+    // the coarse levels are not padded.
+    void make_levels(int N, int stride) {
+      num_levels = 0;
+      for (int n = N; num_levels != max_levels; n /= 2) {
+        level &l = levels[num_levels++];
+        init_level(l, n, num_levels == 1 ? stride : n+2);
+        int size = l.stride*(n+2);
+        l.storage.resize(num_levels == 1 ? size : size * 3);
+        float *p = l.storage.data();
+        memset(p, 0, l.storage.size() * sizeof(float));
+        l.r = p;
+        l.x = num_levels == 1 ? 0 : p + size;
+        l.b = num_levels == 1 ? 0 : p + size*2;
+        if (n <= min_level_size || (n & 1)) break;
+      }
+    }
+
+  public:
+    fluid_multigrid() {
+      num_levels = 0;
+      cycle = v_cycle;
+      pre_smooth = 2;
+      post_smooth = 2;
+      simd = fluid_simd::reference;
+      workers = 0;
+      kind = op_smooth;
+      cur_level = 0;
+      parity = 0;
+    }
+
+    /// set the fine grid size and the distance between its rows.
+    /// workers may be NULL.
+    void init(int N, int stride, fluid_workers *workers = 0) {
+      this->workers = workers;
+      make_levels(N, stride);
+    }
+
+    void set_simd(fluid_simd::level_t level) {
+      simd = level;
+    }
+
+    /// V cycles (default) or W cycles, which do twice the coarse grid work.
+    void set_cycle(cycle_t value) {
+      cycle = value;
+    }
+
+    cycle_t get_cycle() const {
+      return cycle;
+    }
+
+    /// number of red-black sweeps before and after the coarse grid correction
+    void set_smoothing(int pre, int post) {
+      pre_smooth = pre;
+      post_smooth = post;
+    }
+
+    int get_num_levels() const {
+      return num_levels;
+    }
+
+    /// solve A x = b on the N x N grid given to init(), starting from x.
+    /// The mean of b is removed first (the system only has a solution if b
+    /// sums to zero), so b is modified.
+    /// Stops after max_cycles or when |b - A x| <= tolerance * |b|.
+    /// Returns the number of cycles, sets residual to |b - A x| / |b| and,
+    /// if history is not NULL, appends the residual after every cycle.
+    int solve(float *x, float *b, float tolerance, int max_cycles, float &residual, dynarray<float> *history = 0) {
+      level &l = levels[0];
+      int n = l.n, stride = l.stride;
+      l.x = x;
+      l.b = b;
+
+      double sum = 0;
+      for (int j = 1; j <= n; ++j) {
+        for (int i = j*stride + 1, end = j*stride + n; i <= end; ++i) {
+          sum += b[i];
+        }
+      }
+      float mean = (float)(sum / ((double)n * n));
+      double b_norm2 = 0;
+      for (int j = 1; j <= n; ++j) {
+        for (int i = j*stride + 1, end = j*stride + n; i <= end; ++i) {
+          b[i] -= mean;
+          b_norm2 += (double)b[i] * b[i];
+        }
+      }
+
+      if (b_norm2 == 0) {
+        residual = 0;
+        return 0;
+      }
+
+      int cycles = 0;
+      double r_norm2 = this->residual(0);
+      double limit = (double)tolerance * tolerance * b_norm2;
+      while (cycles != max_cycles && r_norm2 > limit) {
+        do_cycle(0);
+        r_norm2 = this->residual(0);
+        cycles++;
+        if (history) history->push_back((float)sqrt(r_norm2 / b_norm2));
+      }
+
+      residual = (float)sqrt(r_norm2 / b_norm2);
+      return cycles;
+    }
+  };
+}
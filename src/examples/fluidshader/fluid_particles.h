@@ -0,0 +1,307 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2012-2014
+//
+// Modular Framework for OpenGLES2 rendering on multiple platforms.
+//
+// Passive tracer particles carried by the velocity of the fluid solver.
+//
+// The particles are massless: each step moves them through the bilinear
+// velocity of the grid with a second or third order Runge-Kutta step and
+// never feeds anything back. Positions are in cells, (i, j) being the
+// centre of cell (i, j), as the departure points of the advection are.
+//
+// Storage is a structure of arrays of a fixed capacity, split into chunks
+// that the workers update in parallel. The live particles of a chunk are
+// its first alive[c] slots; a particle that dies, by age or by leaving the
+// interior, is swapped with the chunk's last live one, so the dead slots
+// of every chunk form a pool at its end that emit() refills. Nothing is
+// allocated after init().
+//
+
+namespace octet {
+  class fluid_particles {
+  public:
+    enum integrator_t {
+      integrator_rk2,
+      integrator_rk3,
+      num_integrators,
+    };
+
+    enum {
+      // particles a task updates
+      chunk_size = 4096,
+    };
+
+  private:
+    // x, y in cells and age in the solver's time, one slot a particle
+    dynarray<float> x;
+    dynarray<float> y;
+    dynarray<float> age;
+
+    // live particles in each chunk, and where write_points puts them
+    dynarray<int> alive;
+    dynarray<int> offset;
+
+    int capacity;
+    int num_chunks;
+    int num_alive;
+
+    // the chunk emit() tries first, so emission spreads over the pool
+    int emit_chunk;
+
+    float lifetime;
+    integrator_t integrator;
+    unsigned random_state;
+
+    fluid_workers *workers;
+
+    // what the chunk tasks of the current call work on
+    struct step_args {
+      const float *u;
+      const float *v;
+      int N;
+      int stride;
+      float dt;
+      float dt0;
+      float *points;
+      float origin;
+      float step;
+    };
+    step_args cur;
+
+    // a uniform random number in [0, 1)
+    float next_random() {
+      // xorshift32
+      random_state ^= random_state << 13;
+      random_state ^= random_state >> 17;
+      random_state ^= random_state << 5;
+      return (random_state >> 8) * (1.0f / 16777216.0f);
+    }
+
+    // the velocity at (px, py) in cells a unit of time, clamped to the
+    // centres of the outer cells as the advection's departure points are
+    void sample(float px, float py, float &vx, float &vy) const {
+      float hi = cur.N + 0.5f;
+      if (px < 0.5f) px = 0.5f;
+      if (px > hi) px = hi;
+      if (py < 0.5f) py = 0.5f;
+      if (py > hi) py = hi;
+      int i0 = (int)px, j0 = (int)py;
+      float s1 = px - i0, t1 = py - j0;
+      float s0 = 1 - s1, t0 = 1 - t1;
+      int idx = i0 + j0 * cur.stride;
+      int stride = cur.stride;
+      vx = s0*(t0*cur.u[idx]+t1*cur.u[idx+stride]) + s1*(t0*cur.u[idx+1]+t1*cur.u[idx+stride+1]);
+      vy = s0*(t0*cur.v[idx]+t1*cur.v[idx+stride]) + s1*(t0*cur.v[idx+1]+t1*cur.v[idx+stride+1]);
+    }
+
+    // one Runge-Kutta step of h = dt*N cells a unit of velocity
+    void integrate(float &px, float &py) const {
+      float h = cur.dt0;
+      float k1x, k1y, k2x, k2y;
+      sample(px, py, k1x, k1y);
+      sample(px + 0.5f*h*k1x, py + 0.5f*h*k1y, k2x, k2y);
+      if (integrator == integrator_rk2) {
+        // midpoint
+        px += h*k2x;
+        py += h*k2y;
+      } else {
+        // Kutta's third order method
+        float k3x, k3y;
+        sample(px + h*(2*k2x - k1x), py + h*(2*k2y - k1y), k3x, k3y);
+        px += h*(1.0f/6)*(k1x + 4*k2x + k3x);
+        py += h*(1.0f/6)*(k1y + 4*k2y + k3y);
+      }
+    }
+
+    void step_chunk(int c) {
+      int first = c * chunk_size;
+      float *px = &x[first], *py = &y[first], *pa = &age[first];
+      float hi = cur.N + 0.5f;
+      int n = alive[c];
+      for (int k = 0; k < n; ) {
+        float sx = px[k], sy = py[k];
+        integrate(sx, sy);
+        float a = pa[k] + cur.dt;
+        if (a >= lifetime || !(sx >= 0.5f && sx <= hi && sy >= 0.5f && sy <= hi)) {
+          // recycle: the last live particle takes this slot
+          --n;
+          px[k] = px[n]; py[k] = py[n]; pa[k] = pa[n];
+        } else {
+          px[k] = sx; py[k] = sy; pa[k] = a;
+          ++k;
+        }
+      }
+      alive[c] = n;
+    }
+
+    void points_chunk(int c) {
+      int first = c * chunk_size;
+      const float *px = &x[first], *py = &y[first];
+      float *dst = cur.points + offset[c] * 2;
+      float origin = cur.origin, step = cur.step;
+      for (int k = 0, n = alive[c]; k != n; ++k) {
+        dst[k*2+0] = origin + px[k] * step;
+        dst[k*2+1] = origin + py[k] * step;
+      }
+    }
+
+    static void step_task(void *context, int index) {
+      ((fluid_particles*)context)->step_chunk(index);
+    }
+
+    static void points_task(void *context, int index) {
+      ((fluid_particles*)context)->points_chunk(index);
+    }
+
+    // add a particle at (px, py) if there is a free slot
+    bool add(float px, float py) {
+      for (int tries = 0; tries != num_chunks; ++tries) {
+        int c = emit_chunk;
+        if (alive[c] != chunk_size) {
+          int slot = c * chunk_size + alive[c]++;
+          x[slot] = px;
+          y[slot] = py;
+          age[slot] = 0;
+          ++num_alive;
+          return true;
+        }
+        emit_chunk = c + 1 == num_chunks ? 0 : c + 1;
+      }
+      return false;
+    }
+
+  public:
+    fluid_particles() {
+      capacity = num_chunks = num_alive = emit_chunk = 0;
+      lifetime = 20.0f;
+      integrator = integrator_rk2;
+      random_state = 0x12345678;
+      workers = 0;
+      memset(&cur, 0, sizeof(cur));
+    }
+
+    /// make room for max_particles, rounded up to whole chunks, that live
+    /// for lifetime units of the solver's time. workers may be NULL.
+    void init(fluid_workers *workers, int max_particles, float lifetime = 20.0f) {
+      this->workers = workers;
+      this->lifetime = lifetime;
+      num_chunks = (max_particles + chunk_size - 1) / chunk_size;
+      if (num_chunks < 1) num_chunks = 1;
+      capacity = num_chunks * chunk_size;
+      x.resize(capacity);
+      y.resize(capacity);
+      age.resize(capacity);
+      alive.resize(num_chunks);
+      offset.resize(num_chunks);
+      clear();
+    }
+
+    /// kill every particle
+    void clear() {
+      for (int c = 0; c != num_chunks; ++c) {
+        alive[c] = 0;
+      }
+      num_alive = 0;
+      emit_chunk = 0;
+    }
+
+    /// emit up to count particles spread over the square of half width
+    /// radius around (cx, cy), in cells. Returns how many found a slot.
+    int emit(float cx, float cy, float radius, int count) {
+      int emitted = 0;
+      while (emitted != count && add(cx + (next_random()*2-1)*radius, cy + (next_random()*2-1)*radius)) {
+        ++emitted;
+      }
+      return emitted;
+    }
+
+    /// emit up to count particles anywhere in the N x N interior
+    int emit_uniform(int N, int count) {
+      int emitted = 0;
+      while (emitted != count && add(0.5f + next_random()*N, 0.5f + next_random()*N)) {
+        ++emitted;
+      }
+      return emitted;
+    }
+
+    /// move the particles through velocity (u, v) of grid for dt, as the
+    /// solver's step does its fields, and recycle the ones that die
+    void step(const fluid_grid &grid, const float *u, const float *v, float dt) {
+      cur.u = u;
+      cur.v = v;
+      cur.N = grid.get_N();
+      cur.stride = grid.get_stride();
+      cur.dt = dt;
+      cur.dt0 = dt * cur.N;
+      if (workers) {
+        workers->run(step_task, (void*)this, num_chunks);
+      } else {
+        for (int c = 0; c != num_chunks; ++c) step_chunk(c);
+      }
+      num_alive = 0;
+      for (int c = 0; c != num_chunks; ++c) {
+        num_alive += alive[c];
+      }
+    }
+
+    /// write the live particles to dst as pairs of floats, cell (i, j)
+    /// being at origin + step * (i, j), for drawing as GL_POINTS.
+    /// dst must hold get_capacity() pairs. Returns the number written.
+    int write_points(float *dst, float origin, float step) {
+      int total = 0;
+      for (int c = 0; c != num_chunks; ++c) {
+        offset[c] = total;
+        total += alive[c];
+      }
+      cur.points = dst;
+      cur.origin = origin;
+      cur.step = step;
+      if (workers) {
+        workers->run(points_task, (void*)this, num_chunks);
+      } else {
+        for (int c = 0; c != num_chunks; ++c) points_chunk(c);
+      }
+      return total;
+    }
+
+    void set_integrator(integrator_t value) {
+      integrator = value;
+    }
+
+    integrator_t get_integrator() const {
+      return integrator;
+    }
+
+    static const char *get_integrator_name(int value) {
+      static const char *names[] = { "rk2", "rk3" };
+      return names[value];
+    }
+
+    /// the state of the random numbers of emit(), for checkpoints
+    unsigned get_random_state() const {
+      return random_state;
+    }
+
+    void set_random_state(unsigned value) {
+      random_state = value ? value : 0x12345678;
+    }
+
+    void set_lifetime(float value) {
+      lifetime = value;
+    }
+
+    float get_lifetime() const {
+      return lifetime;
+    }
+
+    int get_capacity() const {
+      return capacity;
+    }
+
+    int get_num_alive() const {
+      return num_alive;
+    }
+  };
+}
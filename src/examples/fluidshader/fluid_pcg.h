@@ -0,0 +1,317 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2012-2014
+//
+// Modular Framework for OpenGLES2 rendering on multiple platforms.
+//
+// Preconditioned conjugate gradient solver for the pressure equation.
+//
+// Solves the same system as fluid_multigrid without storing the matrix:
+// A x is the five point stencil with the ghost cells copied from their
+// neighbours, so a cell next to the wall has one less neighbour.
+//
+// The Jacobi preconditioner divides by the diagonal and runs on the worker
+// threads. MIC(0) (modified incomplete Cholesky, see Bridson's "Fluid
+// Simulation for Computer Graphics") converges in far fewer iterations but
+// its triangular solves are serial.
+//
+
+namespace octet {
+  class fluid_pcg {
+  public:
+    enum preconditioner_t {
+      jacobi,
+      mic0,
+    };
+
+  private:
+    // rows are processed in bands of at least this many cells
+    enum { min_band_cells = 4096 };
+
+    // as in fluid_multigrid, the bands only depend on the grid size
+    enum { max_bands = 256 };
+
+    enum op_kind {
+      op_apply,
+      op_update,
+      op_direction,
+    };
+
+    int N;
+    int stride;
+    int band_rows;
+    int num_bands;
+    preconditioner_t preconditioner;
+    fluid_workers *workers;
+
+    float *x;
+    float *b;
+    dynarray<float> storage;
+    float *r, *z, *d, *q;
+
+    // MIC(0) scale factors, zero in the ghost cells
+    dynarray<float> precon;
+
+    // the op currently being run
+    op_kind kind;
+    float alpha;
+    float beta;
+    double partial[max_bands][2];
+
+    static void run_band(void *context, int index) {
+      fluid_pcg *pcg = (fluid_pcg*)context;
+      int j0 = 1 + index * pcg->band_rows;
+      int j1 = j0 + pcg->band_rows > pcg->N+1 ? pcg->N+1 : j0 + pcg->band_rows;
+      pcg->do_band(index, j0, j1);
+    }
+
+    void do_band(int index, int j0, int j1) {
+      switch (kind) {
+        case op_apply: partial[index][0] = apply_rows(j0, j1); break;
+        case op_update: update_rows(j0, j1, partial[index]); break;
+        case op_direction: direction_rows(j0, j1); break;
+      }
+    }
+
+    void run_op(op_kind kind) {
+      this->kind = kind;
+      if (workers && num_bands > 1) {
+        workers->run(run_band, (void*)this, num_bands);
+      } else {
+        for (int i = 0; i != num_bands; ++i) {
+          run_band((void*)this, i);
+        }
+      }
+    }
+
+    // q = A d. returns the sum of d.q over the rows.
+    double apply_rows(int j0, int j1) {
+      double sum = 0;
+      for (int j = j0; j != j1; ++j) {
+        float row_sum = 0;
+        for (int i = j*stride + 1, end = j*stride + N; i <= end; ++i) {
+          float qi = 4*d[i] - d[i-1] - d[i+1] - d[i-stride] - d[i+stride];
+          q[i] = qi;
+          row_sum += d[i] * qi;
+        }
+        sum += row_sum;
+      }
+      return sum;
+    }
+
+    // x += alpha d, r -= alpha q and, for Jacobi, z = r / diagonal.
+    // sums[0] gets r.r and sums[1] gets r.z.
+    void update_rows(int j0, int j1, double *sums) {
+      double rr = 0, rz = 0;
+      for (int j = j0; j != j1; ++j) {
+        float row_rr = 0, row_rz = 0;
+        float edge_j = j == 1 || j == N ? 1.0f : 0.0f;
+        for (int i = j*stride + 1, end = j*stride + N; i <= end; ++i) {
+          x[i] += alpha * d[i];
+          float ri = r[i] - alpha * q[i];
+          r[i] = ri;
+          row_rr += ri * ri;
+          if (preconditioner == jacobi) {
+            float edge_i = i == j*stride + 1 || i == end ? 1.0f : 0.0f;
+            float zi = ri / (4 - edge_i - edge_j);
+            z[i] = zi;
+            row_rz += ri * zi;
+          }
+        }
+        rr += row_rr;
+        rz += row_rz;
+      }
+      sums[0] = rr;
+      sums[1] = rz;
+    }
+
+    // d = z + beta d
+    void direction_rows(int j0, int j1) {
+      for (int j = j0; j != j1; ++j) {
+        for (int i = j*stride + 1, end = j*stride + N; i <= end; ++i) {
+          d[i] = z[i] + beta * d[i];
+        }
+      }
+    }
+
+    // ghost cells of d are copies of their neighbours
+    void neumann(float *v) {
+      for (int i = 1; i <= N; ++i) {
+        v[i*stride] = v[i*stride + 1];
+        v[i*stride + N+1] = v[i*stride + N];
+        v[i] = v[stride + i];
+        v[(N+1)*stride + i] = v[N*stride + i];
+      }
+    }
+
+    // the number of neighbours of a cell
+    float diagonal(int i, int j) const {
+      return 4.0f - (i == 1) - (i == N) - (j == 1) - (j == N);
+    }
+
+    void make_precon() {
+      const float tau = 0.97f, sigma = 0.25f;
+      precon.resize((N+2) * stride);
+      float *e = precon.data();
+      memset(e, 0, precon.size() * sizeof(float));
+      for (int j = 1; j <= N; ++j) {
+        for (int i = 1; i <= N; ++i) {
+          // the off diagonals are -1, or 0 where the neighbour is a wall
+          float ax = i > 1 ? 1.0f : 0.0f, ay = j > 1 ? 1.0f : 0.0f;
+          float pl = e[j*stride + i-1], pd = e[(j-1)*stride + i];
+          float left_up = j < N ? 1.0f : 0.0f, down_right = i < N ? 1.0f : 0.0f;
+          float diag = diagonal(i, j);
+          float f = diag - ax*pl*ax*pl - ay*pd*ay*pd
+            - tau * (ax*left_up*pl*pl + ay*down_right*pd*pd);
+          if (f < sigma * diag) f = diag;
+          e[j*stride + i] = 1.0f / sqrtf(f);
+        }
+      }
+    }
+
+    // z = M^-1 r for MIC(0). returns r.z
+    double apply_mic0() {
+      const float *e = precon.data();
+      // solve L q = r, L is lower triangular
+      for (int j = 1; j <= N; ++j) {
+        for (int i = j*stride + 1, end = j*stride + N; i <= end; ++i) {
+          q[i] = (r[i] + e[i-1]*q[i-1] + e[i-stride]*q[i-stride]) * e[i];
+        }
+      }
+      // solve L^T z = q
+      double rz = 0;
+      for (int j = N; j >= 1; --j) {
+        for (int i = j*stride + N, begin = j*stride + 1; i >= begin; --i) {
+          float right = i != j*stride + N ? z[i+1] : 0;
+          float up = j != N ? z[i+stride] : 0;
+          float zi = (q[i] + e[i]*(right + up)) * e[i];
+          z[i] = zi;
+          rz += (double)r[i] * zi;
+        }
+      }
+      return rz;
+    }
+
+    // floats from cell (0,0) to cell (N+1,N+1)
+    int field_size() const {
+      return (N+1)*stride + N+2;
+    }
+
+    double sum_partial(int k) const {
+      double sum = 0;
+      for (int i = 0; i != num_bands; ++i) {
+        sum += partial[i][k];
+      }
+      return sum;
+    }
+
+  public:
+    fluid_pcg() {
+      N = stride = 0;
+      band_rows = num_bands = 0;
+      preconditioner = mic0;
+      workers = 0;
+      x = b = r = z = d = q = 0;
+      kind = op_apply;
+      alpha = beta = 0;
+    }
+
+    /// set the grid size and the distance between rows. workers may be NULL.
+    void init(int N, int stride, fluid_workers *workers = 0) {
+      this->N = N;
+      this->stride = stride;
+      this->workers = workers;
+      band_rows = (min_band_cells + N - 1) / N;
+      if (band_rows * max_bands < N) band_rows = (N + max_bands - 1) / max_bands;
+      num_bands = (N + band_rows - 1) / band_rows;
+
+      int size = (N+2)*stride;
+      storage.resize(size * 4);
+      memset(storage.data(), 0, storage.size() * sizeof(float));
+      r = storage.data();
+      z = r + size;
+      d = z + size;
+      q = d + size;
+      make_precon();
+    }
+
+    void set_preconditioner(preconditioner_t value) {
+      preconditioner = value;
+    }
+
+    preconditioner_t get_preconditioner() const {
+      return preconditioner;
+    }
+
+    /// solve A x = b, starting from x. As with fluid_multigrid the mean of b
+    /// is removed first, so b is modified.
+    /// Stops after max_iterations or when |b - A x| <= tolerance * |b|.
+    /// Returns the number of iterations, sets residual to |b - A x| / |b|
+    /// and, if history is not NULL, appends the residual of every iteration.
+    int solve(float *x, float *b, float tolerance, int max_iterations, float &residual, dynarray<float> *history = 0) {
+      this->x = x;
+      this->b = b;
+
+      double sum = 0;
+      for (int j = 1; j <= N; ++j) {
+        for (int i = j*stride + 1, end = j*stride + N; i <= end; ++i) {
+          sum += b[i];
+        }
+      }
+      float mean = (float)(sum / ((double)N * N));
+      double b_norm2 = 0;
+      for (int j = 1; j <= N; ++j) {
+        for (int i = j*stride + 1, end = j*stride + N; i <= end; ++i) {
+          b[i] -= mean;
+          b_norm2 += (double)b[i] * b[i];
+        }
+      }
+
+      if (b_norm2 == 0) {
+        residual = 0;
+        return 0;
+      }
+
+      // r = b - A x, using d as scratch for A x
+      memcpy(d, x, field_size() * sizeof(float));
+      neumann(d);
+      run_op(op_apply);
+      for (int j = 1; j <= N; ++j) {
+        for (int i = j*stride + 1, end = j*stride + N; i <= end; ++i) {
+          r[i] = b[i] - q[i];
+        }
+      }
+
+      // the first update with alpha = 0 just computes r.r and the Jacobi z
+      memset(d, 0, field_size() * sizeof(float));
+      alpha = 0;
+      run_op(op_update);
+      double rr = sum_partial(0);
+      double rz = preconditioner == mic0 ? apply_mic0() : sum_partial(1);
+      double limit = (double)tolerance * tolerance * b_norm2;
+
+      beta = 0;
+      run_op(op_direction);
+
+      int iterations = 0;
+      while (iterations != max_iterations && rr > limit) {
+        neumann(d);
+        run_op(op_apply);
+        double dq = sum_partial(0);
+        if (dq <= 0) break;
+        alpha = (float)(rz / dq);
+        run_op(op_update);
+        rr = sum_partial(0);
+        double rz_new = preconditioner == mic0 ? apply_mic0() : sum_partial(1);
+        beta = (float)(rz_new / rz);
+        rz = rz_new;
+        run_op(op_direction);
+        iterations++;
+        if (history) history->push_back((float)sqrt(rr / b_norm2));
+      }
+
+      residual = (float)sqrt(rr / b_norm2);
+      return iterations;
+    }
+  };
+}
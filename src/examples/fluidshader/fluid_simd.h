@@ -0,0 +1,393 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2012-2014
+//
+// Modular Framework for OpenGLES2 rendering on multiple platforms.
+//
+// SIMD row kernels for the CPU fluid solver.
+//
+// Each kernel works on one row of the grid and is written once against a
+// "lanes" class that wraps the intrinsics for SSE2, AVX2 or NEON.
+// fluid_simd picks a set at runtime. The reference level is not handled
+// here: fluid_solver keeps the original scalar loops for that.
+//
+
+#if OCTET_SSE || defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+  #define OCTET_FLUID_SSE2 1
+  #include <emmintrin.h>
+#endif
+
+#if defined(__AVX2__) || (defined(_MSC_VER) && _MSC_VER >= 1700)
+  #define OCTET_FLUID_AVX2 1
+  #include <immintrin.h>
+#endif
+
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+  #define OCTET_FLUID_NEON 1
+  #include <arm_neon.h>
+#endif
+
+#if defined(_MSC_VER) && (defined(_M_IX86) || defined(_M_X64))
+  #include <intrin.h>
+#elif defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+  #include <cpuid.h>
+#endif
+
+namespace octet {
+  #if OCTET_FLUID_SSE2
+    struct fluid_lanes_sse2 {
+      enum { width = 4 };
+      typedef __m128 vf;
+
+      static vf load(const float *p) { return _mm_loadu_ps(p); }
+      static void store(float *p, vf a) { _mm_storeu_ps(p, a); }
+      static vf set1(float f) { return _mm_set1_ps(f); }
+      static vf iota() { return _mm_setr_ps(0, 1, 2, 3); }
+      static vf add(vf a, vf b) { return _mm_add_ps(a, b); }
+      static vf sub(vf a, vf b) { return _mm_sub_ps(a, b); }
+      static vf mul(vf a, vf b) { return _mm_mul_ps(a, b); }
+      static vf div(vf a, vf b) { return _mm_div_ps(a, b); }
+      static vf min(vf a, vf b) { return _mm_min_ps(a, b); }
+      static vf max(vf a, vf b) { return _mm_max_ps(a, b); }
+
+      // round towards zero (our values are positive, so this is floor)
+      static vf trunc(vf a) { return _mm_cvtepi32_ps(_mm_cvttps_epi32(a)); }
+
+      // { prev[3], cur[0], cur[1], cur[2] }
+      static vf shift_left(vf prev, vf cur) {
+        __m128 t = _mm_shuffle_ps(prev, cur, _MM_SHUFFLE(0, 0, 3, 3));
+        return _mm_shuffle_ps(t, cur, _MM_SHUFFLE(2, 1, 2, 0));
+      }
+
+      // { cur[1], cur[2], cur[3], next[0] }
+      static vf shift_right(vf cur, vf next) {
+        __m128 t = _mm_shuffle_ps(cur, next, _MM_SHUFFLE(0, 0, 3, 3));
+        return _mm_shuffle_ps(cur, t, _MM_SHUFFLE(2, 0, 2, 1));
+      }
+
+      // odd lanes from a if odd, else even lanes from a; the rest from b
+      static vf select_alternate(vf a, vf b, bool odd) {
+        __m128 mask = _mm_castsi128_ps(odd ? _mm_setr_epi32(0, -1, 0, -1) : _mm_setr_epi32(-1, 0, -1, 0));
+        return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b));
+      }
+
+      // fetch the four bilinear corners at base[index], base[index+1], base[index+stride], ...
+      static void gather4(const float *base, int stride, vf index, vf &c00, vf &c10, vf &c01, vf &c11) {
+        int idx[4];
+        _mm_storeu_si128((__m128i*)idx, _mm_cvttps_epi32(index));
+        const float *p0 = base + idx[0], *p1 = base + idx[1], *p2 = base + idx[2], *p3 = base + idx[3];
+        c00 = _mm_setr_ps(p0[0], p1[0], p2[0], p3[0]);
+        c10 = _mm_setr_ps(p0[1], p1[1], p2[1], p3[1]);
+        c01 = _mm_setr_ps(p0[stride], p1[stride], p2[stride], p3[stride]);
+        c11 = _mm_setr_ps(p0[stride+1], p1[stride+1], p2[stride+1], p3[stride+1]);
+      }
+    };
+  #endif
+
+  #if OCTET_FLUID_AVX2
+    struct fluid_lanes_avx2 {
+      enum { width = 8 };
+      typedef __m256 vf;
+
+      static vf load(const float *p) { return _mm256_loadu_ps(p); }
+      static void store(float *p, vf a) { _mm256_storeu_ps(p, a); }
+      static vf set1(float f) { return _mm256_set1_ps(f); }
+      static vf iota() { return _mm256_setr_ps(0, 1, 2, 3, 4, 5, 6, 7); }
+      static vf add(vf a, vf b) { return _mm256_add_ps(a, b); }
+      static vf sub(vf a, vf b) { return _mm256_sub_ps(a, b); }
+      static vf mul(vf a, vf b) { return _mm256_mul_ps(a, b); }
+      static vf div(vf a, vf b) { return _mm256_div_ps(a, b); }
+      static vf min(vf a, vf b) { return _mm256_min_ps(a, b); }
+      static vf max(vf a, vf b) { return _mm256_max_ps(a, b); }
+      static vf trunc(vf a) { return _mm256_cvtepi32_ps(_mm256_cvttps_epi32(a)); }
+
+      // alignr works within each 128 bit half, so line the halves up first
+      static vf shift_left(vf prev, vf cur) {
+        __m256 t = _mm256_permute2f128_ps(prev, cur, 0x21);
+        return _mm256_castsi256_ps(_mm256_alignr_epi8(_mm256_castps_si256(cur), _mm256_castps_si256(t), 12));
+      }
+
+      static vf shift_right(vf cur, vf next) {
+        __m256 t = _mm256_permute2f128_ps(cur, next, 0x21);
+        return _mm256_castsi256_ps(_mm256_alignr_epi8(_mm256_castps_si256(t), _mm256_castps_si256(cur), 4));
+      }
+
+      static vf select_alternate(vf a, vf b, bool odd) {
+        return odd ? _mm256_blend_ps(b, a, 0xaa) : _mm256_blend_ps(b, a, 0x55);
+      }
+
+      static void gather4(const float *base, int stride, vf index, vf &c00, vf &c10, vf &c01, vf &c11) {
+        __m256i idx = _mm256_cvttps_epi32(index);
+        c00 = _mm256_i32gather_ps(base, idx, 4);
+        c10 = _mm256_i32gather_ps(base + 1, idx, 4);
+        c01 = _mm256_i32gather_ps(base + stride, idx, 4);
+        c11 = _mm256_i32gather_ps(base + stride + 1, idx, 4);
+      }
+    };
+  #endif
+
+  #if OCTET_FLUID_NEON
+    struct fluid_lanes_neon {
+      enum { width = 4 };
+      typedef float32x4_t vf;
+
+      static vf load(const float *p) { return vld1q_f32(p); }
+      static void store(float *p, vf a) { vst1q_f32(p, a); }
+      static vf set1(float f) { return vdupq_n_f32(f); }
+      static vf iota() { static const float v[4] = { 0, 1, 2, 3 }; return vld1q_f32(v); }
+      static vf add(vf a, vf b) { return vaddq_f32(a, b); }
+      static vf sub(vf a, vf b) { return vsubq_f32(a, b); }
+      static vf mul(vf a, vf b) { return vmulq_f32(a, b); }
+      static vf div(vf a, vf b) {
+        // two newton steps on the estimate; not exact, unlike sse and avx
+        float32x4_t r = vrecpeq_f32(b);
+        r = vmulq_f32(r, vrecpsq_f32(b, r));
+        r = vmulq_f32(r, vrecpsq_f32(b, r));
+        return vmulq_f32(a, r);
+      }
+      static vf min(vf a, vf b) { return vminq_f32(a, b); }
+      static vf max(vf a, vf b) { return vmaxq_f32(a, b); }
+      static vf trunc(vf a) { return vcvtq_f32_s32(vcvtq_s32_f32(a)); }
+      static vf shift_left(vf prev, vf cur) { return vextq_f32(prev, cur, 3); }
+      static vf shift_right(vf cur, vf next) { return vextq_f32(cur, next, 1); }
+
+      static vf select_alternate(vf a, vf b, bool odd) {
+        static const uint32_t masks[2][4] = { { ~0u, 0, ~0u, 0 }, { 0, ~0u, 0, ~0u } };
+        return vbslq_f32(vld1q_u32(masks[odd]), a, b);
+      }
+
+      static void gather4(const float *base, int stride, vf index, vf &c00, vf &c10, vf &c01, vf &c11) {
+        int32_t idx[4];
+        vst1q_s32(idx, vcvtq_s32_f32(index));
+        float t[4][4];
+        for (int k = 0; k != 4; ++k) {
+          const float *p = base + idx[k];
+          t[0][k] = p[0]; t[1][k] = p[1]; t[2][k] = p[stride]; t[3][k] = p[stride+1];
+        }
+        c00 = vld1q_f32(t[0]); c10 = vld1q_f32(t[1]); c01 = vld1q_f32(t[2]); c11 = vld1q_f32(t[3]);
+      }
+    };
+  #endif
+
+  /// Row kernels written once for any lanes class.
+  /// Row pointers point at cell 0 of the row; stride is the distance between rows.
+  template <class lanes> class fluid_kernels {
+    typedef typename lanes::vf vf;
+    enum { W = lanes::width };
+
+  public:
+    /// relax cells first, first+2, ... <= n of a row.
+    /// Computes whole vectors and keeps only the lanes of the right colour.
+    /// The left and right neighbours are shifted in from the vectors either
+    /// side rather than loaded from x-1 and x+1: those loads would overlap
+    /// the store of the previous vector and stall.
+    static void red_black_row(float *x, const float *x0, int stride, int n, int first, float a, float c) {
+      float inv_c = 1.0f / c;
+      vf va = lanes::set1(a), vinv_c = lanes::set1(inv_c);
+      // lane k is cell 1+k, so the colour we want is in the odd lanes when first is even
+      bool odd = (first & 1) == 0;
+      int i = 1;
+      vf prev = lanes::set1(x[0]);
+      vf cur = lanes::load(x+1);
+      for (; i + W - 1 <= n; i += W) {
+        // the first cell of the next vector is at most the ghost cell n+1
+        vf next = lanes::load(x+i+W);
+        vf sum = lanes::add(lanes::add(lanes::add(lanes::shift_left(prev, cur), lanes::shift_right(cur, next)), lanes::load(x+i-stride)), lanes::load(x+i+stride));
+        vf r = lanes::mul(lanes::add(lanes::load(x0+i), lanes::mul(va, sum)), vinv_c);
+        lanes::store(x+i, lanes::select_alternate(r, cur, odd));
+        prev = cur;
+        cur = next;
+      }
+      if ((i - first) & 1) i++;
+      for (; i <= n; i += 2) {
+        x[i] = (x0[i] + a*(x[i-1]+x[i+1]+x[i-stride]+x[i+stride]))*inv_c;
+      }
+    }
+
+    /// semi-lagrangian advection of one row. d0 is the whole source grid.
+    static void advect_row(float *d, const float *d0, const float *u, const float *v, int stride, int n, int j, float dt0) {
+      vf lo = lanes::set1(0.5f), hi = lanes::set1(n+0.5f), one = lanes::set1(1.0f);
+      vf vdt0 = lanes::set1(dt0), vj = lanes::set1((float)j), vstride = lanes::set1((float)stride);
+      vf vi = lanes::add(lanes::iota(), one);
+      vf step = lanes::set1((float)W);
+      int i = 1;
+      for (; i + W - 1 <= n; i += W, vi = lanes::add(vi, step)) {
+        vf x = lanes::sub(vi, lanes::mul(vdt0, lanes::load(u+i)));
+        vf y = lanes::sub(vj, lanes::mul(vdt0, lanes::load(v+i)));
+        x = lanes::min(lanes::max(x, lo), hi);
+        y = lanes::min(lanes::max(y, lo), hi);
+        vf i0 = lanes::trunc(x), j0 = lanes::trunc(y);
+        vf s1 = lanes::sub(x, i0), s0 = lanes::sub(one, s1);
+        vf t1 = lanes::sub(y, j0), t0 = lanes::sub(one, t1);
+        // indices are exact in float up to 2^24 cells
+        vf c00, c10, c01, c11;
+        lanes::gather4(d0, stride, lanes::add(i0, lanes::mul(j0, vstride)), c00, c10, c01, c11);
+        vf left = lanes::add(lanes::mul(t0, c00), lanes::mul(t1, c01));
+        vf right = lanes::add(lanes::mul(t0, c10), lanes::mul(t1, c11));
+        lanes::store(d+i, lanes::add(lanes::mul(s0, left), lanes::mul(s1, right)));
+      }
+      for (; i <= n; ++i) {
+        float x = i-dt0*u[i], y = j-dt0*v[i];
+        if (x<0.5f) x=0.5f;
+        if (x>n+0.5f) x=n+0.5f;
+        if (y<0.5f) y=0.5f;
+        if (y>n+0.5f) y=n+0.5f;
+        int i0 = (int)x, j0 = (int)y;
+        float s1 = x-i0, s0 = 1-s1, t1 = y-j0, t0 = 1-t1;
+        const float *p = d0 + i0 + stride*j0;
+        d[i] = s0*(t0*p[0]+t1*p[stride]) + s1*(t0*p[1]+t1*p[stride+1]);
+      }
+    }
+
+    /// div = -0.5 * (du + dv) / n, p = 0.
+    /// Same order of operations as the scalar code, so the result is identical.
+    static void divergence_row(float *div, float *p, const float *u, const float *v, int stride, int n) {
+      vf half = lanes::set1(-0.5f), vn = lanes::set1((float)n), zero = lanes::set1(0);
+      int i = 1;
+      for (; i + W - 1 <= n; i += W) {
+        vf sum = lanes::sub(lanes::add(lanes::sub(lanes::load(u+i+1), lanes::load(u+i-1)), lanes::load(v+i+stride)), lanes::load(v+i-stride));
+        lanes::store(div+i, lanes::div(lanes::mul(half, sum), vn));
+        lanes::store(p+i, zero);
+      }
+      for (; i <= n; ++i) {
+        div[i] = -0.5f*(u[i+1]-u[i-1]+v[i+stride]-v[i-stride])/n;
+        p[i] = 0;
+      }
+    }
+
+    /// u -= scale * dp/dx, v -= scale * dp/dy
+    static void gradient_row(float *u, float *v, const float *p, int stride, int n, float scale) {
+      vf vscale = lanes::set1(scale);
+      int i = 1;
+      for (; i + W - 1 <= n; i += W) {
+        vf dx = lanes::sub(lanes::load(p+i+1), lanes::load(p+i-1));
+        vf dy = lanes::sub(lanes::load(p+i+stride), lanes::load(p+i-stride));
+        lanes::store(u+i, lanes::sub(lanes::load(u+i), lanes::mul(vscale, dx)));
+        lanes::store(v+i, lanes::sub(lanes::load(v+i), lanes::mul(vscale, dy)));
+      }
+      for (; i <= n; ++i) {
+        u[i] -= scale*(p[i+1]-p[i-1]);
+        v[i] -= scale*(p[i+stride]-p[i-stride]);
+      }
+    }
+  };
+
+  /// Runtime selection of the kernel set.
+  class fluid_simd {
+    static void cpuid(int info[4], int leaf) {
+      info[0] = info[1] = info[2] = info[3] = 0;
+      #if defined(_MSC_VER) && (defined(_M_IX86) || defined(_M_X64))
+        __cpuidex(info, leaf, 0);
+      #elif defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+        unsigned a, b, c, d;
+        if (__get_cpuid_max(0, 0) >= (unsigned)leaf) {
+          __cpuid_count(leaf, 0, a, b, c, d);
+          info[0] = (int)a; info[1] = (int)b; info[2] = (int)c; info[3] = (int)d;
+        }
+      #endif
+    }
+
+    // true if the OS saves the ymm registers on a context switch
+    static bool os_has_avx() {
+      int info[4];
+      cpuid(info, 1);
+      if (!(info[2] & (1 << 27)) || !(info[2] & (1 << 28))) return false;
+      #if defined(_MSC_VER) && (defined(_M_IX86) || defined(_M_X64))
+        return (_xgetbv(0) & 6) == 6;
+      #elif defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+        unsigned lo, hi;
+        __asm__ __volatile__("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+        return (lo & 6) == 6;
+      #else
+        return false;
+      #endif
+    }
+
+  public:
+    enum level_t {
+      reference,  // original scalar code, bit for bit
+      sse2,
+      avx2,
+      neon,
+    };
+
+    static const char *get_name(level_t level) {
+      switch (level) {
+        case sse2: return "sse2";
+        case avx2: return "avx2";
+        case neon: return "neon";
+        default: return "reference";
+      }
+    }
+
+    /// true if the kernels were compiled in and the cpu can run them
+    static bool is_supported(level_t level) {
+      int info[4];
+      switch (level) {
+        case reference: return true;
+        #if OCTET_FLUID_SSE2
+          case sse2: cpuid(info, 1); return (info[3] & (1 << 26)) != 0;
+        #endif
+        #if OCTET_FLUID_AVX2
+          case avx2: cpuid(info, 7); return os_has_avx() && (info[1] & (1 << 5)) != 0;
+        #endif
+        #if OCTET_FLUID_NEON
+          case neon: return true;
+        #endif
+        default: return false;
+      }
+    }
+
+    /// the fastest level this machine supports
+    static level_t detect() {
+      if (is_supported(avx2)) return avx2;
+      if (is_supported(sse2)) return sse2;
+      if (is_supported(neon)) return neon;
+      return reference;
+    }
+
+    #if OCTET_FLUID_SSE2
+      #define OCTET_FLUID_SSE2_CASE(call) case sse2: fluid_kernels<fluid_lanes_sse2>::call; break;
+    #else
+      #define OCTET_FLUID_SSE2_CASE(call)
+    #endif
+    #if OCTET_FLUID_AVX2
+      #define OCTET_FLUID_AVX2_CASE(call) case avx2: fluid_kernels<fluid_lanes_avx2>::call; break;
+    #else
+      #define OCTET_FLUID_AVX2_CASE(call)
+    #endif
+    #if OCTET_FLUID_NEON
+      #define OCTET_FLUID_NEON_CASE(call) case neon: fluid_kernels<fluid_lanes_neon>::call; break;
+    #else
+      #define OCTET_FLUID_NEON_CASE(call)
+    #endif
+    #define OCTET_FLUID_DISPATCH(level, call) \
+      switch (level) { \
+        OCTET_FLUID_SSE2_CASE(call) \
+        OCTET_FLUID_AVX2_CASE(call) \
+        OCTET_FLUID_NEON_CASE(call) \
+        default: assert(0 && "fluid_simd: level not supported"); \
+      }
+
+    static void red_black_row(level_t level, float *x, const float *x0, int stride, int n, int first, float a, float c) {
+      OCTET_FLUID_DISPATCH(level, red_black_row(x, x0, stride, n, first, a, c))
+    }
+
+    static void advect_row(level_t level, float *d, const float *d0, const float *u, const float *v, int stride, int n, int j, float dt0) {
+      OCTET_FLUID_DISPATCH(level, advect_row(d, d0, u, v, stride, n, j, dt0))
+    }
+
+    static void divergence_row(level_t level, float *div, float *p, const float *u, const float *v, int stride, int n) {
+      OCTET_FLUID_DISPATCH(level, divergence_row(div, p, u, v, stride, n))
+    }
+
+    static void gradient_row(level_t level, float *u, float *v, const float *p, int stride, int n, float scale) {
+      OCTET_FLUID_DISPATCH(level, gradient_row(u, v, p, stride, n, scale))
+    }
+
+    #undef OCTET_FLUID_DISPATCH
+    #undef OCTET_FLUID_SSE2_CASE
+    #undef OCTET_FLUID_AVX2_CASE
+    #undef OCTET_FLUID_NEON_CASE
+  };
+}
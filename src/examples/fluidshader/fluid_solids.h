@@ -0,0 +1,659 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2012-2014
+//
+// Modular Framework for OpenGLES2 rendering on multiple platforms.
+//
+// The boundary of the CPU fluid solver: its walls, obstacles, inflows and
+// outflows and the solid bodies in its grid, and their coupling to Bullet
+// rigid bodies.
+//
+// Every cell has a kind: free fluid, a static solid, an inflow blowing a
+// set velocity into the grid or an outflow letting the fluid leave. Solid
+// bodies take free cells as they move. The solver's stencils run over all
+// the interior without looking at the kinds; set_bnd then calls apply(),
+// which rewrites every cell that isn't free fluid from a table of patches
+//
+//   x[dst] = scale[b] * (w0 x[src0] + w1 x[src1] + w2 x[src2] + w3 x[src3]) + value[b]
+//
+// b being 1 for u, 2 for v, 3 for the pressure and 0 for anything else.
+// Solid cells take their body's velocity, or none, inflows their set
+// velocity, and both the mean of their free interior neighbours for the
+// other fields. Outflows take the mean of their free interior neighbours
+// for everything but the pressure, which is zero there, so the fluid
+// leaves freely. The walls copy or negate the first interior cell, and the
+// corners are the mean of the two walls next to them.
+//
+// The cells inside only read free fluid, the walls read the cells inside
+// and the corners read the walls, so apply() sets them in that order, each
+// in one loop without branches that the compiler can vectorise. The walls
+// have a table of their own with one source a patch, as in the walls-only
+// case they are nearly all of the work.
+//
+// The last project() of each substep adds the pressure on the faces
+// between a body and free fluid to the body's impulse, from a list of the
+// faces made with the table.
+//
+// Bodies are described in cells, (i, j) being the centre of cell (i, j),
+// by a shape and a bounding box. move_body() only redraws a body whose
+// shape changed, and then only the cells of its old and new boxes, so the
+// cost of a frame goes with the bodies that move, not with the grid.
+//
+// fluid_bullet_coupling feeds fluid_solids from the bodies of a
+// physics_world: the slice at z = 0 of each body, boxed by its broadphase
+// AABB, and turns the impulses back into apply_impulse and
+// apply_torque_impulse calls.
+//
+
+namespace octet {
+  class fluid_solids {
+  public:
+    enum shape_kind {
+      shape_box,     // centre, half extents and angle
+      shape_circle,  // centre and radius in half_x
+    };
+
+    enum cell_kind {
+      cell_free,
+      cell_solid,
+      cell_inflow,
+      cell_outflow,
+    };
+
+    enum {
+      // sources of a patch
+      max_sources = 4,
+    };
+
+    /// a body in cells, with the velocity of its centre in cells a unit of
+    /// time and its spin in radians a unit of time
+    struct shape {
+      shape_kind kind;
+      float cx, cy;
+      float half_x, half_y;
+      float angle;
+      float vx, vy;
+      float spin;
+    };
+
+  private:
+    struct body {
+      shape s;
+      // the cells it covers, in [i0, i1] x [j0, j1]; i1 < i0 if none
+      int i0, j0, i1, j1;
+      dynarray<int> cells;
+      // pressure impulse since clear_impulses(): force and torque about the centre
+      float fx, fy, torque;
+      bool active;
+    };
+
+    int N;
+    int stride;
+
+    // the body covering each cell, or -1 for none
+    dynarray<int> owner;
+
+    // the cell_kind of each cell, and the velocity of the inflow cells
+    dynarray<uint8_t> kinds;
+    dynarray<float> inflow_u;
+    dynarray<float> inflow_v;
+
+    // allocated one by one, as a body owns the list of its cells
+    dynarray<body*> bodies;
+
+    // interior cells whose kind isn't cell_free, rebuilt after set_cells
+    dynarray<int> static_cells;
+    bool static_dirty;
+
+    // the patches of apply() as a structure of arrays: the cells inside,
+    // then from corners_begin the corners
+    dynarray<int> patch_dst;
+    dynarray<int> patch_src[max_sources];
+    dynarray<float> patch_weight[max_sources];
+    dynarray<float> patch_scale[4];
+    dynarray<float> patch_value[4];
+    int corners_begin;
+
+    // the walls: x[dst] = scale[b] * x[src]
+    dynarray<int> wall_dst;
+    dynarray<int> wall_src;
+    dynarray<float> wall_scale[4];
+
+    // faces between a body and free fluid: the fluid cell, the body, the
+    // direction of the push and where the face is from the body's centre
+    dynarray<int> face_cell;
+    dynarray<int> face_body;
+    dynarray<float> face_dx;
+    dynarray<float> face_dy;
+    dynarray<float> face_rx;
+    dynarray<float> face_ry;
+    bool lists_dirty;
+
+    bool inside(const shape &s, float x, float y) const {
+      float dx = x - s.cx, dy = y - s.cy;
+      if (s.kind == shape_circle) {
+        return dx*dx + dy*dy <= s.half_x*s.half_x;
+      }
+      float c = cosf(s.angle), sn = sinf(s.angle);
+      float lx = c*dx + sn*dy, ly = c*dy - sn*dx;
+      return fabsf(lx) <= s.half_x && fabsf(ly) <= s.half_y;
+    }
+
+    // give back the cells of body id
+    void erase(int id) {
+      body &b = *bodies[id];
+      for (int k = 0; k != (int)b.cells.size(); ++k) {
+        int c = b.cells[k];
+        if (owner[c] == id) owner[c] = -1;
+      }
+      b.cells.resize(0);
+    }
+
+    // take the free cells of body id's box that its shape covers
+    void draw(int id) {
+      body &b = *bodies[id];
+      for (int j = b.j0; j <= b.j1; ++j) {
+        for (int i = b.i0; i <= b.i1; ++i) {
+          int c = i + j * stride;
+          if (owner[c] < 0 && kinds[c] == cell_free && inside(b.s, (float)i, (float)j)) {
+            owner[c] = id;
+            b.cells.push_back(c);
+          }
+        }
+      }
+    }
+
+    bool is_fluid(int c) const {
+      return owner[c] < 0 && kinds[c] == cell_free;
+    }
+
+    // a wall cell copying src, u and v scaled by scale_u and scale_v
+    void add_wall(int dst, int src, float scale_u, float scale_v) {
+      float scale[4] = { 1, scale_u, scale_v, 1 };
+      wall_dst.push_back(dst);
+      wall_src.push_back(src);
+      for (int b = 0; b != 4; ++b) {
+        wall_scale[b].push_back(scale[b]);
+      }
+    }
+
+    void add_patch(int dst, const int *src, const float *weight, const float *scale, const float *value) {
+      patch_dst.push_back(dst);
+      for (int k = 0; k != max_sources; ++k) {
+        patch_src[k].push_back(src[k]);
+        patch_weight[k].push_back(weight[k]);
+      }
+      for (int b = 0; b != 4; ++b) {
+        patch_scale[b].push_back(scale[b]);
+        patch_value[b].push_back(value[b]);
+      }
+    }
+
+    // a patch for a cell inside: the mean of its free interior neighbours,
+    // or zero if it has none, scaled and offset per field. The walls are
+    // set after the cells inside, so they never count.
+    void add_inside_patch(int c, const float *scale, const float *value) {
+      int i = c % stride, j = c / stride;
+      int offsets[4] = { -1, 1, -stride, stride };
+      bool in_walls[4] = { i > 1, i < N, j > 1, j < N };
+      int src[max_sources] = { c, c, c, c };
+      float weight[max_sources] = { 0, 0, 0, 0 };
+      int n = 0;
+      for (int d = 0; d != 4; ++d) {
+        if (in_walls[d] && is_fluid(c + offsets[d])) src[n++] = c + offsets[d];
+      }
+      for (int k = 0; k != n; ++k) {
+        weight[k] = 1.0f / n;
+      }
+      add_patch(c, src, weight, scale, value);
+    }
+
+    void build_static() {
+      static_cells.resize(0);
+      for (int j = 1; j <= N; ++j) {
+        for (int i = 1; i <= N; ++i) {
+          int c = i + j * stride;
+          if (kinds[c] != cell_free) static_cells.push_back(c);
+        }
+      }
+      static_dirty = false;
+    }
+
+    // patches begin to end of the gathering table. None of them reads
+    // another's cell, so any order will do.
+    void gather(int b, float *x, int begin, int end) {
+      const int *dst = patch_dst.data();
+      const int *s0 = patch_src[0].data(), *s1 = patch_src[1].data();
+      const int *s2 = patch_src[2].data(), *s3 = patch_src[3].data();
+      const float *w0 = patch_weight[0].data(), *w1 = patch_weight[1].data();
+      const float *w2 = patch_weight[2].data(), *w3 = patch_weight[3].data();
+      const float *scale = patch_scale[b].data(), *value = patch_value[b].data();
+      for (int k = begin; k != end; ++k) {
+        x[dst[k]] = scale[k] * (w0[k]*x[s0[k]] + w1[k]*x[s1[k]] + w2[k]*x[s2[k]] + w3[k]*x[s3[k]]) + value[k];
+      }
+    }
+
+    void build_lists() {
+      if (static_dirty) build_static();
+
+      patch_dst.resize(0);
+      for (int k = 0; k != max_sources; ++k) {
+        patch_src[k].resize(0);
+        patch_weight[k].resize(0);
+      }
+      wall_dst.resize(0);
+      wall_src.resize(0);
+      for (int b = 0; b != 4; ++b) {
+        patch_scale[b].resize(0);
+        patch_value[b].resize(0);
+        wall_scale[b].resize(0);
+      }
+
+      // the obstacles, inflows and outflows not under a body
+      for (int k = 0; k != (int)static_cells.size(); ++k) {
+        int c = static_cells[k];
+        if (owner[c] >= 0) continue;
+        float scale[4] = { 1, 0, 0, 1 };
+        float value[4] = { 0, 0, 0, 0 };
+        if (kinds[c] == cell_inflow) {
+          value[1] = inflow_u[c];
+          value[2] = inflow_v[c];
+        } else if (kinds[c] == cell_outflow) {
+          scale[1] = scale[2] = 1;
+          scale[3] = 0;
+        }
+        add_inside_patch(c, scale, value);
+      }
+
+      // the bodies, and the faces the fluid pushes them through
+      face_cell.resize(0);
+      face_body.resize(0);
+      face_dx.resize(0);
+      face_dy.resize(0);
+      face_rx.resize(0);
+      face_ry.resize(0);
+      int offsets[4] = { -1, 1, -stride, stride };
+      float dir_x[4] = { 1, -1, 0, 0 };
+      float dir_y[4] = { 0, 0, 1, -1 };
+      for (int id = 0; id != (int)bodies.size(); ++id) {
+        const body &b = *bodies[id];
+        for (int k = 0; k != (int)b.cells.size(); ++k) {
+          int c = b.cells[k];
+          float rx = (float)(c % stride) - b.s.cx, ry = (float)(c / stride) - b.s.cy;
+          // the body's velocity at the cell: v + spin x r, in domains a unit of time
+          float scale[4] = { 1, 0, 0, 1 };
+          float value[4] = { 0, (b.s.vx - b.s.spin * ry) / N, (b.s.vy + b.s.spin * rx) / N, 0 };
+          add_inside_patch(c, scale, value);
+
+          for (int d = 0; d != 4; ++d) {
+            if (is_fluid(c + offsets[d])) {
+              // the face is half a cell from the centre of the solid cell
+              face_cell.push_back(c + offsets[d]);
+              face_body.push_back(id);
+              face_dx.push_back(dir_x[d]);
+              face_dy.push_back(dir_y[d]);
+              face_rx.push_back(rx - 0.5f * dir_x[d]);
+              face_ry.push_back(ry - 0.5f * dir_y[d]);
+            }
+          }
+        }
+      }
+
+      // the walls, from the cells inside: u is reflected at the sides and v
+      // at the top and bottom
+      for (int i = 1; i <= N; ++i) {
+        add_wall(0 + i * stride, 1 + i * stride, -1, 1);
+        add_wall(N+1 + i * stride, N + i * stride, -1, 1);
+        add_wall(i, i + stride, 1, -1);
+        add_wall(i + (N+1) * stride, i + N * stride, 1, -1);
+      }
+
+      // the corners are the mean of the two walls next to them
+      corners_begin = (int)patch_dst.size();
+      int corners[4][3] = {
+        { 0, 1, stride },
+        { (N+1) * stride, 1 + (N+1) * stride, N * stride },
+        { N+1, N, N+1 + stride },
+        { N+1 + (N+1) * stride, N + (N+1) * stride, N+1 + N * stride },
+      };
+      float one[4] = { 1, 1, 1, 1 }, zero[4] = { 0, 0, 0, 0 };
+      for (int k = 0; k != 4; ++k) {
+        int src[max_sources] = { corners[k][1], corners[k][2], corners[k][1], corners[k][1] };
+        float weight[max_sources] = { 0.5f, 0.5f, 0, 0 };
+        add_patch(corners[k][0], src, weight, one, zero);
+      }
+      lists_dirty = false;
+    }
+
+    void reset() {
+      for (int id = 0; id != (int)bodies.size(); ++id) {
+        delete bodies[id];
+      }
+      bodies.resize(0);
+    }
+
+  public:
+    fluid_solids() {
+      N = stride = 0;
+      static_dirty = false;
+      lists_dirty = false;
+      corners_begin = 0;
+    }
+
+    ~fluid_solids() {
+      reset();
+    }
+
+    /// size the mask for an N x N grid with rows stride floats apart.
+    /// Every cell is free and there are no bodies.
+    void init(int N, int stride) {
+      this->N = N;
+      this->stride = stride;
+      owner.resize((N + 2) * stride);
+      kinds.resize((N + 2) * stride);
+      inflow_u.resize((N + 2) * stride);
+      inflow_v.resize((N + 2) * stride);
+      for (int i = 0; i != (int)owner.size(); ++i) {
+        owner[i] = -1;
+        kinds[i] = cell_free;
+        inflow_u[i] = inflow_v[i] = 0;
+      }
+      reset();
+      static_dirty = true;
+      lists_dirty = true;
+    }
+
+    /// make the interior cells [i0, i1] x [j0, j1] free fluid, solid, an
+    /// inflow blowing (u, v) in the units of the solver's velocity, or an
+    /// outflow. Bodies keep the cells they cover until they move.
+    void set_cells(int i0, int j0, int i1, int j1, cell_kind kind, float u = 0, float v = 0) {
+      if (i0 < 1) i0 = 1;
+      if (j0 < 1) j0 = 1;
+      if (i1 > N) i1 = N;
+      if (j1 > N) j1 = N;
+      for (int j = j0; j <= j1; ++j) {
+        for (int i = i0; i <= i1; ++i) {
+          int c = i + j * stride;
+          kinds[c] = (uint8_t)kind;
+          inflow_u[c] = kind == cell_inflow ? u : 0;
+          inflow_v[c] = kind == cell_inflow ? v : 0;
+        }
+      }
+      static_dirty = true;
+      lists_dirty = true;
+    }
+
+    /// set one cell, for masks
+    void set_cell(int i, int j, cell_kind kind, float u = 0, float v = 0) {
+      set_cells(i, j, i, j, kind, u, v);
+    }
+
+    cell_kind get_cell(int i, int j) const {
+      return (cell_kind)kinds[i + j * stride];
+    }
+
+    /// make every cell free fluid again
+    void clear_cells() {
+      set_cells(1, 1, N, N, cell_free);
+    }
+
+    /// add a body that covers no cells until move_body(). returns its id.
+    int add_body() {
+      int id = (int)bodies.size();
+      body *b = new body;
+      bodies.push_back(b);
+      memset(&b->s, 0, sizeof(b->s));
+      b->i0 = b->j0 = 1;
+      b->i1 = b->j1 = 0;
+      b->fx = b->fy = b->torque = 0;
+      b->active = false;
+      return id;
+    }
+
+    /// put body id at s, inside the box (x0, y0) - (x1, y1) in cells.
+    /// Only a body whose shape or box changed is redrawn; a change of
+    /// velocity only updates the lists.
+    void move_body(int id, const shape &s, float x0, float y0, float x1, float y1) {
+      body &b = *bodies[id];
+      int i0 = (int)ceilf(x0), j0 = (int)ceilf(y0);
+      int i1 = (int)floorf(x1), j1 = (int)floorf(y1);
+      if (i0 < 1) i0 = 1;
+      if (j0 < 1) j0 = 1;
+      if (i1 > N) i1 = N;
+      if (j1 > N) j1 = N;
+
+      bool moved = !b.active || i0 != b.i0 || j0 != b.j0 || i1 != b.i1 || j1 != b.j1 ||
+        s.kind != b.s.kind || s.cx != b.s.cx || s.cy != b.s.cy ||
+        s.half_x != b.s.half_x || s.half_y != b.s.half_y || s.angle != b.s.angle;
+      bool sped = s.vx != b.s.vx || s.vy != b.s.vy || s.spin != b.s.spin;
+      b.s = s;
+      b.active = true;
+      if (moved) {
+        erase(id);
+        b.i0 = i0; b.j0 = j0; b.i1 = i1; b.j1 = j1;
+        draw(id);
+      }
+      if (moved || sped) lists_dirty = true;
+    }
+
+    /// take body id out of the grid
+    void remove_body(int id) {
+      erase(id);
+      bodies[id]->active = false;
+      bodies[id]->i1 = bodies[id]->j1 = 0;
+      lists_dirty = true;
+    }
+
+    /// the body covering cell (i, j), or -1 for fluid
+    int get_owner(int i, int j) const {
+      return owner[i + j * stride];
+    }
+
+    int get_num_bodies() const {
+      return (int)bodies.size();
+    }
+
+    /// cells covered by bodies
+    int get_num_solid_cells() const {
+      int count = 0;
+      for (int id = 0; id != (int)bodies.size(); ++id) {
+        count += (int)bodies[id]->cells.size();
+      }
+      return count;
+    }
+
+    /// cells set_bnd rewrites, walls included
+    int get_num_patches() {
+      if (lists_dirty) build_lists();
+      return (int)(wall_dst.size() + patch_dst.size());
+    }
+
+    /// bytes an apply() reads and writes, the patches included
+    double get_apply_bytes() {
+      if (lists_dirty) build_lists();
+      // a wall reads its source, indices and scale and writes the cell; a
+      // gathering patch reads four of each and its scale and value
+      double wall = 2 * sizeof(float) + 2 * sizeof(int) + sizeof(float);
+      double gather = (max_sources + 1) * sizeof(int) + (max_sources * 2 + 3) * sizeof(float);
+      return wall * wall_dst.size() + gather * patch_dst.size();
+    }
+
+    /// set the walls and every cell that isn't free fluid, called by
+    /// set_bnd. b is 1 for u, 2 for v, 3 for the pressure and 0 for
+    /// anything else.
+    void apply(int b, float *x) {
+      if (lists_dirty) build_lists();
+      gather(b, x, 0, corners_begin);
+
+      const int *dst = wall_dst.data(), *src = wall_src.data();
+      const float *scale = wall_scale[b].data();
+      for (int k = 0, end = (int)wall_dst.size(); k != end; ++k) {
+        x[dst[k]] = scale[k] * x[src[k]];
+      }
+
+      gather(b, x, corners_begin, (int)patch_dst.size());
+    }
+
+    /// add the push of pressure p on each body: on every face between a
+    /// body and free fluid, p of the fluid cell towards the body.
+    /// Forces are in p times cells and torques about the body's centre.
+    void add_pressure(const float *p) {
+      if (lists_dirty) build_lists();
+      for (int k = 0; k != (int)face_cell.size(); ++k) {
+        body &b = *bodies[face_body[k]];
+        float pressure = p[face_cell[k]];
+        float fx = pressure * face_dx[k], fy = pressure * face_dy[k];
+        b.fx += fx;
+        b.fy += fy;
+        b.torque += face_rx[k] * fy - face_ry[k] * fx;
+      }
+    }
+
+    /// the pressure impulse on body id since clear_impulses()
+    void get_impulse(int id, float &fx, float &fy, float &torque) const {
+      const body &b = *bodies[id];
+      fx = b.fx;
+      fy = b.fy;
+      torque = b.torque;
+    }
+
+    void clear_impulses() {
+      for (int id = 0; id != (int)bodies.size(); ++id) {
+        bodies[id]->fx = bodies[id]->fy = bodies[id]->torque = 0;
+      }
+    }
+  };
+
+  #if OCTET_BULLET
+  class fluid_bullet_coupling {
+    physics_world *world;
+    fluid_solids *solids;
+
+    // the rigid body of each fluid_solids body
+    dynarray<int> handles;
+
+    int N;
+    float origin;
+    float step;
+    float density;
+
+  public:
+    fluid_bullet_coupling() {
+      world = 0;
+      solids = 0;
+      N = 0;
+      origin = 0;
+      step = 1;
+      density = 1;
+    }
+
+    /// couple the bodies of world to solids. Cell (i, j) of the N x N grid
+    /// is at (origin, origin) + step * (i, j) in the world's x, y plane.
+    void init(physics_world *world, fluid_solids *solids, int N, float origin, float step) {
+      this->world = world;
+      this->solids = solids;
+      this->N = N;
+      this->origin = origin;
+      this->step = step;
+      handles.resize(0);
+    }
+
+    /// mass of the fluid per unit of area, which scales the impulses
+    void set_density(float value) {
+      density = value;
+    }
+
+    float get_density() const {
+      return density;
+    }
+
+    /// put rigid body handle of the world in the fluid. returns its id in
+    /// the fluid_solids.
+    int add_body(int handle) {
+      handles.push_back(handle);
+      return solids->add_body();
+    }
+
+    /// voxelise the bodies that have moved, from the z = 0 slice of their
+    /// shapes. Bodies not crossing the plane leave the grid. Boxes and
+    /// spheres are exact; other shapes fill their broadphase box.
+    void update_solids() {
+      float length = N * step;
+      for (int id = 0; id != (int)handles.size(); ++id) {
+        btRigidBody *body = world->get_rigid_body(handles[id]);
+        btCollisionShape *collision_shape = body->getCollisionShape();
+        btBroadphaseProxy *proxy = body->getBroadphaseHandle();
+        btVector3 lo, hi;
+        if (proxy) {
+          lo = proxy->m_aabbMin;
+          hi = proxy->m_aabbMax;
+        } else {
+          body->getAabb(lo, hi);
+        }
+        if (lo.z() > 0 || hi.z() < 0) {
+          solids->remove_body(id);
+          continue;
+        }
+
+        const btTransform &transform = body->getCenterOfMassTransform();
+        btVector3 pos = transform.getOrigin();
+        btVector3 axis_x = transform.getBasis().getColumn(0);
+        btVector3 vel = body->getLinearVelocity();
+        btVector3 spin = body->getAngularVelocity();
+
+        fluid_solids::shape s;
+        s.cx = (pos.x() - origin) / step;
+        s.cy = (pos.y() - origin) / step;
+        s.angle = atan2f(axis_x.y(), axis_x.x());
+        s.vx = vel.x() / length * N;
+        s.vy = vel.y() / length * N;
+        s.spin = spin.z();
+
+        int type = collision_shape->getShapeType();
+        if (type == SPHERE_SHAPE_PROXYTYPE) {
+          float radius = ((btSphereShape*)collision_shape)->getRadius();
+          float z = pos.z();
+          s.kind = fluid_solids::shape_circle;
+          s.half_x = sqrtf(radius*radius > z*z ? radius*radius - z*z : 0) / step;
+          s.half_y = s.half_x;
+        } else if (type == BOX_SHAPE_PROXYTYPE) {
+          btVector3 half = ((btBoxShape*)collision_shape)->getHalfExtentsWithMargin();
+          s.kind = fluid_solids::shape_box;
+          s.half_x = half.x() / step;
+          s.half_y = half.y() / step;
+        } else {
+          s.kind = fluid_solids::shape_box;
+          s.cx = ((lo.x() + hi.x()) * 0.5f - origin) / step;
+          s.cy = ((lo.y() + hi.y()) * 0.5f - origin) / step;
+          s.half_x = (hi.x() - lo.x()) * 0.5f / step;
+          s.half_y = (hi.y() - lo.y()) * 0.5f / step;
+          s.angle = 0;
+        }
+        solids->move_body(id, s, (lo.x() - origin) / step, (lo.y() - origin) / step,
+          (hi.x() - origin) / step, (hi.y() - origin) / step);
+      }
+    }
+
+    /// apply the pressure impulses the solver gathered since the last call
+    /// to the rigid bodies, then clear them. The solver's pressure p is
+    /// the physical pressure times dt over the fluid's density in a unit
+    /// domain, so the impulse through a face of length step is
+    /// density * length^2 * step * p, with no dt.
+    void apply_impulses() {
+      float length = N * step;
+      float scale = density * length * length * step;
+      for (int id = 0; id != (int)handles.size(); ++id) {
+        float fx, fy, torque;
+        solids->get_impulse(id, fx, fy, torque);
+        if (fx != 0 || fy != 0) {
+          world->apply_impulse(handles[id], vec4(fx * scale, fy * scale, 0, 0));
+        }
+        if (torque != 0) {
+          world->apply_torque_impulse(handles[id], vec4(0, 0, torque * scale * step, 0));
+        }
+      }
+      solids->clear_impulses();
+    }
+  };
+  #endif
+}
@@ -0,0 +1,974 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2012-2014
+//
+// Modular Framework for OpenGLES2 rendering on multiple platforms.
+//
+// CPU stable fluids solver (Jos Stam, "Real-Time Fluid Dynamics for Games").
+//
+// Fields are laid out like a fluid_grid: cell (i,j) is at i + j*stride.
+//
+// The grid is split into strips of rows which are run on a fluid_workers pool.
+// Gauss-Seidel uses red-black ordering: all the red cells, then all the black
+// cells, so every strip can be relaxed at once and the result does not depend
+// on the number of threads.
+//
+// The strip kernels use the fluid_simd row kernels unless the SIMD level is
+// fluid_simd::reference, which runs the original scalar code.
+//
+// The pressure equation in project() can be relaxed with a fixed 20 sweeps
+// of lin_solve or solved to a tolerance with fluid_multigrid or fluid_pcg.
+// With warm starts the pressure of each project() is kept for the next step.
+// The whole grid solvers only know the walls, so while set_solids() has
+// given the solver any solids the pressure is relaxed with lin_solve, whose
+// sweeps apply the solids' patches, whichever solver is chosen.
+//
+// In sparse mode the passes only run over the active bricks of a
+// fluid_bricks mask, updated by update_active() before each step. Cells
+// outside the active bricks are zero, so the pressure is always relaxed
+// with red-black Gauss-Seidel over the active bricks, with zero pressure
+// around them, rather than with the whole grid solvers.
+//
+// advect() is first order semi-Lagrangian by default. MacCormack and BFECC
+// advect forwards and backwards to estimate the error and correct it, then
+// clamp the result to the four cells the first order value came from so the
+// correction can't overshoot.
+//
+// step() adds the sources once and then splits the frame into substeps so
+// that no cell moves more than a CFL number of cells per substep, going by
+// the largest velocity component found by a parallel reduction. With a time
+// budget the number of substeps is also limited to what fits in the budget
+// at the measured cost of recent substeps, so under load the solver trades
+// accuracy for frame rate rather than falling behind.
+//
+// With profiling on, the time spent in add_source, diffuse, advect, project
+// and set_bnd is added up for each stage, not counting the stages called
+// from inside it, so diffuse doesn't include the set_bnd calls of its
+// lin_solve. The memory traffic of each pass is estimated from the fields
+// it must read and write per cell; the multigrid and pcg pressure solvers
+// aren't counted.
+//
+// set_bnd applies the patches of a fluid_solids, the solver's own with
+// just the walls unless set_solids() gives it one with obstacles, inflows,
+// outflows or bodies. The last project() of each substep gathers the
+// pressure on the bodies.
+//
+
+#define IX(i,j) ((i)+stride*(j))
+#define SWAP(x0,x) {float * tmp=x0;x0=x;x=tmp;}
+#define FOR_EACH_CELL for ( i=1 ; i<=N ; i++ ) { for ( j=1 ; j<=N ; j++ ) {
+#define END_FOR }}
+
+namespace octet {
+  class fluid_solver {
+  public:
+    enum pressure_solver_t {
+      pressure_gauss_seidel,  // 20 sweeps of lin_solve, as in the original code
+      pressure_multigrid,
+      pressure_pcg,
+    };
+
+    enum advection_t {
+      advection_semi_lagrangian,  // first order, as in the original code
+      advection_maccormack,
+      advection_bfecc,
+    };
+
+    /// what the last pressure solve did
+    struct pressure_stats {
+      int iterations;
+      float residual;  // |div - A p| / |div|, or -1 for gauss_seidel, which doesn't measure it
+      double seconds;
+      dynarray<float> history;  // residual after each iteration
+    };
+
+    /// what the last step() did
+    struct step_stats {
+      int substeps;
+      int cfl_substeps;   // substeps the cfl limit asked for, more than substeps if the budget cut them
+      float max_speed;    // largest |u| or |v| after adding the sources
+      double seconds;
+    };
+
+    enum stage_t {
+      stage_add_source,
+      stage_diffuse,
+      stage_advect,
+      stage_project,
+      stage_set_bnd,
+      num_stages,
+    };
+
+    /// time and estimated memory traffic of each stage since reset_profile()
+    struct stage_stats {
+      double seconds[num_stages];
+      double bytes[num_stages];
+      int calls[num_stages];
+    };
+
+  private:
+    // cells [i0, i1) x [j0, j1) of the interior: whole rows, or a brick in sparse mode
+    struct strip {
+      int i0;
+      int i1;
+      int j0;
+      int j1;
+    };
+
+    // a pass over the grid, run one strip at a time
+    enum pass_kind {
+      pass_add_source,
+      pass_lin_solve,
+      pass_advect,
+      pass_divergence,
+      pass_gradient,
+      pass_maccormack,
+      pass_bfecc_correct,
+      pass_advect_limited,
+      pass_max_speed,
+    };
+
+    struct pass {
+      pass_kind kind;
+      float *x, *x0, *u, *v;
+      float *fwd, *bwd;  // the forward and backward advected fields of the higher order advection
+      float a, c, dt0;
+      int parity;
+    };
+
+    // try to keep the working set of a strip in a 256k L2 cache
+    enum { cache_bytes = 256 * 1024 };
+
+    // don't bother splitting strips smaller than this
+    enum { min_strip_cells = 4096 };
+
+    int N;
+    int stride;
+    bool red_black;
+    fluid_simd::level_t simd;
+    fluid_workers *workers;
+    dynarray<strip> strips;
+    pass cur;
+
+    // the strips of the pass being run, per_task of them to each worker task
+    const strip *pass_strips;
+    int pass_per_task;
+    int pass_count;
+
+    bool sparse;
+    fluid_bricks bricks;
+    dynarray<strip> brick_strips;
+
+    advection_t advection;
+
+    // largest |u| or |v| of each strip of the last max_speed pass
+    dynarray<float> partial_speed;
+
+    // substeps of step(). cfl = 0 means always one.
+    float cfl;
+    int max_substeps;
+    double time_budget;
+    double substep_seconds;  // smoothed cost of one substep
+    step_stats steps;
+
+    // the fwd and bwd fields of the higher order advection
+    dynarray<float> advect_scratch;
+
+    pressure_solver_t pressure_solver;
+    float pressure_tolerance;
+    int pressure_max_iterations;
+    bool warm_start;
+    pressure_stats stats;
+    fluid_multigrid multigrid;
+    fluid_pcg pcg;
+
+    // the pressure of the two project() calls of vel_step, for warm starts
+    dynarray<float> last_pressure[2];
+
+    // the boundary set_bnd applies: solids if it isn't NULL, or else walls
+    fluid_solids walls;
+    fluid_solids *solids;
+
+    // the stage being timed, or -1, and when it was last entered
+    bool profiling;
+    int stage;
+    double stage_start;
+    stage_stats profile;
+
+    // time a stage function until it returns, then go back to the stage that called it
+    struct stage_scope {
+      fluid_solver *solver;
+      int saved;
+      stage_scope(fluid_solver *solver, stage_t stage) : solver(solver), saved(solver->stage) {
+        if (solver->profiling) {
+          solver->profile.calls[stage]++;
+          solver->enter_stage(stage);
+        }
+      }
+      ~stage_scope() {
+        if (solver->profiling) solver->enter_stage(saved);
+      }
+    };
+
+    void enter_stage(int next) {
+      double now = fluid_timer::now();
+      if (stage >= 0) profile.seconds[stage] += now - stage_start;
+      stage = next;
+      stage_start = now;
+    }
+
+    // bytes each pass must read and write per cell of its strips.
+    // A lin_solve pass writes half the cells and reads the other half.
+    static int get_pass_bytes(pass_kind kind) {
+      static const int bytes[] = { 12, 8, 16, 16, 20, 24, 12, 20, 8 };
+      return bytes[kind];
+    }
+
+    static void run_strip(void *context, int index) {
+      fluid_solver *solver = (fluid_solver*)context;
+      int begin = index * solver->pass_per_task;
+      int end = begin + solver->pass_per_task > solver->pass_count ? solver->pass_count : begin + solver->pass_per_task;
+      for (int i = begin; i != end; ++i) {
+        solver->do_strip(i);
+      }
+    }
+
+    void do_strip(int index) {
+      const strip &s = pass_strips[index];
+      switch (cur.kind) {
+        case pass_add_source: add_source_rows(s); break;
+        case pass_lin_solve: lin_solve_rows(s); break;
+        case pass_advect: advect_rows(s); break;
+        case pass_divergence: divergence_rows(s); break;
+        case pass_gradient: gradient_rows(s); break;
+        case pass_maccormack: maccormack_rows(s); break;
+        case pass_bfecc_correct: bfecc_correct_rows(s); break;
+        case pass_advect_limited: advect_limited_rows(s); break;
+        case pass_max_speed: max_speed_rows(s, index); break;
+      }
+    }
+
+    // true if the passes only run on some of the bricks
+    bool is_sparse() const {
+      return sparse && !bricks.is_all_active();
+    }
+
+    // run the current pass on every strip, or every active brick, and wait for them all
+    void run_pass(pass_kind kind) {
+      cur.kind = kind;
+      const dynarray<strip> &list = is_sparse() ? brick_strips : strips;
+      pass_strips = list.data();
+      pass_count = (int)list.size();
+      pass_per_task = 1;
+
+      // bricks are small, so give each task a few of them
+      int tasks = pass_count;
+      if (is_sparse() && workers) {
+        int max_tasks = workers->get_num_threads() * 4;
+        if (tasks > max_tasks) {
+          pass_per_task = (pass_count + max_tasks - 1) / max_tasks;
+          tasks = (pass_count + pass_per_task - 1) / pass_per_task;
+        }
+      }
+
+      if (profiling && stage >= 0) {
+        double cells = 0;
+        for (int i = 0; i != pass_count; ++i) {
+          cells += (double)(pass_strips[i].i1 - pass_strips[i].i0) * (pass_strips[i].j1 - pass_strips[i].j0);
+        }
+        profile.bytes[stage] += cells * get_pass_bytes(kind);
+      }
+
+      if (workers && tasks > 1) {
+        workers->run(run_strip, (void*)this, tasks);
+      } else {
+        for (int i = 0; i != pass_count; ++i) {
+          do_strip(i);
+        }
+      }
+    }
+
+    void make_strips() {
+      int threads = workers ? workers->get_num_threads() : 1;
+      int rows = cache_bytes / (3 * stride * (int)sizeof(float));
+      int balance = (N + threads*4 - 1) / (threads*4);
+      int min_rows = (min_strip_cells + N - 1) / N;
+      if (rows > balance) rows = balance;
+      if (rows < min_rows) rows = min_rows;
+      if (rows > N) rows = N;
+
+      strips.resize(0);
+      for (int j = 1; j <= N; j += rows) {
+        strip s = { 1, N+1, j, j + rows > N+1 ? N+1 : j + rows };
+        strips.push_back(s);
+      }
+    }
+
+    void make_brick_strips() {
+      brick_strips.resize(0);
+      int num_bricks = bricks.get_num_bricks();
+      for (int k = 0; k != bricks.get_num_active(); ++k) {
+        int brick = bricks.get_active(k);
+        strip s;
+        bricks.get_cells(brick % num_bricks, brick / num_bricks, s.i0, s.i1, s.j0, s.j1);
+        brick_strips.push_back(s);
+      }
+    }
+
+    // the strip kernels. With whole rows, the first and last strips include
+    // the ghost rows for passes that touch the whole array. The SIMD
+    // kernels that need the cell position only run on whole rows.
+
+    static bool is_whole_rows(const strip &s, int N) {
+      return s.i0 == 1 && s.i1 == N+1;
+    }
+
+    void add_source_rows(const strip &st) {
+      float *x = cur.x, *s = cur.x0;
+      float dt = cur.dt0;
+      if (!is_whole_rows(st, N)) {
+        for (int j = st.j0; j != st.j1; ++j) {
+          for (int i = IX(st.i0, j), end = IX(st.i1, j); i != end; ++i) {
+            x[i] += dt*s[i];
+          }
+        }
+        return;
+      }
+      int j0 = st.j0 == 1 ? 0 : st.j0;
+      int j1 = st.j1 == N+1 ? N+2 : st.j1;
+      for (int i = IX(0, j0), end = IX(0, j1); i != end; ++i) {
+        x[i] += dt*s[i];
+      }
+    }
+
+    // relax the cells with (i+j)&1 == parity. These only read cells of the
+    // other colour, so the strips can run in any order.
+    void lin_solve_rows(const strip &s) {
+      float *x = cur.x, *x0 = cur.x0;
+      float a = cur.a, c = cur.c;
+      if (simd != fluid_simd::reference) {
+        // the row kernel counts cells from 1, so start it at cell i0-1
+        for (int j = s.j0; j != s.j1; ++j) {
+          fluid_simd::red_black_row(simd, x + IX(s.i0-1,j), x0 + IX(s.i0-1,j), stride, s.i1 - s.i0, 1 + ((s.i0 + j + cur.parity) & 1), a, c);
+        }
+        return;
+      }
+      for (int j = s.j0; j != s.j1; ++j) {
+        for (int i = s.i0 + ((s.i0 + j + cur.parity) & 1); i < s.i1; i += 2) {
+          x[IX(i,j)] = (x0[IX(i,j)] + a*(x[IX(i-1,j)]+x[IX(i+1,j)]+x[IX(i,j-1)]+x[IX(i,j+1)]))/c;
+        }
+      }
+    }
+
+    void advect_rows(const strip &s) {
+      float *d = cur.x, *d0 = cur.x0, *u = cur.u, *v = cur.v;
+      float dt0 = cur.dt0;
+      if (simd != fluid_simd::reference && is_whole_rows(s, N)) {
+        for (int j = s.j0; j != s.j1; ++j) {
+          fluid_simd::advect_row(simd, d + IX(0,j), d0, u + IX(0,j), v + IX(0,j), stride, N, j, dt0);
+        }
+        return;
+      }
+      for (int j = s.j0; j != s.j1; ++j) {
+        for (int i = s.i0; i != s.i1; ++i) {
+          int i0, j0, i1, j1;
+          float x, y, s0, t0, s1, t1;
+          x = i-dt0*u[IX(i,j)]; y = j-dt0*v[IX(i,j)];
+          if (x<0.5f) x=0.5f;
+          if (x>N+0.5f) x=N+0.5f;
+          i0=(int)x; i1=i0+1;
+          if (y<0.5f) y=0.5f;
+          if (y>N+0.5f) y=N+0.5f;
+          j0=(int)y; j1=j0+1;
+          s1 = x-i0; s0 = 1-s1; t1 = y-j0; t0 = 1-t1;
+          d[IX(i,j)] = s0*(t0*d0[IX(i0,j0)]+t1*d0[IX(i0,j1)])+
+            s1*(t0*d0[IX(i1,j0)]+t1*d0[IX(i1,j1)]);
+        }
+      }
+    }
+
+    // the departure point of cell (i,j), as in advect_rows. Returns the index
+    // of the cell below and to the left of it and the bilinear weights.
+    int departure(int i, int j, float dt0, float u, float v, float &s1, float &t1) const {
+      float x = i-dt0*u, y = j-dt0*v;
+      if (x<0.5f) x=0.5f;
+      if (x>N+0.5f) x=N+0.5f;
+      if (y<0.5f) y=0.5f;
+      if (y>N+0.5f) y=N+0.5f;
+      int i0 = (int)x, j0 = (int)y;
+      s1 = x-i0; t1 = y-j0;
+      return IX(i0,j0);
+    }
+
+    float bilinear(const float *d0, int idx, float s1, float t1) const {
+      float s0 = 1-s1, t0 = 1-t1;
+      return s0*(t0*d0[idx]+t1*d0[idx+stride]) + s1*(t0*d0[idx+1]+t1*d0[idx+stride+1]);
+    }
+
+    // clamp x to the range of the four cells the first order advection used
+    float limit(const float *d0, int idx, float x) const {
+      float a = d0[idx], b = d0[idx+1], c = d0[idx+stride], d = d0[idx+stride+1];
+      float lo = a < b ? a : b, hi = a < b ? b : a;
+      if (c < lo) lo = c;
+      if (c > hi) hi = c;
+      if (d < lo) lo = d;
+      if (d > hi) hi = d;
+      return x < lo ? lo : x > hi ? hi : x;
+    }
+
+    // x = result, x0 = original. fwd = A(x0), bwd = A^-1(fwd).
+    void maccormack_rows(const strip &s) {
+      float *d = cur.x, *d0 = cur.x0, *fwd = cur.fwd, *bwd = cur.bwd, *u = cur.u, *v = cur.v;
+      float dt0 = cur.dt0;
+      for (int j = s.j0; j != s.j1; ++j) {
+        for (int i = s.i0; i != s.i1; ++i) {
+          int c = IX(i,j);
+          float s1, t1;
+          int idx = departure(i, j, dt0, u[c], v[c], s1, t1);
+          d[c] = limit(d0, idx, fwd[c] + 0.5f*(d0[c] - bwd[c]));
+        }
+      }
+    }
+
+    // bwd = x0 + (x0 - bwd) / 2, the original with the round trip error removed
+    void bfecc_correct_rows(const strip &s) {
+      float *d0 = cur.x0, *bwd = cur.bwd;
+      for (int j = s.j0; j != s.j1; ++j) {
+        for (int i = IX(s.i0,j), end = IX(s.i1,j); i != end; ++i) {
+          bwd[i] = d0[i] + 0.5f*(d0[i] - bwd[i]);
+        }
+      }
+    }
+
+    // x = A(bwd), clamped to the cells of x0 it came from
+    void advect_limited_rows(const strip &s) {
+      float *d = cur.x, *d0 = cur.x0, *bwd = cur.bwd, *u = cur.u, *v = cur.v;
+      float dt0 = cur.dt0;
+      for (int j = s.j0; j != s.j1; ++j) {
+        for (int i = s.i0; i != s.i1; ++i) {
+          int c = IX(i,j);
+          float s1, t1;
+          int idx = departure(i, j, dt0, u[c], v[c], s1, t1);
+          d[c] = limit(d0, idx, bilinear(bwd, idx, s1, t1));
+        }
+      }
+    }
+
+    // each strip writes its own result, so they can be combined in a fixed order
+    void max_speed_rows(const strip &s, int index) {
+      const float *u = cur.u, *v = cur.v;
+      float speed = 0;
+      for (int j = s.j0; j != s.j1; ++j) {
+        for (int i = IX(s.i0,j), end = IX(s.i1,j); i != end; ++i) {
+          float au = fabsf(u[i]), av = fabsf(v[i]);
+          if (au > speed) speed = au;
+          if (av > speed) speed = av;
+        }
+      }
+      partial_speed[index] = speed;
+    }
+
+    // x = p, x0 = div
+    void divergence_rows(const strip &s) {
+      float *p = cur.x, *div = cur.x0, *u = cur.u, *v = cur.v;
+      if (simd != fluid_simd::reference && is_whole_rows(s, N)) {
+        for (int j = s.j0; j != s.j1; ++j) {
+          fluid_simd::divergence_row(simd, div + IX(0,j), p + IX(0,j), u + IX(0,j), v + IX(0,j), stride, N);
+        }
+        return;
+      }
+      for (int j = s.j0; j != s.j1; ++j) {
+        for (int i = s.i0; i != s.i1; ++i) {
+          div[IX(i,j)] = -0.5f*(u[IX(i+1,j)]-u[IX(i-1,j)]+v[IX(i,j+1)]-v[IX(i,j-1)])/N;
+          p[IX(i,j)] = 0;
+        }
+      }
+    }
+
+    // x = p
+    void gradient_rows(const strip &s) {
+      float *p = cur.x, *u = cur.u, *v = cur.v;
+      if (simd != fluid_simd::reference) {
+        for (int j = s.j0; j != s.j1; ++j) {
+          fluid_simd::gradient_row(simd, u + IX(s.i0-1,j), v + IX(s.i0-1,j), p + IX(s.i0-1,j), stride, s.i1 - s.i0, 0.5f*N);
+        }
+        return;
+      }
+      for (int j = s.j0; j != s.j1; ++j) {
+        for (int i = s.i0; i != s.i1; ++i) {
+          u[IX(i,j)] -= 0.5f*N*(p[IX(i+1,j)]-p[IX(i-1,j)]);
+          v[IX(i,j)] -= 0.5f*N*(p[IX(i,j+1)]-p[IX(i,j-1)]);
+        }
+      }
+    }
+
+    void add_source ( float * x, float * s, float dt )
+    {
+      stage_scope scope(this, stage_add_source);
+      cur.x = x; cur.x0 = s; cur.dt0 = dt;
+      run_pass(pass_add_source);
+    }
+
+    void set_bnd ( int b, float * x )
+    {
+      stage_scope scope(this, stage_set_bnd);
+      fluid_solids *boundary = solids ? solids : &walls;
+      if (profiling) profile.bytes[stage_set_bnd] += boundary->get_apply_bytes();
+      boundary->apply(b, x);
+    }
+
+    // the original lexicographic Gauss-Seidel sweep, serial.
+    void lin_solve_reference ( int b, float * x, float * x0, float a, float c )
+    {
+      int i, j, k;
+
+      if (profiling && stage >= 0) profile.bytes[stage] += 20.0 * N * N * 3 * sizeof(float);
+      for ( k=0 ; k<20 ; k++ ) {
+        FOR_EACH_CELL
+          x[IX(i,j)] = (x0[IX(i,j)] + a*(x[IX(i-1,j)]+x[IX(i+1,j)]+x[IX(i,j-1)]+x[IX(i,j+1)]))/c;
+        END_FOR
+        set_bnd ( b, x );
+      }
+    }
+
+    void lin_solve ( int b, float * x, float * x0, float a, float c )
+    {
+      if (!red_black && !is_sparse()) {
+        lin_solve_reference(b, x, x0, a, c);
+        return;
+      }
+
+      cur.x = x; cur.x0 = x0; cur.a = a; cur.c = c;
+      for (int k = 0; k != 20; ++k) {
+        cur.parity = 0;
+        run_pass(pass_lin_solve);
+        cur.parity = 1;
+        run_pass(pass_lin_solve);
+        set_bnd(b, x);
+      }
+    }
+
+    void diffuse ( int b, float * x, float * x0, float diff, float dt )
+    {
+      stage_scope scope(this, stage_diffuse);
+      float a=dt*diff*N*N;
+      lin_solve ( b, x, x0, a, 1+4*a );
+    }
+
+    void advect_semi_lagrangian ( int b, float * d, float * d0, float * u, float * v, float dt )
+    {
+      cur.x = d; cur.x0 = d0; cur.u = u; cur.v = v; cur.dt0 = dt*N;
+      run_pass(pass_advect);
+      set_bnd ( b, d );
+    }
+
+    void advect ( int b, float * d, float * d0, float * u, float * v, float dt )
+    {
+      stage_scope scope(this, stage_advect);
+      if (advection == advection_semi_lagrangian) {
+        advect_semi_lagrangian(b, d, d0, u, v, dt);
+        return;
+      }
+
+      float *fwd = advect_scratch.data(), *bwd = fwd + field_size();
+      advect_semi_lagrangian(b, fwd, d0, u, v, dt);
+      advect_semi_lagrangian(b, bwd, fwd, u, v, -dt);
+
+      cur.x = d; cur.x0 = d0; cur.fwd = fwd; cur.bwd = bwd; cur.u = u; cur.v = v; cur.dt0 = dt*N;
+      if (advection == advection_maccormack) {
+        run_pass(pass_maccormack);
+      } else {
+        run_pass(pass_bfecc_correct);
+        set_bnd ( b, bwd );
+        run_pass(pass_advect_limited);
+      }
+      set_bnd ( b, d );
+    }
+
+    // floats from cell (0,0) to cell (N+1,N+1)
+    int field_size() const {
+      return IX(N+2, N+1);
+    }
+
+    void project ( float * u, float * v, float * p, float * div, int which )
+    {
+      stage_scope scope(this, stage_project);
+      cur.x = p; cur.x0 = div; cur.u = u; cur.v = v;
+      run_pass(pass_divergence);
+      set_bnd ( 0, div );
+
+      // the whole grid solvers would write pressure outside the active bricks
+      if (is_sparse()) {
+        set_bnd ( 3, p );
+        lin_solve ( 3, p, div, 1, 4 );
+        stats.iterations = 20;
+        stats.residual = -1;
+        stats.seconds = 0;
+        stats.history.resize(0);
+        if (solids && which == 1) solids->add_pressure(p);
+        cur.x = p; cur.u = u; cur.v = v;
+        run_pass(pass_gradient);
+        set_bnd ( 1, u ); set_bnd ( 2, v );
+        return;
+      }
+
+      if (warm_start) {
+        memcpy(p, last_pressure[which].data(), field_size() * sizeof(float));
+      }
+      set_bnd ( 3, p );
+
+      double start = fluid_timer::now();
+      stats.history.resize(0);
+      pressure_solver_t method = get_active_pressure_solver();
+      if (method == pressure_multigrid) {
+        stats.iterations = multigrid.solve(p, div, pressure_tolerance, pressure_max_iterations, stats.residual, &stats.history);
+        set_bnd ( 3, p );
+      } else if (method == pressure_pcg) {
+        stats.iterations = pcg.solve(p, div, pressure_tolerance, pressure_max_iterations, stats.residual, &stats.history);
+        set_bnd ( 3, p );
+      } else {
+        lin_solve ( 3, p, div, 1, 4 );
+        stats.iterations = 20;
+        stats.residual = -1;
+      }
+      stats.seconds = fluid_timer::now() - start;
+
+      if (warm_start) {
+        memcpy(last_pressure[which].data(), p, field_size() * sizeof(float));
+      }
+      if (solids && which == 1) solids->add_pressure(p);
+
+      cur.x = p; cur.u = u; cur.v = v;
+      run_pass(pass_gradient);
+      set_bnd ( 1, u ); set_bnd ( 2, v );
+    }
+
+    // dens_step and vel_step without the sources
+    void dens_substep ( float * x, float * x0, float * u, float * v, float diff, float dt )
+    {
+      SWAP ( x0, x ); diffuse ( 0, x, x0, diff, dt );
+      SWAP ( x0, x ); advect ( 0, x, x0, u, v, dt );
+    }
+
+    void vel_substep ( float * u, float * v, float * u0, float * v0, float visc, float dt )
+    {
+      diffuse ( 1, u0, u, visc, dt );
+      diffuse ( 2, v0, v, visc, dt );
+      project ( u0, v0, u, v, 0 );
+      advect ( 1, u, u0, u0, v0, dt ); advect ( 2, v, v0, u0, v0, dt );
+      project ( u, v, u0, v0, 1 );
+    }
+
+  public:
+    fluid_solver() {
+      N = 0;
+      stride = 0;
+      red_black = true;
+      simd = fluid_simd::detect();
+      workers = 0;
+      memset(&cur, 0, sizeof(cur));
+      pass_strips = 0;
+      pass_per_task = pass_count = 0;
+      sparse = false;
+      advection = advection_semi_lagrangian;
+      cfl = 0;
+      max_substeps = 1;
+      time_budget = 0;
+      substep_seconds = 0;
+      memset(&steps, 0, sizeof(steps));
+      pressure_solver = pressure_gauss_seidel;
+      pressure_tolerance = 1e-3f;
+      pressure_max_iterations = 20;
+      warm_start = false;
+      stats.iterations = 0;
+      stats.residual = 0;
+      stats.seconds = 0;
+      multigrid.set_simd(simd);
+      solids = 0;
+      profiling = false;
+      stage = -1;
+      stage_start = 0;
+      memset(&profile, 0, sizeof(profile));
+    }
+
+    /// set the grid size (N x N interior cells), the distance between rows
+    /// (at least N+2) and the thread pool to use.
+    /// workers may be NULL to run on the calling thread only.
+    void init(int N, int stride, fluid_workers *workers = 0) {
+      this->N = N;
+      this->stride = stride;
+      this->workers = workers;
+      make_strips();
+      bricks.init(N, stride, workers);
+      make_brick_strips();
+      multigrid.init(N, stride, workers);
+      pcg.init(N, stride, workers);
+      walls.init(N, stride);
+      for (int i = 0; i != 2; ++i) {
+        last_pressure[i].resize(field_size());
+        memset(last_pressure[i].data(), 0, last_pressure[i].size() * sizeof(float));
+      }
+      advect_scratch.resize(field_size() * 2);
+      memset(advect_scratch.data(), 0, advect_scratch.size() * sizeof(float));
+    }
+
+    /// use the layout of a fluid_grid
+    void init(const fluid_grid &grid, fluid_workers *workers = 0) {
+      init(grid.get_N(), grid.get_stride(), workers);
+    }
+
+    /// red-black (default) or the original lexicographic ordering for lin_solve.
+    /// lexicographic ordering is serial; with fluid_simd::reference kernels
+    /// it matches the original code bit for bit.
+    void set_red_black(bool value) {
+      red_black = value;
+    }
+
+    bool get_red_black() const {
+      return red_black;
+    }
+
+    /// choose the row kernels. fluid_simd::reference is the original scalar code.
+    /// returns false and leaves the level alone if this machine can't run it.
+    bool set_simd(fluid_simd::level_t level) {
+      if (!fluid_simd::is_supported(level)) return false;
+      simd = level;
+      multigrid.set_simd(level);
+      return true;
+    }
+
+    fluid_simd::level_t get_simd() const {
+      return simd;
+    }
+
+    /// the boundary: walls, obstacles, inflows, outflows and bodies to keep
+    /// the fluid out of and push with its pressure, or NULL for just the
+    /// walls. The solids must have been sized for this grid.
+    void set_solids(fluid_solids *value) {
+      solids = value;
+    }
+
+    fluid_solids *get_solids() const {
+      return solids;
+    }
+
+    /// first order (default), MacCormack or BFECC advection.
+    /// MacCormack costs two first order advections, BFECC three.
+    void set_advection(advection_t value) {
+      advection = value;
+    }
+
+    advection_t get_advection() const {
+      return advection;
+    }
+
+    void set_pressure_solver(pressure_solver_t value) {
+      pressure_solver = value;
+    }
+
+    pressure_solver_t get_pressure_solver() const {
+      return pressure_solver;
+    }
+
+    /// the solver project() uses: gauss-seidel while there are solids, as
+    /// the multigrid and pcg solvers would ignore them, else the chosen one
+    pressure_solver_t get_active_pressure_solver() const {
+      return solids ? pressure_gauss_seidel : pressure_solver;
+    }
+
+    /// the multigrid and pcg solvers stop when the residual drops by
+    /// tolerance or after max_iterations cycles or iterations.
+    void set_pressure_tolerance(float tolerance, int max_iterations) {
+      pressure_tolerance = tolerance;
+      pressure_max_iterations = max_iterations;
+    }
+
+    /// start each pressure solve from the pressure of the last step
+    /// instead of zero. Gauss-Seidel starts from it too.
+    void set_warm_start(bool value) {
+      warm_start = value;
+    }
+
+    bool get_warm_start() const {
+      return warm_start;
+    }
+
+    /// the pressure the warm start of project() call which (0 or 1) begins
+    /// from, cells (0, 0) .. (N+1, N+1) of the grid's layout. Checkpoints
+    /// save it so a resumed run takes the same steps.
+    float *access_last_pressure(int which) {
+      return last_pressure[which].data();
+    }
+
+    /// cycle type and smoothing of the multigrid pressure solver
+    fluid_multigrid &access_multigrid() {
+      return multigrid;
+    }
+
+    /// preconditioner of the pcg pressure solver
+    fluid_pcg &access_pcg() {
+      return pcg;
+    }
+
+    /// stats for the last pressure solve (the second one of vel_step)
+    const pressure_stats &get_pressure_stats() const {
+      return stats;
+    }
+
+    int get_num_strips() const {
+      return (int)strips.size();
+    }
+
+    /// only run on the active bricks found by update_active().
+    /// Every brick is active until the first update.
+    void set_sparse(bool value) {
+      if (value && !sparse) {
+        bricks.set_all_active();
+        make_brick_strips();
+      }
+      sparse = value;
+    }
+
+    bool get_sparse() const {
+      return sparse;
+    }
+
+    /// in sparse mode, call before vel_step and dens_step with the velocity
+    /// and every other field that is used (density, sources). Fields are
+    /// cleared in bricks that become inactive.
+    void update_active(float *u, float *v, float **fields, int num_fields, float dt) {
+      if (!sparse) return;
+      bricks.update(u, v, fields, num_fields, dt);
+      make_brick_strips();
+
+      // the advection scratch may hold old values in bricks that are no longer active
+      if (advection != advection_semi_lagrangian) {
+        memset(advect_scratch.data(), 0, advect_scratch.size() * sizeof(float));
+      }
+    }
+
+    /// threshold and state of the sparse mode's brick mask
+    fluid_bricks &access_bricks() {
+      return bricks;
+    }
+
+    /// largest |u| or |v| of the interior, or of the active bricks in sparse mode
+    float max_speed(float *u, float *v) {
+      partial_speed.resize(is_sparse() ? brick_strips.size() : strips.size());
+      cur.u = u; cur.v = v;
+      run_pass(pass_max_speed);
+      float speed = 0;
+      for (int i = 0; i != (int)partial_speed.size(); ++i) {
+        if (partial_speed[i] > speed) speed = partial_speed[i];
+      }
+      return speed;
+    }
+
+    /// split step() into enough substeps that no cell moves more than
+    /// cfl cells in one, up to max_substeps. cfl = 0 (default) always takes one.
+    void set_cfl(float cfl, int max_substeps) {
+      this->cfl = cfl;
+      this->max_substeps = max_substeps < 1 ? 1 : max_substeps;
+    }
+
+    float get_cfl() const {
+      return cfl;
+    }
+
+    int get_max_substeps() const {
+      return max_substeps;
+    }
+
+    /// take no more substeps than fit in this many seconds at the cost of
+    /// recent substeps, even if that breaks the cfl limit. 0 (default) for no limit.
+    void set_time_budget(double seconds) {
+      time_budget = seconds;
+    }
+
+    double get_time_budget() const {
+      return time_budget;
+    }
+
+    /// stats for the last step()
+    const step_stats &get_step_stats() const {
+      return steps;
+    }
+
+    /// time the stages. Off by default, as it reads the clock a few hundred times a step.
+    void set_profiling(bool value) {
+      profiling = value;
+      stage = -1;
+    }
+
+    bool get_profiling() const {
+      return profiling;
+    }
+
+    /// clear the stage times
+    void reset_profile() {
+      memset(&profile, 0, sizeof(profile));
+    }
+
+    /// the stage times since reset_profile()
+    const stage_stats &get_profile() const {
+      return profile;
+    }
+
+    static const char *get_stage_name(stage_t stage) {
+      static const char *names[] = { "add_source", "diffuse", "advect", "project", "set_bnd" };
+      return names[stage];
+    }
+
+    void dens_step ( float * x, float * x0, float * u, float * v, float diff, float dt )
+    {
+      add_source ( x, x0, dt );
+      dens_substep ( x, x0, u, v, diff, dt );
+    }
+
+    void vel_step ( float * u, float * v, float * u0, float * v0, float visc, float dt )
+    {
+      add_source ( u, u0, dt ); add_source ( v, v0, dt );
+      vel_substep ( u, v, u0, v0, visc, dt );
+    }
+
+    /// add the sources u0, v0 and x0 for the frame time dt, then move the
+    /// velocity and density on by dt in the number of substeps set_cfl()
+    /// and set_time_budget() allow. With one substep this is vel_step
+    /// followed by dens_step. The sources are used as scratch.
+    /// returns the number of substeps.
+    int step ( float * u, float * v, float * u0, float * v0, float * x, float * x0, float visc, float diff, float dt )
+    {
+      double start = fluid_timer::now();
+      add_source ( u, u0, dt ); add_source ( v, v0, dt );
+      add_source ( x, x0, dt );
+
+      int n = 1;
+      steps.max_speed = 0;
+      if (cfl > 0) {
+        steps.max_speed = max_speed(u, v);
+        float cells = steps.max_speed * dt * N;
+        n = cells < cfl * max_substeps ? (int)ceilf(cells / cfl) : max_substeps;
+        if (n < 1) n = 1;
+      }
+      steps.cfl_substeps = n;
+
+      if (time_budget > 0 && substep_seconds > 0) {
+        int fit = (int)(time_budget / substep_seconds);
+        if (fit < 1) fit = 1;
+        if (n > fit) n = fit;
+      }
+
+      float h = dt / n;
+      for (int k = 0; k != n; ++k) {
+        vel_substep ( u, v, u0, v0, visc, h );
+        dens_substep ( x, x0, u, v, diff, h );
+      }
+
+      steps.substeps = n;
+      steps.seconds = fluid_timer::now() - start;
+      double per_substep = steps.seconds / n;
+      substep_seconds = substep_seconds == 0 ? per_substep : 0.75 * substep_seconds + 0.25 * per_substep;
+      return n;
+    }
+  };
+}
@@ -0,0 +1,314 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2012-2014
+//
+// Modular Framework for OpenGLES2 rendering on multiple platforms.
+//
+// 3D stable fluids solver: the fluid_solver passes with a seven point
+// stencil, trilinear advection and six boundary faces.
+//
+// Fields are stored in 8x8x8 bricks so that the six neighbours of a cell
+// are usually in the same 2k block. A row-major N^3 array would touch three
+// far apart planes for every cell and run at memory speed. index(i,j,k)
+// gives the position of a cell; cells 0..N+1 on each axis are stored and
+// get_field_size() is the number of floats to allocate for a field.
+//
+// The passes are split into slabs of bricks along k and run on a
+// fluid_workers pool. Gauss-Seidel uses red-black ordering as in 2D.
+//
+
+namespace octet {
+  class fluid_solver3d {
+    enum {
+      brick_bits = 3,
+      brick_size = 1 << brick_bits,
+      brick_mask = brick_size - 1,
+      brick_cells = brick_size * brick_size * brick_size,
+    };
+
+    enum pass_kind {
+      pass_add_source,
+      pass_lin_solve,
+      pass_advect,
+      pass_divergence,
+      pass_gradient,
+    };
+
+    struct pass {
+      pass_kind kind;
+      float *x, *x0, *u, *v, *w;
+      float a, c, dt0;
+      int parity;
+    };
+
+    int N;
+
+    // bricks along each axis
+    int num_bricks;
+
+    // distance between bricks along j and k
+    int brick_stride_j;
+    int brick_stride_k;
+
+    fluid_workers *workers;
+    pass cur;
+
+    static void run_slab(void *context, int index) {
+      fluid_solver3d *solver = (fluid_solver3d*)context;
+      solver->do_slab(index);
+    }
+
+    // run the current pass on every slab and wait for them all
+    void run_pass(pass_kind kind) {
+      cur.kind = kind;
+      if (workers) {
+        workers->run(run_slab, (void*)this, num_bricks);
+      } else {
+        for (int i = 0; i != num_bricks; ++i) {
+          do_slab(i);
+        }
+      }
+    }
+
+    // neighbours of cell c at (i,j,k): one step within a brick,
+    // or to the far side of the next brick.
+    int xm(int c, int i) const { return i & brick_mask ? c-1 : c - brick_cells + brick_mask; }
+    int xp(int c, int i) const { return (i & brick_mask) != brick_mask ? c+1 : c + brick_cells - brick_mask; }
+    int ym(int c, int j) const { return j & brick_mask ? c-brick_size : c - brick_stride_j + brick_mask*brick_size; }
+    int yp(int c, int j) const { return (j & brick_mask) != brick_mask ? c+brick_size : c + brick_stride_j - brick_mask*brick_size; }
+    int zm(int c, int k) const { return k & brick_mask ? c-brick_size*brick_size : c - brick_stride_k + brick_mask*brick_size*brick_size; }
+    int zp(int c, int k) const { return (k & brick_mask) != brick_mask ? c+brick_size*brick_size : c + brick_stride_k - brick_mask*brick_size*brick_size; }
+
+    // the interior cells of slab bk, brick by brick
+    #define FOR_EACH_SLAB_CELL(bk) \
+      int k0 = (bk) << brick_bits, k1 = k0 + brick_size; \
+      if (k0 < 1) k0 = 1; \
+      if (k1 > N+1) k1 = N+1; \
+      for (int bj = 0; bj != num_bricks; ++bj) { \
+        int j0 = bj << brick_bits, j1 = j0 + brick_size; \
+        if (j0 < 1) j0 = 1; \
+        if (j1 > N+1) j1 = N+1; \
+        for (int bi = 0; bi != num_bricks; ++bi) { \
+          int i0 = bi << brick_bits, i1 = i0 + brick_size; \
+          if (i0 < 1) i0 = 1; \
+          if (i1 > N+1) i1 = N+1; \
+          for (int k = k0; k < k1; ++k) { \
+            for (int j = j0; j < j1; ++j) { \
+              for (int i = i0; i < i1; ++i) { \
+                int c = index(i, j, k);
+    #define END_SLAB_CELL }}}}}
+
+    void do_slab(int bk) {
+      switch (cur.kind) {
+        case pass_add_source: add_source_slab(bk); break;
+        case pass_lin_solve: lin_solve_slab(bk); break;
+        case pass_advect: advect_slab(bk); break;
+        case pass_divergence: divergence_slab(bk); break;
+        case pass_gradient: gradient_slab(bk); break;
+      }
+    }
+
+    // every cell of the slab's bricks, ghosts and padding included
+    void add_source_slab(int bk) {
+      float *x = cur.x, *s = cur.x0;
+      float dt = cur.dt0;
+      for (int c = bk * brick_stride_k, end = c + brick_stride_k; c != end; ++c) {
+        x[c] += dt*s[c];
+      }
+    }
+
+    // relax the cells with (i+j+k)&1 == parity
+    void lin_solve_slab(int bk) {
+      float *x = cur.x, *x0 = cur.x0;
+      float a = cur.a, inv_c = 1.0f / cur.c;
+      int parity = cur.parity;
+      FOR_EACH_SLAB_CELL(bk)
+        if (((i + j + k) & 1) != parity) continue;
+        x[c] = (x0[c] + a*(x[xm(c,i)]+x[xp(c,i)]+x[ym(c,j)]+x[yp(c,j)]+x[zm(c,k)]+x[zp(c,k)])) * inv_c;
+      END_SLAB_CELL
+    }
+
+    void advect_slab(int bk) {
+      float *d = cur.x, *d0 = cur.x0, *u = cur.u, *v = cur.v, *w = cur.w;
+      float dt0 = cur.dt0;
+      float lo = 0.5f, hi = N + 0.5f;
+      FOR_EACH_SLAB_CELL(bk)
+        float x = i - dt0*u[c], y = j - dt0*v[c], z = k - dt0*w[c];
+        if (x < lo) x = lo;
+        if (x > hi) x = hi;
+        if (y < lo) y = lo;
+        if (y > hi) y = hi;
+        if (z < lo) z = lo;
+        if (z > hi) z = hi;
+        int ia = (int)x, ja = (int)y, ka = (int)z;
+        float s1 = x - ia, s0 = 1 - s1;
+        float t1 = y - ja, t0 = 1 - t1;
+        float r1 = z - ka, r0 = 1 - r1;
+        int c000 = index(ia, ja, ka);
+        int c100 = xp(c000, ia), c010 = yp(c000, ja), c110 = yp(c100, ja);
+        int c001 = zp(c000, ka), c101 = zp(c100, ka), c011 = zp(c010, ka), c111 = zp(c110, ka);
+        d[c] =
+          r0 * (s0*(t0*d0[c000] + t1*d0[c010]) + s1*(t0*d0[c100] + t1*d0[c110])) +
+          r1 * (s0*(t0*d0[c001] + t1*d0[c011]) + s1*(t0*d0[c101] + t1*d0[c111]));
+      END_SLAB_CELL
+    }
+
+    // x = p, x0 = div
+    void divergence_slab(int bk) {
+      float *p = cur.x, *div = cur.x0, *u = cur.u, *v = cur.v, *w = cur.w;
+      float scale = -0.5f / N;
+      FOR_EACH_SLAB_CELL(bk)
+        div[c] = scale * (u[xp(c,i)] - u[xm(c,i)] + v[yp(c,j)] - v[ym(c,j)] + w[zp(c,k)] - w[zm(c,k)]);
+        p[c] = 0;
+      END_SLAB_CELL
+    }
+
+    // x = p
+    void gradient_slab(int bk) {
+      float *p = cur.x, *u = cur.u, *v = cur.v, *w = cur.w;
+      float scale = 0.5f * N;
+      FOR_EACH_SLAB_CELL(bk)
+        u[c] -= scale * (p[xp(c,i)] - p[xm(c,i)]);
+        v[c] -= scale * (p[yp(c,j)] - p[ym(c,j)]);
+        w[c] -= scale * (p[zp(c,k)] - p[zm(c,k)]);
+      END_SLAB_CELL
+    }
+
+    #undef FOR_EACH_SLAB_CELL
+    #undef END_SLAB_CELL
+
+    void add_source ( float * x, float * s, float dt )
+    {
+      cur.x = x; cur.x0 = s; cur.dt0 = dt;
+      run_pass(pass_add_source);
+    }
+
+    // b is the axis (1, 2 or 3) whose velocity component is reflected, 0 for none
+    void set_bnd ( int b, float * x )
+    {
+      for (int j = 1; j <= N; ++j) {
+        for (int i = 1; i <= N; ++i) {
+          x[index(0,  i,j)] = b==1 ? -x[index(1,i,j)] : x[index(1,i,j)];
+          x[index(N+1,i,j)] = b==1 ? -x[index(N,i,j)] : x[index(N,i,j)];
+          x[index(i,0,  j)] = b==2 ? -x[index(i,1,j)] : x[index(i,1,j)];
+          x[index(i,N+1,j)] = b==2 ? -x[index(i,N,j)] : x[index(i,N,j)];
+          x[index(i,j,0  )] = b==3 ? -x[index(i,j,1)] : x[index(i,j,1)];
+          x[index(i,j,N+1)] = b==3 ? -x[index(i,j,N)] : x[index(i,j,N)];
+        }
+      }
+
+      // edges are the average of their two face neighbours
+      for (int i = 1; i <= N; ++i) {
+        x[index(i,0,  0  )] = 0.5f*(x[index(i,1,0  )] + x[index(i,0,  1)]);
+        x[index(i,N+1,0  )] = 0.5f*(x[index(i,N,0  )] + x[index(i,N+1,1)]);
+        x[index(i,0,  N+1)] = 0.5f*(x[index(i,1,N+1)] + x[index(i,0,  N)]);
+        x[index(i,N+1,N+1)] = 0.5f*(x[index(i,N,N+1)] + x[index(i,N+1,N)]);
+        x[index(0,  i,0  )] = 0.5f*(x[index(1,i,0  )] + x[index(0,  i,1)]);
+        x[index(N+1,i,0  )] = 0.5f*(x[index(N,i,0  )] + x[index(N+1,i,1)]);
+        x[index(0,  i,N+1)] = 0.5f*(x[index(1,i,N+1)] + x[index(0,  i,N)]);
+        x[index(N+1,i,N+1)] = 0.5f*(x[index(N,i,N+1)] + x[index(N+1,i,N)]);
+        x[index(0,  0,  i)] = 0.5f*(x[index(1,0,  i)] + x[index(0,  1,i)]);
+        x[index(N+1,0,  i)] = 0.5f*(x[index(N,0,  i)] + x[index(N+1,1,i)]);
+        x[index(0,  N+1,i)] = 0.5f*(x[index(1,N+1,i)] + x[index(0,  N,i)]);
+        x[index(N+1,N+1,i)] = 0.5f*(x[index(N,N+1,i)] + x[index(N+1,N,i)]);
+      }
+
+      // corners are the average of their three edge neighbours
+      for (int c = 0; c != 8; ++c) {
+        int i = c & 1 ? N+1 : 0, j = c & 2 ? N+1 : 0, k = c & 4 ? N+1 : 0;
+        int di = i ? -1 : 1, dj = j ? -1 : 1, dk = k ? -1 : 1;
+        x[index(i,j,k)] = (1.0f/3)*(x[index(i+di,j,k)] + x[index(i,j+dj,k)] + x[index(i,j,k+dk)]);
+      }
+    }
+
+    void lin_solve ( int b, float * x, float * x0, float a, float c )
+    {
+      cur.x = x; cur.x0 = x0; cur.a = a; cur.c = c;
+      for (int k = 0; k != 20; ++k) {
+        cur.parity = 0;
+        run_pass(pass_lin_solve);
+        cur.parity = 1;
+        run_pass(pass_lin_solve);
+        set_bnd(b, x);
+      }
+    }
+
+    void diffuse ( int b, float * x, float * x0, float diff, float dt )
+    {
+      float a=dt*diff*N*N;
+      lin_solve ( b, x, x0, a, 1+6*a );
+    }
+
+    void advect ( int b, float * d, float * d0, float * u, float * v, float * w, float dt )
+    {
+      cur.x = d; cur.x0 = d0; cur.u = u; cur.v = v; cur.w = w; cur.dt0 = dt*N;
+      run_pass(pass_advect);
+      set_bnd ( b, d );
+    }
+
+    void project ( float * u, float * v, float * w, float * p, float * div )
+    {
+      cur.x = p; cur.x0 = div; cur.u = u; cur.v = v; cur.w = w;
+      run_pass(pass_divergence);
+      set_bnd ( 0, div ); set_bnd ( 0, p );
+
+      lin_solve ( 0, p, div, 1, 6 );
+
+      cur.x = p; cur.u = u; cur.v = v; cur.w = w;
+      run_pass(pass_gradient);
+      set_bnd ( 1, u ); set_bnd ( 2, v ); set_bnd ( 3, w );
+    }
+
+  public:
+    fluid_solver3d() {
+      N = 0;
+      num_bricks = 0;
+      brick_stride_j = brick_stride_k = 0;
+      workers = 0;
+      memset(&cur, 0, sizeof(cur));
+    }
+
+    /// set the grid size (N x N x N interior cells) and the thread pool.
+    /// workers may be NULL to run on the calling thread only.
+    void init(int N, fluid_workers *workers = 0) {
+      this->N = N;
+      this->workers = workers;
+      num_bricks = (N + 2 + brick_mask) >> brick_bits;
+      brick_stride_j = num_bricks * brick_cells;
+      brick_stride_k = num_bricks * brick_stride_j;
+    }
+
+    /// floats needed for one field
+    int get_field_size() const {
+      return num_bricks * brick_stride_k;
+    }
+
+    /// position of cell (i,j,k) in a field, 0 <= i,j,k <= N+1
+    int index(int i, int j, int k) const {
+      return (k >> brick_bits) * brick_stride_k + (j >> brick_bits) * brick_stride_j + (i >> brick_bits) * brick_cells +
+        (((k & brick_mask) << brick_bits | (j & brick_mask)) << brick_bits | (i & brick_mask));
+    }
+
+    int get_N() const {
+      return N;
+    }
+
+    void dens_step ( float * x, float * x0, float * u, float * v, float * w, float diff, float dt )
+    {
+      add_source ( x, x0, dt );
+      diffuse ( 0, x0, x, diff, dt );
+      advect ( 0, x, x0, u, v, w, dt );
+    }
+
+    void vel_step ( float * u, float * v, float * w, float * u0, float * v0, float * w0, float visc, float dt )
+    {
+      add_source ( u, u0, dt ); add_source ( v, v0, dt ); add_source ( w, w0, dt );
+      diffuse ( 1, u0, u, visc, dt );
+      diffuse ( 2, v0, v, visc, dt );
+      diffuse ( 3, w0, w, visc, dt );
+      project ( u0, v0, w0, u, v );
+      advect ( 1, u, u0, u0, v0, w0, dt ); advect ( 2, v, v0, u0, v0, w0, dt ); advect ( 3, w, w0, u0, v0, w0, dt );
+      project ( u, v, w, u0, v0 );
+    }
+  };
+}
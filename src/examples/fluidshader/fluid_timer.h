@@ -0,0 +1,48 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2012-2014
+//
+// Modular Framework for OpenGLES2 rendering on multiple platforms.
+//
+// High resolution wall clock for timing the fluid solver.
+//
+
+#if defined(WIN32)
+  // windows.h has already been included by windows_specific.h
+#elif defined(__APPLE__)
+  #include <mach/mach_time.h>
+#else
+  #include <sys/time.h>
+#endif
+
+namespace octet {
+  class fluid_timer {
+  public:
+    /// seconds since some arbitrary point
+    static double now() {
+      #if defined(WIN32)
+        static double scale = 0;
+        if (scale == 0) {
+          LARGE_INTEGER freq;
+          QueryPerformanceFrequency(&freq);
+          scale = 1.0 / (double)freq.QuadPart;
+        }
+        LARGE_INTEGER count;
+        QueryPerformanceCounter(&count);
+        return (double)count.QuadPart * scale;
+      #elif defined(__APPLE__)
+        static double scale = 0;
+        if (scale == 0) {
+          mach_timebase_info_data_t info;
+          mach_timebase_info(&info);
+          scale = 1e-9 * info.numer / info.denom;
+        }
+        return (double)mach_absolute_time() * scale;
+      #else
+        timeval tv;
+        gettimeofday(&tv, NULL);
+        return tv.tv_sec + tv.tv_usec * 1e-6;
+      #endif
+    }
+  };
+}
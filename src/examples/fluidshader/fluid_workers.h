@@ -0,0 +1,236 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2012-2014
+//
+// Modular Framework for OpenGLES2 rendering on multiple platforms.
+//
+// Pool of worker threads for the CPU fluid solver.
+//
+// The solver splits each pass into tiles and calls run() with a task function.
+// run() returns when every tile is done, so each pass is also a barrier.
+// The calling thread works too, so a pool with one thread is just a loop.
+//
+
+#if defined(WIN32)
+  // windows.h has already been included by windows_specific.h
+  #define OCTET_FLUID_THREADS 1
+#elif defined(__APPLE__) || defined(__linux__)
+  #include <pthread.h>
+  #include <unistd.h>
+  #define OCTET_FLUID_THREADS 1
+#else
+  // no threads on this platform: run() does all the work on the caller
+  #define OCTET_FLUID_THREADS 0
+#endif
+
+namespace octet {
+  class fluid_workers {
+  public:
+    // called once for every index in [0, count)
+    typedef void (*task_fn)(void *context, int index);
+
+  private:
+    enum { max_threads = 64 };
+
+    // number of threads including the caller
+    int num_threads;
+
+    // the task currently being run
+    task_fn task;
+    void *context;
+    int count;
+    int next;
+    int completed;
+
+    // incremented for every run() so that sleeping workers know there is new work
+    unsigned generation;
+    bool quit;
+
+    #if OCTET_FLUID_THREADS && defined(WIN32)
+      HANDLE threads[max_threads];
+      CRITICAL_SECTION mutex;
+      CONDITION_VARIABLE work_ready;
+      CONDITION_VARIABLE work_done;
+
+      void lock() { EnterCriticalSection(&mutex); }
+      void unlock() { LeaveCriticalSection(&mutex); }
+      void wait_ready() { SleepConditionVariableCS(&work_ready, &mutex, INFINITE); }
+      void wait_done() { SleepConditionVariableCS(&work_done, &mutex, INFINITE); }
+      void signal_ready() { WakeAllConditionVariable(&work_ready); }
+      void signal_done() { WakeAllConditionVariable(&work_done); }
+
+      static DWORD WINAPI thread_proc(LPVOID param) {
+        ((fluid_workers*)param)->worker_loop();
+        return 0;
+      }
+
+      void start_threads() {
+        InitializeCriticalSection(&mutex);
+        InitializeConditionVariable(&work_ready);
+        InitializeConditionVariable(&work_done);
+        for (int i = 1; i < num_threads; ++i) {
+          threads[i] = CreateThread(NULL, 0, thread_proc, (LPVOID)this, 0, NULL);
+        }
+      }
+
+      void join_threads() {
+        for (int i = 1; i < num_threads; ++i) {
+          WaitForSingleObject(threads[i], INFINITE);
+          CloseHandle(threads[i]);
+        }
+        DeleteCriticalSection(&mutex);
+      }
+    #elif OCTET_FLUID_THREADS
+      pthread_t threads[max_threads];
+      pthread_mutex_t mutex;
+      pthread_cond_t work_ready;
+      pthread_cond_t work_done;
+
+      void lock() { pthread_mutex_lock(&mutex); }
+      void unlock() { pthread_mutex_unlock(&mutex); }
+      void wait_ready() { pthread_cond_wait(&work_ready, &mutex); }
+      void wait_done() { pthread_cond_wait(&work_done, &mutex); }
+      void signal_ready() { pthread_cond_broadcast(&work_ready); }
+      void signal_done() { pthread_cond_broadcast(&work_done); }
+
+      static void *thread_proc(void *param) {
+        ((fluid_workers*)param)->worker_loop();
+        return NULL;
+      }
+
+      void start_threads() {
+        pthread_mutex_init(&mutex, NULL);
+        pthread_cond_init(&work_ready, NULL);
+        pthread_cond_init(&work_done, NULL);
+        for (int i = 1; i < num_threads; ++i) {
+          pthread_create(&threads[i], NULL, thread_proc, (void*)this);
+        }
+      }
+
+      void join_threads() {
+        for (int i = 1; i < num_threads; ++i) {
+          pthread_join(threads[i], NULL);
+        }
+        pthread_cond_destroy(&work_done);
+        pthread_cond_destroy(&work_ready);
+        pthread_mutex_destroy(&mutex);
+      }
+    #else
+      void lock() {}
+      void unlock() {}
+      void wait_ready() {}
+      void wait_done() {}
+      void signal_ready() {}
+      void signal_done() {}
+      void start_threads() {}
+      void join_threads() {}
+    #endif
+
+    // take tiles until there are none left. call with the lock held.
+    void do_tiles() {
+      while (next < count) {
+        int index = next++;
+        unlock();
+        task(context, index);
+        lock();
+        if (++completed == count) {
+          signal_done();
+        }
+      }
+    }
+
+    void worker_loop() {
+      unsigned seen = 0;
+      lock();
+      for (;;) {
+        while (generation == seen && !quit) {
+          wait_ready();
+        }
+        if (quit) break;
+        seen = generation;
+        do_tiles();
+      }
+      unlock();
+    }
+
+  public:
+    fluid_workers() {
+      num_threads = 0;
+      task = 0;
+      context = 0;
+      count = next = completed = 0;
+      generation = 0;
+      quit = false;
+    }
+
+    ~fluid_workers() {
+      reset();
+    }
+
+    // returns the number of hardware threads on this machine
+    static int get_num_cores() {
+      #if OCTET_FLUID_THREADS && defined(WIN32)
+        SYSTEM_INFO info;
+        GetSystemInfo(&info);
+        return (int)info.dwNumberOfProcessors;
+      #elif OCTET_FLUID_THREADS
+        long n = sysconf(_SC_NPROCESSORS_ONLN);
+        return n < 1 ? 1 : (int)n;
+      #else
+        return 1;
+      #endif
+    }
+
+    // start the threads. num_threads == 0 uses every core.
+    void init(int num_threads = 0) {
+      reset();
+      if (num_threads <= 0) num_threads = get_num_cores();
+      if (num_threads > max_threads) num_threads = max_threads;
+      if (!OCTET_FLUID_THREADS) num_threads = 1;
+      this->num_threads = num_threads;
+      start_threads();
+    }
+
+    // stop the threads
+    void reset() {
+      if (num_threads) {
+        lock();
+        quit = true;
+        signal_ready();
+        unlock();
+        join_threads();
+        num_threads = 0;
+        quit = false;
+      }
+    }
+
+    int get_num_threads() const {
+      return num_threads < 1 ? 1 : num_threads;
+    }
+
+    // call task(context, i) for i in [0, count) and wait for all of them to finish.
+    void run(task_fn task, void *context, int count) {
+      if (num_threads <= 1 || count <= 1) {
+        for (int i = 0; i != count; ++i) {
+          task(context, i);
+        }
+        return;
+      }
+
+      lock();
+      this->task = task;
+      this->context = context;
+      this->count = count;
+      next = 0;
+      completed = 0;
+      generation++;
+      signal_ready();
+
+      do_tiles();
+      while (completed != count) {
+        wait_done();
+      }
+      unlock();
+    }
+  };
+}
@@ -5,91 +5,101 @@
 // Modular Framework for OpenGLES2 rendering on multiple platforms.
 //
 
-#define IX(i,j) ((i)+(N+2)*(j))
-#define SWAP(x0,x) {float * tmp=x0;x0=x;x=tmp;}
-#define FOR_EACH_CELL for ( i=1 ; i<=N ; i++ ) { for ( j=1 ; j<=N ; j++ ) {
-#define END_FOR }}
-
 namespace octet {
   /// Scene containing a box with octet.
   class fluidshader : public app {
     fluid_shader fshader;
     color_shader cshader;
 
+    fluid_workers workers;
+    fluid_solver solver;
+
     int N;
     int Nborder;
     float dt, diff, visc;
     float force, source;
     int dvel;
+    int dpart;
+    int dbodies;
+    int dduct;
     int currentAngle;
 
-    float * u, * v, * u_prev, * v_prev;
-    float * dens, * dens_prev;
+    // u, v and dens are double buffered: get_prev() is u_prev etc.
+    fluid_grid grid;
+    int u_field, v_field, dens_field;
+
+    // dens without the row padding, for glTexSubImage2D
+    dynarray<float> densUpload;
+
+    dynarray<float> uvArrayPositions;
+
+    // tracers carried by the velocity, drawn from particlePoints as GL_POINTS
+    fluid_particles particles;
+    dynarray<float> particlePoints;
 
-    float *uvArrayPositions;
+    // rigid bodies falling through the fluid while dbodies is on, pushing
+    // it aside and pushed by its pressure, and a duct while dduct is on
+    fluid_solids solids;
+    #if OCTET_BULLET
+      physics_world world;
+      fluid_bullet_coupling coupling;
+      dynarray<int> bodyHandles;
+      dynarray<vec4> bodySizes;  // half extents of a box, or a radius in x with y = 0
+    #endif
 
     int win_x, win_y;
     int mouse_down[3];
     int omx, omy, mx, my;
 
+    // S and L save and load a checkpoint, R starts and stops recording the
+    // mouse and Y replays the recording, as does -replay file at startup
+    fluid_checkpoint checkpoint;
+    int stepCount;
+    const char *replayFile;
+    unsigned char keyWasDown[256];
+
     GLuint vertexArrayID;
-    GLuint fluidPositionsVBO;
-    GLuint fluidIndicesVBO;
-    GLuint fluidDensity0VBO;
-    GLuint fluidDensity1VBO;
+    GLuint fluidQuadVBO;
+    GLuint fluidDensityTexture;
 
     GLuint fluidVelocitiesPositionsVBO;
-    GLuint fluidVelocitiesIndicesVBO;
+    GLuint fluidParticlesVBO;
+    GLuint fluidBodiesVBO;
 
     void initVBO() {
-      dynarray <float>fluidPositions;
       float fluidLength = 18.0f;
       float fluidStep = fluidLength/Nborder;
-      for (int i = 0; i != Nborder; i++) {
-        for (int j = 0; j != Nborder; j++) {
-          fluidPositions.push_back(-fluidLength/2.0f+j*fluidStep);
-          fluidPositions.push_back(-fluidLength/2.0f+i*fluidStep);
-          fluidPositions.push_back(0);
-        }
-      }
-      dynarray <unsigned short>fluidIndices;
-      for (int i = 0; i != N+1; i++) {
-        for (int j = 0; j != N+1; j++) {
-          fluidIndices.push_back(Nborder*(j+0)+(i+0));
-          fluidIndices.push_back(Nborder*(j+0)+(i+1));
-          fluidIndices.push_back(Nborder*(j+1)+(i+0));
 
-          fluidIndices.push_back(Nborder*(j+0)+(i+1));
-          fluidIndices.push_back(Nborder*(j+1)+(i+1));
-          fluidIndices.push_back(Nborder*(j+1)+(i+0));
-        }
-      }
-      
-      dynarray <float>fluidDensity;
-      fluidDensity.resize(Nborder*Nborder);
-      for (int i = 0; i != Nborder*Nborder; i++) {
-        fluidDensity[i] = 0.0f;
-      }
+      // one quad over the grid, two floats of position and two of texture
+      // coordinate a corner. The corners sample the centres of the corner
+      // cells, so the texture filter blends cells as the old vertex grid did.
+      float lo = -fluidLength/2.0f, hi = lo + (Nborder-1)*fluidStep;
+      float tlo = 0.5f/Nborder, thi = 1.0f - tlo;
+      float fluidQuad[] = {
+        lo, lo, tlo, tlo,
+        hi, lo, thi, tlo,
+        lo, hi, tlo, thi,
+        hi, hi, thi, thi,
+      };
       
       glGenVertexArrays(1, &vertexArrayID);
       glBindVertexArray(vertexArrayID);
 
-      glGenBuffers(1, &fluidPositionsVBO);
-      glGenBuffers(1, &fluidIndicesVBO);
-      glGenBuffers(1, &fluidDensity0VBO);
-      glGenBuffers(1, &fluidDensity1VBO);
-      
+      glGenBuffers(1, &fluidQuadVBO);
       glGenBuffers(1, &fluidVelocitiesPositionsVBO);
-      glGenBuffers(1, &fluidVelocitiesIndicesVBO);
       
-      glBindBuffer(GL_ARRAY_BUFFER, fluidPositionsVBO);
-      glBufferData(GL_ARRAY_BUFFER, fluidPositions.size()*sizeof(GLfloat), (void *)fluidPositions.data(), GL_DYNAMIC_DRAW);
-
-      glBindBuffer(GL_ARRAY_BUFFER, fluidDensity0VBO);
-      glBufferData(GL_ARRAY_BUFFER, fluidDensity.size()*sizeof(GLfloat), (void *)fluidDensity.data(), GL_DYNAMIC_DRAW);
-
-      glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, fluidIndicesVBO);
-      glBufferData(GL_ELEMENT_ARRAY_BUFFER, fluidIndices.size()*sizeof(GLushort), (void *)fluidIndices.data(), GL_DYNAMIC_DRAW);
+      glBindBuffer(GL_ARRAY_BUFFER, fluidQuadVBO);
+      glBufferData(GL_ARRAY_BUFFER, sizeof(fluidQuad), (void *)fluidQuad, GL_STATIC_DRAW);
+
+      // the density texture, one cell a texel, refilled each frame from densUpload
+      glGenTextures(1, &fluidDensityTexture);
+      glActiveTexture(GL_TEXTURE0);
+      glBindTexture(GL_TEXTURE_2D, fluidDensityTexture);
+      glTexImage2D(GL_TEXTURE_2D, 0, GL_R32F, Nborder, Nborder, 0, GL_RED, GL_FLOAT, NULL);
+      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
 
       for (int j = 0; j != Nborder; j++) {
         for (int i = 0; i != Nborder; i++) {
@@ -103,55 +113,39 @@ namespace octet {
         }
       }
 
-      dynarray<unsigned short>fluidVelocitiesIndices;
-      for (unsigned short i = 0; i != Nborder*Nborder; i++) {
-        fluidVelocitiesIndices.push_back(i*2);
-        fluidVelocitiesIndices.push_back(i*2+1);
-      }
-
       glBindBuffer(GL_ARRAY_BUFFER, fluidVelocitiesPositionsVBO);
-      glBufferData(GL_ARRAY_BUFFER, Nborder*Nborder*6*sizeof(GLfloat), (void *)uvArrayPositions, GL_DYNAMIC_DRAW);
+      glBufferData(GL_ARRAY_BUFFER, Nborder*Nborder*6*sizeof(GLfloat), (void *)uvArrayPositions.data(), GL_DYNAMIC_DRAW);
+
+      // two floats a particle, as many as the pool holds
+      glGenBuffers(1, &fluidParticlesVBO);
+      glBindBuffer(GL_ARRAY_BUFFER, fluidParticlesVBO);
+      glBufferData(GL_ARRAY_BUFFER, particles.get_capacity()*2*sizeof(GLfloat), NULL, GL_STREAM_DRAW);
 
-      glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, fluidVelocitiesIndicesVBO);
-      glBufferData(GL_ELEMENT_ARRAY_BUFFER, fluidVelocitiesIndices.size()*sizeof(GLushort), (void *)fluidVelocitiesIndices.data(), GL_DYNAMIC_DRAW);
+      glGenBuffers(1, &fluidBodiesVBO);
 
       glBindBuffer(GL_ARRAY_BUFFER, 0);
-      glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
     }
 
     void free_data ( void )
     {
-      if ( u ) free ( u );
-      if ( v ) free ( v );
-      if ( u_prev ) free ( u_prev );
-      if ( v_prev ) free ( v_prev );
-      if ( dens ) free ( dens );
-      if ( dens_prev ) free ( dens_prev );
-      if ( uvArrayPositions ) free ( uvArrayPositions );
+      grid.reset();
     }
 
     void clear_data ( void )
     {
-      int i, size=(N+2)*(N+2);
-
-      for ( i=0 ; i<size ; i++ ) {
-        u[i] = v[i] = u_prev[i] = v_prev[i] = dens[i] = dens_prev[i] = 0.0f;
-      }
+      grid.clear_all();
     }
 
     int allocate_data ( void )
     {
-      int size = (N+2)*(N+2);
-
-      u			= (float *) malloc ( size*sizeof(float) );
-      v			= (float *) malloc ( size*sizeof(float) );
-      u_prev		= (float *) malloc ( size*sizeof(float) );
-      v_prev		= (float *) malloc ( size*sizeof(float) );
-      dens		= (float *) malloc ( size*sizeof(float) );	
-      dens_prev	= (float *) malloc ( size*sizeof(float) );
-      uvArrayPositions = (float *)malloc(size*3*2*sizeof(float));
-
-      if ( !u || !v || !u_prev || !v_prev || !dens || !dens_prev ) {
+      grid.init(N);
+      u_field = grid.add_field("u", true);
+      v_field = grid.add_field("v", true);
+      dens_field = grid.add_field("dens", true);
+      densUpload.resize(Nborder*Nborder);
+      uvArrayPositions.resize(Nborder*Nborder*3*2);
+
+      if ( u_field < 0 || v_field < 0 || dens_field < 0 ) {
         fprintf ( stderr, "cannot allocate data\n" );
         return ( 0 );
       }
@@ -161,10 +155,12 @@ namespace octet {
 
     void get_from_UI ( float * d, float * u, float * v )
     {
-      int i, j, size = (N+2)*(N+2);
+      int i, j;
 
-      for ( i=0 ; i<size ; i++ ) {
-        u[i] = v[i] = d[i] = 0.0f;
+      for ( j=0 ; j<N+2 ; j++ ) {
+        for ( i=grid.index(0,j) ; i<grid.index(N+2,j) ; i++ ) {
+          u[i] = v[i] = d[i] = 0.0f;
+        }
       }
 
       if ( !mouse_down[0] && !mouse_down[2] ) return;
@@ -176,12 +172,13 @@ namespace octet {
 
       if ( mouse_down[0] ) {
         printf("Force: (%d, %d)\n", (mx-omx), (omy-my));
-        u[IX(i,j)] = force * (mx-omx);
-        v[IX(i,j)] = force * (omy-my);
+        u[grid.index(i,j)] = force * (mx-omx);
+        v[grid.index(i,j)] = force * (omy-my);
       }
 
       if ( mouse_down[2] ) {
-        d[IX(i,j)] = source;
+        d[grid.index(i,j)] = source;
+        if (dpart) particles.emit((float)i, (float)j, 1.0f, 2000);
       }
 
       omx = mx;
@@ -190,103 +187,13 @@ namespace octet {
       return;
     }
 
-    void add_source ( int N, float * x, float * s, float dt )
-    {
-      int i, size=(N+2)*(N+2);
-      for ( i=0 ; i<size ; i++ ) x[i] += dt*s[i];
-    }
-
-    void set_bnd ( int N, int b, float * x )
-    {
-      int i;
-
-      for ( i=1 ; i<=N ; i++ ) {
-        x[IX(0  ,i)] = b==1 ? -x[IX(1,i)] : x[IX(1,i)];
-        x[IX(N+1,i)] = b==1 ? -x[IX(N,i)] : x[IX(N,i)];
-        x[IX(i,0  )] = b==2 ? -x[IX(i,1)] : x[IX(i,1)];
-        x[IX(i,N+1)] = b==2 ? -x[IX(i,N)] : x[IX(i,N)];
-      }
-      x[IX(0  ,0  )] = 0.5f*(x[IX(1,0  )]+x[IX(0  ,1)]);
-      x[IX(0  ,N+1)] = 0.5f*(x[IX(1,N+1)]+x[IX(0  ,N)]);
-      x[IX(N+1,0  )] = 0.5f*(x[IX(N,0  )]+x[IX(N+1,1)]);
-      x[IX(N+1,N+1)] = 0.5f*(x[IX(N,N+1)]+x[IX(N+1,N)]);
-    }
-
-    void lin_solve ( int N, int b, float * x, float * x0, float a, float c )
-    {
-      int i, j, k;
-
-      for ( k=0 ; k<20 ; k++ ) {
-        FOR_EACH_CELL
-          x[IX(i,j)] = (x0[IX(i,j)] + a*(x[IX(i-1,j)]+x[IX(i+1,j)]+x[IX(i,j-1)]+x[IX(i,j+1)]))/c;
-        END_FOR
-          set_bnd ( N, b, x );
-      }
-    }
-
-    void diffuse ( int N, int b, float * x, float * x0, float diff, float dt )
-    {
-      float a=dt*diff*N*N;
-      lin_solve ( N, b, x, x0, a, 1+4*a );
-    }
-
-    void advect ( int N, int b, float * d, float * d0, float * u, float * v, float dt )
-    {
-      int i, j, i0, j0, i1, j1;
-      float x, y, s0, t0, s1, t1, dt0;
-
-      dt0 = dt*N;
-      FOR_EACH_CELL
-        x = i-dt0*u[IX(i,j)]; y = j-dt0*v[IX(i,j)];
-      if (x<0.5f) x=0.5f; if (x>N+0.5f) x=N+0.5f; i0=(int)x; i1=i0+1;
-      if (y<0.5f) y=0.5f; if (y>N+0.5f) y=N+0.5f; j0=(int)y; j1=j0+1;
-      s1 = x-i0; s0 = 1-s1; t1 = y-j0; t0 = 1-t1;
-      d[IX(i,j)] = s0*(t0*d0[IX(i0,j0)]+t1*d0[IX(i0,j1)])+
-        s1*(t0*d0[IX(i1,j0)]+t1*d0[IX(i1,j1)]);
-      END_FOR
-        set_bnd ( N, b, d );
-    }
-
-    void project ( int N, float * u, float * v, float * p, float * div )
-    {
-      int i, j;
-
-      FOR_EACH_CELL
-        div[IX(i,j)] = -0.5f*(u[IX(i+1,j)]-u[IX(i-1,j)]+v[IX(i,j+1)]-v[IX(i,j-1)])/N;
-      p[IX(i,j)] = 0;
-      END_FOR	
-        set_bnd ( N, 0, div ); set_bnd ( N, 0, p );
-
-      lin_solve ( N, 0, p, div, 1, 4 );
-
-      FOR_EACH_CELL
-        u[IX(i,j)] -= 0.5f*N*(p[IX(i+1,j)]-p[IX(i-1,j)]);
-      v[IX(i,j)] -= 0.5f*N*(p[IX(i,j+1)]-p[IX(i,j-1)]);
-      END_FOR
-        set_bnd ( N, 1, u ); set_bnd ( N, 2, v );
-    }
-
-    void dens_step ( int N, float * x, float * x0, float * u, float * v, float diff, float dt )
-    {
-      add_source ( N, x, x0, dt );
-      SWAP ( x0, x ); diffuse ( N, 0, x, x0, diff, dt );
-      SWAP ( x0, x ); advect ( N, 0, x, x0, u, v, dt );
-    }
-
-    void vel_step ( int N, float * u, float * v, float * u0, float * v0, float visc, float dt )
-    {
-      add_source ( N, u, u0, dt ); add_source ( N, v, v0, dt );
-      diffuse ( N, 1, u0, u, visc, dt );
-      diffuse ( N, 2, v0, v, visc, dt );
-      project ( N, u0, v0, u, v );
-      advect ( N, 1, u, u0, u0, v0, dt ); advect ( N, 2, v, v0, u0, v0, dt );
-      project ( N, u, v, u0, v0 );
-    }
-
-
   public:
     /// this is called when we construct the class before everything is initialised.
     fluidshader(int argc, char **argv) : app(argc, argv) {
+      replayFile = 0;
+      for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "-replay") && i + 1 < argc) replayFile = argv[++i];
+      }
     }
 
     /// this is called once OpenGL is initialized
@@ -303,13 +210,92 @@ namespace octet {
       source = 100.0f;
 
       dvel = 0;
+      dpart = 0;
+      dbodies = 0;
+      dduct = 0;
       currentAngle = 0;
       if ( !allocate_data () ) exit ( 1 );
       clear_data ();
 
+      workers.init();
+      solver.init(grid, &workers);
+      solver.set_pressure_solver(fluid_solver::pressure_multigrid);
+      solver.set_cfl(2.0f, 8);
+      printf("fluid solver: %d threads, %s kernels\n", workers.get_num_threads(), fluid_simd::get_name(solver.get_simd()));
+
+      particles.init(&workers, 1 << 20);
+      particlePoints.resize(particles.get_capacity()*2);
+
+      solids.init(N, grid.get_stride());
+      #if OCTET_BULLET
+        float fluidLength = 18.0f;
+        coupling.init(&world, &solids, N, -fluidLength/2.0f, fluidLength/Nborder);
+        coupling.set_density(0.05f);
+        addBodies();
+      #endif
+
+      stepCount = 0;
+      memset(keyWasDown, 0, sizeof(keyWasDown));
+      checkpoint.init(grid, &solver);
+      if (replayFile) loadState(replayFile);
+
       initVBO();
     }
 
+    // true on the frame a key goes down, so holding it doesn't save every frame
+    bool keyPressed(unsigned key) {
+      bool down = is_key_down(key);
+      bool pressed = down && !keyWasDown[key & 0xff];
+      keyWasDown[key & 0xff] = down;
+      return pressed;
+    }
+
+    void saveState(const char *filename) {
+      checkpoint.set_state(stepCount, dt, particles.get_random_state());
+      if (checkpoint.save(filename)) printf("Saved step %d to %s\n", stepCount, filename);
+    }
+
+    // load a checkpoint, and replay the input if it is a recording
+    void loadState(const char *filename) {
+      if (!checkpoint.load(filename)) return;
+      stepCount = checkpoint.get_step();
+      dt = checkpoint.get_dt();
+      particles.clear();
+      particles.set_random_state(checkpoint.get_seed());
+      if (checkpoint.is_replaying()) {
+        // the time budget would make the steps depend on the machine
+        solver.set_time_budget(0);
+        printf("Replaying %d steps from step %d of %s\n", checkpoint.get_num_inputs(), stepCount, filename);
+      } else {
+        printf("Loaded step %d from %s\n", stepCount, filename);
+      }
+    }
+
+    // feed get_from_UI the recorded mouse while replaying, and record the
+    // mouse it gets while recording
+    void replayInput() {
+      fluid_checkpoint::input in;
+      if (checkpoint.is_replaying()) {
+        if (checkpoint.next_input(in)) {
+          win_x = in.win_x; win_y = in.win_y;
+          mx = in.mx; my = in.my;
+          omx = in.omx; omy = in.omy;
+          for (int k = 0; k != 3; ++k) mouse_down[k] = (in.buttons >> k) & 1;
+        } else {
+          printf("Replay finished at step %d\n", stepCount);
+        }
+      }
+
+      if (checkpoint.is_recording()) {
+        in.step = stepCount;
+        in.win_x = win_x; in.win_y = win_y;
+        in.mx = mx; in.my = my;
+        in.omx = omx; in.omy = omy;
+        in.buttons = mouse_down[0] | (mouse_down[1] << 1) | (mouse_down[2] << 2);
+        checkpoint.record(in);
+      }
+    }
+
     void readMouse() {
       omx = mx;
       omy = my;
@@ -323,6 +309,84 @@ namespace octet {
         dvel = dvel? 0: 1;
         printf("Changing dvel to %d\n", dvel);
       }
+
+      if (keyPressed('P')) {
+        dpart = dpart? 0: 1;
+        if (!dpart) particles.clear();
+        printf("Particles: %s\n", dpart ? "on" : "off");
+      }
+
+      if (keyPressed('O')) {
+        dbodies = dbodies? 0: 1;
+        solver.set_solids(dbodies || dduct ? &solids : NULL);
+        #if OCTET_BULLET
+          if (dbodies) resetBodies();
+        #endif
+        if (!dbodies) {
+          for (int id = 0; id != solids.get_num_bodies(); ++id) solids.remove_body(id);
+        }
+        printf("Bodies: %s\n", dbodies ? "on" : "off");
+        printPressureSolver();
+      }
+
+      if (keyPressed('D')) {
+        dduct = dduct? 0: 1;
+        paintDuct(dduct != 0);
+        solver.set_solids(dbodies || dduct ? &solids : NULL);
+        printf("Duct: %s\n", dduct ? "on" : "off");
+        printPressureSolver();
+      }
+
+      if (keyPressed('K')) {
+        int next = (particles.get_integrator() + 1) % fluid_particles::num_integrators;
+        particles.set_integrator((fluid_particles::integrator_t)next);
+        printf("Particle integrator: %s\n", fluid_particles::get_integrator_name(next));
+      }
+
+      if (keyPressed('M')) {
+        int next = (solver.get_pressure_solver() + 1) % 3;
+        solver.set_pressure_solver((fluid_solver::pressure_solver_t)next);
+        printPressureSolver();
+      }
+
+      if (keyPressed('A')) {
+        static const char *names[] = { "semi-lagrangian", "maccormack", "bfecc" };
+        int next = (solver.get_advection() + 1) % 3;
+        solver.set_advection((fluid_solver::advection_t)next);
+        printf("Advection: %s\n", names[next]);
+      }
+
+      if (keyPressed('B')) {
+        solver.set_sparse(!solver.get_sparse());
+        printf("Sparse bricks: %s\n", solver.get_sparse() ? "on" : "off");
+      }
+
+      if (keyPressed('T')) {
+        solver.set_time_budget(solver.get_time_budget() > 0 ? 0 : 0.008);
+        printf("Time budget: %s\n", solver.get_time_budget() > 0 ? "8ms" : "off");
+      }
+
+      if (keyPressed('S')) {
+        saveState("fluid_checkpoint.bin");
+      }
+
+      if (keyPressed('L')) {
+        loadState("fluid_checkpoint.bin");
+      }
+
+      if (keyPressed('R')) {
+        if (checkpoint.is_recording()) {
+          checkpoint.end_record();
+          printf("Recorded %d steps to fluid_replay.bin\n", checkpoint.get_num_inputs());
+        } else {
+          checkpoint.set_state(stepCount, dt, particles.get_random_state());
+          if (checkpoint.begin_record("fluid_replay.bin")) printf("Recording from step %d\n", stepCount);
+        }
+      }
+
+      if (keyPressed('Y') && !checkpoint.is_recording()) {
+        loadState("fluid_replay.bin");
+      }
     }
 
     /// this is called to draw the world
@@ -340,13 +404,64 @@ namespace octet {
       
       mat4t modelToProjection = setProjection(vx, vy);
       
-      fshader.render(modelToProjection);
+      fshader.render(modelToProjection, 0);
       renderFluid();
       if (dvel) {
         vec4 color(1.0f, 1.0f, 0.0f, 1.0f);
         cshader.render(modelToProjection, color);
         renderVelocities();
       }
+      if (dpart) {
+        vec4 color(0.4f, 0.8f, 1.0f, 1.0f);
+        cshader.render(modelToProjection, color);
+        renderParticles();
+      }
+      if (dbodies || dduct) {
+        vec4 color(1.0f, 0.5f, 0.2f, 1.0f);
+        cshader.render(modelToProjection, color);
+        renderBodies();
+      }
+    }
+
+    // the chosen pressure solver, and the one project() falls back to
+    // while there are bodies or a duct
+    void printPressureSolver() {
+      static const char *names[] = { "gauss-seidel", "multigrid", "pcg" };
+      int chosen = solver.get_pressure_solver(), active = solver.get_active_pressure_solver();
+      if (chosen == active) {
+        printf("Pressure solver: %s\n", names[chosen]);
+      } else {
+        printf("Pressure solver: %s (%s while there are solids)\n", names[chosen], names[active]);
+      }
+    }
+
+    // solid part b of the duct, its two walls and a block, as cells
+    // box[0], box[1] to box[2], box[3]. The channel is rows lo to hi.
+    void getDuctBox(int b, int box[4], int &lo, int &hi) {
+      lo = N*3/8;
+      hi = N*5/8;
+      int boxes[3][4] = {
+        { 1, 1, N, lo-1 },
+        { 1, hi+1, N, N },
+        { N/3, N/2 - N/16, N/3 + N/8, N/2 + N/16 },
+      };
+      memcpy(box, boxes[b], sizeof(boxes[b]));
+    }
+
+    // a channel across the middle, blown through from an inflow at its
+    // left end to an outflow at its right end, with a block in the way.
+    // While it is on the solver relaxes the pressure with gauss-seidel, as
+    // only that sees the duct and the zero pressure of the outflow.
+    void paintDuct(bool on) {
+      solids.clear_cells();
+      if (!on) return;
+      int box[4], lo, hi;
+      for (int b = 0; b != 3; b++) {
+        getDuctBox(b, box, lo, hi);
+        solids.set_cells(box[0], box[1], box[2], box[3], fluid_solids::cell_solid);
+      }
+      solids.set_cells(1, lo, 1, hi, fluid_solids::cell_inflow, 0.2f, 0.0f);
+      solids.set_cells(N, lo, N, hi, fluid_solids::cell_outflow);
     }
 
     mat4t setProjection(int vx, int vy) {
@@ -363,25 +478,52 @@ namespace octet {
     } 
 
     void calculateFluid() {
+      float *u = grid.get(u_field), *u_prev = grid.get_prev(u_field);
+      float *v = grid.get(v_field), *v_prev = grid.get_prev(v_field);
+      float *dens = grid.get(dens_field), *dens_prev = grid.get_prev(dens_field);
+
+      replayInput();
       get_from_UI ( dens_prev, u_prev, v_prev );
-      vel_step ( N, u, v, u_prev, v_prev, visc, dt );
-      dens_step ( N, dens, dens_prev, u, v, diff, dt );
+      float *fields[] = { dens, dens_prev, u_prev, v_prev };
+      solver.update_active ( u, v, fields, 4, dt );
+      #if OCTET_BULLET
+        // voxelise the bodies where the physics left them, then give them
+        // the push of the step's pressure before the physics moves them on
+        if (dbodies) coupling.update_solids();
+      #endif
+      solver.step ( u, v, u_prev, v_prev, dens, dens_prev, visc, diff, dt );
+      stepCount++;
+      #if OCTET_BULLET
+        if (dbodies) {
+          coupling.apply_impulses();
+          world.step(dt);
+        }
+      #endif
+
+      if (dpart) {
+        // replace the particles that die each step, so the pool stays full
+        particles.emit_uniform(N, (int)(particles.get_capacity() * dt / particles.get_lifetime()));
+        particles.step(grid, u, v, dt);
+      }
 
-      glBindBuffer(GL_ARRAY_BUFFER, fluidDensity0VBO);
-      glBufferSubData(GL_ARRAY_BUFFER, 0, Nborder*Nborder*sizeof(GLfloat), dens);
+      // one contiguous copy of the whole grid into the texture
+      grid.copy_out(dens_field, densUpload.data());
+      glActiveTexture(GL_TEXTURE0);
+      glBindTexture(GL_TEXTURE_2D, fluidDensityTexture);
+      glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, Nborder, Nborder, GL_RED, GL_FLOAT, densUpload.data());
     }
 
     void renderFluid() {
+      glActiveTexture(GL_TEXTURE0);
+      glBindTexture(GL_TEXTURE_2D, fluidDensityTexture);
+
+      glBindBuffer(GL_ARRAY_BUFFER, fluidQuadVBO);
       glEnableVertexAttribArray(attribute_pos);
-      glBindBuffer(GL_ARRAY_BUFFER, fluidPositionsVBO);
-      glVertexAttribPointer(attribute_pos, 3, GL_FLOAT, GL_FALSE, 0, (void *)0);
-      
+      glVertexAttribPointer(attribute_pos, 2, GL_FLOAT, GL_FALSE, 4*sizeof(GLfloat), (void *)0);
       glEnableVertexAttribArray(attribute_uv);
-      glBindBuffer(GL_ARRAY_BUFFER, fluidDensity0VBO);
-      glVertexAttribPointer(attribute_uv, 1, GL_FLOAT, GL_FALSE, 0, (void *)0);
-      
-      glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, fluidIndicesVBO);
-      glDrawElements(GL_TRIANGLES, (N+1)*(N+1)*2*3, GL_UNSIGNED_SHORT, 0);
+      glVertexAttribPointer(attribute_uv, 2, GL_FLOAT, GL_FALSE, 4*sizeof(GLfloat), (void *)(2*sizeof(GLfloat)));
+
+      glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
       
       glFlush();
 
@@ -390,6 +532,7 @@ namespace octet {
     }
 
     void renderVelocities() {
+      const float *u = grid.get(u_field), *v = grid.get(v_field);
       float fluidLength = 18.0f;
       float fluidStep = fluidLength/Nborder;
 
@@ -399,19 +542,123 @@ namespace octet {
           uvArrayPositions[(j*Nborder+i)*6+1] = -fluidLength/2.0f+j*fluidStep;
           uvArrayPositions[(j*Nborder+i)*6+2] = 0.0f;
 
-          uvArrayPositions[(j*Nborder+i)*6+3] = -fluidLength/2.0f+i*fluidStep + u[IX(i, j)];
-          uvArrayPositions[(j*Nborder+i)*6+4] = -fluidLength/2.0f+j*fluidStep + v[IX(i, j)];
+          uvArrayPositions[(j*Nborder+i)*6+3] = -fluidLength/2.0f+i*fluidStep + u[grid.index(i, j)];
+          uvArrayPositions[(j*Nborder+i)*6+4] = -fluidLength/2.0f+j*fluidStep + v[grid.index(i, j)];
           uvArrayPositions[(j*Nborder+i)*6+5] = 0.0f;
         }
       }
 
-      glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, fluidVelocitiesIndicesVBO);
       glBindBuffer(GL_ARRAY_BUFFER, fluidVelocitiesPositionsVBO);
-      glBufferSubData(GL_ARRAY_BUFFER, 0, Nborder*Nborder*6*sizeof(GLfloat), uvArrayPositions);
+      glBufferSubData(GL_ARRAY_BUFFER, 0, Nborder*Nborder*6*sizeof(GLfloat), uvArrayPositions.data());
       glLineWidth(1.5f);
       glEnableVertexAttribArray(attribute_pos);
       glVertexAttribPointer(attribute_pos, 3, GL_FLOAT, GL_FALSE, 0, 0);
-      glDrawElements(GL_LINES, Nborder*Nborder*2, GL_UNSIGNED_SHORT, 0);
+      glDrawArrays(GL_LINES, 0, Nborder*Nborder*2);
+      glDisableVertexAttribArray(attribute_pos);
+    }
+
+    // the live tracers, as points
+    void renderParticles() {
+      float fluidLength = 18.0f;
+      float fluidStep = fluidLength/Nborder;
+      int count = particles.write_points(particlePoints.data(), -fluidLength/2.0f, fluidStep);
+
+      glBindBuffer(GL_ARRAY_BUFFER, fluidParticlesVBO);
+      glBufferSubData(GL_ARRAY_BUFFER, 0, count*2*sizeof(GLfloat), particlePoints.data());
+      glEnableVertexAttribArray(attribute_pos);
+      glVertexAttribPointer(attribute_pos, 2, GL_FLOAT, GL_FALSE, 0, 0);
+      glDrawArrays(GL_POINTS, 0, count);
+      glDisableVertexAttribArray(attribute_pos);
+    }
+
+    #if OCTET_BULLET
+      // a ball and a box above the fluid and a floor below it, all kept in
+      // the plane of the fluid
+      void addBodies() {
+        mat4t modelToWorld;
+        modelToWorld.loadIdentity();
+        modelToWorld.translate(0, -9.5f, 0);
+        world.add_rigid_body(modelToWorld, vec4(9, 0.5f, 1, 0), false, physics_world::body_box);
+
+        bodyHandles.push_back(world.add_rigid_body(modelToWorld, vec4(1.2f, 0, 0, 0), true, physics_world::body_sphere));
+        bodySizes.push_back(vec4(1.2f, 0, 0, 0));
+        bodyHandles.push_back(world.add_rigid_body(modelToWorld, vec4(1.5f, 0.8f, 1, 0), true, physics_world::body_box));
+        bodySizes.push_back(vec4(1.5f, 0.8f, 1, 0));
+
+        for (int i = 0; i != bodyHandles.size(); i++) {
+          btRigidBody *body = world.get_rigid_body(bodyHandles[i]);
+          body->setLinearFactor(btVector3(1, 1, 0));
+          body->setAngularFactor(btVector3(0, 0, 1));
+          coupling.add_body(bodyHandles[i]);
+        }
+      }
+
+      // drop the bodies from the top again
+      void resetBodies() {
+        for (int i = 0; i != bodyHandles.size(); i++) {
+          btRigidBody *body = world.get_rigid_body(bodyHandles[i]);
+          btTransform transform;
+          transform.setIdentity();
+          transform.setOrigin(btVector3(i * 4.0f - 2.0f, 6.0f, 0));
+          body->setCenterOfMassTransform(transform);
+          body->getMotionState()->setWorldTransform(transform);
+          body->setLinearVelocity(btVector3(0, 0, 0));
+          body->setAngularVelocity(btVector3(0, 0, 0));
+          body->activate();
+        }
+      }
+    #endif
+
+    // outlines of the bodies in the fluid
+    void renderBodies() {
+      dynarray<float> lines;
+      dynarray<int> counts;
+      #if OCTET_BULLET
+        for (int i = 0; i != bodyHandles.size() && dbodies; i++) {
+          mat4t modelToWorld;
+          world.get_modelToWorld(modelToWorld, bodyHandles[i]);
+          vec4 size = bodySizes[i];
+          int count = size[1] == 0 ? 24 : 4;
+          for (int k = 0; k != count; k++) {
+            vec4 corner;
+            if (size[1] == 0) {
+              float angle = k * (2 * 3.14159265f / count);
+              corner = vec4(cosf(angle) * size[0], sinf(angle) * size[0], 0, 1);
+            } else {
+              corner = vec4(k == 1 || k == 2 ? size[0] : -size[0], k >= 2 ? size[1] : -size[1], 0, 1);
+            }
+            vec4 pos = corner * modelToWorld;
+            lines.push_back(pos[0]);
+            lines.push_back(pos[1]);
+          }
+          counts.push_back(count);
+        }
+      #endif
+
+      if (dduct) {
+        // the edges of the duct's walls and block, half a cell out from their cells
+        float fluidLength = 18.0f;
+        float fluidStep = fluidLength/Nborder;
+        int box[4], lo, hi;
+        for (int b = 0; b != 3; b++) {
+          getDuctBox(b, box, lo, hi);
+          float x0 = -fluidLength/2.0f + (box[0] - 0.5f) * fluidStep;
+          float y0 = -fluidLength/2.0f + (box[1] - 0.5f) * fluidStep;
+          float x1 = -fluidLength/2.0f + (box[2] + 0.5f) * fluidStep;
+          float y1 = -fluidLength/2.0f + (box[3] + 0.5f) * fluidStep;
+          float corners[] = { x0, y0, x1, y0, x1, y1, x0, y1 };
+          for (int k = 0; k != 8; k++) lines.push_back(corners[k]);
+          counts.push_back(4);
+        }
+      }
+
+      glBindBuffer(GL_ARRAY_BUFFER, fluidBodiesVBO);
+      glBufferData(GL_ARRAY_BUFFER, lines.size()*sizeof(GLfloat), (void *)lines.data(), GL_STREAM_DRAW);
+      glEnableVertexAttribArray(attribute_pos);
+      glVertexAttribPointer(attribute_pos, 2, GL_FLOAT, GL_FALSE, 0, 0);
+      for (int i = 0, first = 0; i != (int)counts.size(); first += counts[i++]) {
+        glDrawArrays(GL_LINE_LOOP, first, counts[i]);
+      }
       glDisableVertexAttribArray(attribute_pos);
     }
   };
@@ -9,6 +9,18 @@
 
 #include "../../octet.h"
 
+#include "fluid_timer.h"
+#include "fluid_workers.h"
+#include "fluid_grid.h"
+#include "fluid_simd.h"
+#include "fluid_multigrid.h"
+#include "fluid_pcg.h"
+#include "fluid_bricks.h"
+#include "fluid_solids.h"
+#include "fluid_solver.h"
+#include "fluid_solver3d.h"
+#include "fluid_particles.h"
+#include "fluid_checkpoint.h"
 #include "fluidshader.h"
 
 /// Create a box with octet
@@ -0,0 +1,238 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2012-2014
+//
+// Modular Framework for OpenGLES2 rendering on multiple platforms.
+//
+// Builds OpenCL programs, keeping their binaries on disk so that later
+// runs skip the compiler.
+//
+// The binary of a program is kept next to its source, in
+// <source>.<key>.bin, where the key is a hash of the device name, the
+// driver version and the build options. The file starts with a hash of
+// the source, so editing the source rebuilds it. If the file is missing or
+// stale, or the driver won't take the binary, the program is built from
+// source and its binary saved for next time. Any .cl file can be built
+// this way: fluids.cl, raytracer.cl or add_numbers.cl.
+//
+// The programs built are also kept in memory, one variant for each
+// context, device, file and set of options, so building the same variant
+// again, for example with -D options for a grid size, returns it with a
+// new reference. release(ctx) lets a context's variants go.
+//
+
+namespace octet {
+  class cl_program_cache {
+    enum { magic = 0x42434c4f, version = 1 }; // "OCLB"
+
+    // a program in memory, holding a reference to it
+    struct variant {
+      cl_context ctx;
+      cl_device_id dev;
+      string filename;
+      string options;
+      cl_program program;
+    };
+
+    static dynarray<variant *> &get_variants() {
+      static dynarray<variant *> variants;
+      return variants;
+    }
+
+    static cl_program find_variant(cl_context ctx, cl_device_id dev, const char *filename, const char *options) {
+      dynarray<variant *> &variants = get_variants();
+      for (int i = 0; i != (int)variants.size(); ++i) {
+        variant *v = variants[i];
+        if (v->ctx == ctx && v->dev == dev && v->filename == filename && v->options == options) {
+          return v->program;
+        }
+      }
+      return NULL;
+    }
+
+    static void add_variant(cl_context ctx, cl_device_id dev, const char *filename, const char *options, cl_program program) {
+      variant *v = new variant;
+      v->ctx = ctx;
+      v->dev = dev;
+      v->filename = filename;
+      v->options = options;
+      v->program = program;
+      clRetainProgram(program);
+      get_variants().push_back(v);
+    }
+
+    // FNV-1a, 64 bit
+    static uint64_t hash(const void *data, size_t size, uint64_t h = 0xcbf29ce484222325ULL) {
+      const unsigned char *bytes = (const unsigned char *)data;
+      for (size_t i = 0; i != size; ++i) {
+        h = (h ^ bytes[i]) * 0x100000001b3ULL;
+      }
+      return h;
+    }
+
+    static uint64_t hash_string(const char *str, uint64_t h) {
+      // include the terminator so "ab" "c" and "a" "bc" differ
+      return hash(str, strlen(str) + 1, h);
+    }
+
+    static uint64_t hash_device_info(cl_device_id dev, cl_device_info param, uint64_t h) {
+      char value[256];
+      value[0] = 0;
+      clGetDeviceInfo(dev, param, sizeof(value), value, NULL);
+      value[sizeof(value)-1] = 0;
+      return hash_string(value, h);
+    }
+
+    static bool read_file(const char *path, dynarray<unsigned char> &buffer) {
+      FILE *file = fopen(path, "rb");
+      if (!file) return false;
+      fseek(file, 0, SEEK_END);
+      buffer.resize((unsigned)ftell(file));
+      fseek(file, 0, SEEK_SET);
+      bool ok = fread(buffer.data(), 1, buffer.size(), file) == buffer.size();
+      fclose(file);
+      return ok;
+    }
+
+    static void print_build_log(cl_program program, cl_device_id dev) {
+      size_t log_size = 0;
+      clGetProgramBuildInfo(program, dev, CL_PROGRAM_BUILD_LOG, 0, NULL, &log_size);
+      char *program_log = (char *)malloc(log_size + 1);
+      program_log[log_size] = '\0';
+      clGetProgramBuildInfo(program, dev, CL_PROGRAM_BUILD_LOG, log_size + 1, program_log, NULL);
+      printf("%s\n", program_log);
+      free(program_log);
+    }
+
+    // the program from a cached binary, or NULL if there isn't a good one
+    static cl_program load_binary(cl_context ctx, cl_device_id dev, const char *path, uint64_t source_hash, const char *options) {
+      dynarray<unsigned char> file;
+      if (!read_file(path, file) || file.size() <= 16) return NULL;
+
+      uint32_t file_magic, file_version;
+      uint64_t file_source_hash;
+      memcpy(&file_magic, &file[0], 4);
+      memcpy(&file_version, &file[4], 4);
+      memcpy(&file_source_hash, &file[8], 8);
+      if (file_magic != magic || file_version != version || file_source_hash != source_hash) return NULL;
+
+      size_t binary_size = file.size() - 16;
+      const unsigned char *binary = &file[16];
+      cl_int status, err;
+      cl_program program = clCreateProgramWithBinary(ctx, 1, &dev, &binary_size, &binary, &status, &err);
+      if (err < 0 || status < 0) {
+        if (program) clReleaseProgram(program);
+        return NULL;
+      }
+      if (clBuildProgram(program, 1, &dev, options, NULL, NULL) < 0) {
+        clReleaseProgram(program);
+        return NULL;
+      }
+      return program;
+    }
+
+    // write the binary of program for dev to path, after the header
+    static void save_binary(cl_program program, cl_device_id dev, const char *path, uint64_t source_hash) {
+      cl_uint num_devices = 0;
+      clGetProgramInfo(program, CL_PROGRAM_NUM_DEVICES, sizeof(num_devices), &num_devices, NULL);
+      if (num_devices == 0) return;
+
+      dynarray<cl_device_id> devices(num_devices);
+      dynarray<size_t> sizes(num_devices);
+      clGetProgramInfo(program, CL_PROGRAM_DEVICES, num_devices * sizeof(cl_device_id), devices.data(), NULL);
+      if (clGetProgramInfo(program, CL_PROGRAM_BINARY_SIZES, num_devices * sizeof(size_t), sizes.data(), NULL) < 0) return;
+
+      // every device's binary has to be asked for, even if only one is kept
+      dynarray<unsigned char *> binaries(num_devices);
+      int index = -1;
+      for (unsigned i = 0; i != num_devices; ++i) {
+        binaries[i] = sizes[i] ? (unsigned char *)malloc(sizes[i]) : NULL;
+        if (devices[i] == dev) index = (int)i;
+      }
+      cl_int err = clGetProgramInfo(program, CL_PROGRAM_BINARIES, num_devices * sizeof(unsigned char *), binaries.data(), NULL);
+
+      if (err >= 0 && index >= 0 && sizes[index]) {
+        FILE *file = fopen(path, "wb");
+        if (file) {
+          uint32_t header[2] = { magic, version };
+          fwrite(header, 4, 2, file);
+          fwrite(&source_hash, 8, 1, file);
+          fwrite(binaries[index], 1, sizes[index], file);
+          fclose(file);
+        } else {
+          printf("Could not save the program binary %s\n", path);
+        }
+      }
+      for (unsigned i = 0; i != num_devices; ++i) {
+        free(binaries[i]);
+      }
+    }
+
+  public:
+    /// build the program in filename, relative to app_utils::prefix(), for
+    /// dev with the given build options. Returns the variant in memory or
+    /// loads the cached binary if there is a good one. Prints the build
+    /// log and returns NULL if the source doesn't build. The caller
+    /// releases the program.
+    static cl_program build(cl_context ctx, cl_device_id dev, const char *filename, const char *options = "") {
+      cl_program program = find_variant(ctx, dev, filename, options);
+      if (program) {
+        clRetainProgram(program);
+        return program;
+      }
+
+      // get_path() reuses its result, so take a copy
+      string source_path = app_utils::get_path(filename);
+      dynarray<unsigned char> source;
+      if (!read_file(source_path.c_str(), source) || source.size() == 0) {
+        perror("Could not find the program file");
+        return NULL;
+      }
+
+      uint64_t source_hash = hash(source.data(), source.size());
+      uint64_t key = hash_device_info(dev, CL_DEVICE_NAME, 0xcbf29ce484222325ULL);
+      key = hash_device_info(dev, CL_DRIVER_VERSION, key);
+      key = hash_string(options, key);
+      string binary_path;
+      binary_path.format("%s.%08x%08x.bin", source_path.c_str(), (unsigned)(key >> 32), (unsigned)key);
+
+      program = load_binary(ctx, dev, binary_path.c_str(), source_hash, options);
+      if (program) {
+        add_variant(ctx, dev, filename, options, program);
+        return program;
+      }
+
+      const char *source_text = (const char *)source.data();
+      size_t source_size = source.size();
+      cl_int err;
+      program = clCreateProgramWithSource(ctx, 1, &source_text, &source_size, &err);
+      if (err < 0) {
+        perror("Could not create the program");
+        return NULL;
+      }
+      err = clBuildProgram(program, 1, &dev, options, NULL, NULL);
+      if (err < 0) {
+        print_build_log(program, dev);
+        clReleaseProgram(program);
+        return NULL;
+      }
+      save_binary(program, dev, binary_path.c_str(), source_hash);
+      add_variant(ctx, dev, filename, options, program);
+      return program;
+    }
+
+    /// drop the variants in memory built in ctx, before releasing it
+    static void release(cl_context ctx) {
+      dynarray<variant *> &variants = get_variants();
+      for (int i = 0; i != (int)variants.size(); ) {
+        if (variants[i]->ctx == ctx) {
+          clReleaseProgram(variants[i]->program);
+          delete variants[i];
+          variants.erase(i);
+        } else {
+          ++i;
+        }
+      }
+    }
+  };
+}
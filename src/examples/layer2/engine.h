@@ -35,36 +35,50 @@ namespace octet {
     // OpenCL stuff
     cl_device_id clDeviceID;
     cl_context clContext;
-    cl_program clProgram;
-    cl_kernel clAddSourceFloat2Kernel;
-    cl_kernel clLinSolveFloat2Kernel;
-    cl_kernel clLinSolveFloat2ipKernel;
-    cl_kernel clSetBoundFloat2Kernel;
-    cl_kernel clSetBoundEndFloat2Kernel;
-    cl_kernel clAddSourceFloatKernel;
-    cl_kernel clLinSolveFloatKernel;
-    cl_kernel clSetBoundFloatKernel;
-    cl_kernel clSetBoundEndFloatKernel;
-    cl_kernel clProjectStartKernel;
-    cl_kernel clProjectEndKernel;
-    cl_kernel clAdvectFloat2Kernel;
-    cl_kernel clAdvectFloatKernel;
-
     cl_command_queue clQueue;
 
-    cl_mem uv0_buffer;
-    cl_mem uv1_buffer;
-    cl_mem dens0_buffer;
-    cl_mem dens1_buffer;
+    // the GL pixel buffers of the density, shared with OpenCL. Each frame
+    // the solver copies its density into one while GL uploads the other,
+    // display_front, which the frame before filled, to the density
+    // texture. display_done[i] is the release of buffer i to GL after its
+    // copy. With the solver's half storage they hold half floats, uploaded
+    // as GL_HALF_FLOAT into an R16F texture.
+    cl_mem display_buffers[2];
+    cl_event display_done[2];
+    int display_front;
+
+    // the lines of the velocity, written by the solver into GL vertex
+    // buffers in the same frames as the density while dvel is on
+    cl_mem velocity_buffers[2];
+
+    // tracers carried by the velocity while dpart is on, two floats of
+    // position each in GL vertex buffers drawn as GL_POINTS; their ages
+    // stay on the device. Each frame the solver moves them from
+    // particle_last, which it wrote the frame before, into the next buffer
+    // round while GL draws the third, particle_front. That one was last
+    // acquired by CL the frame before, and its release is waited for at
+    // the end of calculateFluid, so GL never draws a buffer CL holds.
+    cl_mem particle_buffers[3];
+    cl_mem particle_ages;
+    int particle_last;
+    int particle_front;
+    int num_particles;
+    float particle_lifetime;
+    bool particle_rk3;
+
+    // the kernel chain of fluids.cl
+    fluid_cl_solver solver;
 
     GLuint vertexArrayID;
-    GLuint fluidPositionsVBO;
-    GLuint fluidIndicesVBO;
+    GLuint fluidQuadVBO;
+    GLuint fluidDensityTexture;
     GLuint fluidDensity0VBO;
     GLuint fluidDensity1VBO;
 
-    GLuint fluidVelocitiesPositionsVBO;
-    GLuint fluidVelocitiesIndicesVBO;
+    GLuint fluidVelocities0VBO;
+    GLuint fluidVelocities1VBO;
+
+    GLuint fluidParticlesVBOs[3];
 
     // Fluid data
     unsigned int N;
@@ -82,10 +96,9 @@ namespace octet {
     int omx, omy, mx, my;
 
     int dvel;
+    int dpart;
 
-    float *uvArray;
-    float *dArray;
-    float *uvArrayPositions;
+    int substeps;
 
     /*** OPENCL SPECIFIC FUNCTIONS ***/
     int isExtensionSupported(const char *support_str, char *ext_string, size_t ext_buffer_size) {
@@ -118,78 +131,6 @@ namespace octet {
       printf("Found GL Sharing Support.\n");
     }
 
-    cl_kernel createKernel(cl_program prg, const char *kernel_name) {
-      cl_int err;
-      cl_kernel k = clCreateKernel(clProgram, kernel_name, &err);
-      if (err < 0) {
-        printf("Could not create kernel %s", kernel_name);
-        return NULL; 
-      }
-      return k;
-    }
-
-    void writeArray(cl_mem dst, float *src, unsigned int size) {
-      cl_int err = clEnqueueWriteBuffer(clQueue, dst, CL_TRUE, 0, size*sizeof(cl_float), (void *)src, 0, NULL, NULL);
-      if (err < 0) {
-        printf("Could not write array.");
-      }
-    }
-
-    void readArray(cl_mem src, float *dst, unsigned int size) {
-      cl_int err = clEnqueueReadBuffer(clQueue, src, CL_TRUE, 0, size*sizeof(cl_float), (void *)dst, 0, NULL, NULL);
-      if (err < 0) {
-        printf("Could not read array.");
-      }
-    }
-
-    cl_program buildProgram(cl_context ctx, cl_device_id dev, const char *filename) {
-      
-      cl_program program;
-      FILE *program_handle;
-      char *program_buffer, *program_log;
-      size_t program_size, log_size;
-      int err;
-
-      // Read program file and place content into buffer
-      program_handle = fopen(app_utils::get_path(filename), "r");
-      if (program_handle == NULL) {
-        perror("Could not find the program file");
-        exit(1);
-      }
-      fseek(program_handle, 0, SEEK_END);
-      program_size = ftell(program_handle);
-      rewind(program_handle);
-      program_buffer = (char *)malloc(program_size + 1);
-      program_buffer[program_size] = '\0';
-      fread(program_buffer, sizeof(char), program_size, program_handle);
-      fclose(program_handle);
-
-      // Create program from file
-      program = clCreateProgramWithSource(ctx, 1, 
-        (const char **)&program_buffer, &program_size, &err);
-      if (err < 0) {
-        perror("Could not create the program");
-        exit(1);
-      }
-      free(program_buffer);
-
-      // Build program
-      err = clBuildProgram(program, 0, NULL, "-cl-nv-verbose", NULL, NULL);
-      if (err < 0) {
-        // Find size of log and print to std output
-        clGetProgramBuildInfo(program, dev, CL_PROGRAM_BUILD_LOG,
-          0, NULL, &log_size);
-        program_log = (char *) malloc(log_size + 1);
-        program_log[log_size] = '\0';
-        clGetProgramBuildInfo(program, dev, CL_PROGRAM_BUILD_LOG,
-          log_size + 1, program_log, NULL);
-        printf("%s\n", program_log);
-        free(program_log);
-        exit(1);
-      }
-      return program; 
-    }
-
     void initOpenCL() {
       cl_int err;
 
@@ -244,97 +185,24 @@ namespace octet {
         perror("Could not create a context");
         return; //exit(1);
       }
-
-      // Build program
-      clProgram = buildProgram(clContext, clDeviceID, "assets/opencl/fluids.cl");
-
-      // Create data buffer
-      dynarray <float>uv0;
-      dynarray <float>uv1;
-      dynarray <float>dens0;
-      dynarray <float>dens1;
-
-      int size = (Nborder)*(Nborder);
-      uv0.resize(size*2);
-      uv1.resize(size*2);
-      dens0.resize(size);
-      dens1.resize(size);
-
-      for (int i = 0; i != size*2; i++) {
-        uv0[i] = 0;
-        uv1[i] = 0;
-      }
-      
-      for (int i = 0; i != size; i++) {
-        dens0[i] = 0;
-        dens1[i] = 0;
-      }
-      //print_float(dens0.data(), Nborder, Nborder, 1);
-
-      uv0_buffer = clCreateBuffer(clContext, CL_MEM_READ_WRITE |
-        CL_MEM_COPY_HOST_PTR, size * 2 * sizeof(float), uv0.data(), &err);
-      //dens0_buffer = clCreateBuffer(clContext, CL_MEM_READ_WRITE |
-      //  CL_MEM_COPY_HOST_PTR, size * sizeof(float), dens0.data(), &err);
-      uv1_buffer = clCreateBuffer(clContext, CL_MEM_READ_WRITE |
-        CL_MEM_COPY_HOST_PTR, size * 2 * sizeof(float), uv1.data(), &err);
-      //dens1_buffer = clCreateBuffer(clContext, CL_MEM_READ_WRITE |
-      //  CL_MEM_COPY_HOST_PTR, size * sizeof(float), dens1.data(), &err);
-      if (err < 0) {
-        perror("Could not create a buffer");
-        return; //exit(1);
-      }
-      
-      // Create a Command Queue
-      clQueue = clCreateCommandQueue(clContext, clDeviceID, 0, &err);
-      if (err < 0) {
-        perror("Could not create a command queue");
-        return; //exit(1);
-      }
-
-      // Create a Kernel
-      clAddSourceFloat2Kernel = createKernel(clProgram, "add_source_float2");
-      clLinSolveFloat2Kernel = createKernel(clProgram, "lin_solve_float2");
-      clLinSolveFloat2ipKernel = createKernel(clProgram, "lin_solve_float2_ip");
-      clSetBoundFloat2Kernel = createKernel(clProgram, "set_bnd_float2");
-      clSetBoundEndFloat2Kernel = createKernel(clProgram, "set_bnd_float2_end");
-      
-      clAddSourceFloatKernel = createKernel(clProgram, "add_source_float");
-      clLinSolveFloatKernel = createKernel(clProgram, "lin_solve_float");
-      clSetBoundFloatKernel = createKernel(clProgram, "set_bnd_float");
-      clSetBoundEndFloatKernel = createKernel(clProgram, "set_bnd_float_end");
-
-      clProjectStartKernel = createKernel(clProgram, "project_start");
-      clProjectEndKernel = createKernel(clProgram, "project_end");
-
-      clAdvectFloat2Kernel = createKernel(clProgram, "advect_float2");
-      clAdvectFloatKernel = createKernel(clProgram, "advect_float");
     }
 
     void initVBO() {
       cl_int err;
 
-      dynarray <float>fluidPositions;
+      // one quad over the grid, two floats of position and two of texture
+      // coordinate a corner. The corners sample the centres of the corner
+      // cells, so the texture filter blends cells as the old vertex grid did.
       float fluidStep = fluidLength/Nborder;
-      for (int i = 0; i != Nborder; i++) {
-        for (int j = 0; j != Nborder; j++) {
-          fluidPositions.push_back(-fluidLength/2.0f+j*fluidStep);
-          fluidPositions.push_back(-fluidLength/2.0f+i*fluidStep);
-          fluidPositions.push_back(0);
-        }
-      }
-      dynarray <unsigned short>fluidIndices;
-      for (int i = 0; i != N+1; i++) {
-        for (int j = 0; j != N+1; j++) {
-          fluidIndices.push_back(Nborder*(j+0)+(i+0));
-          fluidIndices.push_back(Nborder*(j+0)+(i+1));
-          fluidIndices.push_back(Nborder*(j+1)+(i+0));
+      float lo = -fluidLength/2.0f, hi = lo + (Nborder-1)*fluidStep;
+      float tlo = 0.5f/Nborder, thi = 1.0f - tlo;
+      float fluidQuad[] = {
+        lo, lo, tlo, tlo,
+        hi, lo, thi, tlo,
+        lo, hi, tlo, thi,
+        hi, hi, thi, thi,
+      };
 
-          fluidIndices.push_back(Nborder*(j+0)+(i+1));
-          fluidIndices.push_back(Nborder*(j+1)+(i+1));
-          fluidIndices.push_back(Nborder*(j+1)+(i+0));
-        }
-      }
-      
       dynarray <float>fluidDensity;
       fluidDensity.resize(Nborder*Nborder);
       for (int i = 0; i != Nborder*Nborder; i++) {
@@ -344,62 +212,76 @@ namespace octet {
       glGenVertexArrays(1, &vertexArrayID);
       glBindVertexArray(vertexArrayID);
 
-      glGenBuffers(1, &fluidPositionsVBO);
-      glGenBuffers(1, &fluidIndicesVBO);
+      glGenBuffers(1, &fluidQuadVBO);
       glGenBuffers(1, &fluidDensity0VBO);
       glGenBuffers(1, &fluidDensity1VBO);
-      glGenBuffers(1, &fluidVelocitiesPositionsVBO);
-      glGenBuffers(1, &fluidVelocitiesIndicesVBO);
+      glGenBuffers(1, &fluidVelocities0VBO);
+      glGenBuffers(1, &fluidVelocities1VBO);
+      glGenBuffers(3, fluidParticlesVBOs);
       
-      glBindBuffer(GL_ARRAY_BUFFER, fluidPositionsVBO);
-      glBufferData(GL_ARRAY_BUFFER, fluidPositions.size()*sizeof(GLfloat), (void *)fluidPositions.data(), GL_DYNAMIC_DRAW);
-      glVertexPointer(3, GL_FLOAT, 0, 0);
-
-      glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, fluidIndicesVBO);
-      glBufferData(GL_ELEMENT_ARRAY_BUFFER, fluidIndices.size()*sizeof(GLushort), (void *)fluidIndices.data(), GL_DYNAMIC_DRAW);
-
-      glBindBuffer(GL_ARRAY_BUFFER, fluidDensity0VBO);
-      glBufferData(GL_ARRAY_BUFFER, fluidDensity.size()*sizeof(GLfloat), (void *)fluidDensity.data(), GL_DYNAMIC_DRAW);
-      glVertexPointer(1, GL_FLOAT, 0, 0);
-      dens0_buffer = clCreateFromGLBuffer(clContext, CL_MEM_READ_WRITE, fluidDensity0VBO, &err);
-      if (err < 0) {
-        perror("Error creating CL buffer from GL.");
+      glBindBuffer(GL_ARRAY_BUFFER, fluidQuadVBO);
+      glBufferData(GL_ARRAY_BUFFER, sizeof(fluidQuad), (void *)fluidQuad, GL_STATIC_DRAW);
+
+      // the density texture, one cell a texel, refilled each frame from
+      // the front pixel buffer
+      bool half = solver.get_half_storage();
+      glGenTextures(1, &fluidDensityTexture);
+      glActiveTexture(GL_TEXTURE0);
+      glBindTexture(GL_TEXTURE_2D, fluidDensityTexture);
+      glTexImage2D(GL_TEXTURE_2D, 0, half ? GL_R16F : GL_R32F, Nborder, Nborder, 0, GL_RED, half ? GL_HALF_FLOAT : GL_FLOAT, NULL);
+      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+      // rows of halves need not be a multiple of four bytes
+      glPixelStorei(GL_UNPACK_ALIGNMENT, half ? 2 : 4);
+
+      // zero floats are zero halves too
+      size_t densityBytes = fluidDensity.size()*(half ? sizeof(cl_half) : sizeof(GLfloat));
+      GLuint densityVBOs[2] = { fluidDensity0VBO, fluidDensity1VBO };
+      for (int i = 0; i != 2; i++) {
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, densityVBOs[i]);
+        glBufferData(GL_PIXEL_UNPACK_BUFFER, densityBytes, (void *)fluidDensity.data(), GL_STREAM_DRAW);
+        display_buffers[i] = clCreateFromGLBuffer(clContext, CL_MEM_WRITE_ONLY, densityVBOs[i], &err);
+        if (err < 0) {
+          perror("Error creating CL buffer from GL.");
+        }
       }
+      glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
 
-      glBindBuffer(GL_ARRAY_BUFFER, fluidDensity1VBO);
-      glBufferData(GL_ARRAY_BUFFER, fluidDensity.size()*sizeof(GLfloat), (void *)fluidDensity.data(), GL_DYNAMIC_DRAW);
-      glVertexPointer(1, GL_FLOAT, 0, 0);
-      dens1_buffer = clCreateFromGLBuffer(clContext, CL_MEM_READ_WRITE, fluidDensity1VBO, &err);
-      if (err < 0) {
-        perror("Error creating CL buffer from GL.");
+      // two vertices a cell, filled in by the solver
+      GLuint velocityVBOs[2] = { fluidVelocities0VBO, fluidVelocities1VBO };
+      for (int i = 0; i != 2; i++) {
+        glBindBuffer(GL_ARRAY_BUFFER, velocityVBOs[i]);
+        glBufferData(GL_ARRAY_BUFFER, Nborder*Nborder*6*sizeof(GLfloat), NULL, GL_DYNAMIC_DRAW);
+        velocity_buffers[i] = clCreateFromGLBuffer(clContext, CL_MEM_WRITE_ONLY, velocityVBOs[i], &err);
+        if (err < 0) {
+          perror("Error creating CL buffer from GL.");
+        }
       }
 
-      for (int j = 0; j != Nborder; j++) {
-        for (int i = 0; i != Nborder; i++) {
-          uvArrayPositions[(j*Nborder+i)*6+0] = -fluidLength/2.0f+i*fluidStep;
-          uvArrayPositions[(j*Nborder+i)*6+1] = -fluidLength/2.0f+j*fluidStep;
-          uvArrayPositions[(j*Nborder+i)*6+2] = 0.0f;
-
-          uvArrayPositions[(j*Nborder+i)*6+3] = -fluidLength/2.0f+i*fluidStep;
-          uvArrayPositions[(j*Nborder+i)*6+4] = -fluidLength/2.0f+j*fluidStep;
-          uvArrayPositions[(j*Nborder+i)*6+5] = 0.0f;
+      // the tracers start anywhere in the interior at any age, so they
+      // don't all die in the same frame
+      dynarray<float> positions(num_particles*2), ages(num_particles);
+      for (int i = 0; i != num_particles; i++) {
+        positions[i*2+0] = -fluidLength/2.0f + (0.5f + N*(rand()/(RAND_MAX+1.0f)))*fluidStep;
+        positions[i*2+1] = -fluidLength/2.0f + (0.5f + N*(rand()/(RAND_MAX+1.0f)))*fluidStep;
+        ages[i] = particle_lifetime*(rand()/(RAND_MAX+1.0f));
+      }
+      for (int i = 0; i != 3; i++) {
+        glBindBuffer(GL_ARRAY_BUFFER, fluidParticlesVBOs[i]);
+        glBufferData(GL_ARRAY_BUFFER, num_particles*2*sizeof(GLfloat), (void *)positions.data(), GL_DYNAMIC_DRAW);
+        particle_buffers[i] = clCreateFromGLBuffer(clContext, CL_MEM_READ_WRITE, fluidParticlesVBOs[i], &err);
+        if (err < 0) {
+          perror("Error creating CL buffer from GL.");
         }
       }
-
-      dynarray<unsigned short>fluidVelocitiesIndices;
-      for (unsigned short i = 0; i != Nborder*Nborder; i++) {
-        fluidVelocitiesIndices.push_back(i*2);
-        fluidVelocitiesIndices.push_back(i*2+1);
+      particle_ages = clCreateBuffer(clContext, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, num_particles*sizeof(cl_float), ages.data(), &err);
+      if (err < 0) {
+        perror("Error creating the particle ages.");
       }
 
-      glBindBuffer(GL_ARRAY_BUFFER, fluidVelocitiesPositionsVBO);
-      glBufferData(GL_ARRAY_BUFFER, Nborder*Nborder*6*sizeof(GLfloat), (void *)uvArrayPositions, GL_DYNAMIC_DRAW);
-
-      glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, fluidVelocitiesIndicesVBO);
-      glBufferData(GL_ELEMENT_ARRAY_BUFFER, fluidVelocitiesIndices.size()*sizeof(GLushort), (void *)fluidVelocitiesIndices.data(), GL_DYNAMIC_DRAW);
-
       glBindBuffer(GL_ARRAY_BUFFER, 0);
-      glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
     }
 
     void synch() {
@@ -410,215 +292,12 @@ namespace octet {
       }
     }
     
-    /*** FLUID DYNAMICS FUNCTIONS ***/
-    
-    void dens_step ( int N, cl_mem dens1_buffer, cl_mem dens0_buffer, cl_mem uv0_buffer, float diff, float dt )
-    {
-      add_source(N, dens1_buffer, dens0_buffer, dt, clAddSourceFloatKernel);
-      diffuse(N, dens0_buffer, dens1_buffer, diff, dt, clLinSolveFloatKernel, clSetBoundFloatKernel, clSetBoundEndFloatKernel);
-      advect(N, dens1_buffer, dens0_buffer, uv0_buffer, dt, clAdvectFloatKernel, clSetBoundFloatKernel, clSetBoundEndFloatKernel);
-    }
-
-    void vel_step ( int N, cl_mem uv1_buffer, cl_mem uv0_buffer, float visc, float dt )
-    {
-      add_source(N, uv1_buffer, uv0_buffer, dt, clAddSourceFloat2Kernel);
-      diffuse(N, uv0_buffer, uv1_buffer, visc, dt, clLinSolveFloat2Kernel, clSetBoundFloat2Kernel, clSetBoundEndFloat2Kernel);
-      project(N, uv0_buffer, uv1_buffer);
-      advect(N, uv1_buffer, uv0_buffer, uv0_buffer, dt, clAdvectFloat2Kernel, clSetBoundFloat2Kernel, clSetBoundEndFloat2Kernel);
-      project(N, uv1_buffer, uv0_buffer);
-    }
-
-    void add_source ( int N, cl_mem x, cl_mem s, float dt, cl_kernel clAddSourceKern)
-    {
-      cl_int err;
-
-      size_t global_size[2] = {N, N};
-      size_t local_size[2] = {1, 1};
-      cl_int num_groups[2] = {global_size[0]/local_size[0], global_size[1]/local_size[1]};
-
-      int size = (N+2);
-
-      // Create Kernel Arguments
-      err = clSetKernelArg(clAddSourceKern, 0, sizeof(cl_mem), &s);
-      err |= clSetKernelArg(clAddSourceKern, 1, sizeof(cl_mem), &x);
-      err |= clSetKernelArg(clAddSourceKern, 2, sizeof(cl_int), &size);
-      err |= clSetKernelArg(clAddSourceKern, 3, sizeof(cl_float), &dt);
-      if (err < 0) {
-        perror("Could not create a kernel argument");
-      }
-
-      // Enqueue kernel
-
-      err = clEnqueueNDRangeKernel(clQueue, clAddSourceKern, 2, NULL, global_size, local_size, 0, NULL, NULL);
-      if (err < 0) {
-        perror("Could not enqueue the kernel");
-      }
-    }
-
-    void set_bnd ( int N, cl_mem x, cl_kernel setBndKern, cl_kernel setBndEndKern)
-    {
-      cl_int err;
-
-      size_t global_size = N;
-      size_t local_size = 1;
-      size_t end_size = 1;
-      size_t end_size_local = 1;
-
-      int Nborder = N + 2;
-
-      err = clSetKernelArg(setBndKern, 0, sizeof(cl_mem), &x);
-      err |= clSetKernelArg(setBndKern, 1, sizeof(cl_int), &Nborder);
-      if (err < 0) {
-        perror("Could not create a kernel argument for setBndKern");
-        return; //exit(1);
-      }
-
-      err = clSetKernelArg(setBndEndKern, 0, sizeof(cl_mem), &x);
-      err |= clSetKernelArg(setBndEndKern, 1, sizeof(int), &Nborder);
-      if (err < 0) {
-        perror("Could not create a kernel argument for setBndEndKern");
-        return; //exit(1);
-      }
-
-      err |= clEnqueueNDRangeKernel(clQueue, setBndKern, 1, NULL, &global_size,
-        &local_size, 0, NULL, NULL);
-      err |= clEnqueueNDRangeKernel(clQueue, setBndEndKern, 1, NULL, &end_size,
-        &end_size_local, 0, NULL, NULL);
-      if (err < 0) {
-        perror("Could not enqueue the kernel for set_bnd");
-        return; //exit(1);
-      }
-    } 
-
-    void lin_solve(int width, cl_mem x, cl_mem x0, float a, float c,
-                   cl_kernel linSolveKern, cl_kernel setBndKern, cl_kernel setBndEndKern)
-    {
-      cl_int err;
-      int k = 0;
-
-      size_t global_size[2] = {width, width};
-      size_t local_size[2] = {1, 1};
-      cl_int num_groups[2] = {global_size[0]/local_size[0], global_size[1]/local_size[1]};
-      
-      int Nborder = width+2;
-
-      // Create Kernel Arguments
-      err = clSetKernelArg(linSolveKern, 0, sizeof(cl_mem), &x0);
-      err |= clSetKernelArg(linSolveKern, 1, sizeof(cl_mem), &x);
-      err |= clSetKernelArg(linSolveKern, 2, sizeof(cl_int), &Nborder);
-      err |= clSetKernelArg(linSolveKern, 3, sizeof(cl_float), &a);
-      err |= clSetKernelArg(linSolveKern, 4, sizeof(cl_float), &c);
-      if (err < 0) {
-        perror("Could not create a kernel argument for linSolveKern");
-        return; //exit(1);
-      }
-
-      // Enqueue kernel
-      for (k = 0; k != 50; k++) {
-        err = clEnqueueNDRangeKernel(clQueue, linSolveKern, 2, NULL, global_size,
-          local_size, 0, NULL, NULL);
-        if (err < 0) {
-          perror("Could not enqueue the kernel for linSolveKern");
-          return; //exit(1);
-        }
-        set_bnd( width, x, setBndKern, setBndEndKern );
-      }
-    }
-
-    void diffuse ( int N, cl_mem x, cl_mem x0, float diff, float dt, cl_kernel linSolveKern, cl_kernel setBndKern, cl_kernel setBndEndKern)
-    {
-      float a=dt*diff*N*N;
-      lin_solve ( N, x, x0, a, 1+4*a, linSolveKern, setBndKern, setBndEndKern);
-    }
-    
-    void advect ( int N, cl_mem d, cl_mem d0, cl_mem uv, float dt, cl_kernel advectKern, cl_kernel setBndKern, cl_kernel setBndEndKern )
-    {
-      cl_int err;
-      float dt0 = dt*N;
-      int Nborder = N+2;
-
-      size_t global_size[2] = {N, N};
-      size_t local_size[2] = {1, 1};
-      size_t end_size = 1;
-      cl_int num_groups[2] = {global_size[0]/local_size[0], global_size[1]/local_size[1]};
-
-      // Create Kernel Arguments
-      err = clSetKernelArg(advectKern, 0, sizeof(cl_mem), &d0);
-      err |= clSetKernelArg(advectKern, 1, sizeof(cl_mem), &d);
-      err |= clSetKernelArg(advectKern, 2, sizeof(cl_mem), &uv);
-      err |= clSetKernelArg(advectKern, 3, sizeof(cl_int), &Nborder);
-      err |= clSetKernelArg(advectKern, 4, sizeof(cl_float), &dt0);
-      if (err < 0) {
-        perror("Could not create a kernel argument for advectKern");
-        return; //exit(1);
-      }
-
-      err = clEnqueueNDRangeKernel(clQueue, advectKern, 2, NULL, global_size,
-        local_size, 0, NULL, NULL);
-      if (err < 0) {
-        perror("Could not enqueue the kernel for advectKern");
-        return; //exit(1);
-      }
-      set_bnd ( N, d, setBndKern, setBndEndKern );
-    }
-
-    void project ( int N, cl_mem uv1, cl_mem uv0 )
-    {
-      cl_int err;
-      int k = 0;
-
-      size_t global_size[2] = {N, N};
-      size_t local_size[2] = {1, 1};
-      size_t end_size = 1;
-      cl_int num_groups[2] = {global_size[0]/local_size[0], global_size[1]/local_size[1]};
-      
-      int Nborder = N+2;
-      float a = 1.0f;
-      float c = 4.0f;
-      
-      // Create Kernel Arguments
-      err = clSetKernelArg(clProjectStartKernel, 0, sizeof(cl_mem), &uv1);
-      err |= clSetKernelArg(clProjectStartKernel, 1, sizeof(cl_mem), &uv0);
-      err |= clSetKernelArg(clProjectStartKernel, 2, sizeof(cl_int), &Nborder);
-      if (err < 0) {
-        perror("Could not create a kernel argument for clProjectStartKernel");
-        return; //exit(1);
-      }
-
-      err = clSetKernelArg(clProjectEndKernel, 0, sizeof(cl_mem), &uv1);
-      err |= clSetKernelArg(clProjectEndKernel, 1, sizeof(cl_mem), &uv0);
-      err |= clSetKernelArg(clProjectEndKernel, 2, sizeof(cl_int), &Nborder);
-      if (err < 0) {
-        perror("Could not create a kernel argument for clProjectEndKernel");
-        return; //exit(1);
-      }
-
-      err = clEnqueueNDRangeKernel(clQueue, clProjectStartKernel, 2, NULL, global_size,
-          local_size, 0, NULL, NULL);
-      if (err < 0) {
-        perror("Could not enqueue the kernel for clProjectStartKernel");
-        return; //exit(1);
-      }
-      set_bnd( N, uv0, clSetBoundFloat2Kernel, clSetBoundEndFloat2Kernel );
-
-      lin_solve ( N, uv0, uv0, 1.0f, 4.0f, clLinSolveFloat2ipKernel, clSetBoundFloat2Kernel, clSetBoundEndFloat2Kernel);
-
-      err = clEnqueueNDRangeKernel(clQueue, clProjectEndKernel, 2, NULL, global_size,
-          local_size, 0, NULL, NULL);
-      if (err < 0) {
-        perror("Could not enqueue the kernel for clProjectEndKernel");
-        return; //exit(1);
-      }
-      set_bnd( N, uv1, clSetBoundFloat2Kernel, clSetBoundEndFloat2Kernel );
-    }
-
     /*** UI FUNCTIONS ***/
-    void get_from_UI ( float * d, float * uv )
+    // add the cells the mouse touched to the solver's splats
+    void get_from_UI ()
     {
-      int i, j, size = (N+2)*(N+2);
-
-      memset(uv, 0, size*2*sizeof(float));
-      memset(d, 0, size*sizeof(float));
+      int i, j;
+      float u = 0, v = 0, d = 0;
 
       if ( !mouse_down[0] && !mouse_down[2] ) return;
 
@@ -628,18 +307,19 @@ namespace octet {
       if ( i<1 || i>N || j<1 || j>N ) return;
 
       if ( mouse_down[0] ) {
-        uv[j*2*Nborder+i*2]   = force * (mx-omx);
-        uv[j*2*Nborder+i*2+1] = force * (omy-my);
-        printf("Force: (%g, %g)\n", uv[j*2*Nborder+i*2], uv[j*2*Nborder+i*2+1]);
+        u = force * (mx-omx);
+        v = force * (omy-my);
+        printf("Force: (%g, %g)\n", u, v);
       }
 
       if ( mouse_down[2] ) {
-        d[j*Nborder+i] = source;
-        d[(j-1)*Nborder+(i+0)] = source;
-        d[(j+1)*Nborder+(i+0)] = source;
-        d[(j+0)*Nborder+(i-1)] = source;
-        d[(j+0)*Nborder+(i+1)] = source;
+        d = source;
+        solver.add_splat(i+0, j-1, 0, 0, source);
+        solver.add_splat(i+0, j+1, 0, 0, source);
+        solver.add_splat(i-1, j+0, 0, 0, source);
+        solver.add_splat(i+1, j+0, 0, 0, source);
       }
+      solver.add_splat(i, j, u, v, d);
 
       omx = mx;
       omy = my;
@@ -672,21 +352,33 @@ namespace octet {
     engine(int argc, char **argv)
     : app(argc, argv)
     {
+      // -half keeps the fluid in half floats, on the device and in the
+      // pixel buffers. -n sets the grid size, which the texture lets go
+      // well past the 254 that 16 bit vertex indices allowed. -particles
+      // sets the number of tracers P shows.
+      N = 64;
+      num_particles = 1 << 20;
+      for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "-half")) solver.set_half_storage(true);
+        if (!strcmp(argv[i], "-n") && i + 1 < argc && atoi(argv[i+1]) > 0) N = atoi(argv[++i]);
+        if (!strcmp(argv[i], "-particles") && i + 1 < argc && atoi(argv[i+1]) > 0) num_particles = atoi(argv[++i]);
+      }
     }
 
     ~engine() {
       // Deallocate resource
-      clReleaseKernel(clLinSolveFloat2Kernel);
-      clReleaseMemObject(uv0_buffer);
-      clReleaseMemObject(uv1_buffer);
-      clReleaseMemObject(dens0_buffer);
-      clReleaseMemObject(dens1_buffer);
-      clReleaseCommandQueue(clQueue);
-      clReleaseProgram(clProgram);
+      solver.release();
+      for (int i = 0; i != 2; ++i) {
+        if (display_done[i]) clReleaseEvent(display_done[i]);
+        clReleaseMemObject(display_buffers[i]);
+        clReleaseMemObject(velocity_buffers[i]);
+      }
+      for (int i = 0; i != 3; ++i) {
+        clReleaseMemObject(particle_buffers[i]);
+      }
+      clReleaseMemObject(particle_ages);
+      cl_program_cache::release(clContext);
       clReleaseContext(clContext);
-      free(uvArray);
-      free(dArray);
-      free(uvArrayPositions);
     }
 
     // this is called once OpenGL is initialized
@@ -695,7 +387,6 @@ namespace octet {
       fshader.init();
       cshader.init();
 
-      N = 64; 
       Nborder = N+2;
       dt = 0.1f;
       diff = 0.0f;
@@ -706,14 +397,23 @@ namespace octet {
       fluidLength = 19.0f;
 
       dvel = 0;
+      dpart = 0;
+      substeps = 1;
 
-      uvArray = (float *)malloc(Nborder*Nborder*sizeof(float)*2);
-      dArray = (float *)malloc(Nborder*Nborder*sizeof(float));
-      uvArrayPositions = (float *)malloc(Nborder*Nborder*3*2*sizeof(float));
+      particle_last = 0;
+      particle_front = 2;
+      particle_lifetime = 20.0f;
+      particle_rk3 = false;
 
       // Create device and context
       initOpenCL();
       initVBO();
+      display_done[0] = display_done[1] = NULL;
+      display_front = 0;
+      solver.set_pipelined(true);
+      solver.init(clContext, clDeviceID, N);
+      solver.set_cfl(2.0f, 8);
+      clQueue = solver.get_queue();
       initCLGLSharing();
 
       //overlay.init();
@@ -732,6 +432,32 @@ namespace octet {
         dvel = dvel? 0: 1;
         printf("Changing dvel to %d\n", dvel);
       }
+
+      if (is_key_down('P')) {
+        dpart = dpart? 0: 1;
+        printf("Particles: %s\n", dpart ? "on" : "off");
+      }
+
+      if (is_key_down('K')) {
+        particle_rk3 = !particle_rk3;
+        printf("Particle integrator: %s\n", particle_rk3 ? "rk3" : "rk2");
+      }
+
+      if (is_key_down('A')) {
+        static const char *names[] = { "semi-lagrangian", "maccormack", "bfecc" };
+        solver.set_advection((solver.get_advection() + 1) % 3);
+        printf("Advection: %s\n", names[solver.get_advection()]);
+      }
+
+      if (is_key_down('T')) {
+        solver.set_time_budget(solver.get_time_budget() > 0 ? 0 : 0.008);
+        printf("Time budget: %s\n", solver.get_time_budget() > 0 ? "8ms" : "off");
+      }
+
+      if (is_key_down('F')) {
+        solver.set_fused(!solver.get_fused());
+        printf("Fused kernels: %s\n", solver.get_fused() ? "on" : "off");
+      }
     }
 
     // this is called to draw the world
@@ -749,13 +475,18 @@ namespace octet {
       
       mat4t modelToProjection = setProjection(vx, vy);
 
-      fshader.render(modelToProjection);
+      fshader.render(modelToProjection, 0);
       renderFluid();
       if (dvel) {
         vec4 color(1.0f, 0.0f, 0.0f, 1.0f);
         cshader.render(modelToProjection, color);
         renderVelocities();
       }
+      if (dpart) {
+        vec4 color(0.4f, 0.8f, 1.0f, 1.0f);
+        cshader.render(modelToProjection, color);
+        renderParticles();
+      }
       //overlay.render(object_shader, skin_shader, vx, vy, get_frame_number());
     }
 
@@ -772,46 +503,83 @@ namespace octet {
       return mat4t::build_projection_matrix(modelToWorld, cameraToWorld, 0.1f, 1000.0f, 0.0f, 0.0f, 0.1f*vy/float(vx));
     } 
 
+    // queue a step and the copy of its density, with dvel its velocity
+    // lines and with dpart the move of the tracers, for the next frame to
+    // draw, without waiting for any of them
     void calculateFluid() {
       cl_int err;
-
-      err = clEnqueueAcquireGLObjects(clQueue, 1, &dens0_buffer, NULL, NULL, NULL);
-      err = clEnqueueAcquireGLObjects(clQueue, 1, &dens1_buffer, NULL, NULL, NULL);
+      int back = display_front;
+      display_front = 1 - back;
+
+      get_from_UI();
+      solver.splat_sources();
+      substeps = solver.step(visc, diff, dt);
+
+      cl_mem objects[4];
+      cl_uint num_objects = 0;
+      objects[num_objects++] = display_buffers[back];
+      if (dvel) objects[num_objects++] = velocity_buffers[back];
+      int particle_src = particle_last, particle_dst = (particle_last + 1) % 3;
+      if (dpart) {
+        // read the buffer the last move wrote and write the one GL drew last
+        // frame; GL draws the buffer this frame leaves alone
+        particle_front = particle_src == 0 ? 2 : particle_src - 1;
+        particle_last = particle_dst;
+        objects[num_objects++] = particle_buffers[particle_src];
+        objects[num_objects++] = particle_buffers[particle_dst];
+      }
+      cl_event acquired = NULL, written[3] = { NULL, NULL, NULL };
+      err = clEnqueueAcquireGLObjects(clQueue, num_objects, objects, 0, NULL, &acquired);
       if (err < 0) {
         perror("Error acquiring GL objects.");
       }
-      get_from_UI ( dArray, uvArray );
-      writeArray(dens0_buffer, dArray, Nborder*Nborder);
-      writeArray(uv0_buffer, uvArray, Nborder*Nborder*2);
-
-      vel_step(N, uv1_buffer, uv0_buffer, visc, dt);
-      dens_step(N, dens1_buffer, dens0_buffer, uv1_buffer, diff, dt);
-
-      /*readArray(dens1_buffer, dArray, Nborder*Nborder);
-      readArray(uv1_buffer, uvArray, Nborder*Nborder*2);
-
-      glBindBuffer(GL_ARRAY_BUFFER, fluidDensity0VBO);
-      glBufferSubData(GL_ARRAY_BUFFER, 0, Nborder*Nborder*sizeof(GLfloat), dArray);*/
+      float fluidStep = fluidLength/Nborder;
+      solver.copy_density(display_buffers[back], acquired, &written[0]);
+      if (dvel) {
+        solver.write_velocity_lines(velocity_buffers[back], -fluidLength/2.0f, fluidStep, 1.0f/fluidStep, acquired, &written[1]);
+      }
+      if (dpart) {
+        solver.advect_particles(particle_buffers[particle_src], particle_buffers[particle_dst], particle_ages,
+          num_particles, dt, particle_lifetime, -fluidLength/2.0f, fluidStep, particle_rk3, acquired, &written[2]);
+      }
 
-      err = clEnqueueReleaseGLObjects(clQueue, 1, &dens0_buffer, NULL, NULL, NULL);
-      err = clEnqueueReleaseGLObjects(clQueue, 1, &dens1_buffer, NULL, NULL, NULL);
+      if (display_done[back]) clReleaseEvent(display_done[back]);
+      display_done[back] = NULL;
+      cl_uint num_written = 0;
+      for (int i = 0; i != 3; ++i) {
+        if (written[i]) written[num_written++] = written[i];
+      }
+      err = clEnqueueReleaseGLObjects(clQueue, num_objects, objects, num_written, num_written ? written : NULL, &display_done[back]);
       if (err < 0) {
         perror("Error releasing GL objects.");
       }
+      if (acquired) clReleaseEvent(acquired);
+      for (cl_uint i = 0; i != num_written; ++i) clReleaseEvent(written[i]);
       synch();
+
+      // the front buffers were released a frame ago, so this rarely waits
+      if (display_done[display_front]) {
+        clWaitForEvents(1, &display_done[display_front]);
+      }
     }
 
+    // copy the front buffer into the density texture, which stays on the
+    // GPU, and draw the quad with it
     void renderFluid() {
+      bool half = solver.get_half_storage();
+      glActiveTexture(GL_TEXTURE0);
+      glBindTexture(GL_TEXTURE_2D, fluidDensityTexture);
+      glBindBuffer(GL_PIXEL_UNPACK_BUFFER, display_front ? fluidDensity1VBO : fluidDensity0VBO);
+      glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, Nborder, Nborder, GL_RED, half ? GL_HALF_FLOAT : GL_FLOAT, (void *)0);
+      glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+      glBindBuffer(GL_ARRAY_BUFFER, fluidQuadVBO);
       glEnableVertexAttribArray(attribute_pos);
-      glBindBuffer(GL_ARRAY_BUFFER, fluidPositionsVBO);
-      glVertexAttribPointer(attribute_pos, 3, GL_FLOAT, GL_FALSE, 0, (void *)0);
-      
+      glVertexAttribPointer(attribute_pos, 2, GL_FLOAT, GL_FALSE, 4*sizeof(GLfloat), (void *)0);
       glEnableVertexAttribArray(attribute_uv);
-      glBindBuffer(GL_ARRAY_BUFFER, fluidDensity1VBO);
-      glVertexAttribPointer(attribute_uv, 1, GL_FLOAT, GL_FALSE, 0, (void *)0);
-      
-      glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, fluidIndicesVBO);
-      glDrawElements(GL_TRIANGLES, (N+1)*(N+1)*2*3, GL_UNSIGNED_SHORT, 0);
+      glVertexAttribPointer(attribute_uv, 2, GL_FLOAT, GL_FALSE, 4*sizeof(GLfloat), (void *)(2*sizeof(GLfloat)));
+
+      glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
       
       glFlush();
 
@@ -819,29 +587,24 @@ namespace octet {
       glDisableVertexAttribArray(attribute_uv);
     }
 
+    // the lines the solver wrote with the density being drawn
     void renderVelocities() {
-      glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, fluidVelocitiesIndicesVBO);
-      glBindBuffer(GL_ARRAY_BUFFER, fluidVelocitiesPositionsVBO);
-
-      readArray(uv1_buffer, uvArray, Nborder*Nborder*2);
-      float fluidStep = fluidLength/Nborder;
-
-      for (int j = 0; j != Nborder; j++) {
-        for (int i = 0; i != Nborder; i++) {
-          uvArrayPositions[(j*Nborder+i)*6+0] = -fluidLength/2.0f+i*fluidStep;
-          uvArrayPositions[(j*Nborder+i)*6+1] = -fluidLength/2.0f+j*fluidStep;
-          uvArrayPositions[(j*Nborder+i)*6+2] = 0.0f;
-
-          uvArrayPositions[(j*Nborder+i)*6+3] = -fluidLength/2.0f+i*fluidStep + uvArray[(j*Nborder+i)*2]/fluidStep;
-          uvArrayPositions[(j*Nborder+i)*6+4] = -fluidLength/2.0f+j*fluidStep + uvArray[(j*Nborder+i)*2+1]/fluidStep;
-          uvArrayPositions[(j*Nborder+i)*6+5] = 0.0f;
-        }
-      }
-      glBufferSubData(GL_ARRAY_BUFFER, 0, Nborder*Nborder*6*sizeof(GLfloat), uvArrayPositions);
+      glBindBuffer(GL_ARRAY_BUFFER, display_front ? fluidVelocities1VBO : fluidVelocities0VBO);
       glLineWidth(1.5f);
       glEnableVertexAttribArray(attribute_pos);
       glVertexAttribPointer(attribute_pos, 3, GL_FLOAT, GL_FALSE, 0, 0);
-      glDrawElements(GL_LINES, Nborder*Nborder*2, GL_UNSIGNED_SHORT, 0);
+      glDrawArrays(GL_LINES, 0, Nborder*Nborder*2);
+      glFlush();
+      glDisableVertexAttribArray(attribute_pos);
+    }
+
+    // the tracers the solver moved two frames before, in the buffer it
+    // doesn't hold this frame
+    void renderParticles() {
+      glBindBuffer(GL_ARRAY_BUFFER, fluidParticlesVBOs[particle_front]);
+      glEnableVertexAttribArray(attribute_pos);
+      glVertexAttribPointer(attribute_pos, 2, GL_FLOAT, GL_FALSE, 0, 0);
+      glDrawArrays(GL_POINTS, 0, num_particles);
       glFlush();
       glDisableVertexAttribArray(attribute_pos);
     }
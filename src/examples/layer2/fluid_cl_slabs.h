@@ -0,0 +1,413 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Ciro Duran, Andy Thomason 2012, 2013, 2014
+//
+// Modular Framework for OpenGLES2 rendering on multiple platforms.
+//
+// An N x N fluid split into slabs of rows across several OpenCL devices,
+// each a fluid_cl_solver in its own context, for grids too large for the
+// memory of one device.
+//
+// Every slab steps on its own thread. After each launch that writes a
+// field the slabs read their edge rows back, meet at a barrier and write
+// their neighbours' edges into their halo rows, so the devices keep in
+// step while the transfers of one overlap the kernels of the others. The
+// edges are double buffered, which makes one barrier an exchange enough.
+// The slabs but the last are whole multiples of 16 rows, the largest tile,
+// so their sweeps and results are those of one solver on the whole grid.
+//
+// Every slab must make the same launches, and so the same exchanges, or
+// the barriers would never meet: all of them use one relaxation and the
+// smallest tile any of their devices can run.
+//
+// The slabs can be on different devices, for example the CPU devices of a
+// platform, or in several contexts on one device. Slabs in separate
+// processes would swap the same edge rows through shared memory where
+// these swap them through the host buffers of edges.
+//
+
+namespace octet {
+  class fluid_cl_slabs : public fluid_cl_solver::halo_exchange {
+    // slabs start on a multiple of this many rows, after the ghost row
+    enum { row_align = 16 };
+
+    struct slab {
+      cl_context ctx;
+      cl_device_id dev;
+      bool own_context;
+      fluid_cl_solver *solver;
+
+      // the slab's top and bottom halo rows worth of its own edge rows,
+      // in the half of the exchange's parity
+      dynarray<unsigned char> edges[2][2];
+      int substeps[2];
+      // exchanges so far, whose parity picks the half of edges, and
+      // agreements so far, whose parity picks the half of substeps
+      int exchanges;
+      int agreements;
+      // substeps of the last step
+      int taken;
+    };
+
+    dynarray<slab *> slabs;
+    int N;
+    int halo;
+    bool half_storage;
+    bool pipelined;
+    int relaxation;
+    fluid_workers workers;
+
+    // the arguments of step() for the slabs' threads
+    float step_visc;
+    float step_diff;
+    float step_dt;
+
+    // threads waiting at the barrier, and the barriers passed so far
+    int arrived;
+    unsigned barriers;
+
+    #if OCTET_FLUID_THREADS && defined(WIN32)
+      CRITICAL_SECTION mutex;
+      CONDITION_VARIABLE all_arrived;
+
+      void lock() { EnterCriticalSection(&mutex); }
+      void unlock() { LeaveCriticalSection(&mutex); }
+      void wait_all() { SleepConditionVariableCS(&all_arrived, &mutex, INFINITE); }
+      void signal_all() { WakeAllConditionVariable(&all_arrived); }
+      void init_sync() { InitializeCriticalSection(&mutex); InitializeConditionVariable(&all_arrived); }
+      void release_sync() { DeleteCriticalSection(&mutex); }
+    #elif OCTET_FLUID_THREADS
+      pthread_mutex_t mutex;
+      pthread_cond_t all_arrived;
+
+      void lock() { pthread_mutex_lock(&mutex); }
+      void unlock() { pthread_mutex_unlock(&mutex); }
+      void wait_all() { pthread_cond_wait(&all_arrived, &mutex); }
+      void signal_all() { pthread_cond_broadcast(&all_arrived); }
+      void init_sync() { pthread_mutex_init(&mutex, NULL); pthread_cond_init(&all_arrived, NULL); }
+      void release_sync() { pthread_cond_destroy(&all_arrived); pthread_mutex_destroy(&mutex); }
+    #else
+      void lock() {}
+      void unlock() {}
+      void wait_all() {}
+      void signal_all() {}
+      void init_sync() {}
+      void release_sync() {}
+    #endif
+
+    // wait for the threads of every slab to get here
+    void barrier() {
+      lock();
+      unsigned barrier = barriers;
+      if (++arrived == (int)slabs.size()) {
+        arrived = 0;
+        barriers++;
+        signal_all();
+      } else {
+        while (barrier == barriers) {
+          wait_all();
+        }
+      }
+      unlock();
+    }
+
+    int find_slab(fluid_cl_solver *solver) const {
+      for (int k = 0; k != (int)slabs.size(); ++k) {
+        if (slabs[k]->solver == solver) return k;
+      }
+      return -1;
+    }
+
+    static void step_slab(void *context, int index) {
+      fluid_cl_slabs *self = (fluid_cl_slabs *)context;
+      slab *s = self->slabs[index];
+      s->taken = s->solver->step(self->step_visc, self->step_diff, self->step_dt);
+    }
+
+    // the rows of the grid the slab k keeps: its own and the ghost rows it reaches
+    void get_owned_rows(int k, int &first, int &last) const {
+      first = k == 0 ? 0 : slabs[k]->solver->get_slab_first();
+      last = k + 1 == (int)slabs.size() ? N+1 : slabs[k]->solver->get_slab_last();
+    }
+
+    // read a field of values floats a cell from every slab's own rows
+    void read_field(int field, float *dst, int values) {
+      for (int k = 0; k != (int)slabs.size(); ++k) {
+        fluid_cl_solver *solver = slabs[k]->solver;
+        cl_mem buffer = field == 0 ? solver->get_dens1() : solver->get_uv1();
+        int first, last;
+        get_owned_rows(k, first, last);
+        int count = (last - first + 1) * (N+2) * values;
+        float *rows = dst + first * (N+2) * values;
+        if (half_storage) {
+          dynarray<uint16_t> halves(count);
+          solver->read_rows(buffer, first, last - first + 1, values, halves.data());
+          fluid_half::unpack(rows, halves.data(), count, fluid_half::format_half);
+        } else {
+          solver->read_rows(buffer, first, last - first + 1, values, rows);
+        }
+      }
+    }
+
+  public:
+    fluid_cl_slabs() {
+      N = 0;
+      halo = 4;
+      half_storage = false;
+      pipelined = false;
+      relaxation = fluid_cl_solver::relaxation_tiled;
+      step_visc = step_diff = step_dt = 0;
+      arrived = 0;
+      barriers = 0;
+      init_sync();
+    }
+
+    ~fluid_cl_slabs() {
+      release();
+      release_sync();
+    }
+
+    /// add a device for a slab, in a context the caller keeps. The same
+    /// device may be added more than once, each slab has its own buffers.
+    void add_device(cl_context ctx, cl_device_id dev) {
+      slab *s = new slab;
+      s->ctx = ctx;
+      s->dev = dev;
+      s->own_context = false;
+      s->solver = NULL;
+      s->exchanges = 0;
+      s->agreements = 0;
+      s->taken = 0;
+      slabs.push_back(s);
+    }
+
+    /// add count devices of the type on the first platform that has one,
+    /// each in a context of its own, going round the devices again if
+    /// there are fewer. Returns the number added.
+    int add_devices(cl_device_type type, int count) {
+      cl_platform_id platforms[8];
+      cl_uint num_platforms = 0;
+      if (clGetPlatformIDs(8, platforms, &num_platforms) < 0) return 0;
+      if (num_platforms > 8) num_platforms = 8;
+      for (cl_uint p = 0; p != num_platforms; ++p) {
+        cl_device_id devices[16];
+        cl_uint num_devices = 0;
+        if (clGetDeviceIDs(platforms[p], type, 16, devices, &num_devices) < 0 || num_devices == 0) continue;
+        if (num_devices > 16) num_devices = 16;
+        int added = 0;
+        for (int k = 0; k != count; ++k) {
+          cl_int err;
+          cl_device_id dev = devices[k % num_devices];
+          cl_context ctx = clCreateContext(NULL, 1, &dev, NULL, NULL, &err);
+          if (err < 0) {
+            perror("Could not create a context");
+            continue;
+          }
+          add_device(ctx, dev);
+          slabs.back()->own_context = true;
+          ++added;
+        }
+        return added;
+      }
+      return 0;
+    }
+
+    /// rows of halo each side of a slab, from 2 to 16. A substep is exact
+    /// as long as no cell moves more than the halo less one row, so it
+    /// should be at least the solvers' cfl number plus one. Set it before
+    /// init().
+    void set_halo(int value) {
+      halo = value < 2 ? 2 : value > row_align ? row_align : value;
+    }
+
+    int get_halo() const {
+      return halo;
+    }
+
+    /// keep the slabs' fields in half floats. Set it before init().
+    void set_half_storage(bool value) {
+      half_storage = value;
+    }
+
+    /// run the slabs' solvers pipelined, see
+    /// fluid_cl_solver::set_pipelined. Set it before init().
+    void set_pipelined(bool value) {
+      pipelined = value;
+    }
+
+    /// the relaxation of every slab's solver, see
+    /// fluid_cl_solver::set_relaxation
+    void set_relaxation(int value) {
+      relaxation = value;
+      for (int k = 0; k != (int)slabs.size(); ++k) {
+        if (slabs[k]->solver) slabs[k]->solver->set_relaxation(value);
+      }
+    }
+
+    int get_relaxation() const {
+      return relaxation;
+    }
+
+    /// split an N x N grid into a slab for each device added, or fewer if
+    /// N is too small for them, and make their solvers.
+    bool init(int N, bool enable_profiling = false, const char *filename = "assets/opencl/fluids.cl") {
+      this->N = N;
+      if (slabs.size() == 0) {
+        printf("No devices for the slabs\n");
+        return false;
+      }
+      int count = (int)slabs.size();
+      if (count > N / row_align) count = N / row_align;
+      if (!OCTET_FLUID_THREADS || count < 1) count = 1;
+      while ((int)slabs.size() > count) {
+        slab *s = slabs.back();
+        if (s->own_context) clReleaseContext(s->ctx);
+        delete s;
+        slabs.pop_back();
+      }
+
+      int rows = N / count / row_align * row_align;
+      workers.init(count);
+
+      // remake the solvers whose tile is larger than the smallest so far
+      // until they all have the same
+      int tile_limit = row_align;
+      for (bool agreed = false; !agreed; ) {
+        agreed = true;
+        for (int k = 0; k != count; ++k) {
+          slab *s = slabs[k];
+          if (s->solver && s->solver->get_tile_size() == tile_limit) continue;
+          delete s->solver;
+          int first = 1 + k * rows;
+          int last = k + 1 == count ? N : first + rows - 1;
+          s->solver = new fluid_cl_solver();
+          s->solver->set_half_storage(half_storage);
+          s->solver->set_pipelined(pipelined);
+          s->solver->set_relaxation(relaxation);
+          s->solver->set_tile_limit(tile_limit);
+          s->solver->set_slab(first, last, halo, this);
+          if (!s->solver->init(s->ctx, s->dev, N, NULL, NULL, enable_profiling, filename)) {
+            return false;
+          }
+          if (s->solver->get_tile_size() < tile_limit) {
+            tile_limit = s->solver->get_tile_size();
+            agreed = false;
+          }
+        }
+      }
+
+      for (int k = 0; k != count; ++k) {
+        slab *s = slabs[k];
+        for (int p = 0; p != 2; ++p) {
+          s->edges[p][0].resize(halo * s->solver->get_row_bytes(2));
+          s->edges[p][1].resize(halo * s->solver->get_row_bytes(2));
+        }
+        s->exchanges = 0;
+        s->agreements = 0;
+      }
+      return true;
+    }
+
+    /// release the solvers and the contexts made by add_devices()
+    void release() {
+      workers.reset();
+      for (int k = 0; k != (int)slabs.size(); ++k) {
+        slab *s = slabs[k];
+        delete s->solver;
+        if (s->own_context) {
+          cl_program_cache::release(s->ctx);
+          clReleaseContext(s->ctx);
+        }
+        delete s;
+      }
+      slabs.resize(0);
+    }
+
+    /// the halo_exchange: swap the edge rows of buffer with the neighbours
+    void exchange(fluid_cl_solver *solver, cl_mem buffer, int values) {
+      int k = find_slab(solver);
+      slab *s = slabs[k];
+      int p = s->exchanges++ & 1;
+      int first = solver->get_slab_first(), last = solver->get_slab_last();
+      bool up = k > 0, down = k + 1 != (int)slabs.size();
+
+      if (up) solver->read_rows(buffer, first, halo, values, s->edges[p][0].data());
+      if (down) solver->read_rows(buffer, last - halo + 1, halo, values, s->edges[p][1].data());
+      barrier();
+      // the neighbours only write this half again in the exchange after
+      // next, after the barrier of the next exchange. This slab reaches
+      // that barrier after the blocking reads before it, which its queue
+      // makes after these writes. Agreements pass barriers without waiting
+      // for the queue, so they keep a parity of their own.
+      if (up) solver->write_rows(buffer, first - halo, halo, values, slabs[k-1]->edges[p][1].data());
+      if (down) solver->write_rows(buffer, last + 1, halo, values, slabs[k+1]->edges[p][0].data());
+    }
+
+    /// the halo_exchange: every slab takes the most substeps any asks for
+    int agree_substeps(fluid_cl_solver *solver, int n) {
+      slab *s = slabs[find_slab(solver)];
+      int p = s->agreements++ & 1;
+      s->substeps[p] = n;
+      barrier();
+      for (int k = 0; k != (int)slabs.size(); ++k) {
+        if (slabs[k]->substeps[p] > n) n = slabs[k]->substeps[p];
+      }
+      return n;
+    }
+
+    /// add a source to the slab holding row j, as fluid_cl_solver::add_splat()
+    void add_splat(int i, int j, float u, float v, float d) {
+      int k = 0;
+      while (k + 1 != (int)slabs.size() && j > slabs[k]->solver->get_slab_last()) ++k;
+      slabs[k]->solver->add_splat(i, j, u, v, d);
+    }
+
+    /// make the splats the sources of the next step, as fluid_cl_solver::splat_sources()
+    void splat_sources() {
+      for (int k = 0; k != (int)slabs.size(); ++k) {
+        slabs[k]->solver->splat_sources();
+      }
+    }
+
+    /// step every slab, each on its own thread. returns the number of substeps.
+    int step(float visc, float diff, float dt) {
+      step_visc = visc;
+      step_diff = diff;
+      step_dt = dt;
+      workers.run(step_slab, this, (int)slabs.size());
+      return slabs[0]->taken;
+    }
+
+    /// wait for every slab's queue
+    void finish() {
+      for (int k = 0; k != (int)slabs.size(); ++k) {
+        slabs[k]->solver->finish();
+      }
+    }
+
+    /// the density of the whole grid, (N+2)*(N+2) floats
+    void read_density(float *dst) {
+      read_field(0, dst, 1);
+    }
+
+    /// the velocity of the whole grid, (N+2)*(N+2) float pairs
+    void read_velocity(float *dst) {
+      read_field(1, dst, 2);
+    }
+
+    int get_num_slabs() const {
+      return (int)slabs.size();
+    }
+
+    /// the solver of slab k, to change its settings or read its profile.
+    /// Every slab should have the same settings; set the relaxation with
+    /// set_relaxation() rather than on the solvers.
+    fluid_cl_solver *get_solver(int k) {
+      return slabs[k]->solver;
+    }
+
+    int get_N() const {
+      return N;
+    }
+  };
+}
@@ -0,0 +1,1749 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Ciro Duran, Andy Thomason 2012, 2013, 2014
+//
+// Modular Framework for OpenGLES2 rendering on multiple platforms.
+//
+// OpenCL stable fluids solver: the kernel chain of assets/opencl/fluids.cl.
+//
+// uv0/uv1 hold the velocity as float2 and dens0/dens1 the density, with
+// the _0 buffers holding the sources on entry to step() and used as
+// scratch after. The density buffers may be made by the caller, for
+// example from GL vertex buffers so they can be drawn directly.
+//
+// By default the fused kernels are used: they read the ghost cells from
+// the interior as set_bnd would set them and write the ghost cells of
+// their results, so set_bnd isn't run between them. The sources are added
+// in the first sweep of the first diffuse, the divergence is taken in the
+// first pressure sweep and the gradient in the last.
+//
+// The sweeps of the fused solves are made by tiled kernels, which keep a
+// tile of the grid in local memory and make several sweeps on it each
+// launch. The tile size is the largest that fits the device's work group
+// and local memory limits. They can also be made by red-black kernels, a
+// launch for each colour, or by Jacobi kernels ping-ponging between two
+// buffers. No kernel reads a cell another work item of the same launch
+// writes, so the results don't depend on the scheduling.
+//
+// The program is built for the grid size, with the width of the grids a
+// constant, then again for the tile size once the tiled kernels show
+// what they can run. cl_program_cache keeps the variants, so solvers of
+// the same sizes share them.
+//
+// Pipelined, the solver can run a frame behind the host. The sources
+// are set on the device from a list of splats, uploaded without waiting
+// for them to be copied, and the CFL substeps are taken from the speed of
+// the step before, read back without waiting too. If the device has them
+// the queue is out of order, with every kernel waiting for the event of
+// the one before it, so the splat uploads and the caller's commands (for
+// example copying the density into a GL buffer) only wait for what they
+// use.
+//
+// With half storage the velocity, density and source fields are half
+// floats on the device, loaded and stored with vload_half and vstore_half
+// and worked on as floats. Only the fused kernels and semi-Lagrangian
+// advection take half fields, so they are always used. writeArray() and
+// readArray() convert to and from floats, and the density copied into a
+// caller's buffer is half floats, which GL can draw as GL_HALF_FLOAT.
+//
+// As a slab, the solver works on a band of rows of a grid shared with
+// other solvers, on other devices or in other contexts, for grids too
+// large for one device. Its buffers hold the slab's rows and a few halo
+// rows either side, and after every launch that writes a field a
+// halo_exchange copies the edge rows of each slab into its neighbours'
+// halos, so the slabs step exactly as one grid would, as long as no cell
+// moves further than the halo less one row in a substep. The slabs agree
+// on the number of substeps through the exchange too.
+//
+// With profiling on, every kernel's event is kept and its time is added to
+// the stage (add_source, diffuse, advect, project or set_bnd) that
+// enqueued it, along with an estimate of the memory it moved.
+//
+
+namespace octet {
+  class fluid_cl_solver {
+  public:
+    enum advection_t {
+      advection_semi_lagrangian,
+      advection_maccormack,
+      advection_bfecc,
+    };
+
+    enum relaxation_t {
+      relaxation_tiled,
+      relaxation_red_black,
+      relaxation_jacobi,
+    };
+
+    enum stage_t {
+      stage_add_source,
+      stage_diffuse,
+      stage_advect,
+      stage_project,
+      stage_set_bnd,
+      num_stages,
+    };
+
+    /// kernel time and memory traffic of each stage since reset_profile()
+    struct stage_stats {
+      double seconds[num_stages];
+      double bytes[num_stages];
+      int kernels[num_stages];
+    };
+
+    /// keeps the halo rows of the slabs of a grid up to date, as at the top
+    /// of the file. Every slab's solver calls it in the same order.
+    class halo_exchange {
+    public:
+      virtual ~halo_exchange() {}
+
+      /// refresh the halo rows of buffer, a field of values floats a cell,
+      /// which the last launch of solver wrote
+      virtual void exchange(fluid_cl_solver *solver, cl_mem buffer, int values) = 0;
+
+      /// the substeps every slab takes in a step when solver asks for n
+      virtual int agree_substeps(fluid_cl_solver *solver, int n) = 0;
+    };
+
+  private:
+    cl_context clContext;
+    cl_device_id clDeviceID;
+    cl_command_queue clQueue;
+    cl_program clProgram;
+
+    cl_kernel clAddSourceFloat2Kernel;
+    cl_kernel clLinSolveFloat2Kernel;
+    cl_kernel clLinSolveFloat2ipKernel;
+    cl_kernel clSetBoundFloat2Kernel;
+    cl_kernel clSetBoundEndFloat2Kernel;
+    cl_kernel clSetBoundMirrorFloat2Kernel;
+    cl_kernel clAddSourceFloatKernel;
+    cl_kernel clLinSolveFloatKernel;
+    cl_kernel clSetBoundFloatKernel;
+    cl_kernel clSetBoundEndFloatKernel;
+    cl_kernel clProjectStartKernel;
+    cl_kernel clProjectEndKernel;
+    cl_kernel clAdvectFloat2Kernel;
+    cl_kernel clAdvectFloatKernel;
+    cl_kernel clMacCormackFloat2Kernel;
+    cl_kernel clMacCormackFloatKernel;
+    cl_kernel clBfeccCorrectFloat2Kernel;
+    cl_kernel clBfeccCorrectFloatKernel;
+    cl_kernel clAdvectLimitedFloat2Kernel;
+    cl_kernel clAdvectLimitedFloatKernel;
+    cl_kernel clMaxSpeedKernel;
+
+    cl_kernel clLinSolveFusedFloat2Kernel;
+    cl_kernel clLinSolveFusedFloatKernel;
+    cl_kernel clLinSolveFusedFloat2ipKernel;
+    cl_kernel clProjectStartFusedKernel;
+    cl_kernel clProjectEndFusedKernel;
+    cl_kernel clAdvectFusedFloat2Kernel;
+    cl_kernel clAdvectFusedFloatKernel;
+
+    cl_kernel clLinSolveTiledFloat2Kernel;
+    cl_kernel clLinSolveTiledFloatKernel;
+    cl_kernel clLinSolveTiledFloat2ipKernel;
+
+    cl_kernel clLinSolveJacobiFloat2Kernel;
+    cl_kernel clLinSolveJacobiFloatKernel;
+    cl_kernel clLinSolveJacobiFloat2ipKernel;
+
+    cl_kernel clClearSourcesKernel;
+    cl_kernel clSplatSourcesKernel;
+
+    cl_kernel clVelocityLinesKernel;
+    cl_kernel clAdvectParticlesKernel;
+
+    cl_mem uv0_buffer;
+    cl_mem uv1_buffer;
+    cl_mem dens0_buffer;
+    cl_mem dens1_buffer;
+    bool own_dens_buffers;
+
+    // forward and backward advected fields for MacCormack and BFECC.
+    // float2 sized, so they hold densities too.
+    cl_mem fwd_buffer;
+    cl_mem bwd_buffer;
+
+    // one result per work group of the max_speed_float2 reduction
+    enum { speed_groups = 32, speed_local_size = 64 };
+    cl_mem speed_buffer;
+
+    // pipelined, the partial speeds of the last two steps, read back
+    // without waiting, and which half the next step reads into
+    float speed_partial[2][speed_groups];
+    cl_event speed_read[2];
+    int speed_half;
+
+    // the splats of the next sources, four floats each, in one half while
+    // the other half may still be uploading to its buffer. splat_read is
+    // the last kernel to read each buffer, on an out of order queue.
+    dynarray<float> splat_values[2];
+    cl_mem splat_buffer[2];
+    int splat_capacity[2];
+    cl_event splat_written[2];
+    cl_event splat_read[2];
+    int splat_half;
+
+    // advances every advect_particles, so recycled tracers land elsewhere
+    cl_uint particle_seed;
+
+    // on an out of order queue every command waits for last_event, the
+    // event of the command before it, which keeps the kernels in order
+    bool pipelined;
+    bool out_of_order;
+    cl_event last_event;
+
+    int N;
+    int advection;
+    bool fused;
+    // the fields are half floats, as at the top of fluids.cl
+    bool half_storage;
+    // build the program for this N and tile size
+    bool specialised;
+
+    // rows slab_first to slab_last of the interior with halo rows either
+    // side, if slab_exchange isn't NULL
+    halo_exchange *slab_exchange;
+    int slab_first;
+    int slab_last;
+    int halo;
+
+    // work groups of the tiled kernels are tile_size x tile_size, no more
+    // than tile_limit. 0 if they can't run on the device. Sweeps a launch
+    // of the tiled diffuse and pressure solves.
+    enum { max_tile_size = 16 };
+    int tile_size;
+    int tile_limit;
+    int diffuse_sweeps;
+    int pressure_sweeps;
+
+    // kernels for the sweeps of the fused solves, and how many sweeps
+    int relaxation;
+    int solver_sweeps;
+
+    // substeps so no cell moves more than cfl cells in one. cfl = 0 for one step.
+    float cfl;
+    int max_substeps;
+    // seconds per frame for the solver, 0 for no limit
+    double time_budget;
+    double substep_seconds;
+
+    // profiling: the events of the kernels enqueued since the last collect
+    struct kernel_event {
+      cl_event event;
+      int stage;
+      double bytes;
+    };
+    bool profiling;
+    int stage;
+    dynarray<kernel_event> events;
+    stage_stats profile;
+
+    // count the kernels of a stage function against it until it returns
+    struct stage_scope {
+      fluid_cl_solver *solver;
+      int saved;
+      stage_scope(fluid_cl_solver *solver, int stage) : solver(solver), saved(solver->stage) {
+        solver->stage = stage;
+      }
+      ~stage_scope() {
+        solver->stage = saved;
+      }
+    };
+
+    cl_kernel createKernel(cl_program prg, const char *kernel_name) {
+      cl_int err;
+      cl_kernel k = clCreateKernel(prg, kernel_name, &err);
+      if (err < 0) {
+        printf("Could not create kernel %s", kernel_name);
+        return NULL;
+      }
+      return k;
+    }
+
+    // the options to build fluids.cl with, specialised for the grid size
+    // and, if not 0, the tile size
+    const char *get_build_options(int tile) {
+      static char options[192];
+      char storage[80];
+      sprintf(storage, "%s", half_storage ? " -DHALF_STORAGE" : "");
+      if (slab_exchange) {
+        sprintf(storage + strlen(storage), " -DSLAB_FIRST=%d -DSLAB_LAST=%d -DHALO=%d", slab_first, slab_last, halo);
+      }
+      if (!specialised) {
+        sprintf(options, "-cl-nv-verbose%s", storage);
+      } else if (tile == 0) {
+        sprintf(options, "-cl-nv-verbose -DDATA_WIDTH=%d%s", N+2, storage);
+      } else {
+        sprintf(options, "-cl-nv-verbose -DDATA_WIDTH=%d -DTILE_SIZE=%d%s", N+2, tile, storage);
+      }
+      return options;
+    }
+
+    // bytes of count values of a field
+    size_t field_bytes(int count) const {
+      return count * (half_storage ? sizeof(cl_half) : sizeof(cl_float));
+    }
+
+    // the buffers writeArray() and readArray() convert with half storage
+    bool is_field(cl_mem buffer) const {
+      return buffer == uv0_buffer || buffer == uv1_buffer || buffer == dens0_buffer ||
+        buffer == dens1_buffer || buffer == fwd_buffer || buffer == bwd_buffer;
+    }
+
+    // build the program, from its cached binary if there is one
+    cl_program buildProgram(cl_context ctx, cl_device_id dev, const char *filename, const char *options) {
+      cl_program program = cl_program_cache::build(ctx, dev, filename, options);
+      if (!program) {
+        exit(1);
+      }
+      return program;
+    }
+
+    // the events a command waits for: last_event and, if not NULL, also
+    cl_uint get_wait_list(cl_event also, cl_event *wait) {
+      cl_uint num_waits = 0;
+      if (last_event) wait[num_waits++] = last_event;
+      if (also) wait[num_waits++] = also;
+      return num_waits;
+    }
+
+    // make event, which the caller gives up, the one the next command waits for
+    void chain(cl_event event) {
+      if (last_event) clReleaseEvent(last_event);
+      last_event = event;
+    }
+
+    // in a slab, a 2D launch covers the slab's rows of the interior,
+    // rounded up to the local size, with an offset to the first of them.
+    // With ghost_rows it covers every row the slab stores instead, for
+    // kernels that don't skip the ghost cells.
+    void get_slab_launch(const size_t *global_size, const size_t *local_size, bool ghost_rows, size_t *offset, size_t *slab_size) const {
+      size_t rows = ghost_rows ? get_stored_rows() : slab_last - slab_first + 1;
+      size_t local = local_size ? local_size[1] : 1;
+      offset[0] = 0;
+      offset[1] = ghost_rows ? get_stored_first() : slab_first - 1;
+      slab_size[0] = global_size[0];
+      slab_size[1] = (rows + local - 1) / local * local;
+    }
+
+    // refresh the halo rows of buffer, values floats a cell, after a launch wrote it
+    void exchange_halo(cl_mem buffer, int values) {
+      if (slab_exchange) slab_exchange->exchange(this, buffer, values);
+    }
+
+    // enqueue a kernel, keeping its event when profiling. bytes is the
+    // memory read and written by one work item, in floats; half storage
+    // moves about half of it. It also waits for the event after, if there
+    // is one. ghost_rows is for slabs, as get_slab_launch().
+    cl_int enqueue(cl_kernel kern, cl_uint dims, const size_t *global_size, const size_t *local_size, int bytes, cl_event after = NULL, bool ghost_rows = false) {
+      cl_event event = NULL;
+      cl_event wait[2];
+      cl_uint num_waits = get_wait_list(after, wait);
+      size_t offset[2], slab_size[2];
+      bool slab_launch = slab_exchange && dims == 2;
+      if (slab_launch) {
+        get_slab_launch(global_size, local_size, ghost_rows, offset, slab_size);
+        global_size = slab_size;
+      }
+      cl_int err = clEnqueueNDRangeKernel(clQueue, kern, dims, slab_launch ? offset : NULL, global_size,
+        local_size, num_waits, num_waits ? wait : NULL, profiling || out_of_order ? &event : NULL);
+      if (err >= 0 && profiling) {
+        double items = 1;
+        for (cl_uint d = 0; d != dims; ++d) items *= global_size[d];
+        kernel_event ke = { event, stage, items * bytes * (half_storage ? 0.5 : 1.0) };
+        events.push_back(ke);
+        if (out_of_order) clRetainEvent(event);
+      }
+      if (err >= 0 && out_of_order) chain(event);
+      return err;
+    }
+
+    // wait for the profiled kernels and add their times to the stages
+    void collect_profile() {
+      if (events.size() == 0) return;
+      clFinish(clQueue);
+      for (int i = 0; i != (int)events.size(); ++i) {
+        cl_ulong start = 0, end = 0;
+        clGetEventProfilingInfo(events[i].event, CL_PROFILING_COMMAND_START, sizeof(start), &start, NULL);
+        clGetEventProfilingInfo(events[i].event, CL_PROFILING_COMMAND_END, sizeof(end), &end, NULL);
+        int s = events[i].stage;
+        profile.seconds[s] += (end - start) * 1e-9;
+        profile.bytes[s] += events[i].bytes;
+        profile.kernels[s]++;
+        clReleaseEvent(events[i].event);
+      }
+      events.resize(0);
+    }
+
+    // every kernel member, ending in NULL, to clear or release them all
+    cl_kernel **get_kernels() {
+      static cl_kernel *kernels[64];
+      cl_kernel *list[] = {
+        &clAddSourceFloat2Kernel, &clLinSolveFloat2Kernel, &clLinSolveFloat2ipKernel,
+        &clSetBoundFloat2Kernel, &clSetBoundEndFloat2Kernel, &clSetBoundMirrorFloat2Kernel, &clAddSourceFloatKernel,
+        &clLinSolveFloatKernel, &clSetBoundFloatKernel, &clSetBoundEndFloatKernel,
+        &clProjectStartKernel, &clProjectEndKernel, &clAdvectFloat2Kernel, &clAdvectFloatKernel,
+        &clMacCormackFloat2Kernel, &clMacCormackFloatKernel, &clBfeccCorrectFloat2Kernel,
+        &clBfeccCorrectFloatKernel, &clAdvectLimitedFloat2Kernel, &clAdvectLimitedFloatKernel,
+        &clMaxSpeedKernel, &clLinSolveFusedFloat2Kernel, &clLinSolveFusedFloatKernel,
+        &clLinSolveFusedFloat2ipKernel, &clProjectStartFusedKernel, &clProjectEndFusedKernel,
+        &clAdvectFusedFloat2Kernel, &clAdvectFusedFloatKernel, &clLinSolveTiledFloat2Kernel,
+        &clLinSolveTiledFloatKernel, &clLinSolveTiledFloat2ipKernel, &clLinSolveJacobiFloat2Kernel,
+        &clLinSolveJacobiFloatKernel, &clLinSolveJacobiFloat2ipKernel, &clClearSourcesKernel,
+        &clSplatSourcesKernel, &clVelocityLinesKernel, &clAdvectParticlesKernel,
+        NULL,
+      };
+      memcpy(kernels, list, sizeof(list));
+      return kernels;
+    }
+
+    // the largest power of two tile, up to max_tile_size, whose work group
+    // the device and the tiled kernels can run and whose (T+2) x (T+2)
+    // float2 tile fits in local memory. 0 if there isn't one.
+    int choose_tile_size() {
+      size_t max_items = 0;
+      cl_ulong local_mem = 0;
+      clGetDeviceInfo(clDeviceID, CL_DEVICE_MAX_WORK_GROUP_SIZE, sizeof(max_items), &max_items, NULL);
+      clGetDeviceInfo(clDeviceID, CL_DEVICE_LOCAL_MEM_SIZE, sizeof(local_mem), &local_mem, NULL);
+
+      cl_kernel kernels[] = { clLinSolveTiledFloat2Kernel, clLinSolveTiledFloatKernel, clLinSolveTiledFloat2ipKernel };
+      for (int i = 0; i != sizeof(kernels)/sizeof(kernels[0]); ++i) {
+        size_t kernel_items = 0;
+        if (!kernels[i] || clGetKernelWorkGroupInfo(kernels[i], clDeviceID, CL_KERNEL_WORK_GROUP_SIZE, sizeof(kernel_items), &kernel_items, NULL) < 0) {
+          return 0;
+        }
+        max_items = kernel_items < max_items ? kernel_items : max_items;
+      }
+
+      int size = max_tile_size;
+      while (size > 1 && ((size_t)(size*size) > max_items || (cl_ulong)((size+2)*(size+2)*2*sizeof(cl_float)) > local_mem)) {
+        size /= 2;
+      }
+      return size > 1 ? size : 0;
+    }
+
+    void createKernels() {
+      clAddSourceFloat2Kernel = createKernel(clProgram, "add_source_float2");
+      clLinSolveFloat2Kernel = createKernel(clProgram, "lin_solve_float2");
+      clLinSolveFloat2ipKernel = createKernel(clProgram, "lin_solve_float2_ip");
+      clSetBoundFloat2Kernel = createKernel(clProgram, "set_bnd_float2");
+      clSetBoundEndFloat2Kernel = createKernel(clProgram, "set_bnd_float2_end");
+      clSetBoundMirrorFloat2Kernel = createKernel(clProgram, "set_bnd_mirror_float2");
+
+      clAddSourceFloatKernel = createKernel(clProgram, "add_source_float");
+      clLinSolveFloatKernel = createKernel(clProgram, "lin_solve_float");
+      clSetBoundFloatKernel = createKernel(clProgram, "set_bnd_float");
+      clSetBoundEndFloatKernel = createKernel(clProgram, "set_bnd_float_end");
+
+      clProjectStartKernel = createKernel(clProgram, "project_start");
+      clProjectEndKernel = createKernel(clProgram, "project_end");
+
+      clAdvectFloat2Kernel = createKernel(clProgram, "advect_float2");
+      clAdvectFloatKernel = createKernel(clProgram, "advect_float");
+
+      clMacCormackFloat2Kernel = createKernel(clProgram, "maccormack_float2");
+      clMacCormackFloatKernel = createKernel(clProgram, "maccormack_float");
+      clBfeccCorrectFloat2Kernel = createKernel(clProgram, "bfecc_correct_float2");
+      clBfeccCorrectFloatKernel = createKernel(clProgram, "bfecc_correct_float");
+      clAdvectLimitedFloat2Kernel = createKernel(clProgram, "advect_limited_float2");
+      clAdvectLimitedFloatKernel = createKernel(clProgram, "advect_limited_float");
+
+      clMaxSpeedKernel = createKernel(clProgram, "max_speed_float2");
+
+      clLinSolveFusedFloat2Kernel = createKernel(clProgram, "lin_solve_fused_float2");
+      clLinSolveFusedFloatKernel = createKernel(clProgram, "lin_solve_fused_float");
+      clLinSolveFusedFloat2ipKernel = createKernel(clProgram, "lin_solve_fused_float2_ip");
+      clProjectStartFusedKernel = createKernel(clProgram, "project_start_fused");
+      clProjectEndFusedKernel = createKernel(clProgram, "project_end_fused");
+      clAdvectFusedFloat2Kernel = createKernel(clProgram, "advect_fused_float2");
+      clAdvectFusedFloatKernel = createKernel(clProgram, "advect_fused_float");
+
+      clLinSolveTiledFloat2Kernel = createKernel(clProgram, "lin_solve_tiled_float2");
+      clLinSolveTiledFloatKernel = createKernel(clProgram, "lin_solve_tiled_float");
+      clLinSolveTiledFloat2ipKernel = createKernel(clProgram, "lin_solve_tiled_float2_ip");
+
+      clLinSolveJacobiFloat2Kernel = createKernel(clProgram, "lin_solve_jacobi_float2");
+      clLinSolveJacobiFloatKernel = createKernel(clProgram, "lin_solve_jacobi_float");
+      clLinSolveJacobiFloat2ipKernel = createKernel(clProgram, "lin_solve_jacobi_float2_ip");
+
+      clClearSourcesKernel = createKernel(clProgram, "clear_sources");
+      clSplatSourcesKernel = createKernel(clProgram, "splat_sources");
+
+      clVelocityLinesKernel = createKernel(clProgram, "velocity_lines");
+      clAdvectParticlesKernel = createKernel(clProgram, "advect_particles");
+    }
+
+    void releaseKernels() {
+      cl_kernel **kernels = get_kernels();
+      for (int i = 0; kernels[i]; ++i) {
+        releaseKernel(*kernels[i]);
+      }
+    }
+
+    void releaseKernel(cl_kernel &k) {
+      if (k) clReleaseKernel(k);
+      k = NULL;
+    }
+
+    void releaseMemObject(cl_mem &m) {
+      if (m) clReleaseMemObject(m);
+      m = NULL;
+    }
+
+    void releaseEvent(cl_event &e) {
+      if (e) clReleaseEvent(e);
+      e = NULL;
+    }
+
+    /*** FLUID DYNAMICS FUNCTIONS ***/
+
+    // source_dt is the time step of sources the fused kernels still have to add, or 0
+    void dens_substep ( int N, cl_mem dens1_buffer, cl_mem dens0_buffer, cl_mem uv0_buffer, float diff, float dt, float source_dt )
+    {
+      if (fused) {
+        diffuse_fused(N, dens0_buffer, dens1_buffer, diff, dt, source_dt, clLinSolveFusedFloatKernel, sizeof(cl_float));
+      } else {
+        diffuse(N, dens0_buffer, dens1_buffer, diff, dt, clLinSolveFloatKernel, clSetBoundFloatKernel, clSetBoundEndFloatKernel, sizeof(cl_float));
+      }
+      advect(N, dens1_buffer, dens0_buffer, uv0_buffer, dt, clAdvectFloatKernel, clMacCormackFloatKernel, clBfeccCorrectFloatKernel, clAdvectLimitedFloatKernel, clSetBoundFloatKernel, clSetBoundEndFloatKernel, sizeof(cl_float));
+    }
+
+    void vel_substep ( int N, cl_mem uv1_buffer, cl_mem uv0_buffer, float visc, float dt, float source_dt )
+    {
+      if (fused) {
+        diffuse_fused(N, uv0_buffer, uv1_buffer, visc, dt, source_dt, clLinSolveFusedFloat2Kernel, 2*sizeof(cl_float));
+      } else {
+        diffuse(N, uv0_buffer, uv1_buffer, visc, dt, clLinSolveFloat2Kernel, clSetBoundFloat2Kernel, clSetBoundEndFloat2Kernel, 2*sizeof(cl_float));
+      }
+      project(N, uv0_buffer, uv1_buffer);
+      advect(N, uv1_buffer, uv0_buffer, uv0_buffer, dt, clAdvectFloat2Kernel, clMacCormackFloat2Kernel, clBfeccCorrectFloat2Kernel, clAdvectLimitedFloat2Kernel, clSetBoundFloat2Kernel, clSetBoundEndFloat2Kernel, 2*sizeof(cl_float));
+      project(N, uv1_buffer, uv0_buffer);
+    }
+
+    // cell is the size of one cell of x and s, for the bandwidth estimate
+    void add_source ( int N, cl_mem x, cl_mem s, float dt, cl_kernel clAddSourceKern, int cell)
+    {
+      stage_scope scope(this, stage_add_source);
+      cl_int err;
+
+      // the kernel has no offset, so cover the ghost cells too
+      size_t global_size[2] = {N+2, N+2};
+      size_t local_size[2] = {1, 1};
+
+      int size = (N+2);
+
+      // Create Kernel Arguments
+      err = clSetKernelArg(clAddSourceKern, 0, sizeof(cl_mem), &s);
+      err |= clSetKernelArg(clAddSourceKern, 1, sizeof(cl_mem), &x);
+      err |= clSetKernelArg(clAddSourceKern, 2, sizeof(cl_int), &size);
+      err |= clSetKernelArg(clAddSourceKern, 3, sizeof(cl_float), &dt);
+      if (err < 0) {
+        perror("Could not create a kernel argument");
+      }
+
+      // Enqueue kernel
+
+      err = enqueue(clAddSourceKern, 2, global_size, local_size, 3*cell);
+      if (err < 0) {
+        perror("Could not enqueue the kernel");
+      }
+    }
+
+    void set_bnd ( int N, cl_mem x, cl_kernel setBndKern, cl_kernel setBndEndKern, int cell)
+    {
+      stage_scope scope(this, stage_set_bnd);
+      cl_int err;
+
+      size_t global_size = N;
+      size_t local_size = 1;
+      size_t end_size = 1;
+      size_t end_size_local = 1;
+
+      int Nborder = N + 2;
+
+      err = clSetKernelArg(setBndKern, 0, sizeof(cl_mem), &x);
+      err |= clSetKernelArg(setBndKern, 1, sizeof(cl_int), &Nborder);
+      if (err < 0) {
+        perror("Could not create a kernel argument for setBndKern");
+        return; //exit(1);
+      }
+
+      err = clSetKernelArg(setBndEndKern, 0, sizeof(cl_mem), &x);
+      err |= clSetKernelArg(setBndEndKern, 1, sizeof(int), &Nborder);
+      if (err < 0) {
+        perror("Could not create a kernel argument for setBndEndKern");
+        return; //exit(1);
+      }
+
+      err |= enqueue(setBndKern, 1, &global_size, &local_size, 8*cell);
+      err |= enqueue(setBndEndKern, 1, &end_size, &end_size_local, 12*cell);
+      if (err < 0) {
+        perror("Could not enqueue the kernel for set_bnd");
+        return; //exit(1);
+      }
+    }
+
+    void lin_solve(int width, cl_mem x, cl_mem x0, float a, float c,
+                   cl_kernel linSolveKern, cl_kernel setBndKern, cl_kernel setBndEndKern, int cell)
+    {
+      cl_int err;
+      int k = 0;
+
+      size_t global_size[2] = {width, width};
+      size_t local_size[2] = {1, 1};
+
+      int Nborder = width+2;
+
+      // Create Kernel Arguments
+      err = clSetKernelArg(linSolveKern, 0, sizeof(cl_mem), &x0);
+      err |= clSetKernelArg(linSolveKern, 1, sizeof(cl_mem), &x);
+      err |= clSetKernelArg(linSolveKern, 2, sizeof(cl_int), &Nborder);
+      err |= clSetKernelArg(linSolveKern, 3, sizeof(cl_float), &a);
+      err |= clSetKernelArg(linSolveKern, 4, sizeof(cl_float), &c);
+      if (err < 0) {
+        perror("Could not create a kernel argument for linSolveKern");
+        return; //exit(1);
+      }
+
+      // Enqueue kernel
+      for (k = 0; k != 50; k++) {
+        err = enqueue(linSolveKern, 2, global_size, local_size, 3*cell);
+        if (err < 0) {
+          perror("Could not enqueue the kernel for linSolveKern");
+          return; //exit(1);
+        }
+        set_bnd( width, x, setBndKern, setBndEndKern, cell );
+      }
+    }
+
+    void diffuse ( int N, cl_mem x, cl_mem x0, float diff, float dt, cl_kernel linSolveKern, cl_kernel setBndKern, cl_kernel setBndEndKern, int cell)
+    {
+      stage_scope scope(this, stage_diffuse);
+      float a=dt*diff*N*N;
+      lin_solve ( N, x, x0, a, 1+4*a, linSolveKern, setBndKern, setBndEndKern, cell);
+    }
+
+    // lin_solve with the fused kernels, which keep the ghost cells
+    // themselves. x holds the sources on entry if source_dt isn't 0.
+    void diffuse_fused ( int N, cl_mem x, cl_mem x0, float diff, float dt, float source_dt, cl_kernel linSolveKern, int cell )
+    {
+      stage_scope scope(this, stage_diffuse);
+      float a = dt*diff*N*N;
+      float c = 1+4*a;
+
+      if (get_tiled()) {
+        cl_kernel tiledKern = cell == sizeof(cl_float) ? clLinSolveTiledFloatKernel : clLinSolveTiledFloat2Kernel;
+        lin_solve_tiled(tiledKern, x, x0, a, c, source_dt, cell);
+      } else if (relaxation == relaxation_jacobi) {
+        cl_kernel jacobiKern = cell == sizeof(cl_float) ? clLinSolveJacobiFloatKernel : clLinSolveJacobiFloat2Kernel;
+        lin_solve_jacobi(jacobiKern, x, x0, a, c, source_dt, cell);
+      } else {
+        lin_solve_red_black(linSolveKern, x, x0, a, c, source_dt, cell);
+      }
+    }
+
+    // solver_sweeps red-black sweeps of lin_solve_fused_float(2), each a
+    // launch for the red cells and one for the black. The first launch
+    // adds the sources.
+    void lin_solve_red_black ( cl_kernel kern, cl_mem x, cl_mem x0, float a, float c, float source_dt, int cell )
+    {
+      size_t global_size[2] = {N, N};
+      int Nborder = N+2;
+
+      cl_int err = clSetKernelArg(kern, 0, sizeof(cl_mem), &x0);
+      err |= clSetKernelArg(kern, 1, sizeof(cl_mem), &x);
+      err |= clSetKernelArg(kern, 2, sizeof(cl_mem), &x);
+      err |= clSetKernelArg(kern, 3, sizeof(cl_int), &Nborder);
+      err |= clSetKernelArg(kern, 4, sizeof(cl_float), &a);
+      err |= clSetKernelArg(kern, 5, sizeof(cl_float), &c);
+      for (int l = 0; l != solver_sweeps*2 && err >= 0; ++l) {
+        float dt = l == 0 ? source_dt : 0;
+        int color = l & 1;
+        err |= clSetKernelArg(kern, 6, sizeof(cl_float), &dt);
+        err |= clSetKernelArg(kern, 7, sizeof(cl_int), &color);
+        err |= enqueue(kern, 2, global_size, NULL, (dt != 0 ? 4 : 2)*cell);
+        exchange_halo(x, cell / sizeof(cl_float));
+      }
+      if (err < 0) {
+        perror("Could not run the red-black lin_solve kernel");
+      }
+    }
+
+    // solver_sweeps Jacobi sweeps of lin_solve_jacobi_float(2), rounded up
+    // to an even number, ping-ponging between x and fwd_buffer
+    void lin_solve_jacobi ( cl_kernel kern, cl_mem x, cl_mem x0, float a, float c, float source_dt, int cell )
+    {
+      size_t global_size[2] = {N, N};
+      int Nborder = N+2;
+      cl_mem buffers[2] = { x, fwd_buffer };
+
+      cl_int err = clSetKernelArg(kern, 0, sizeof(cl_mem), &x0);
+      err |= clSetKernelArg(kern, 3, sizeof(cl_mem), &x);
+      err |= clSetKernelArg(kern, 4, sizeof(cl_int), &Nborder);
+      err |= clSetKernelArg(kern, 5, sizeof(cl_float), &a);
+      err |= clSetKernelArg(kern, 6, sizeof(cl_float), &c);
+      for (int l = 0; l != get_tiled_launches(solver_sweeps, 1) && err >= 0; ++l) {
+        float dt = l == 0 ? source_dt : 0;
+        err |= clSetKernelArg(kern, 1, sizeof(cl_mem), &buffers[l & 1]);
+        err |= clSetKernelArg(kern, 2, sizeof(cl_mem), &buffers[~l & 1]);
+        err |= clSetKernelArg(kern, 7, sizeof(cl_float), &dt);
+        err |= enqueue(kern, 2, global_size, NULL, (dt != 0 ? 5 : 3)*cell);
+        exchange_halo(buffers[~l & 1], cell / sizeof(cl_float));
+      }
+      if (err < 0) {
+        perror("Could not run the Jacobi lin_solve kernel");
+      }
+    }
+
+    // launches to make sweeps sweeps of per_launch or fewer, rounded up to
+    // an even number so ping-ponging ends in the buffer it started in.
+    // At least two, even for no sweeps.
+    static int get_tiled_launches(int sweeps, int per_launch) {
+      int launches = (sweeps + per_launch - 1) / per_launch;
+      return launches < 2 ? 2 : launches + (launches & 1);
+    }
+
+    // global size of the tiled kernels, rounded up to a whole number of tiles
+    void get_tiled_sizes(size_t *global_size, size_t *local_size) const {
+      size_t tiles = (N + tile_size - 1) / tile_size;
+      global_size[0] = global_size[1] = tiles * tile_size;
+      local_size[0] = local_size[1] = tile_size;
+    }
+
+    // the sweeps of diffuse_fused with lin_solve_tiled_float(2), ping-ponging
+    // between x and fwd_buffer. The first launch adds the sources.
+    void lin_solve_tiled ( cl_kernel kern, cl_mem x, cl_mem x0, float a, float c, float source_dt, int cell )
+    {
+      size_t global_size[2], local_size[2];
+      get_tiled_sizes(global_size, local_size);
+      int Nborder = N+2;
+      int launches = get_tiled_launches(solver_sweeps, diffuse_sweeps);
+      cl_mem buffers[2] = { x, fwd_buffer };
+
+      cl_int err = clSetKernelArg(kern, 0, sizeof(cl_mem), &x0);
+      err |= clSetKernelArg(kern, 4, sizeof(cl_int), &Nborder);
+      err |= clSetKernelArg(kern, 5, sizeof(cl_float), &a);
+      err |= clSetKernelArg(kern, 6, sizeof(cl_float), &c);
+      err |= clSetKernelArg(kern, 9, (tile_size+2)*(tile_size+2)*cell, NULL);
+      for (int l = 0; l != launches && err >= 0; ++l) {
+        int sweeps = solver_sweeps / launches + (l < solver_sweeps % launches);
+        float dt = l == 0 ? source_dt : 0;
+        err |= clSetKernelArg(kern, 1, sizeof(cl_mem), &buffers[l & 1]);
+        err |= clSetKernelArg(kern, 2, sizeof(cl_mem), &buffers[~l & 1]);
+        err |= clSetKernelArg(kern, 3, sizeof(cl_mem), &x);
+        err |= clSetKernelArg(kern, 7, sizeof(cl_float), &dt);
+        err |= clSetKernelArg(kern, 8, sizeof(cl_int), &sweeps);
+        err |= enqueue(kern, 2, global_size, local_size, (dt != 0 ? 5 : 3)*cell);
+        exchange_halo(buffers[~l & 1], cell / sizeof(cl_float));
+      }
+      if (err < 0) {
+        perror("Could not run the tiled lin_solve kernel");
+      }
+    }
+
+    void advect_semi_lagrangian ( int N, cl_mem d, cl_mem d0, cl_mem uv, float dt, cl_kernel advectKern, cl_kernel setBndKern, cl_kernel setBndEndKern, int cell )
+    {
+      if (fused) {
+        advectKern = cell == sizeof(cl_float) ? clAdvectFusedFloatKernel : clAdvectFusedFloat2Kernel;
+      }
+      cl_int err;
+      float dt0 = dt*N;
+      int Nborder = N+2;
+
+      size_t global_size[2] = {N, N};
+      size_t local_size[2] = {1, 1};
+
+      // Create Kernel Arguments
+      err = clSetKernelArg(advectKern, 0, sizeof(cl_mem), &d0);
+      err |= clSetKernelArg(advectKern, 1, sizeof(cl_mem), &d);
+      err |= clSetKernelArg(advectKern, 2, sizeof(cl_mem), &uv);
+      err |= clSetKernelArg(advectKern, 3, sizeof(cl_int), &Nborder);
+      err |= clSetKernelArg(advectKern, 4, sizeof(cl_float), &dt0);
+      if (err < 0) {
+        perror("Could not create a kernel argument for advectKern");
+        return; //exit(1);
+      }
+
+      err = enqueue(advectKern, 2, global_size, local_size, 8 + 2*cell);
+      if (err < 0) {
+        perror("Could not enqueue the kernel for advectKern");
+        return; //exit(1);
+      }
+      exchange_halo(d, cell / sizeof(cl_float));
+      if (!fused) {
+        set_bnd ( N, d, setBndKern, setBndEndKern, cell );
+      }
+    }
+
+    // MacCormack and BFECC advect forwards into fwd_buffer and back into
+    // bwd_buffer to estimate the error of the first order advection.
+    void advect ( int N, cl_mem d, cl_mem d0, cl_mem uv, float dt, cl_kernel advectKern,
+                  cl_kernel macCormackKern, cl_kernel bfeccCorrectKern, cl_kernel advectLimitedKern,
+                  cl_kernel setBndKern, cl_kernel setBndEndKern, int cell )
+    {
+      stage_scope scope(this, stage_advect);
+      if (advection == advection_semi_lagrangian) {
+        advect_semi_lagrangian(N, d, d0, uv, dt, advectKern, setBndKern, setBndEndKern, cell);
+        return;
+      }
+
+      advect_semi_lagrangian(N, fwd_buffer, d0, uv, dt, advectKern, setBndKern, setBndEndKern, cell);
+      advect_semi_lagrangian(N, bwd_buffer, fwd_buffer, uv, -dt, advectKern, setBndKern, setBndEndKern, cell);
+
+      cl_int err;
+      float dt0 = dt*N;
+      int Nborder = N+2;
+      size_t global_size[2] = {N, N};
+      size_t local_size[2] = {1, 1};
+
+      if (advection == advection_maccormack) {
+        err = clSetKernelArg(macCormackKern, 0, sizeof(cl_mem), &d0);
+        err |= clSetKernelArg(macCormackKern, 1, sizeof(cl_mem), &fwd_buffer);
+        err |= clSetKernelArg(macCormackKern, 2, sizeof(cl_mem), &bwd_buffer);
+        err |= clSetKernelArg(macCormackKern, 3, sizeof(cl_mem), &d);
+        err |= clSetKernelArg(macCormackKern, 4, sizeof(cl_mem), &uv);
+        err |= clSetKernelArg(macCormackKern, 5, sizeof(cl_int), &Nborder);
+        err |= clSetKernelArg(macCormackKern, 6, sizeof(cl_float), &dt0);
+        if (err < 0) {
+          perror("Could not create a kernel argument for macCormackKern");
+          return;
+        }
+        err = enqueue(macCormackKern, 2, global_size, local_size, 8 + 5*cell);
+        if (err < 0) {
+          perror("Could not enqueue the kernel for macCormackKern");
+          return;
+        }
+      } else {
+        err = clSetKernelArg(bfeccCorrectKern, 0, sizeof(cl_mem), &d0);
+        err |= clSetKernelArg(bfeccCorrectKern, 1, sizeof(cl_mem), &bwd_buffer);
+        err |= clSetKernelArg(bfeccCorrectKern, 2, sizeof(cl_int), &Nborder);
+        err |= clSetKernelArg(advectLimitedKern, 0, sizeof(cl_mem), &d0);
+        err |= clSetKernelArg(advectLimitedKern, 1, sizeof(cl_mem), &bwd_buffer);
+        err |= clSetKernelArg(advectLimitedKern, 2, sizeof(cl_mem), &d);
+        err |= clSetKernelArg(advectLimitedKern, 3, sizeof(cl_mem), &uv);
+        err |= clSetKernelArg(advectLimitedKern, 4, sizeof(cl_int), &Nborder);
+        err |= clSetKernelArg(advectLimitedKern, 5, sizeof(cl_float), &dt0);
+        if (err < 0) {
+          perror("Could not create a kernel argument for bfeccCorrectKern/advectLimitedKern");
+          return;
+        }
+        err = enqueue(bfeccCorrectKern, 2, global_size, local_size, 3*cell);
+        if (err < 0) {
+          perror("Could not enqueue the kernel for bfeccCorrectKern");
+          return;
+        }
+        set_bnd ( N, bwd_buffer, setBndKern, setBndEndKern, cell );
+        err = enqueue(advectLimitedKern, 2, global_size, local_size, 8 + 4*cell);
+        if (err < 0) {
+          perror("Could not enqueue the kernel for advectLimitedKern");
+          return;
+        }
+      }
+      set_bnd ( N, d, setBndKern, setBndEndKern, cell );
+    }
+
+    // the ghost cells are kept by the kernels. The tiled and Jacobi solves
+    // take the divergence with their first pressure sweep and the gradient
+    // with their last; red-black starts from zero pressure as the CPU
+    // solver does.
+    void project_fused ( int N, cl_mem uv1, cl_mem uv0 )
+    {
+      cl_int err;
+
+      size_t global_size[2] = {N, N};
+
+      int Nborder = N+2;
+      int sweep = get_tiled() || relaxation == relaxation_jacobi;
+      int sweeps = solver_sweeps - 2*sweep;
+
+      err = clSetKernelArg(clProjectStartFusedKernel, 0, sizeof(cl_mem), &uv1);
+      err |= clSetKernelArg(clProjectStartFusedKernel, 1, sizeof(cl_mem), &uv0);
+      err |= clSetKernelArg(clProjectStartFusedKernel, 2, sizeof(cl_int), &Nborder);
+      err |= clSetKernelArg(clProjectStartFusedKernel, 3, sizeof(cl_int), &sweep);
+      err |= clSetKernelArg(clProjectEndFusedKernel, 0, sizeof(cl_mem), &uv1);
+      err |= clSetKernelArg(clProjectEndFusedKernel, 1, sizeof(cl_mem), &uv0);
+      err |= clSetKernelArg(clProjectEndFusedKernel, 2, sizeof(cl_int), &Nborder);
+      err |= clSetKernelArg(clProjectEndFusedKernel, 3, sizeof(cl_int), &sweep);
+      if (err < 0) {
+        perror("Could not create a kernel argument for the fused project kernels");
+        return;
+      }
+
+      err = enqueue(clProjectStartFusedKernel, 2, global_size, NULL, 24);
+      exchange_halo(uv0, 2);
+      if (get_tiled() || relaxation == relaxation_jacobi) {
+        // ping-pong between uv0 and fwd_buffer
+        cl_kernel kern = get_tiled() ? clLinSolveTiledFloat2ipKernel : clLinSolveJacobiFloat2ipKernel;
+        size_t tiled_global_size[2], tiled_local_size[2];
+        get_tiled_sizes(tiled_global_size, tiled_local_size);
+        int launches = get_tiled_launches(sweeps, get_tiled() ? pressure_sweeps : 1);
+        cl_mem buffers[2] = { uv0, fwd_buffer };
+        err |= clSetKernelArg(kern, 2, sizeof(cl_int), &Nborder);
+        if (get_tiled()) {
+          err |= clSetKernelArg(kern, 4, (tile_size+2)*(tile_size+2)*sizeof(cl_float), NULL);
+        }
+        for (int l = 0; l != launches && err >= 0; ++l) {
+          int launch_sweeps = sweeps / launches + (l < sweeps % launches);
+          err |= clSetKernelArg(kern, 0, sizeof(cl_mem), &buffers[l & 1]);
+          err |= clSetKernelArg(kern, 1, sizeof(cl_mem), &buffers[~l & 1]);
+          if (get_tiled()) {
+            err |= clSetKernelArg(kern, 3, sizeof(cl_int), &launch_sweeps);
+            err |= enqueue(kern, 2, tiled_global_size, tiled_local_size, 16);
+          } else {
+            err |= enqueue(kern, 2, global_size, NULL, 16);
+          }
+          exchange_halo(buffers[~l & 1], 2);
+        }
+      } else {
+        err |= clSetKernelArg(clLinSolveFusedFloat2ipKernel, 0, sizeof(cl_mem), &uv0);
+        err |= clSetKernelArg(clLinSolveFusedFloat2ipKernel, 1, sizeof(cl_int), &Nborder);
+        for (int l = 0; l != sweeps*2 && err >= 0; ++l) {
+          int color = l & 1;
+          err |= clSetKernelArg(clLinSolveFusedFloat2ipKernel, 2, sizeof(cl_int), &color);
+          err |= enqueue(clLinSolveFusedFloat2ipKernel, 2, global_size, NULL, 12);
+          exchange_halo(uv0, 2);
+        }
+      }
+      err |= enqueue(clProjectEndFusedKernel, 2, global_size, NULL, 24);
+      exchange_halo(uv1, 2);
+      if (err < 0) {
+        perror("Could not enqueue the fused project kernels");
+      }
+    }
+
+    void project ( int N, cl_mem uv1, cl_mem uv0 )
+    {
+      stage_scope scope(this, stage_project);
+      if (fused) {
+        project_fused(N, uv1, uv0);
+        return;
+      }
+      cl_int err;
+
+      size_t global_size[2] = {N, N};
+      size_t local_size[2] = {1, 1};
+
+      int Nborder = N+2;
+
+      // Create Kernel Arguments
+      err = clSetKernelArg(clProjectStartKernel, 0, sizeof(cl_mem), &uv1);
+      err |= clSetKernelArg(clProjectStartKernel, 1, sizeof(cl_mem), &uv0);
+      err |= clSetKernelArg(clProjectStartKernel, 2, sizeof(cl_int), &Nborder);
+      if (err < 0) {
+        perror("Could not create a kernel argument for clProjectStartKernel");
+        return; //exit(1);
+      }
+
+      err = clSetKernelArg(clProjectEndKernel, 0, sizeof(cl_mem), &uv1);
+      err |= clSetKernelArg(clProjectEndKernel, 1, sizeof(cl_mem), &uv0);
+      err |= clSetKernelArg(clProjectEndKernel, 2, sizeof(cl_int), &Nborder);
+      if (err < 0) {
+        perror("Could not create a kernel argument for clProjectEndKernel");
+        return; //exit(1);
+      }
+
+      err = enqueue(clProjectStartKernel, 2, global_size, local_size, 16);
+      if (err < 0) {
+        perror("Could not enqueue the kernel for clProjectStartKernel");
+        return; //exit(1);
+      }
+      set_bnd( N, uv0, clSetBoundMirrorFloat2Kernel, clSetBoundEndFloat2Kernel, 8 );
+
+      lin_solve ( N, uv0, uv0, 1.0f, 4.0f, clLinSolveFloat2ipKernel, clSetBoundMirrorFloat2Kernel, clSetBoundEndFloat2Kernel, 8 );
+
+      err = enqueue(clProjectEndKernel, 2, global_size, local_size, 24);
+      if (err < 0) {
+        perror("Could not enqueue the kernel for clProjectEndKernel");
+        return; //exit(1);
+      }
+      set_bnd( N, uv1, clSetBoundFloat2Kernel, clSetBoundEndFloat2Kernel, 8 );
+    }
+
+    // run max_speed_float2 on uv + dt*src into speed_buffer
+    bool enqueue_max_speed(cl_mem uv, cl_mem src, float dt) {
+      if (!src) src = uv;
+      cl_int err;
+
+      size_t global_size = speed_groups * speed_local_size;
+      size_t local_size = speed_local_size;
+      int Nborder = N + 2;
+
+      err = clSetKernelArg(clMaxSpeedKernel, 0, sizeof(cl_mem), &uv);
+      err |= clSetKernelArg(clMaxSpeedKernel, 1, sizeof(cl_mem), &src);
+      err |= clSetKernelArg(clMaxSpeedKernel, 2, sizeof(cl_mem), &speed_buffer);
+      err |= clSetKernelArg(clMaxSpeedKernel, 3, speed_local_size * sizeof(cl_float), NULL);
+      err |= clSetKernelArg(clMaxSpeedKernel, 4, sizeof(cl_int), &Nborder);
+      err |= clSetKernelArg(clMaxSpeedKernel, 5, sizeof(cl_float), &dt);
+      if (err < 0) {
+        perror("Could not create a kernel argument for clMaxSpeedKernel");
+        return false;
+      }
+
+      cl_event event = NULL;
+      err = clEnqueueNDRangeKernel(clQueue, clMaxSpeedKernel, 1, NULL, &global_size,
+        &local_size, last_event ? 1 : 0, last_event ? &last_event : NULL, out_of_order ? &event : NULL);
+      if (err < 0) {
+        perror("Could not enqueue the kernel for clMaxSpeedKernel");
+        return false;
+      }
+      if (out_of_order) chain(event);
+      return true;
+    }
+
+    // combine the results of the work groups of max_speed_float2
+    static float largest(const float *partial) {
+      float speed = 0;
+      for (int i = 0; i != speed_groups; ++i) {
+        if (partial[i] > speed) speed = partial[i];
+      }
+      return speed;
+    }
+
+  public:
+    fluid_cl_solver() {
+      clContext = NULL;
+      clDeviceID = NULL;
+      clQueue = NULL;
+      clProgram = NULL;
+      cl_kernel **kernels = get_kernels();
+      for (int i = 0; kernels[i]; ++i) {
+        *kernels[i] = NULL;
+      }
+      uv0_buffer = uv1_buffer = dens0_buffer = dens1_buffer = NULL;
+      fwd_buffer = bwd_buffer = speed_buffer = NULL;
+      own_dens_buffers = false;
+      speed_read[0] = speed_read[1] = NULL;
+      speed_half = 0;
+      splat_buffer[0] = splat_buffer[1] = NULL;
+      splat_capacity[0] = splat_capacity[1] = 0;
+      splat_written[0] = splat_written[1] = NULL;
+      splat_read[0] = splat_read[1] = NULL;
+      splat_half = 0;
+      particle_seed = 0;
+      pipelined = false;
+      out_of_order = false;
+      last_event = NULL;
+      N = 0;
+      advection = advection_semi_lagrangian;
+      fused = true;
+      half_storage = false;
+      specialised = true;
+      slab_exchange = NULL;
+      slab_first = slab_last = halo = 0;
+      tile_size = 0;
+      tile_limit = max_tile_size;
+      diffuse_sweeps = 5;
+      pressure_sweeps = 1;
+      relaxation = relaxation_tiled;
+      solver_sweeps = 50;
+      cfl = 0;
+      max_substeps = 1;
+      time_budget = 0;
+      substep_seconds = 0;
+      profiling = false;
+      stage = stage_add_source;
+      memset(&profile, 0, sizeof(profile));
+    }
+
+    ~fluid_cl_solver() {
+      release();
+    }
+
+    /// build the program and make the buffers for an N x N grid.
+    /// dens0 and dens1 may be made by the caller with (N+2)*(N+2) floats,
+    /// or halves with half storage; if they are NULL the solver makes them.
+    /// A slab's buffers hold only its stored rows, get_stored_rows()*(N+2)
+    /// cells.
+    /// The solver makes its own command queue, with profiling enabled if
+    /// asked for, out of order if pipelined and the device has them.
+    bool init(cl_context ctx, cl_device_id dev, int N, cl_mem dens0 = NULL, cl_mem dens1 = NULL, bool enable_profiling = false, const char *filename = "assets/opencl/fluids.cl") {
+      cl_int err;
+      clContext = ctx;
+      clDeviceID = dev;
+      this->N = N;
+
+      // Create a Command Queue
+      cl_command_queue_properties device_props = 0;
+      if (pipelined) {
+        clGetDeviceInfo(clDeviceID, CL_DEVICE_QUEUE_PROPERTIES, sizeof(device_props), &device_props, NULL);
+      }
+      out_of_order = (device_props & CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE) != 0;
+      cl_command_queue_properties props = enable_profiling ? CL_QUEUE_PROFILING_ENABLE : 0;
+      if (out_of_order) props |= CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE;
+      clQueue = clCreateCommandQueue(clContext, clDeviceID, props, &err);
+      if (err < 0) {
+        perror("Could not create a command queue");
+        return false;
+      }
+      profiling = enable_profiling;
+      reset_profile();
+
+      // Build program
+      clProgram = buildProgram(clContext, clDeviceID, filename, get_build_options(0));
+
+      // Create data buffer
+      int size = (N+2)*get_stored_rows();
+      dynarray<float> zero(size*2);
+      memset(zero.data(), 0, size*2*sizeof(float));
+
+      uv0_buffer = clCreateBuffer(clContext, CL_MEM_READ_WRITE |
+        CL_MEM_COPY_HOST_PTR, field_bytes(size * 2), zero.data(), &err);
+      uv1_buffer = clCreateBuffer(clContext, CL_MEM_READ_WRITE |
+        CL_MEM_COPY_HOST_PTR, field_bytes(size * 2), zero.data(), &err);
+      fwd_buffer = clCreateBuffer(clContext, CL_MEM_READ_WRITE |
+        CL_MEM_COPY_HOST_PTR, field_bytes(size * 2), zero.data(), &err);
+      bwd_buffer = clCreateBuffer(clContext, CL_MEM_READ_WRITE |
+        CL_MEM_COPY_HOST_PTR, field_bytes(size * 2), zero.data(), &err);
+      speed_buffer = clCreateBuffer(clContext, CL_MEM_READ_WRITE, speed_groups * sizeof(float), NULL, &err);
+      own_dens_buffers = dens0 == NULL;
+      if (own_dens_buffers) {
+        dens0_buffer = clCreateBuffer(clContext, CL_MEM_READ_WRITE |
+          CL_MEM_COPY_HOST_PTR, field_bytes(size), zero.data(), &err);
+        dens1_buffer = clCreateBuffer(clContext, CL_MEM_READ_WRITE |
+          CL_MEM_COPY_HOST_PTR, field_bytes(size), zero.data(), &err);
+      } else {
+        dens0_buffer = dens0;
+        dens1_buffer = dens1;
+      }
+      if (err < 0) {
+        perror("Could not create a buffer");
+        return false;
+      }
+
+      // Create the kernels, then specialise the program for the tile size
+      // they can run, if there is one
+      createKernels();
+      tile_size = choose_tile_size();
+      if (tile_size > tile_limit) tile_size = tile_limit;
+      if (specialised && tile_size) {
+        int generic_tile_size = tile_size;
+        releaseKernels();
+        clReleaseProgram(clProgram);
+        clProgram = buildProgram(clContext, clDeviceID, filename, get_build_options(tile_size));
+        createKernels();
+        // the compiler may need more of the device for the fixed tile
+        if (choose_tile_size() < generic_tile_size) tile_size = 0;
+      }
+      return true;
+    }
+
+    /// release the kernels, buffers, program and queue
+    void release() {
+      if (!clQueue) return;
+      collect_profile();
+      clFinish(clQueue);
+      releaseKernels();
+      for (int h = 0; h != 2; ++h) {
+        releaseEvent(speed_read[h]);
+        releaseEvent(splat_written[h]);
+        releaseEvent(splat_read[h]);
+        releaseMemObject(splat_buffer[h]);
+        splat_capacity[h] = 0;
+        splat_values[h].resize(0);
+      }
+      releaseEvent(last_event);
+      releaseMemObject(uv0_buffer);
+      releaseMemObject(uv1_buffer);
+      releaseMemObject(fwd_buffer);
+      releaseMemObject(bwd_buffer);
+      releaseMemObject(speed_buffer);
+      if (own_dens_buffers) {
+        releaseMemObject(dens0_buffer);
+        releaseMemObject(dens1_buffer);
+      }
+      clReleaseProgram(clProgram);
+      clReleaseCommandQueue(clQueue);
+      clProgram = NULL;
+      clQueue = NULL;
+    }
+
+    /// write size floats from src into dst, as half floats if dst is a
+    /// field with half storage
+    void writeArray(cl_mem dst, float *src, unsigned int size) {
+      cl_event event = NULL;
+      size_t bytes = size*sizeof(cl_float);
+      void *data = (void *)src;
+      dynarray<uint16_t> packed;
+      if (half_storage && is_field(dst)) {
+        packed.resize(size);
+        fluid_half::pack(packed.data(), src, size, fluid_half::format_half);
+        bytes = size*sizeof(cl_half);
+        data = packed.data();
+      }
+      cl_int err = clEnqueueWriteBuffer(clQueue, dst, CL_TRUE, 0, bytes, data,
+        last_event ? 1 : 0, last_event ? &last_event : NULL, out_of_order ? &event : NULL);
+      if (err < 0) {
+        printf("Could not write array.");
+      } else if (out_of_order) {
+        chain(event);
+      }
+    }
+
+    /// read size floats from src into dst, from half floats if src is a
+    /// field with half storage
+    void readArray(cl_mem src, float *dst, unsigned int size) {
+      cl_event event = NULL;
+      bool packed = half_storage && is_field(src);
+      dynarray<uint16_t> halves(packed ? size : 0);
+      cl_int err = clEnqueueReadBuffer(clQueue, src, CL_TRUE, 0, packed ? size*sizeof(cl_half) : size*sizeof(cl_float),
+        packed ? (void *)halves.data() : (void *)dst,
+        last_event ? 1 : 0, last_event ? &last_event : NULL, out_of_order ? &event : NULL);
+      if (err < 0) {
+        printf("Could not read array.");
+        return;
+      }
+      if (out_of_order) {
+        chain(event);
+      }
+      if (packed) {
+        fluid_half::unpack(dst, halves.data(), size, fluid_half::format_half);
+      }
+    }
+
+    /// add a source of force (u, v) and density d at cell (i, j) to the
+    /// next splat_sources(). A cell should have one splat at most.
+    void add_splat(int i, int j, float u, float v, float d) {
+      dynarray<float> &values = splat_values[splat_half];
+      // this half may still be uploading from the call before last
+      if (splat_written[splat_half]) {
+        clWaitForEvents(1, &splat_written[splat_half]);
+        releaseEvent(splat_written[splat_half]);
+      }
+      values.push_back((float)(j*(N+2) + i));
+      values.push_back(u);
+      values.push_back(v);
+      values.push_back(d);
+    }
+
+    /// make the splats added since the last call the sources of the next
+    /// step in place of uv0 and dens0. Only the splats are uploaded, and
+    /// the host doesn't wait for them.
+    void splat_sources() {
+      stage_scope scope(this, stage_add_source);
+      int h = splat_half;
+      int count = splat_values[h].size() / 4;
+      int Nborder = N + 2;
+      size_t global_size[2] = {Nborder, Nborder};
+      cl_int err;
+
+      err = clSetKernelArg(clClearSourcesKernel, 0, sizeof(cl_mem), &uv0_buffer);
+      err |= clSetKernelArg(clClearSourcesKernel, 1, sizeof(cl_mem), &dens0_buffer);
+      err |= clSetKernelArg(clClearSourcesKernel, 2, sizeof(int), &Nborder);
+      if (err < 0) {
+        perror("Could not create a kernel argument for clClearSourcesKernel");
+        return;
+      }
+      err = enqueue(clClearSourcesKernel, 2, global_size, NULL, 12, NULL, true);
+      if (err < 0) {
+        perror("Could not enqueue the kernel for clClearSourcesKernel");
+        return;
+      }
+      if (count == 0) return;
+
+      if (count > splat_capacity[h]) {
+        releaseMemObject(splat_buffer[h]);
+        splat_capacity[h] = 0;
+        splat_buffer[h] = clCreateBuffer(clContext, CL_MEM_READ_ONLY, count * 4 * sizeof(float), NULL, &err);
+        if (err < 0) {
+          perror("Could not create a buffer");
+          splat_values[h].resize(0);
+          return;
+        }
+        splat_capacity[h] = count;
+      }
+
+      // the upload only waits for the last kernel to read its buffer, so
+      // it can overlap the kernels of the step before
+      err = clEnqueueWriteBuffer(clQueue, splat_buffer[h], CL_FALSE, 0, count * 4 * sizeof(float), splat_values[h].data(),
+        splat_read[h] ? 1 : 0, splat_read[h] ? &splat_read[h] : NULL, &splat_written[h]);
+      if (err < 0) {
+        printf("Could not write array.");
+        splat_values[h].resize(0);
+        return;
+      }
+
+      size_t splat_size = count;
+      err = clSetKernelArg(clSplatSourcesKernel, 0, sizeof(cl_mem), &uv0_buffer);
+      err |= clSetKernelArg(clSplatSourcesKernel, 1, sizeof(cl_mem), &dens0_buffer);
+      err |= clSetKernelArg(clSplatSourcesKernel, 2, sizeof(cl_mem), &splat_buffer[h]);
+      err |= clSetKernelArg(clSplatSourcesKernel, 3, sizeof(int), &Nborder);
+      if (err < 0) {
+        perror("Could not create a kernel argument for clSplatSourcesKernel");
+        return;
+      }
+      err = enqueue(clSplatSourcesKernel, 1, &splat_size, NULL, 28, splat_written[h]);
+      if (err < 0) {
+        perror("Could not enqueue the kernel for clSplatSourcesKernel");
+        return;
+      }
+      if (out_of_order) {
+        releaseEvent(splat_read[h]);
+        clRetainEvent(last_event);
+        splat_read[h] = last_event;
+      }
+
+      // the values stay put until add_splat() comes back to this half
+      splat_values[h].resize(0);
+      splat_half = 1 - h;
+    }
+
+    /// copy the density into dst, (N+2)*(N+2) floats or halves, or a slab's
+    /// stored rows of them, once the step and
+    /// the event after, if not NULL, are done. The next step waits for the
+    /// copy. done gets the copy's event, for the caller to release.
+    bool copy_density(cl_mem dst, cl_event after, cl_event *done) {
+      cl_event wait[2];
+      cl_uint num_waits = get_wait_list(after, wait);
+      cl_event event = NULL;
+      cl_int err = clEnqueueCopyBuffer(clQueue, dens1_buffer, dst, 0, 0, field_bytes((N+2)*get_stored_rows()),
+        num_waits, num_waits ? wait : NULL, &event);
+      if (err < 0) {
+        perror("Could not copy the density");
+        return false;
+      }
+      if (out_of_order) {
+        clRetainEvent(event);
+        chain(event);
+      }
+      *done = event;
+      return true;
+    }
+
+    /// write the velocity into dst as (N+2)*(N+2) lines for GL_LINES, two
+    /// vertices of three floats a cell, as velocity_lines in fluids.cl:
+    /// cell (i, j) is at origin + step*(i, j) and its line is its velocity
+    /// times scale. dst is usually a GL buffer shared with the context. It
+    /// waits for the step and for after, if not NULL, and done gets its
+    /// event, for the caller to release.
+    bool write_velocity_lines(cl_mem dst, float origin, float step, float scale, cl_event after, cl_event *done) {
+      int Nborder = N + 2;
+      size_t global_size[2] = {Nborder, Nborder};
+      cl_int err;
+
+      err = clSetKernelArg(clVelocityLinesKernel, 0, sizeof(cl_mem), &uv1_buffer);
+      err |= clSetKernelArg(clVelocityLinesKernel, 1, sizeof(cl_mem), &dst);
+      err |= clSetKernelArg(clVelocityLinesKernel, 2, sizeof(int), &Nborder);
+      err |= clSetKernelArg(clVelocityLinesKernel, 3, sizeof(cl_float), &origin);
+      err |= clSetKernelArg(clVelocityLinesKernel, 4, sizeof(cl_float), &step);
+      err |= clSetKernelArg(clVelocityLinesKernel, 5, sizeof(cl_float), &scale);
+      if (err < 0) {
+        perror("Could not create a kernel argument for clVelocityLinesKernel");
+        return false;
+      }
+
+      cl_event wait[2];
+      cl_uint num_waits = get_wait_list(after, wait);
+      cl_event event = NULL;
+      err = clEnqueueNDRangeKernel(clQueue, clVelocityLinesKernel, 2, NULL, global_size, NULL,
+        num_waits, num_waits ? wait : NULL, &event);
+      if (err < 0) {
+        perror("Could not enqueue the kernel for clVelocityLinesKernel");
+        return false;
+      }
+      if (out_of_order) {
+        clRetainEvent(event);
+        chain(event);
+      }
+      *done = event;
+      return true;
+    }
+
+    /// move count tracers through the velocity of the step, as
+    /// advect_particles in fluids.cl: their float2 positions, with cell
+    /// (i, j) at origin + step*(i, j), go from src to dst and their ages,
+    /// count floats, are updated in place. Tracers older than lifetime or
+    /// outside the grid start again at random places. Waits for the step
+    /// and for after, if not NULL; done gets its event, for the caller to
+    /// release. Needs the whole grid, so not on a slab.
+    bool advect_particles(cl_mem src, cl_mem dst, cl_mem ages, int count, float dt, float lifetime,
+                          float origin, float step, bool rk3, cl_event after, cl_event *done) {
+      if (slab_exchange) {
+        printf("fluid_cl_solver: tracer particles need the whole grid, not a slab\n");
+        return false;
+      }
+      int Nborder = N + 2;
+      size_t global_size[1] = {count};
+      float dt0 = dt * N;
+      cl_uint seed = particle_seed++;
+      cl_int use_rk3 = rk3;
+      cl_int err;
+
+      err = clSetKernelArg(clAdvectParticlesKernel, 0, sizeof(cl_mem), &src);
+      err |= clSetKernelArg(clAdvectParticlesKernel, 1, sizeof(cl_mem), &dst);
+      err |= clSetKernelArg(clAdvectParticlesKernel, 2, sizeof(cl_mem), &ages);
+      err |= clSetKernelArg(clAdvectParticlesKernel, 3, sizeof(cl_mem), &uv1_buffer);
+      err |= clSetKernelArg(clAdvectParticlesKernel, 4, sizeof(int), &Nborder);
+      err |= clSetKernelArg(clAdvectParticlesKernel, 5, sizeof(cl_float), &dt);
+      err |= clSetKernelArg(clAdvectParticlesKernel, 6, sizeof(cl_float), &dt0);
+      err |= clSetKernelArg(clAdvectParticlesKernel, 7, sizeof(cl_float), &lifetime);
+      err |= clSetKernelArg(clAdvectParticlesKernel, 8, sizeof(cl_float), &origin);
+      err |= clSetKernelArg(clAdvectParticlesKernel, 9, sizeof(cl_float), &step);
+      err |= clSetKernelArg(clAdvectParticlesKernel, 10, sizeof(cl_uint), &seed);
+      err |= clSetKernelArg(clAdvectParticlesKernel, 11, sizeof(cl_int), &use_rk3);
+      if (err < 0) {
+        perror("Could not create a kernel argument for clAdvectParticlesKernel");
+        return false;
+      }
+
+      cl_event wait[2];
+      cl_uint num_waits = get_wait_list(after, wait);
+      cl_event event = NULL;
+      err = clEnqueueNDRangeKernel(clQueue, clAdvectParticlesKernel, 1, NULL, global_size, NULL,
+        num_waits, num_waits ? wait : NULL, &event);
+      if (err < 0) {
+        perror("Could not enqueue the kernel for clAdvectParticlesKernel");
+        return false;
+      }
+      if (out_of_order) {
+        clRetainEvent(event);
+        chain(event);
+      }
+      *done = event;
+      return true;
+    }
+
+    void dens_step ( float diff, float dt )
+    {
+      if (!fused) {
+        add_source(N, dens1_buffer, dens0_buffer, dt, clAddSourceFloatKernel, sizeof(cl_float));
+      }
+      dens_substep(N, dens1_buffer, dens0_buffer, uv1_buffer, diff, dt, fused ? dt : 0);
+    }
+
+    void vel_step ( float visc, float dt )
+    {
+      if (!fused) {
+        add_source(N, uv1_buffer, uv0_buffer, dt, clAddSourceFloat2Kernel, 2*sizeof(cl_float));
+      }
+      vel_substep(N, uv1_buffer, uv0_buffer, visc, dt, fused ? dt : 0);
+    }
+
+    /// add the sources, then move on by dt in as many substeps as the cfl
+    /// number and time budget allow. returns the number of substeps.
+    int step ( float visc, float diff, float dt )
+    {
+      double start = fluid_timer::now();
+      // the fused kernels add the sources in the first substep
+      float source_dt = fused ? dt : 0;
+      if (!fused) {
+        add_source(N, uv1_buffer, uv0_buffer, dt, clAddSourceFloat2Kernel, 2*sizeof(cl_float));
+        add_source(N, dens1_buffer, dens0_buffer, dt, clAddSourceFloatKernel, sizeof(cl_float));
+      }
+
+      int n = 1;
+      if (cfl > 0) {
+        float speed = pipelined ? lagged_max_speed(uv1_buffer, uv0_buffer, source_dt) : max_speed(uv1_buffer, uv0_buffer, source_dt);
+        float cells = speed * dt * N;
+        n = cells < cfl * max_substeps ? (int)ceilf(cells / cfl) : max_substeps;
+        if (n < 1) n = 1;
+      }
+      if (time_budget > 0 && substep_seconds > 0) {
+        int fit = (int)(time_budget / substep_seconds);
+        if (fit < 1) fit = 1;
+        if (n > fit) n = fit;
+      }
+      if (slab_exchange) {
+        n = slab_exchange->agree_substeps(this, n);
+      }
+
+      float h = dt / n;
+      for (int k = 0; k != n; ++k) {
+        vel_substep(N, uv1_buffer, uv0_buffer, visc, h, k == 0 ? source_dt : 0);
+        dens_substep(N, dens1_buffer, dens0_buffer, uv1_buffer, diff, h, k == 0 ? source_dt : 0);
+      }
+
+      // kernels run asynchronously, so only wait for them when we need the time
+      if (time_budget > 0) {
+        clFinish(clQueue);
+        double per_substep = (fluid_timer::now() - start) / n;
+        substep_seconds = substep_seconds == 0 ? per_substep : 0.75 * substep_seconds + 0.25 * per_substep;
+      }
+      return n;
+    }
+
+    /// largest |u| or |v| of the interior of uv + dt*src. Waits for the queue to get there.
+    float max_speed ( cl_mem uv, cl_mem src = NULL, float dt = 0 )
+    {
+      if (!enqueue_max_speed(uv, src, dt)) return 0;
+      float partial[speed_groups];
+      readArray(speed_buffer, partial, speed_groups);
+      return largest(partial);
+    }
+
+    /// max_speed() of the step before, for pipelined steps. This step's is
+    /// read back without waiting; the first step waits for its own.
+    float lagged_max_speed ( cl_mem uv, cl_mem src = NULL, float dt = 0 )
+    {
+      if (!enqueue_max_speed(uv, src, dt)) return 0;
+      int h = speed_half;
+      cl_event event = NULL;
+      cl_int err = clEnqueueReadBuffer(clQueue, speed_buffer, CL_FALSE, 0, sizeof(speed_partial[h]), speed_partial[h],
+        last_event ? 1 : 0, last_event ? &last_event : NULL, &event);
+      if (err < 0) {
+        printf("Could not read array.");
+        return 0;
+      }
+      // the next max_speed_float2 overwrites speed_buffer, so it waits for the read
+      if (out_of_order) {
+        clRetainEvent(event);
+        chain(event);
+      }
+      releaseEvent(speed_read[h]);
+      speed_read[h] = event;
+      speed_half = 1 - h;
+
+      int k = speed_read[1 - h] ? 1 - h : h;
+      clWaitForEvents(1, &speed_read[k]);
+      return largest(speed_partial[k]);
+    }
+
+    /// wait for the queued kernels
+    void finish() {
+      clFinish(clQueue);
+    }
+
+    /// run the solver a frame behind the host, as at the top of the file.
+    /// Set it before init() for an out of order queue.
+    void set_pipelined(bool value) {
+      pipelined = value;
+    }
+
+    bool get_pipelined() const {
+      return pipelined;
+    }
+
+    /// build the program for the grid size and the tile size, as at the top
+    /// of fluids.cl, or build one program for any. Set it before init().
+    void set_specialised(bool value) {
+      specialised = value || slab_exchange;
+    }
+
+    bool get_specialised() const {
+      return specialised;
+    }
+
+    /// keep the fields as half floats, as at the top of the file. Set it
+    /// before init().
+    void set_half_storage(bool value) {
+      half_storage = value;
+      if (value) {
+        fused = true;
+        advection = advection_semi_lagrangian;
+      }
+    }
+
+    bool get_half_storage() const {
+      return half_storage;
+    }
+
+    /// make the solver a slab of a grid shared with other solvers, rows
+    /// first to last of the interior with halo rows either side kept by
+    /// exchange, as at the top of the file. The halo has to be at least
+    /// two rows and no more than the rows of the neighbouring slabs. Set
+    /// it before init(). The program is always specialised, with the fused
+    /// kernels and semi-Lagrangian advection, and the sweeps are the same
+    /// as one grid's if first-1 is a multiple of the tile size.
+    void set_slab(int first, int last, int halo, halo_exchange *exchange) {
+      slab_first = first;
+      slab_last = last;
+      this->halo = halo;
+      slab_exchange = exchange;
+      specialised = true;
+      fused = true;
+      advection = advection_semi_lagrangian;
+    }
+
+    /// true if the solver is a slab of a shared grid
+    bool get_slab() const {
+      return slab_exchange != NULL;
+    }
+
+    int get_slab_first() const {
+      return slab_exchange ? slab_first : 1;
+    }
+
+    int get_slab_last() const {
+      return slab_exchange ? slab_last : N;
+    }
+
+    /// first of the rows, of the whole grid, in the buffers
+    int get_stored_first() const {
+      int first = slab_first - halo;
+      return !slab_exchange || first < 0 ? 0 : first;
+    }
+
+    /// rows of (N+2) cells in the buffers: the slab's, its halos and any
+    /// ghost rows it reaches, or all N+2
+    int get_stored_rows() const {
+      int last = slab_last + halo;
+      return (!slab_exchange || last > N+1 ? N+1 : last) - get_stored_first() + 1;
+    }
+
+    /// bytes of a row of a field with values floats a cell, as stored
+    size_t get_row_bytes(int values) const {
+      return field_bytes((N+2)*values);
+    }
+
+    /// read count rows of buffer, a field of values floats a cell, from
+    /// row first of the grid into dst as they are stored: half floats
+    /// with half storage. Waits for the read.
+    bool read_rows(cl_mem buffer, int first, int count, int values, void *dst) {
+      cl_event event = NULL;
+      size_t row_bytes = get_row_bytes(values);
+      cl_int err = clEnqueueReadBuffer(clQueue, buffer, CL_TRUE, (first - get_stored_first())*row_bytes, count*row_bytes, dst,
+        last_event ? 1 : 0, last_event ? &last_event : NULL, out_of_order ? &event : NULL);
+      if (err < 0) {
+        printf("Could not read rows.");
+        return false;
+      }
+      if (out_of_order) chain(event);
+      return true;
+    }
+
+    /// write count rows from src into buffer from row first of the grid,
+    /// as read_rows() reads them. Doesn't wait: src has to stay put until
+    /// the queue gets past the write.
+    bool write_rows(cl_mem buffer, int first, int count, int values, const void *src) {
+      cl_event event = NULL;
+      size_t row_bytes = get_row_bytes(values);
+      cl_int err = clEnqueueWriteBuffer(clQueue, buffer, CL_FALSE, (first - get_stored_first())*row_bytes, count*row_bytes, src,
+        last_event ? 1 : 0, last_event ? &last_event : NULL, out_of_order ? &event : NULL);
+      if (err < 0) {
+        printf("Could not write rows.");
+        return false;
+      }
+      if (out_of_order) chain(event);
+      return true;
+    }
+
+    /// true if init() made an out of order queue
+    bool get_out_of_order() const {
+      return out_of_order;
+    }
+
+    /// semi-Lagrangian, MacCormack or BFECC. Half storage and slabs only
+    /// have semi-Lagrangian advection.
+    void set_advection(int value) {
+      advection = half_storage || slab_exchange ? advection_semi_lagrangian : value;
+    }
+
+    int get_advection() const {
+      return advection;
+    }
+
+    /// use the fused kernels (default) or the original chain of kernels.
+    /// Half storage and slabs always use the fused kernels.
+    void set_fused(bool value) {
+      fused = value || half_storage || slab_exchange;
+    }
+
+    bool get_fused() const {
+      return fused;
+    }
+
+    /// kernels for the sweeps of the fused solves: tiled (default) or,
+    /// without tiles, red-black or Jacobi. All of them give the same
+    /// results whatever order the work items run in. Red-black matches the
+    /// red-black sweeps of the CPU fluid_solver.
+    void set_relaxation(int value) {
+      relaxation = value;
+    }
+
+    int get_relaxation() const {
+      return relaxation;
+    }
+
+    /// sweeps of each diffuse and pressure solve, 50 by default
+    void set_solver_sweeps(int value) {
+      solver_sweeps = value < 2 ? 2 : value;
+    }
+
+    int get_solver_sweeps() const {
+      return solver_sweeps;
+    }
+
+    /// sweeps the tiled kernels make each launch in diffuse and in the
+    /// pressure solve. The edges of the tiles lag by up to the sweeps a
+    /// launch less one, which slows the pressure solve much more than
+    /// diffuse, so it defaults to 5 and 1.
+    void set_sweeps_per_launch(int diffuse, int pressure) {
+      diffuse_sweeps = diffuse < 1 ? 1 : diffuse;
+      pressure_sweeps = pressure < 1 ? 1 : pressure;
+    }
+
+    int get_diffuse_sweeps_per_launch() const {
+      return diffuse_sweeps;
+    }
+
+    int get_pressure_sweeps_per_launch() const {
+      return pressure_sweeps;
+    }
+
+    /// true if the fused solves run on tiles, tile_size x tile_size work
+    /// groups. Red-black is used in place of tiles the device can't run.
+    bool get_tiled() const {
+      return fused && relaxation == relaxation_tiled && tile_size > 0;
+    }
+
+    int get_tile_size() const {
+      return tile_size;
+    }
+
+    /// the largest tile init() may choose, a power of two, or 0 for no
+    /// tiles. Slabs that must make the same launches use the smallest
+    /// tile any of their devices can run. Set it before init().
+    void set_tile_limit(int value) {
+      tile_limit = value;
+    }
+
+    /// split step() into enough substeps that no cell moves more than
+    /// cfl cells in one, up to max_substeps. cfl = 0 always takes one.
+    void set_cfl(float cfl, int max_substeps) {
+      this->cfl = cfl;
+      this->max_substeps = max_substeps < 1 ? 1 : max_substeps;
+    }
+
+    /// take no more substeps than fit in this many seconds, 0 for no limit
+    void set_time_budget(double seconds) {
+      time_budget = seconds;
+      substep_seconds = 0;
+    }
+
+    double get_time_budget() const {
+      return time_budget;
+    }
+
+    /// clear the stage times. Profiling must have been asked for in init().
+    void reset_profile() {
+      collect_profile();
+      memset(&profile, 0, sizeof(profile));
+    }
+
+    /// the stage times since reset_profile(). Waits for the queue.
+    const stage_stats &get_profile() {
+      collect_profile();
+      return profile;
+    }
+
+    static const char *get_stage_name(int stage) {
+      static const char *names[] = { "add_source", "diffuse", "advect", "project", "set_bnd" };
+      return names[stage];
+    }
+
+    int get_N() const {
+      return N;
+    }
+
+    cl_command_queue get_queue() const {
+      return clQueue;
+    }
+
+    cl_mem get_uv0() const { return uv0_buffer; }
+    cl_mem get_uv1() const { return uv1_buffer; }
+    cl_mem get_dens0() const { return dens0_buffer; }
+    cl_mem get_dens1() const { return dens1_buffer; }
+  };
+}
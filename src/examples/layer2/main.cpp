@@ -11,6 +11,10 @@
 
 #include "../../octet.h"
 
+#include "../fluidshader/fluid_timer.h"
+#include "../fluidshader/fluid_half.h"
+#include "cl_program_cache.h"
+#include "fluid_cl_solver.h"
 #include "engine.h"
 
 //
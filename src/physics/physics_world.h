@@ -82,6 +82,13 @@ namespace octet {
       #endif
     }
 
+    #if OCTET_BULLET
+      // the Bullet body of a handle, for code that needs more than this class gives
+      btRigidBody *get_rigid_body(int handle) {
+        return rigid_bodies[handle];
+      }
+    #endif
+
     int num_rigid_bodies() {
       #if OCTET_BULLET
         return rigid_bodies.size();
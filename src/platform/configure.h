@@ -32,8 +32,13 @@
 #endif
 
 #if !OCTET_VOXEL_TEST && !OCTET_VITA
-  #define OCTET_BULLET 1
-  #define OCTET_BOX2D 1
+  // define these as 0 to build without the physics engines
+  #ifndef OCTET_BULLET
+    #define OCTET_BULLET 1
+  #endif
+  #ifndef OCTET_BOX2D
+    #define OCTET_BOX2D 1
+  #endif
 #endif
 
 // use <> to include from standard directories
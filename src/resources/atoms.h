@@ -113,4 +113,16 @@ OCTET_ATOM(uscale)
 OCTET_ATOM(vscale)
 OCTET_ATOM(flags)
 OCTET_ATOM(size)
+OCTET_ATOM(fluid_checkpoint)
+OCTET_ATOM(version)
+OCTET_ATOM(step)
+OCTET_ATOM(dt)
+OCTET_ATOM(seed)
+OCTET_ATOM(rows)
+OCTET_ATOM(fields)
+OCTET_ATOM(field)
+OCTET_ATOM(buffers)
+OCTET_ATOM(chunk)
+OCTET_ATOM(pressure)
+OCTET_ATOM(inputs)
 
@@ -9,7 +9,7 @@
 
 namespace octet { namespace resources {
   class binary_reader : public visitor {
-    enum { debug = true };
+    enum { debug = false };
     hash_map<void *, int> refs;
     dynarray<void *> id_to_ref;
     FILE *file;
@@ -51,7 +51,7 @@ namespace octet { namespace resources {
     bool check_atom(atom_t sid) {
       if (!get_error()) {
         atom_t test = read_atom();
-        log("%*scheck_atom %s\n", get_depth()*2, "", app_utils::get_atom_name(sid));
+        if (debug) log("%*scheck_atom %s\n", get_depth()*2, "", app_utils::get_atom_name(sid));
         if (test != sid) {
           log("error: expected %s\n", app_utils::get_atom_name(sid));
           set_error(true);
@@ -63,7 +63,7 @@ namespace octet { namespace resources {
     bool check_size(unsigned size) {
       if (!get_error()) {
         int test = read_int();
-        log("%*scheck_size %d\n", get_depth()*2, "", size);
+        if (debug) log("%*scheck_size %d\n", get_depth()*2, "", size);
         if (test != (int)size) {
           log("error: expected %d bytes\n", size);
           set_error(true);
@@ -73,7 +73,7 @@ namespace octet { namespace resources {
     }
 
     void *get_ref(int id) {
-      log("%*sget_ref %d/%d\n", get_depth()*2, "", id, id_to_ref.size());
+      if (debug) log("%*sget_ref %d/%d\n", get_depth()*2, "", id, id_to_ref.size());
       if (id == (int)id_to_ref.size()) {
         return NULL;
       } else if (id > (int)id_to_ref.size()) {
@@ -200,8 +200,8 @@ namespace octet { namespace resources {
       //check_atom(atom_end_refs);
     }
 
-    void visit_bin(void *value, unsigned size, atom_t sid, atom_t type) {
-      if (debug) log("%*svisit_bin %s %d\n", get_depth()*2, "", app_utils::get_atom_name(sid), size);
+    void visit_bin(void *value, size_t size, atom_t sid, atom_t type) {
+      if (debug) log("%*svisit_bin %s %d\n", get_depth()*2, "", app_utils::get_atom_name(sid), (int)size);
       if (!check_atom(type) && !check_atom(sid) && !check_size(size)) {
         read((uint8_t*)value, size);
       }
@@ -9,7 +9,7 @@
 
 namespace octet { namespace resources {
   class binary_writer : public visitor {
-    enum { debug = true };
+    enum { debug = false };
     hash_map<void *, int> refs;
     int next_id;
     FILE *file;
@@ -144,7 +144,7 @@ namespace octet { namespace resources {
       //write_atom(atom_end_refs);
     }
 
-    void visit_bin(void *value, unsigned size, atom_t sid, atom_t type) {
+    void visit_bin(void *value, size_t size, atom_t sid, atom_t type) {
       write_atom(type);
       write_atom(sid);
       write_int(size);
@@ -4,7 +4,9 @@
 //
 // Modular Framework for OpenGLES2 rendering on multiple platforms.
 //
-// Shader that displays fluid densities. Uses vertex buffer array for source data.
+// Shader that displays fluid densities. The density is a one channel float
+// texture of the whole grid, drawn on a single quad, so the grid size is
+// not limited by the vertex indices.
 
 namespace octet { namespace shaders {
   class fluid_shader : public shader {
@@ -13,6 +15,9 @@ namespace octet { namespace shaders {
     // index for model space to projection space matrix
     GLuint modelToProjectionIndex_;
 
+    // index for texture sampler of the density
+    GLuint samplerIndex_;
+
   public:
     void init() {
       // this is the vertex shader.
@@ -20,14 +25,14 @@ namespace octet { namespace shaders {
       // it inputs pos and uv from each corner
       // it outputs gl_Position and uv_ to the rasterizer
       const char vertex_shader[] = SHADER_STR(
-        varying float dens_;
+        varying vec2 uv_;
 
         attribute vec4 pos;
-        attribute float uv;
+        attribute vec2 uv;
 
         uniform mat4 modelToProjection;
 
-        void main() { gl_Position = modelToProjection * pos; dens_ = uv; }
+        void main() { gl_Position = modelToProjection * pos; uv_ = uv; }
       );
 
       // this is the fragment shader
@@ -35,8 +40,9 @@ namespace octet { namespace shaders {
       // this is called for every fragment
       // it outputs gl_FragColor, the color of the pixel and inputs uv_
       const char fragment_shader[] = SHADER_STR(
-        varying float dens_;
-        void main() { gl_FragColor = vec4(dens_, dens_, dens_, 1.0); }
+        varying vec2 uv_;
+        uniform sampler2D sampler;
+        void main() { float dens = texture2D(sampler, uv_).r; gl_FragColor = vec4(dens, dens, dens, 1.0); }
       );
     
       // use the common shader code to compile and link the shaders
@@ -45,14 +51,19 @@ namespace octet { namespace shaders {
 
       // extract the indices of the uniforms to use later
       modelToProjectionIndex_ = glGetUniformLocation(program(), "modelToProjection");
+      samplerIndex_ = glGetUniformLocation(program(), "sampler");
     }
 
-    void render(const mat4t &modelToProjection) {
+    /// sampler is the texture unit of the density texture
+    void render(const mat4t &modelToProjection, int sampler) {
       // tell openGL to use the program
       shader::render();
 
       // customize the program with uniforms
       glUniformMatrix4fv(modelToProjectionIndex_, 1, GL_FALSE, modelToProjection.get());
+
+      // use the density texture bound to this unit
+      glUniform1i(samplerIndex_, sampler);
     }
   };
 